@@ -3,539 +3,8850 @@
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
+#include <limits.h>
+#include <math.h>
+#include <stdarg.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <afunix.h>
+#include <windows.h>
+#include <intrin.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 #pragma warning(disable:4996)
 
-#define HASH_TABLE_SIZE 127
+#ifndef _WIN32
+// The secure CRT calls used below only exist on Windows; map them onto their POSIX equivalents
+typedef int errno_t;
+
+static errno_t fopen_s(FILE** file, const char* path, const char* mode) {
+    *file = fopen(path, mode);
+    return *file == NULL ? errno : 0;
+}
+
+#define scanf_s scanf
+#define _strdup strdup
+#endif
+
+#define HASH_TABLE_INITIAL_SIZE 128  // Must be a power of two
+#define HASH_TABLE_MAX_LOAD 1.0      // Countries per bucket before the table doubles
+#define HASH_TABLE_REHASH_STEP 4     // Old buckets migrated per insert while growing
+#define PARCEL_SLAB_SIZE 4096         // Parcel nodes carved from each slab
+#define ARENA_BLOCK_SIZE 65536        // Bytes per arena block for names and country records
+#define ARENA_ALIGNMENT 16
+#define COUNTRY_ID_INITIAL_CAPACITY 64
+#define CASE_FOLD_CHUNK 64             // Bytes of a name folded at a time while it is hashed or compared
+#define PERFECT_HASH_BUCKET_SIZE 4     // Average countries per seed of the perfect hash
+#define PERFECT_HASH_MAX_SEED (1 << 24)  // Seeds tried for one bucket before the build gives up
+#define MALFORMED_LINE_PREVIEW 60      // Bytes of a malformed line echoed in the report
+#define INGEST_MIN_CHUNK_SIZE 65536    // Smallest input slice handed to an ingest worker
+#define INGEST_MAX_THREADS 256
+#define LIVE_MAX_READERS 256           // Threads that may run queries while the input file is followed
+#define LIVE_OTHER_READERS 2           // Of those, kept for the main thread and the statistics dump
+#define LIVE_POLL_INTERVAL_MS 200      // Pause between checks for lines appended to the input file
+#define LIVE_READ_SIZE 65536           // Bytes read from the followed file at a time; longer lines are dropped
+#define AVL_MAX_HEIGHT 64  // An AVL tree of height 64 would need more than 2^44 nodes
+#define COLUMN_SCAN_BLOCK 64           // Values per block a column scan remembers as holding its extremes
+#define PACKED_BLOCK_SIZE 128          // Parcels per block of compressed columns; a block is decoded whole
+#define OUTPUT_BUFFER_SIZE (1 << 20)   // Bytes the batch writer collects before each write
+#define BATCH_QUERY_MAX_LENGTH 1024
+#define REPORT_BLOCK_SIZE 64           // Countries a report worker claims at a time
+#define SNAPSHOT_MAGIC "PRCLSNAP"      // First 8 bytes of a snapshot file, no terminator
+#define SNAPSHOT_VERSION 2             // Bump whenever the layout below changes
+#define SNAPSHOT_BYTE_ORDER 0x01020304u  // Reads back differently on a machine of the other endianness
+#define SPILL_PARTITIONS 64            // Files the parcels are spread over by country before sorting
+#define SPILL_BUFFER_RECORDS 4096      // Records each partition collects before they are written out
+#define SPILL_READ_SIZE (1 << 20)      // Bytes of the input read at a time; longer lines are dropped
+#define SPILL_DEFAULT_MEMORY 64        // Megabytes the external sort may hold at a time
+#define SPILL_PAGE_SIZE 65536          // Bytes of the spilled columns read from disk at a time
+#define SPILL_CACHE_PAGES 256          // Pages kept in memory; the least recently used one is replaced
+#define QUERY_CACHE_ENTRIES 4096       // Default summaries kept by the query result cache (see summarizeCountryCached)
+#define QUERY_CACHE_SHARDS 16          // Separately locked parts of the query cache, chosen by key hash
+#define SERVER_MAX_CONNECTIONS 64      // Connections each server worker watches at a time
+#define SERVER_POLL_INTERVAL_MS 200    // How often an idle server worker checks for shutdown
+#define SERVER_END_OF_RESPONSE ".\n"   // Ends every response; no result line is a lone dot
+#define SERVER_MAX_QUEUED (1 << 20)    // Unsent response bytes past which a connection's requests wait
+#define LOAD_TEST_CLIENTS 8
+#define LOAD_TEST_REQUESTS 10000       // Requests sent by each load test client
+#define GENERATOR_MAX_WEIGHT 50000     // Generated weights are 1..GENERATOR_MAX_WEIGHT
+#define GENERATOR_MAX_VALUATION_CENTS 200000
+#define GENERATOR_MAX_NAME_LENGTH 256
+#define BENCHMARK_SEARCHES 1000        // Random weight searches per country
+#define BENCHMARK_ROUNDS 1000          // Passes over every country for the single-parcel queries
+#define STATS_MAX_THREADS 512          // Threads with counters of their own; later ones share the last block
+#define STATS_HISTOGRAM_BUCKETS 164    // Four buckets per power of two of nanoseconds, up to about an hour
+#define STATS_CHAIN_LENGTHS 9          // Longer bucket chains are reported together with the longest
+#define STATS_POLL_INTERVAL_MS 200     // How often the statistics dump thread checks for shutdown
+#define STATS_DEFAULT_INTERVAL 60      // Seconds between statistics dumps
+
+#ifdef _WIN32
+typedef SOCKET SocketHandle;
+typedef int SocketLength;       // Type of the length send and recv take
+#define INVALID_SOCKET_HANDLE INVALID_SOCKET
+#define SOCKET_SEND_FLAGS 0
+#else
+typedef int SocketHandle;
+typedef size_t SocketLength;
+#define INVALID_SOCKET_HANDLE (-1)
+#define SOCKET_SEND_FLAGS MSG_NOSIGNAL  // A client that hangs up must not kill the server with SIGPIPE
+#endif
+
+struct Country;
 
 typedef struct Parcel {
-    char* destination;
+    int countryId;
     int weight;
     float valuation;
+    int height;
     struct Parcel* left;
     struct Parcel* right;
+    // Aggregates over the subtree rooted at this node
+    int count;
+    float minValuation;
+    float maxValuation;
+    long long weightSum;
+    double valuationSum;
 } Parcel;
 
+typedef struct ParcelIterator {
+    Parcel* stack[AVL_MAX_HEIGHT];  // Nodes still to be returned, each followed by its right subtree
+    int depth;
+    int maxWeight;
+    long long remaining;            // Parcels left before the limit, -1 for no limit
+    int descending;                 // Walks from the end of the tree down; the stack then holds left subtrees
+    long long visited;              // Nodes stepped through by nextParcel, for STAT_NODES_VISITED
+} ParcelIterator;
+
+typedef struct ParcelCopy {
+    Parcel* originals[AVL_MAX_HEIGHT];   // Nodes the copy replaces, retired once it is published
+    Parcel* created[AVL_MAX_HEIGHT + 1]; // The new leaf and the copies, released if it never is
+    int depth;                           // Number of originals; created holds one more
+} ParcelCopy;
+
+typedef int (*ParcelVisitor)(Parcel* parcel, void* context);  // Returns 0 to stop the walk
+typedef int (*ParcelRecordVisitor)(struct Country* record, int weight, float valuation, void* context);  // Same, for tree or columns
+
+typedef struct PackedBlock {
+    int firstWeight;            // The later weights are stored as the gap to the one before them
+    int minCents;               // The valuations are stored in whole cents above the block's smallest
+    size_t start;               // Bit of the packed fields the gaps start at; the cents follow them
+    unsigned char weightBits;   // Width of each gap
+    unsigned char centsBits;    // Width of each cents offset
+} PackedBlock;
+
+typedef struct ColumnSnapshot {
+    int count;
+    int* weights;               // Sorted ascending; equal weights keep insertion order
+    float* valuations;          // valuations[i] belongs to weights[i]
+    int* valuationOrder;        // Indices into weights and valuations from the cheapest parcel up
+    PackedBlock* blocks;        // The three columns compressed by packColumns, with the arrays NULL, or NULL
+    unsigned long long* bits;   // The blocks' fields, then valuationOrder, orderBits per index
+    size_t orderStart;          // Bit of bits valuationOrder starts at
+    int orderBits;
+    int* eytzinger;             // The weights in Eytzinger order from index 1 (see indexColumnWeights), or NULL
+    int* eytzingerIndex;        // Index into weights of each entry of eytzinger
+    struct SpillStore* spill;   // File the columns are paged in from, with the arrays NULL, or NULL
+    unsigned long long spillParcels;  // Offset in spill of count ParcelRecords in weight order
+    unsigned long long spillOrder;    // Offset in spill of count ints of valuationOrder
+    long long weightSum;
+    double valuationSum;
+    int minValuationIndex;      // -1 when the country has no parcels
+    int maxValuationIndex;
+} ColumnSnapshot;  // The columns follow the header in the same allocation
+
+enum FreezeMode {
+    FREEZE_NONE,
+    FREEZE_COLUMNS,             // Columnar snapshots beside the trees
+    FREEZE_COMPACT,             // Compressed columns instead of the trees
+    FREEZE_EYTZINGER            // Columnar snapshots with their weights also laid out for searching
+};
+
+enum ParcelOrder {
+    WEIGHT_ORDER,
+    VALUATION_ORDER             // By valuation, then by weight
+};
+
+enum ParcelExtreme {
+    CHEAPEST_PARCEL,
+    MOST_EXPENSIVE_PARCEL,
+    LIGHTEST_PARCEL,
+    HEAVIEST_PARCEL
+};
+
+typedef struct Country {
+    char* name;
+    unsigned long hash;
+    int id;
+    std::atomic<Parcel*> root;             // Replaced, never changed in place, while the file is followed
+    std::atomic<Parcel*> valuationRoot;    // The same parcels in a second tree in VALUATION_ORDER, likewise
+    std::atomic<ColumnSnapshot*> columns;  // Read-only copy of the tree built by freezeCountry, or NULL
+    std::atomic<unsigned long> version;    // Bumped after every change to the parcels, for the query cache
+    struct Country* next;
+} Country;
+
+typedef struct ParcelSlab {
+    struct ParcelSlab* next;
+    int used;
+    Parcel parcels[PARCEL_SLAB_SIZE];
+} ParcelSlab;
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t used;
+    size_t capacity;
+} ArenaBlock;  // The block's bytes follow the header
+
+typedef struct ParcelPool {
+    ParcelSlab* slabs;          // Newest slab first; parcels are carved from its tail
+    ArenaBlock* arena;          // Newest block first; bytes are bumped from its tail
+    Parcel* freeParcels;        // Released nodes, linked through left, handed out before new ones
+    unsigned long slabCount;
+    unsigned long arenaBlockCount;
+} ParcelPool;
+
 typedef struct HashTable {
-    Parcel* table[HASH_TABLE_SIZE];
+    ParcelPool pool;            // Owns every parcel, country record and name in the table
+    std::atomic<Country**> table;  // Buckets new countries are added to
+    unsigned long size;         // Number of buckets in table
+    Country** oldTable;         // Buckets still being migrated, NULL when not growing
+    unsigned long oldSize;      // Number of buckets in oldTable
+    unsigned long rehashIndex;  // Next bucket of oldTable to migrate
+    std::atomic<unsigned long> count;     // Number of countries in both tables
+    std::atomic<Country**> countries;     // Intern table: country records indexed by their id
+    unsigned long countryCapacity;
+    struct MappedFile* snapshot;  // Mapping the country columns point into, NULL unless loaded from a snapshot
+    struct SpillStore* spill;     // File the country columns are paged in from, NULL unless loaded out of core
+    struct LiveIngest* live;      // Follower of the input file, NULL unless following it
+    struct StatsDumper* dumper;   // Periodic statistics dump, NULL unless enabled
+    struct QueryCache* cache;     // Summaries of recent queries, NULL unless enabled
+    struct PerfectHash* perfect;  // Collision-free index of the countries, NULL unless built
+    int serving;                  // Nonzero while runQueryServer answers queries on several threads
 } HashTable;
 
+typedef struct PerfectHash {
+    unsigned long count;        // Countries hashed; any added later are only found through the chains
+    unsigned long buckets;      // Number of seeds
+    unsigned int* seeds;        // Seed of each bucket, which sends its countries to free slots
+    int* slots;                 // Id of the country in each of the count slots
+} PerfectHash;
+
+typedef struct MappedFile {
+    const char* data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+} MappedFile;
+
+typedef struct FileInfo {
+    int exists;
+    long long modified;         // Last modification, in seconds since the epoch
+    unsigned long long size;
+} FileInfo;
+
+typedef struct SnapshotHeader {
+    char magic[8];              // SNAPSHOT_MAGIC
+    unsigned int version;       // SNAPSHOT_VERSION
+    unsigned int byteOrder;     // SNAPSHOT_BYTE_ORDER
+    unsigned long long size;    // Size of the whole file
+    unsigned long long checksum;  // snapshotChecksum of everything after the header
+    long long sourceModified;   // The text file the snapshot was built from, when the load started
+    unsigned long long sourceSize;
+    unsigned int countryCount;
+    unsigned int reserved;
+} SnapshotHeader;  // Followed by countryCount SnapshotCountry entries in id order, the names and the columns
+
+typedef struct SnapshotCountry {
+    unsigned long long nameOffset;    // From the start of the file; the name is NUL-terminated
+    unsigned long long columnOffset;  // count weights, count valuations, then count valuation order indices
+    long long weightSum;
+    double valuationSum;
+    int count;
+    int minValuationIndex;
+    int maxValuationIndex;
+    unsigned int nameLength;
+} SnapshotCountry;
+
+typedef struct SpillRecord {
+    int countryId;
+    unsigned int key;           // Sorted on within the country: the weight with its sign bit flipped, or a valuationKey
+    unsigned int value;         // The bits of the valuation, or the index of the parcel in weight order
+} SpillRecord;
+
+typedef int (*SpillRecordSink)(const SpillRecord* records, size_t count, void* context);  // Returns 0 on failure
+
+typedef struct SpillMergeRun {
+    SpillRecord* buffer;        // Slice of the sort memory holding the run's next records
+    size_t used;                // Records of buffer already merged
+    size_t filled;
+    unsigned long long next;    // Record of the run file to read after buffer
+    unsigned long long end;     // One past the run's last record
+} SpillMergeRun;
+
+typedef struct SpillPage {
+    unsigned long long number;  // Page of the file held, ULLONG_MAX while empty
+    unsigned long long lastUse; // The store's clock when the page was last read
+    int next;                   // Next page in the same bucket, -1 at the end
+} SpillPage;  // The page's bytes are at cache + index * SPILL_PAGE_SIZE
+
+typedef struct SpillStore {
+    FILE* file;
+    char* path;                 // Removed when the store is closed
+    unsigned long long size;    // Bytes written to the file
+    SpillPage pages[SPILL_CACHE_PAGES];
+    int buckets[SPILL_CACHE_PAGES];  // First page of each bucket, by page number, -1 if none
+    unsigned long long clock;   // Counts page reads, for least recently used replacement
+    char* cache;
+    std::mutex lock;            // Held while a read looks up, loads or copies pages
+    std::atomic<int> failed;    // Set for good once a read fails; see spillFailed
+} SpillStore;
+
+typedef struct SpillBuild {
+    HashTable* hashTable;
+    const char* directory;
+    SpillStore* store;          // Where the sorted columns are written
+    FILE* partitions[SPILL_PARTITIONS];  // Records of the countries whose id falls in each, in file order
+    unsigned long long partitionCounts[SPILL_PARTITIONS];
+    SpillRecord* buffers;       // SPILL_BUFFER_RECORDS per partition, written out when full
+    size_t buffered[SPILL_PARTITIONS];
+    FILE* runs;                 // Sorted runs of a partition too large to sort in memory
+    FILE* order;                // The sorted partition's valuation order records, before they are sorted
+    unsigned long long orderCount;
+    ColumnSnapshot* columns;    // Country being written, NULL before the first
+    int countryId;
+    float cheapest;             // The country's smallest and largest valuation so far
+    float mostExpensive;
+    int failed;                 // Set when a file cannot be created or written, or memory runs out
+} SpillBuild;
+
+typedef struct ParsedLine {
+    const char* line;           // Start of the line, for error reports
+    const char* destination;
+    size_t destinationLength;
+    int weight;
+    float valuation;
+} ParsedLine;
+
+enum ParseResult {
+    PARSE_BLANK,
+    PARSE_MALFORMED,
+    PARSE_OK
+};
+
+typedef struct ParcelRecord {
+    int weight;
+    float valuation;
+} ParcelRecord;
+
+enum ParcelSummaryField {
+    SUMMARY_WEIGHT_SUM = 1,
+    SUMMARY_VALUATION_SUM = 2,
+    SUMMARY_MEANS = 4,          // Implies both sums
+    SUMMARY_CHEAPEST = 8 << CHEAPEST_PARCEL,
+    SUMMARY_MOST_EXPENSIVE = 8 << MOST_EXPENSIVE_PARCEL,
+    SUMMARY_LIGHTEST = 8 << LIGHTEST_PARCEL,
+    SUMMARY_HEAVIEST = 8 << HEAVIEST_PARCEL,
+    SUMMARY_ALL = 127
+};
+
+typedef struct ParcelSummary {
+    long long count;            // Always computed; fields that were not requested stay zero
+    long long weightSum;
+    double valuationSum;
+    double meanWeight;
+    double meanValuation;
+    ParcelRecord extremes[4];   // Indexed by ParcelExtreme; only meaningful when count > 0
+} ParcelSummary;
+
+typedef struct QueryCacheEntry {
+    int countryId;              // -1 while empty
+    unsigned fields;            // The SummaryField flags the summary was computed with
+    int minWeight;
+    int maxWeight;
+    unsigned long version;      // The country's version the summary was computed for
+    int referenced;             // Set by every hit, cleared as the clock hand passes
+    int next;                   // Next entry in the same bucket, -1 at the end
+    ParcelSummary summary;
+} QueryCacheEntry;
+
+typedef struct alignas(64) QueryCacheShard {  // One cache line or more per shard, so locks are not shared
+    QueryCacheEntry* entries;
+    int* buckets;               // First entry of each bucket, by key, -1 if none
+    int capacity;               // Number of entries and of buckets
+    int hand;                   // Next entry the clock considers replacing
+    std::mutex lock;            // Held while an entry of this shard is looked up or replaced
+} QueryCacheShard;
+
+typedef struct QueryCache {
+    QueryCacheShard shards[QUERY_CACHE_SHARDS];  // Each key goes to the shard picked by queryCacheHash
+} QueryCache;
+
+typedef struct Partition {
+    const char* name;           // Slice of the input holding the first spelling seen
+    size_t length;
+    unsigned long hash;
+    ParcelRecord* records;      // This destination's parcels in file order
+    size_t count;
+    size_t capacity;
+    struct Partition* nextForCountry;  // Same country's partition in the next chunk
+} Partition;
+
+typedef struct IngestChunk {
+    const char* begin;
+    const char* end;
+    Partition* partitions;      // In order of first appearance within the chunk
+    size_t partitionCount;
+    size_t partitionCapacity;
+    size_t* slots;              // Open-addressing index into partitions, 0 marks an empty slot
+    size_t slotCount;
+    size_t* malformedOffsets;   // Offsets of malformed lines, in file order
+    size_t malformedCount;
+    size_t malformedCapacity;
+    int failed;                 // Set when the worker ran out of memory
+} IngestChunk;
+
+typedef struct DatasetSpec {
+    long long rows;
+    int countries;
+    double skew;                // Zipf exponent of the destination frequencies, 0 for uniform
+    int sorted;                 // Weights rise through the file instead of being random
+    int nameLength;             // Shortest destination name
+    unsigned long long seed;
+} DatasetSpec;
+
+typedef struct Options {
+    int threads;                // Ingest threads, 1 for the serial loader
+    int freeze;                 // What to build after loading, a FreezeMode value
+    const char* batch;          // Query file to run instead of the menu, "-" for stdin, or NULL
+    int snapshot;               // Start from the binary snapshot when it is current, and write one when not
+    int live;                   // Keep adding lines appended to the input file while answering queries
+    const char* serve;          // Socket path to answer queries on instead of the menu, or NULL
+    int workers;                // Server worker threads
+    const char* loadTest;       // Socket path of a server to load test instead of loading data, or NULL
+    int clients;                // Concurrent load test clients
+    int requests;               // Requests per load test client
+    const char* generate;       // Parcel file to write instead of loading data, or NULL
+    DatasetSpec dataset;        // What to generate
+    const char* benchmark;      // Parcel file to benchmark instead of loading couries.txt, or NULL
+    const char* results;        // File the benchmark results are appended to
+    const char* statsFile;      // File the statistics are appended to periodically, or NULL
+    const char* report;         // CSV file to write the all-countries report to instead of the menu, or NULL
+    int statsInterval;          // Seconds between statistics dumps
+    const char* spill;          // Directory to keep the parcels in out of core, or NULL
+    int spillMemory;            // Megabytes the external sort may use
+    int cacheEntries;           // Summaries the query result cache keeps, 0 for no cache
+    int perfectHash;            // Index the countries with a minimal perfect hash after loading
+} Options;
+
+typedef struct OutputBuffer {
+    FILE* file;                 // Where the output goes, or NULL to send it to connection
+    struct ServerConnection* connection;
+    char* data;
+    size_t used;
+    size_t capacity;
+    int failed;                 // Set once a write to the file has failed
+} OutputBuffer;
+
+typedef struct ReaderSlot {
+    std::atomic<unsigned long> epoch;  // Epoch the reader entered its read section in, 0 outside one
+    std::atomic<int> taken;            // Set while a thread owns the slot
+    char padding[64 - sizeof(std::atomic<unsigned long>) - sizeof(std::atomic<int>)];  // One cache line per reader
+} ReaderSlot;
+
+typedef struct RetiredPointer {
+    void* pointer;
+    unsigned long epoch;        // Reclaimable once no reader is still in an earlier epoch
+    int isParcel;               // Parcels go back to the pool, anything else to free()
+} RetiredPointer;
+
+typedef struct LiveIngest {
+    std::atomic<unsigned long> epoch;  // Advanced by the writer after each publish, starting at 1
+    ReaderSlot readers[LIVE_MAX_READERS];
+    std::atomic<int> readerCount;      // One past the highest reader slot ever taken
+    std::atomic<int> stop;
+    std::thread thread;
+    const char* path;
+    unsigned long long offset;         // File offset of the first byte not yet ingested
+    RetiredPointer* retired;           // Oldest first; retired[retiredHead..retiredCount) are pending
+    size_t retiredHead;
+    size_t retiredCount;
+    size_t retiredCapacity;
+} LiveIngest;
+
+typedef struct QueryServer {
+    HashTable* hashTable;
+    SocketHandle listener;      // Non-blocking, shared by every worker
+    std::atomic<int> stop;
+} QueryServer;
+
+typedef struct ServerConnection {
+    SocketHandle socket;        // Non-blocking
+    char request[BATCH_QUERY_MAX_LENGTH + 1];  // Received bytes of the unanswered requests
+    size_t used;
+    int skipping;               // Dropping the rest of an overlong request
+    char* queue;                // Response bytes the socket has not taken yet: queue[queueStart..queueEnd)
+    size_t queueStart;
+    size_t queueEnd;
+    size_t queueCapacity;
+} ServerConnection;
+
+typedef struct LoadTestClient {
+    const char* path;
+    char** queries;             // Shared by every client
+    size_t queryCount;
+    int first;                  // Index of the first query this client sends
+    int requests;
+    long long* latencies;       // Nanoseconds per answered request
+    int completed;
+    int errors;                 // Requests not answered
+} LoadTestClient;
+
+typedef struct BenchmarkRun {
+    const char* dataset;
+    FILE* results;
+    long long parcels;
+    unsigned long countries;
+    int threads;
+    int frozen;                 // A FreezeMode value
+} BenchmarkRun;
+
+typedef struct HashTableStats {
+    unsigned long buckets;
+    unsigned long occupiedBuckets;
+    unsigned long countries;
+    double loadFactor;
+    unsigned long maxProbeLength;
+    double averageProbeLength;
+    int rehashing;
+} HashTableStats;
+
+enum StatCounter {
+    STAT_COUNTRY_LOOKUPS,
+    STAT_CHAIN_PROBES,          // Country records looked at by lookups
+    STAT_NAME_COMPARISONS,      // Records whose hash matched, so their name was compared
+    STAT_NODES_VISITED,         // Parcel tree nodes stepped through by queries
+    STAT_COLUMN_VALUES,         // Frozen column entries read or reduced by queries
+    STAT_ROWS_OUTPUT,           // Parcels handed to a visitor, i.e. listed
+    STAT_PARCEL_ALLOCATIONS,    // Parcel nodes carved from a slab
+    STAT_PARCELS_RECYCLED,      // Parcel nodes reused from the free list
+    STAT_PARCELS_RELEASED,      // Parcel nodes given back to the free list
+    STAT_SLAB_ALLOCATIONS,
+    STAT_ARENA_ALLOCATIONS,     // Arena blocks
+    STAT_SPILL_PAGE_HITS,       // Pages of spilled columns found in the cache
+    STAT_SPILL_PAGE_READS,      // Pages of spilled columns read from disk
+    STAT_QUERY_CACHE_HITS,      // Summaries answered from the query cache
+    STAT_QUERY_CACHE_MISSES,    // Summaries computed and added to the query cache
+    STAT_COUNTER_COUNT
+};
+
+enum StatOperation {
+    STAT_OP_LOAD,
+    STAT_OP_LIST,
+    STAT_OP_FILTER,
+    STAT_OP_TOTALS,
+    STAT_OP_VALUATION_EXTREMES,
+    STAT_OP_WEIGHT_EXTREMES,
+    STAT_OP_RANGE_TOTALS,
+    STAT_OP_PAGE,
+    STAT_OP_TOP_VALUATIONS,
+    STAT_OP_VALUATION_RANK,     // Rank and percentile queries
+    STAT_OP_SUMMARY,
+    STAT_OP_REPORT,
+    STAT_OP_REMOVE,
+    STAT_OP_UPDATE,
+    STAT_OP_COUNT
+};
+
+typedef struct ThreadCounters {
+    std::atomic<long long> values[STAT_COUNTER_COUNT];  // Written only by the thread owning the block
+    char padding[64];           // Keeps the next thread's block off this one's last cache line
+} ThreadCounters;
+
+typedef struct LatencyHistogram {
+    std::atomic<long long> buckets[STATS_HISTOGRAM_BUCKETS];  // See latencyBucket
+    std::atomic<long long> count;
+    std::atomic<long long> totalNanoseconds;
+    std::atomic<long long> maxNanoseconds;
+} LatencyHistogram;
+
+typedef struct Statistics {
+    ThreadCounters threads[STATS_MAX_THREADS];
+    std::atomic<int> threadCount;      // Counter blocks claimed so far
+    LatencyHistogram latencies[STAT_OP_COUNT];
+} Statistics;
+
+typedef struct StatsDumper {
+    std::atomic<int> stop;
+    std::thread thread;
+    const char* path;
+    int interval;               // Seconds between dumps
+} StatsDumper;
+
+typedef struct CountryReport {
+    HashTable* hashTable;
+    unsigned long countries;    // Countries in the report, fixed when it starts
+    ParcelSummary* summaries;   // Indexed by country id
+    std::atomic<int>* blockReady;          // Set once every summary of a block is filled in
+    std::atomic<unsigned long> nextBlock;  // Shared counter of the next unclaimed block
+} CountryReport;
+
 //function prototype
-unsigned long djb2_hash(const char* str);
-Parcel* createParcel(const char* destination, int weight, float valuation);
-void insertParcel(Parcel** root, const char* destination, int weight, float valuation);
+int mapFile(const char* path, MappedFile* mapped);
+void unmapFile(MappedFile* mapped);
+const char* findFieldEnd(const char* p, const char* end);
+int parseWeight(const char* p, const char* end, int* weight);
+int parseValuation(const char* p, const char* end, float* valuation);
+const char* parseParcelLine(const char* p, const char* end, ParsedLine* parsed, int* result);
+void reportMalformedLine(const char* data, const char* line, const char* end, unsigned long long base);
+long loadParcelData(HashTable* hashTable, const char* data, size_t size);
+int addPartitionRecord(IngestChunk* chunk, ParsedLine* parsed);
+void parseIngestChunk(IngestChunk* chunk, const char* data);
+void insertCountryPartitions(HashTable* hashTable, Partition** countryPartitions, std::atomic<unsigned long>* nextCountry, ParcelPool* pool, std::atomic<int>* failed);
+void freeIngestChunk(IngestChunk* chunk);
+long loadParcelDataParallel(HashTable* hashTable, const char* data, size_t size, int threads);
+int loadParcelFile(HashTable* hashTable, const char* path, int threads, size_t* loadedSize);
+void getFileInfo(const char* path, FileInfo* info);
+unsigned long long snapshotChecksum(const unsigned char* data, size_t size);
+int saveSnapshot(HashTable* hashTable, const char* path, FileInfo* source);
+HashTable* loadSnapshot(const char* path, FileInfo* source);
+int seekFile(FILE* file, unsigned long long offset);
+char* spillFilePath(const char* directory, const char* name, int number);
+FILE* openSpillFile(const char* path);
+SpillStore* createSpillStore(const char* directory);
+void closeSpillStore(SpillStore* store);
+char* fetchSpillPage(SpillStore* store, unsigned long long number);
+int readSpill(SpillStore* store, unsigned long long offset, void* data, size_t size);
+int spillFailed(HashTable* hashTable);
+void sortSpillRecords(SpillRecord* records, size_t count, SpillRecord* scratch);
+int spillRunBefore(SpillMergeRun* runs, size_t a, size_t b);
+void siftSpillHeap(SpillMergeRun* runs, size_t* heap, size_t count, size_t position);
+int fillSpillRun(FILE* runs, SpillMergeRun* run, size_t capacity);
+int sortSpillFile(FILE* input, unsigned long long count, FILE* runs, SpillRecord* memory, size_t budget, SpillRecordSink sink, void* context);
+int addSpillRecord(SpillBuild* build, int countryId, int weight, float valuation);
+void partitionParcelData(SpillBuild* build, const char* data, size_t size, unsigned long long base);
+int partitionParcelStream(SpillBuild* build, FILE* input, size_t* loadedSize);
+int writeSpilledParcels(const SpillRecord* records, size_t count, void* context);
+int writeSpilledOrder(const SpillRecord* records, size_t count, void* context);
+int sortSpillPartitions(SpillBuild* build, size_t budget);
+void closeSpillBuild(SpillBuild* build);
+int spillParcelFile(HashTable* hashTable, const char* path, const char* directory, int memory, size_t* loadedSize);
+void beginRead(HashTable* hashTable);
+void endRead(HashTable* hashTable);
+void releaseReaderSlot(HashTable* hashTable);
+Country* pinCountry(Country* record, Country* view);
+void retirePointer(LiveIngest* live, void* pointer, int isParcel);
+void reclaimRetired(HashTable* hashTable, int everything);
+Country* addLiveCountry(HashTable* hashTable, const char* country, size_t length);
+int addLiveParcel(HashTable* hashTable, const char* destination, size_t length, int weight, float valuation);
+void ingestLiveData(HashTable* hashTable, const char* data, size_t size, unsigned long long base);
+void followParcelFile(HashTable* hashTable);
+void startLiveIngest(HashTable* hashTable, const char* path, unsigned long long offset);
+void stopLiveIngest(HashTable* hashTable);
+int parseOptions(int argc, char* argv[], Options* options);
+int parseIntOption(const char* option, const char* text, long minimum, long maximum, int* value);
+void foldCase(char* folded, const char* text, size_t length);
+int foldedNamesEqual(const char* a, const char* b, size_t length);
+unsigned long djb2_hash(const char* str, size_t length);
+unsigned long hashBucketIndex(unsigned long hash, unsigned long size);
+void initParcelPool(ParcelPool* pool);
+Parcel* allocParcel(ParcelPool* pool);
+void releaseParcel(ParcelPool* pool, Parcel* node);
+void* arenaAlloc(ParcelPool* pool, size_t size);
+void freeParcelSlabs(ParcelPool* pool);
+void freeParcelPool(ParcelPool* pool);
+void mergeParcelPool(ParcelPool* into, ParcelPool* from);
+Parcel* createParcel(ParcelPool* pool, int countryId, int weight, float valuation);
+int parcelHeight(Parcel* node);
+void updateParcel(Parcel* node);
+Parcel* rotateParcelLeft(Parcel* node);
+Parcel* rotateParcelRight(Parcel* node);
+Parcel* rebalanceParcel(Parcel* node);
+int parcelGoesLeft(Parcel* node, int weight, float valuation, int order);
+void insertParcel(ParcelPool* pool, Parcel** root, int countryId, int weight, float valuation, int order);
+Parcel* insertParcelCopy(ParcelPool* pool, Parcel* root, int countryId, int weight, float valuation, int order, ParcelCopy* copy);
+void releaseParcelCopy(ParcelPool* pool, ParcelCopy* copy);
+void retireParcelCopy(LiveIngest* live, ParcelCopy* copy);
+int findParcelPath(Parcel** root, int weight, float valuation, int order, Parcel*** path);
+void unlinkParcel(ParcelPool* pool, Parcel*** path, int depth);
+int removeParcel(ParcelPool* pool, Parcel** root, int weight, float valuation, int order);
+int replaceParcel(ParcelPool* pool, Parcel** root, int countryId, int weight, float valuation, int newWeight, float newValuation, int order);
+Parcel* buildParcelTree(ParcelPool* pool, int countryId, const int* weights, const float* valuations, const int* order, int count);
+unsigned int valuationKey(float valuation);
+void sortValuationOrder(const float* valuations, int count, int* order, unsigned int* scratch);
+int indexCountryValuations(ParcelPool* pool, Country* record);
+int indexValuations(HashTable* hashTable);
+Parcel* selectParcel(Parcel* root, long long rank);
 Parcel* searchParcel(Parcel* root, int weight);
-Parcel* searchParcelByDestination(Parcel* root, const char* destination);
-void printParcel(Parcel* parcel);
-void printAllParcels(Parcel* root, const char* country);
-void printParcelsWithCondition(Parcel* root, int weight, int condition, const char* country);
+int weightRangeBounds(int low, int lowInclusive, int high, int highInclusive, int* minWeight, int* maxWeight);
+long long countParcelsBelow(Parcel* root, int weight);
+void initParcelIteratorAtRank(ParcelIterator* iterator, Parcel* root, long long rank, long long limit, int descending);
+void initParcelIterator(ParcelIterator* iterator, Parcel* root, int minWeight, int maxWeight, long long offset, long long limit);
+Parcel* nextParcel(ParcelIterator* iterator);
+long long forEachParcelInRange(Parcel* root, int minWeight, int maxWeight, long long offset, long long limit, ParcelVisitor visit, void* context);
+int printParcelVisitor(Country* record, int weight, float valuation, void* context);
+void printParcel(HashTable* hashTable, Parcel* parcel);
+void printParcelFields(HashTable* hashTable, int countryId, int weight, float valuation);
+void printAllParcels(HashTable* hashTable, Country* record);
+void printParcelsWithCondition(HashTable* hashTable, Country* record, int weight, int condition);
 HashTable* createHashTable();
+void rehashStep(HashTable* hashTable, unsigned long buckets);
+void growHashTable(HashTable* hashTable);
+void getHashTableStats(HashTable* hashTable, HashTableStats* stats);
+void addStatCounter(int counter, long long amount);
+long long readStatCounter(int counter);
+int latencyBucket(long long nanoseconds);
+long long latencyBucketLimit(int bucket);
+void recordLatency(int operation, std::chrono::steady_clock::time_point start);
+long long latencyPercentile(LatencyHistogram* histogram, long long count, double fraction);
+void writeStatistics(HashTable* hashTable, OutputBuffer* out);
+void printStatistics(HashTable* hashTable);
+void dumpStatistics(HashTable* hashTable, const char* path);
+void dumpStatisticsPeriodically(HashTable* hashTable);
+void startStatisticsDump(HashTable* hashTable, const char* path, int interval);
+void stopStatisticsDump(HashTable* hashTable);
+int countryNameMatches(const char* name, const char* country, size_t length);
+Country* createCountry(ParcelPool* pool, const char* name, size_t length);
+Country* findCountry(HashTable* hashTable, const char* country, size_t length);
+Country* findOrAddCountry(HashTable* hashTable, const char* country, size_t length);
+Country* countryById(HashTable* hashTable, int id);
+unsigned long long perfectHashMix(unsigned long long hash, unsigned long long seed);
+int buildPerfectHash(HashTable* hashTable);
+void freePerfectHash(PerfectHash* perfect);
 void clean(HashTable* hashTable);
-void totalLoadAndValuation(Parcel* root, const char* country, int* totalLoad, float* totalValuation);
-Parcel* findMinValuation(Parcel* root, const char* country);
-Parcel* findMaxValuation(Parcel* root, const char* country);
-Parcel* findMinWeight(Parcel* root, const char* country);
-Parcel* findMaxWeight(Parcel* root, const char* country);
-int handleCountryName(char* country, unsigned long* hashIndex, HashTable* hashTable);
-int isCountryInHashTable(Parcel* root, const char* country);
+template <int Extreme> Parcel* findExtremeParcel(Parcel* root);
+void setSummaryParcel(ParcelSummary* summary, int extreme, int weight, float valuation);
+template <int Extreme> void addExtremeToSummary(ParcelSummary* summary, Parcel* node, int wholeSubtree, int first, Parcel** extremeSubtrees);
+template <unsigned Fields> void addParcelToSummary(ParcelSummary* summary, Parcel* node, int wholeSubtree, Parcel** extremeSubtrees);
+template <unsigned Fields> void summarizeWeightRange(Parcel* root, int minWeight, int maxWeight, ParcelSummary* summary);
+template <unsigned Fields> void scanColumns(const int* weights, const float* valuations, int count, long long* weightSum, double* valuationSum, int* cheapest, int* mostExpensive);
+int lowerBoundWeight(const int* weights, int count, int weight);
+int fillColumnSnapshot(Country* record, ColumnSnapshot* columns);
+int freezeCountry(Country* record);
+int freezeHashTable(HashTable* hashTable, int mode);
+int bitWidth(unsigned int value);
+unsigned int readBits(const unsigned long long* bits, size_t position, int width);
+void writeBits(unsigned long long* bits, size_t position, int width, unsigned int value);
+int valuationCents(float valuation, int* cents);
+float centsValuation(int cents);
+int measurePackedBlock(ColumnSnapshot* columns, int first, int last, PackedBlock* block);
+ColumnSnapshot* packColumns(ColumnSnapshot* columns);
+int decodePackedBlock(ColumnSnapshot* columns, int block, int* weights, int* cents);
+void columnParcel(ColumnSnapshot* columns, int index, int* weight, float* valuation);
+int readSpilledParcels(ColumnSnapshot* columns, int first, int count, ParcelRecord* parcels);
+int columnOrderIndex(ColumnSnapshot* columns, long long rank);
+int columnLowerBound(ColumnSnapshot* columns, int weight);
+int layOutEytzinger(const int* weights, int* tree, int* index, int next, unsigned long long k, int count);
+int indexColumnWeights(Country* record);
+int eytzingerLowerBound(ColumnSnapshot* columns, int weight);
+int unpackColumns(ColumnSnapshot* columns, int* weights, float* valuations, int* order);
+int buildColumnTrees(ParcelPool* pool, Country* record, ColumnSnapshot* columns, Parcel** root, Parcel** valuationRoot);
+int compactCountry(Country* record);
+int findColumnParcel(ColumnSnapshot* columns, int weight, float valuation);
+int thawCountry(ParcelPool* pool, Country* record);
+int parcelsChangeable(HashTable* hashTable);
+int removeCountryParcel(ParcelPool* pool, Country* record, int weight, float valuation);
+int replaceCountryParcel(ParcelPool* pool, Country* record, int weight, float valuation, int newWeight, float newValuation);
+void columnRangeBounds(ColumnSnapshot* columns, int minWeight, int maxWeight, int* first, int* last);
+long long visitCountryParcels(Country* record, int minWeight, int maxWeight, long long offset, long long limit, ParcelRecordVisitor visit, void* context);
+long long printCountryParcels(HashTable* hashTable, Country* record, int minWeight, int maxWeight, long long offset, long long limit);
+template <unsigned Fields> void scanPackedColumns(ColumnSnapshot* columns, int first, int last, long long* weightSum, double* valuationSum, int* cheapest, int* mostExpensive);
+template <unsigned Fields> void scanSpilledColumns(ColumnSnapshot* columns, int first, int last, long long* weightSum, double* valuationSum, int* cheapest, int* mostExpensive);
+template <unsigned Fields> void summarizeColumns(ColumnSnapshot* columns, int first, int last, ParcelSummary* summary);
+template <unsigned Fields> void summarizeCountry(Country* record, int minWeight, int maxWeight, ParcelSummary* summary);
+QueryCache* createQueryCache(int capacity);
+void freeQueryCache(QueryCache* cache);
+unsigned long long queryCacheHash(int countryId, unsigned fields, int minWeight, int maxWeight);
+int queryCacheBucket(QueryCacheShard* shard, unsigned long long hash);
+int lookupQueryCache(QueryCache* cache, Country* record, unsigned fields, int minWeight, int maxWeight, ParcelSummary* summary);
+void storeQueryCache(QueryCache* cache, Country* record, unsigned long version, unsigned fields, int minWeight, int maxWeight, ParcelSummary* summary);
+template <unsigned Fields> void summarizeCountryCached(HashTable* hashTable, Country* record, int minWeight, int maxWeight, ParcelSummary* summary);
+void summarizeWeightCondition(HashTable* hashTable, Country* record, int weight, int condition, ParcelSummary* summary);
+long long countCountryParcels(Country* record);
+long long percentileRank(long long count, double percentile);
+int findValuationRank(Country* record, long long rank, ParcelRecord* found);
+long long visitByValuation(Country* record, long long offset, long long limit, int descending, ParcelRecordVisitor visit, void* context);
+void printValuationRank(HashTable* hashTable, Country* record, long long rank);
+void printCountryParcel(HashTable* hashTable, Country* record, ParcelSummary* summary, int extreme);
+void printCountrySummary(HashTable* hashTable, Country* record, ParcelSummary* summary);
+int initOutputBuffer(OutputBuffer* out, FILE* file);
+void flushOutputBuffer(OutputBuffer* out);
+void freeOutputBuffer(OutputBuffer* out);
+void writeOutput(OutputBuffer* out, const char* text, size_t length);
+void writeOutputFormat(OutputBuffer* out, const char* format, ...);
+void writeOutputInt(OutputBuffer* out, long long value);
+void writeOutputValuation(OutputBuffer* out, double value);
+void writeOutputDirect(OutputBuffer* out, const char* text, size_t length);
+void writeParcelLine(OutputBuffer* out, const char* name, int weight, float valuation);
+void writeCountryParcel(OutputBuffer* out, Country* record, ParcelSummary* summary, int extreme);
+void writeCountrySummary(OutputBuffer* out, Country* record, ParcelSummary* summary);
+void writeValuationRank(OutputBuffer* out, Country* record, long long rank);
+int writeParcelVisitor(Country* record, int weight, float valuation, void* context);
+char* trimSpaces(char* text);
+char* splitLastWord(char* text);
+int splitParcelFields(char* text, int* weight, float* valuation);
+void runBatchQuery(HashTable* hashTable, char* query, OutputBuffer* out);
+int runBatchQueries(HashTable* hashTable, const char* path);
+void reportWorker(CountryReport* report);
+void writeCsvField(OutputBuffer* out, const char* text);
+void writeReportRow(OutputBuffer* out, Country* record, ParcelSummary* summary);
+int writeCountryReport(HashTable* hashTable, const char* path, int workers);
+void closeSocket(SocketHandle socket);
+int setSocketBlocking(SocketHandle socket, int blocking);
+int pollSockets(struct pollfd* sockets, size_t count, int timeout);
+int sendAll(SocketHandle socket, const char* data, size_t length);
+int socketWouldBlock();
+int sendAvailable(SocketHandle socket, const char* data, size_t length, size_t* sent);
+int queueResponse(ServerConnection* connection, const char* data, size_t length);
+int sendQueuedResponse(ServerConnection* connection);
+int startSockets();
+void stopSockets();
+int unixSocketAddress(const char* path, struct sockaddr_un* address);
+SocketHandle openServerSocket(const char* path);
+SocketHandle connectServerSocket(const char* path);
+int serveConnection(QueryServer* server, ServerConnection* connection, OutputBuffer* out, int readable);
+void serverWorker(QueryServer* server);
+int runQueryServer(HashTable* hashTable, const char* path, int workers);
+int readServerResponse(SocketHandle socket, char* buffer, size_t size);
+void loadTestClient(LoadTestClient* client);
+int compareLatencies(const void* a, const void* b);
+int runLoadTest(const char* path, const char* queryPath, int clients, int requests);
+unsigned long long nextRandom(unsigned long long* state);
+void makeDestinationName(int rank, int minLength, char* name);
+int generateParcelFile(const char* path, DatasetSpec* spec);
+void writeJsonString(FILE* file, const char* text);
+void writeBenchmarkResult(BenchmarkRun* run, const char* operation, long long calls, double seconds, long long checksum);
+double secondsSince(std::chrono::steady_clock::time_point start);
+int runBenchmark(const char* dataset, const char* resultsPath, int threads, int freeze);
+int handleCountryName(char* country, Country** record, HashTable* hashTable);
 void handleWeightInput(int* weight, int* success);
+void handleIntInput(const char* prompt, int* value, int* success);
+void handleValuationInput(const char* prompt, float* valuation, int* success);
 void handleConditionInput(int* condition);
 void handleUserMenu(HashTable* hashTable);
 
 /*
  * FUNCTION: main
- * DESCRIPTION: Main entry point of the program. Initializes the hash table, reads parcel data from a file,
- *              inserts parcels into the hash table, and then presents a user menu for interaction with the data.
- * PARAMETERS: None.
+ * DESCRIPTION: Main entry point of the program. Initializes the hash table from the binary snapshot when
+ *              it is current, or else loads parcel data from the text file (and snapshots the result),
+ *              and then presents a user menu for interaction with the data, or
+ *              answers a file of queries when run in batch mode, or serves queries over a socket, or
+ *              writes the all-countries report. With
+ *              --live, lines appended to the text file keep being added while the queries run. A load
+ *              test only talks to a running server and loads nothing; generating a dataset only writes
+ *              it, and a benchmark loads the dataset it is given. With --stats-file, the statistics are
+ *              appended to a file periodically while the queries run. With --spill, the text file is
+ *              loaded out of core and the queries read the parcels from disk.
+ * PARAMETERS: int argc - The number of command-line arguments.
+ *             char* argv[] - The command-line arguments (see parseOptions).
  * RETURNS: int - Exit status code:
  *         - 0 if the program completes successfully.
- *         - 1 if there is an error in creating the hash table or opening/closing the file.
+ *         - 1 if there is an error in the arguments, creating the hash table, opening/mapping the file,
+ *           writing batch results, setting up the server socket, answering load test requests,
+ *           writing a generated dataset, running a benchmark or writing the report.
  */
-int main() {
-    HashTable* hashTable = createHashTable();
-    if (hashTable == NULL) {
+int main(int argc, char* argv[]) {
+    Options options;
+    if (parseOptions(argc, argv, &options) != 0) {
         return 1;
     }
-
-    FILE* file;
-    errno_t err = fopen_s(&file, "couries.txt", "r");
-    if (err != 0 || file == NULL) {
-        printf("Error opening file\n");
-        free(hashTable);
-        return 1;
+    if (options.loadTest != NULL) {
+        return runLoadTest(options.loadTest, options.batch, options.clients, options.requests);
+    }
+    if (options.generate != NULL) {
+        return generateParcelFile(options.generate, &options.dataset);
+    }
+    if (options.benchmark != NULL) {
+        return runBenchmark(options.benchmark, options.results, options.threads, options.freeze);
     }
 
-    char line[128]; // Adjust the size based on the maximum expected line length
-    while (fgets(line, sizeof(line), file)) {
-        line[strcspn(line, "\n")] = '\0'; // Remove newline character
-
-        char* destination = line;
-        char* weightStr = strchr(line, ',');
-        if (weightStr) {
-            *weightStr = '\0';
-            weightStr++;
+    FileInfo source;
+    getFileInfo("couries.txt", &source);
+    size_t loadedSize = (size_t)source.size;
+    std::chrono::steady_clock::time_point loadStart = std::chrono::steady_clock::now();
+    HashTable* hashTable = options.snapshot && options.spill == NULL ? loadSnapshot("couries.idx", &source) : NULL;
+    if (hashTable == NULL) {
+        hashTable = createHashTable();
+        if (hashTable == NULL) {
+            return 1;
+        }
+        int failed = options.spill != NULL ? spillParcelFile(hashTable, "couries.txt", options.spill, options.spillMemory, &loadedSize)
+                                           : loadParcelFile(hashTable, "couries.txt", options.threads, &loadedSize);
+        if (failed) {
+            clean(hashTable);
+            return 1;
         }
-        char* valuationStr = weightStr ? strchr(weightStr, ',') : NULL;
-        if (valuationStr) {
-            *valuationStr = '\0';
-            valuationStr++;
+        if (options.snapshot && options.spill == NULL) {
+            saveSnapshot(hashTable, "couries.idx", &source);
         }
+    }
+    if (options.freeze != FREEZE_NONE) {
+        freezeHashTable(hashTable, options.freeze);
+    }
+    recordLatency(STAT_OP_LOAD, loadStart);
+    if (options.perfectHash) {
+        buildPerfectHash(hashTable);
+    }
+    if (options.cacheEntries > 0) {
+        hashTable->cache = createQueryCache(options.cacheEntries);
+    }
+    if (options.live) {
+        startLiveIngest(hashTable, "couries.txt", loadedSize);
+    }
+    if (options.statsFile != NULL) {
+        startStatisticsDump(hashTable, options.statsFile, options.statsInterval);
+    }
+
+    if (options.serve != NULL) {
+        int status = runQueryServer(hashTable, options.serve, options.workers);
+        clean(hashTable);
+        return status;
+    }
+    if (options.batch != NULL) {
+        int status = runBatchQueries(hashTable, options.batch);
+        clean(hashTable);
+        return status;
+    }
+    if (options.report != NULL) {
+        int status = writeCountryReport(hashTable, options.report, options.workers);
+        clean(hashTable);
+        return status;
+    }
+    handleUserMenu(hashTable);
 
-        if (destination && weightStr && valuationStr) {
-            int weight = atoi(weightStr);
-            float valuation = (float)atof(valuationStr);
+    return 0;
+}
 
-            unsigned long hashIndex = djb2_hash(destination);
-            insertParcel(&hashTable->table[hashIndex], destination, weight, valuation);
+/*
+ * FUNCTION: parseOptions
+ * DESCRIPTION: Parses the command-line options:
+ *              -t, --threads N  Parse the input on N threads (0 = one per hardware thread, default 1).
+ *              -f, --freeze     Build read-only columnar snapshots of every country after loading.
+ *              --compact        Keep only compressed columns of every country after loading (see
+ *                               compactCountry), in a fraction of the memory.
+ *              --eytzinger      Freeze as --freeze, and search the weights through a copy laid out
+ *                               for the cache (see indexColumnWeights).
+ *              -b, --batch FILE Answer the queries in FILE ("-" for stdin) instead of showing the menu.
+ *              -n, --no-snapshot  Neither read nor write the binary snapshot couries.idx.
+ *              -l, --live       Keep adding lines appended to couries.txt while queries are answered.
+ *              -s, --serve PATH Answer batch queries from clients on the Unix domain socket PATH.
+ *              -w, --workers N  Serve or report on N worker threads (0 = one per hardware thread, the
+ *                               default). A followed file can be served by at most LIVE_MAX_READERS -
+ *                               LIVE_OTHER_READERS workers.
+ *              -g, --load-test PATH  Send the --batch queries to the server on PATH and report latencies.
+ *              -c, --clients N  Load test with N concurrent clients (default LOAD_TEST_CLIENTS).
+ *              -r, --requests N Requests sent by each load test client (default LOAD_TEST_REQUESTS).
+ *              --generate FILE  Write a synthetic parcel file, shaped by:
+ *                  --rows N         Parcels to write (default 1000000).
+ *                  --countries N    Destinations (default 200).
+ *                  --skew S         Zipf exponent of the destination frequencies (default 1, 0 = uniform).
+ *                  --sorted         Write the parcels in order of weight.
+ *                  --name-length N  Pad destination names to at least N characters.
+ *                  --seed N         Seed of the random generator (default 1).
+ *              --benchmark FILE Time the query functions on the parcel file FILE (honours --threads
+ *                               and --freeze, --compact or --eytzinger), appending JSON lines to --results FILE
+ *                               (default benchmark.jsonl).
+ *              --stats-file FILE  Append the statistics (see writeStatistics) to FILE periodically
+ *                                 and on exit.
+ *              --stats-interval N Seconds between statistics dumps (default STATS_DEFAULT_INTERVAL).
+ *              --report FILE    Write the all-countries CSV report (see writeCountryReport) to FILE
+ *                               ("-" for stdout) instead of showing the menu.
+ *              --spill DIR      Load the input out of core (see spillParcelFile), keeping the parcels in
+ *                               files in DIR instead of memory; the binary snapshot is not used.
+ *              --spill-memory MB  Memory the external sort may use (default SPILL_DEFAULT_MEMORY).
+ *              --cache N        Keep the summaries of up to N recent queries (default QUERY_CACHE_ENTRIES,
+ *                               0 = none; see summarizeCountryCached).
+ *              --perfect-hash   Look countries up through a minimal perfect hash built after loading
+ *                               (see buildPerfectHash).
+ * PARAMETERS: int argc - The number of command-line arguments.
+ *             char* argv[] - The command-line arguments.
+ *             Options* options - Pointer to store the parsed options.
+ * RETURNS: 0 on success, 1 if the arguments are invalid.
+ */
+int parseOptions(int argc, char* argv[], Options* options) {
+    options->threads = 1;
+    options->freeze = FREEZE_NONE;
+    options->batch = NULL;
+    options->snapshot = 1;
+    options->live = 0;
+    options->serve = NULL;
+    options->workers = 0;
+    options->loadTest = NULL;
+    options->clients = LOAD_TEST_CLIENTS;
+    options->requests = LOAD_TEST_REQUESTS;
+    options->generate = NULL;
+    options->dataset.rows = 1000000;
+    options->dataset.countries = 200;
+    options->dataset.skew = 1.0;
+    options->dataset.sorted = 0;
+    options->dataset.nameLength = 0;
+    options->dataset.seed = 1;
+    options->benchmark = NULL;
+    options->results = "benchmark.jsonl";
+    options->statsFile = NULL;
+    options->statsInterval = STATS_DEFAULT_INTERVAL;
+    options->report = NULL;
+    options->spill = NULL;
+    options->spillMemory = SPILL_DEFAULT_MEMORY;
+    options->cacheEntries = QUERY_CACHE_ENTRIES;
+    options->perfectHash = 0;
+    for (int i = 1; i < argc; ++i) {
+        if ((strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--threads") == 0) && i + 1 < argc) {
+            char* end;
+            long value = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || value < 0 || value > INGEST_MAX_THREADS) {
+                printf("Invalid thread count '%s'.\n", argv[i]);
+                return 1;
+            }
+            options->threads = value == 0 ? (int)std::thread::hardware_concurrency() : (int)value;
+            if (options->threads < 1) {
+                options->threads = 1;
+            }
+        }
+        else if (strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--freeze") == 0) {
+            if (options->freeze == FREEZE_NONE) {
+                options->freeze = FREEZE_COLUMNS;
+            }
+        }
+        else if (strcmp(argv[i], "--compact") == 0) {
+            options->freeze = FREEZE_COMPACT;
+        }
+        else if (strcmp(argv[i], "--eytzinger") == 0) {
+            if (options->freeze != FREEZE_COMPACT) {
+                options->freeze = FREEZE_EYTZINGER;
+            }
+        }
+        else if ((strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--batch") == 0) && i + 1 < argc) {
+            options->batch = argv[++i];
+        }
+        else if (strcmp(argv[i], "-n") == 0 || strcmp(argv[i], "--no-snapshot") == 0) {
+            options->snapshot = 0;
+        }
+        else if (strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "--live") == 0) {
+            options->live = 1;
+        }
+        else if ((strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--serve") == 0) && i + 1 < argc) {
+            options->serve = argv[++i];
+        }
+        else if ((strcmp(argv[i], "-g") == 0 || strcmp(argv[i], "--load-test") == 0) && i + 1 < argc) {
+            options->loadTest = argv[++i];
+        }
+        else if ((strcmp(argv[i], "-w") == 0 || strcmp(argv[i], "--workers") == 0) && i + 1 < argc) {
+            if (parseIntOption(argv[i], argv[i + 1], 0, INGEST_MAX_THREADS, &options->workers) != 0) {
+                return 1;
+            }
+            ++i;
+        }
+        else if ((strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--clients") == 0) && i + 1 < argc) {
+            if (parseIntOption(argv[i], argv[i + 1], 1, INGEST_MAX_THREADS, &options->clients) != 0) {
+                return 1;
+            }
+            ++i;
+        }
+        else if ((strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "--requests") == 0) && i + 1 < argc) {
+            if (parseIntOption(argv[i], argv[i + 1], 1, INT_MAX, &options->requests) != 0) {
+                return 1;
+            }
+            ++i;
+        }
+        else if (strcmp(argv[i], "--generate") == 0 && i + 1 < argc) {
+            options->generate = argv[++i];
+        }
+        else if (strcmp(argv[i], "--rows") == 0 && i + 1 < argc) {
+            int rows;
+            if (parseIntOption(argv[i], argv[i + 1], 1, INT_MAX, &rows) != 0) {
+                return 1;
+            }
+            options->dataset.rows = rows;
+            ++i;
+        }
+        else if (strcmp(argv[i], "--countries") == 0 && i + 1 < argc) {
+            if (parseIntOption(argv[i], argv[i + 1], 1, 1 << 24, &options->dataset.countries) != 0) {
+                return 1;
+            }
+            ++i;
+        }
+        else if (strcmp(argv[i], "--skew") == 0 && i + 1 < argc) {
+            char* end;
+            options->dataset.skew = strtod(argv[++i], &end);
+            if (end == argv[i] || *end != '\0' || !(options->dataset.skew >= 0.0 && options->dataset.skew <= 10.0)) {
+                printf("Invalid value '%s' for --skew.\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--sorted") == 0) {
+            options->dataset.sorted = 1;
+        }
+        else if (strcmp(argv[i], "--name-length") == 0 && i + 1 < argc) {
+            if (parseIntOption(argv[i], argv[i + 1], 0, GENERATOR_MAX_NAME_LENGTH, &options->dataset.nameLength) != 0) {
+                return 1;
+            }
+            ++i;
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            char* end;
+            options->dataset.seed = strtoull(argv[++i], &end, 10);
+            if (end == argv[i] || *end != '\0') {
+                printf("Invalid value '%s' for --seed.\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--benchmark") == 0 && i + 1 < argc) {
+            options->benchmark = argv[++i];
+        }
+        else if (strcmp(argv[i], "--results") == 0 && i + 1 < argc) {
+            options->results = argv[++i];
+        }
+        else if (strcmp(argv[i], "--stats-file") == 0 && i + 1 < argc) {
+            options->statsFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--report") == 0 && i + 1 < argc) {
+            options->report = argv[++i];
+        }
+        else if (strcmp(argv[i], "--spill") == 0 && i + 1 < argc) {
+            options->spill = argv[++i];
+        }
+        else if (strcmp(argv[i], "--spill-memory") == 0 && i + 1 < argc) {
+            if (parseIntOption(argv[i], argv[i + 1], 1, 1 << 20, &options->spillMemory) != 0) {
+                return 1;
+            }
+            ++i;
+        }
+        else if (strcmp(argv[i], "--perfect-hash") == 0) {
+            options->perfectHash = 1;
+        }
+        else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            if (parseIntOption(argv[i], argv[i + 1], 0, 1 << 24, &options->cacheEntries) != 0) {
+                return 1;
+            }
+            ++i;
+        }
+        else if (strcmp(argv[i], "--stats-interval") == 0 && i + 1 < argc) {
+            if (parseIntOption(argv[i], argv[i + 1], 1, INT_MAX, &options->statsInterval) != 0) {
+                return 1;
+            }
+            ++i;
         }
         else {
-            printf("Malformed line in file: %s\n", line);
+            printf("Usage: %s [--threads N] [--freeze | --compact | --eytzinger] [--batch FILE] [--no-snapshot] [--live]\n"
+                   "       [--serve PATH [--workers N]] [--load-test PATH --batch FILE [--clients N] [--requests N]]\n"
+                   "       [--generate FILE [--rows N] [--countries N] [--skew S] [--sorted] [--name-length N] [--seed N]]\n"
+                   "       [--benchmark FILE [--results FILE]] [--stats-file FILE [--stats-interval N]]\n"
+                   "       [--report FILE [--workers N]] [--spill DIR [--spill-memory MB]] [--cache N] [--perfect-hash]\n", argv[0]);
+            return 1;
         }
     }
-
-    if (fclose(file) != 0) {
-        printf("Error closing file\n");
+    // Every server worker takes a reader slot while the file is followed
+    int maxWorkers = options->serve != NULL && options->live ? LIVE_MAX_READERS - LIVE_OTHER_READERS : INGEST_MAX_THREADS;
+    if (options->workers > maxWorkers) {
+        printf("At most %d workers can serve a followed file.\n", maxWorkers);
+        return 1;
+    }
+    if (options->workers == 0) {
+        options->workers = (int)std::thread::hardware_concurrency();
+        if (options->workers < 1) {
+            options->workers = 1;
+        }
+        if (options->workers > maxWorkers) {
+            options->workers = maxWorkers;
+        }
+    }
+    if (options->loadTest != NULL && options->batch == NULL) {
+        printf("A load test needs the queries to send: --batch FILE.\n");
+        return 1;
+    }
+    if ((options->serve != NULL) + (options->batch != NULL && options->loadTest == NULL) + (options->report != NULL) > 1) {
+        printf("Only one of --serve, --batch and --report can be given.\n");
+        return 1;
     }
+    return 0;
+}
 
-    handleUserMenu(hashTable);
+/*
+ * FUNCTION: parseIntOption
+ * DESCRIPTION: Parses the integer value of a command-line option and checks its range.
+ * PARAMETERS: const char* option - The option, for the error message.
+ *             const char* text - The value to parse.
+ *             long minimum - The smallest value allowed.
+ *             long maximum - The largest value allowed.
+ *             int* value - Pointer to store the value.
+ * RETURNS: 0 on success, 1 if the value is not a number in range.
+ */
+int parseIntOption(const char* option, const char* text, long minimum, long maximum, int* value) {
+    char* end;
+    errno = 0;
+    long parsed = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno == ERANGE || parsed < minimum || parsed > maximum) {
+        printf("Invalid value '%s' for %s.\n", text, option);
+        return 1;
+    }
+    *value = (int)parsed;
+    return 0;
+}
 
+/*
+ * FUNCTION: mapFile
+ * DESCRIPTION: Maps a whole file read-only into memory. An empty file is reported as a zero-length
+ *              mapping with no data pointer.
+ * PARAMETERS: const char* path - The path of the file to map.
+ *             MappedFile* mapped - Pointer to store the mapping.
+ * RETURNS: 0 on success, 1 if the file cannot be opened or mapped.
+ */
+int mapFile(const char* path, MappedFile* mapped) {
+    mapped->data = NULL;
+    mapped->size = 0;
+#ifdef _WIN32
+    mapped->mapping = NULL;
+    mapped->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+        FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (mapped->file == INVALID_HANDLE_VALUE) {
+        return 1;
+    }
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(mapped->file, &fileSize)) {
+        CloseHandle(mapped->file);
+        return 1;
+    }
+    mapped->size = (size_t)fileSize.QuadPart;
+    if (mapped->size == 0) {
+        return 0;
+    }
+    mapped->mapping = CreateFileMappingA(mapped->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapped->mapping == NULL) {
+        CloseHandle(mapped->file);
+        return 1;
+    }
+    mapped->data = (const char*)MapViewOfFile(mapped->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (mapped->data == NULL) {
+        CloseHandle(mapped->mapping);
+        CloseHandle(mapped->file);
+        return 1;
+    }
+#else
+    mapped->fd = open(path, O_RDONLY);
+    if (mapped->fd < 0) {
+        return 1;
+    }
+    struct stat fileStat;
+    if (fstat(mapped->fd, &fileStat) != 0) {
+        close(mapped->fd);
+        return 1;
+    }
+    mapped->size = (size_t)fileStat.st_size;
+    if (mapped->size == 0) {
+        return 0;
+    }
+    void* data = mmap(NULL, mapped->size, PROT_READ, MAP_PRIVATE, mapped->fd, 0);
+    if (data == MAP_FAILED) {
+        close(mapped->fd);
+        return 1;
+    }
+    madvise(data, mapped->size, MADV_SEQUENTIAL);
+    mapped->data = (const char*)data;
+#endif
     return 0;
 }
 
 /*
- * FUNCTION: djb2_hash
- * DESCRIPTION: Computes a hash value for a given string using the djb2 hash function.
- * PARAMETERS: const char* str - The string to hash.
- * RETURNS: The computed hash value as an unsigned long integer.
+ * FUNCTION: unmapFile
+ * DESCRIPTION: Releases a mapping created by mapFile and closes the file.
+ * PARAMETERS: MappedFile* mapped - The mapping to release.
+ * RETURNS: None.
  */
-unsigned long djb2_hash(const char* str) {
-    unsigned long hash = 5381;
-    int c;
-    while ((c = *str++) != '\0') {
-        c = tolower(c);  // Convert to lowercase for consistent hashing
-        hash = ((hash << 5) + hash) + c;
+void unmapFile(MappedFile* mapped) {
+#ifdef _WIN32
+    if (mapped->data != NULL) {
+        UnmapViewOfFile(mapped->data);
+        CloseHandle(mapped->mapping);
     }
-    return hash % HASH_TABLE_SIZE;
+    CloseHandle(mapped->file);
+#else
+    if (mapped->data != NULL) {
+        munmap((void*)mapped->data, mapped->size);
+    }
+    close(mapped->fd);
+#endif
+    mapped->data = NULL;
+    mapped->size = 0;
 }
 
 /*
- * FUNCTION: createParcel
- * DESCRIPTION: Creates a new parcel with the specified destination, weight, and valuation.
- * PARAMETERS: const char* destination - The destination of the parcel.
- *             int weight - The weight of the parcel.
- *             float valuation - The valuation of the parcel.
- * RETURNS: A pointer to the newly created Parcel.
+ * FUNCTION: findFieldEnd
+ * DESCRIPTION: Finds the next ',' or '\n' in a buffer. With SSE2 the buffer is scanned 16 bytes at a
+ *              time; the scalar loop handles the tail and builds without SSE2.
+ * PARAMETERS: const char* p - The start of the scan.
+ *             const char* end - One past the last byte of the buffer.
+ * RETURNS: A pointer to the delimiter, or end if there is none.
  */
-Parcel* createParcel(const char* destination, int weight, float valuation) {
-    Parcel* newParcel = (Parcel*)malloc(sizeof(Parcel));
-    if (newParcel == NULL) {
-        printf("Failed to allocate memory for new parcel\n");
-        return NULL;
+const char* findFieldEnd(const char* p, const char* end) {
+#ifdef HAVE_SSE2
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i newline = _mm_set1_epi8('\n');
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(chunk, comma), _mm_cmpeq_epi8(chunk, newline));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(hits);
+        if (mask != 0) {
+#ifdef _MSC_VER
+            unsigned long index;
+            _BitScanForward(&index, mask);
+            return p + index;
+#else
+            return p + __builtin_ctz(mask);
+#endif
+        }
+        p += 16;
     }
-    newParcel->destination = (char*)malloc(strlen(destination) + 1);
-    if (newParcel->destination == NULL) {
-        printf("Failed to allocate memory for destination\n");
-        free(newParcel);
-        return NULL;
+#endif
+    while (p < end && *p != ',' && *p != '\n') {
+        ++p;
     }
-    strcpy_s(newParcel->destination, strlen(destination) + 1, destination);
+    return p;
+}
 
-    // Convert destination to lowercase here
-    for (char* p = newParcel->destination; *p; ++p) {
-        *p = tolower((unsigned char)*p);
+/*
+ * FUNCTION: parseWeight
+ * DESCRIPTION: Parses a decimal integer field without going through the C locale. Surrounding blanks
+ *              are allowed; anything else, an empty field or an overflow makes the field invalid.
+ * PARAMETERS: const char* p - The start of the field.
+ *             const char* end - One past the end of the field.
+ *             int* weight - Pointer to store the parsed value.
+ * RETURNS: 1 if the field is a valid integer, 0 otherwise.
+ */
+int parseWeight(const char* p, const char* end, int* weight) {
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        ++p;
+    }
+    while (end > p && (end[-1] == ' ' || end[-1] == '\t')) {
+        --end;
     }
 
-    newParcel->weight = weight;
-    newParcel->valuation = valuation;
-    newParcel->left = newParcel->right = NULL;
-    return newParcel;
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p++ == '-';
+    }
+    if (p == end) {
+        return 0;
+    }
+
+    long long value = 0;
+    for (; p < end; ++p) {
+        unsigned int digit = (unsigned int)(*p - '0');
+        if (digit > 9) {
+            return 0;
+        }
+        value = value * 10 + digit;
+        if (value > 2147483648LL) {
+            return 0;
+        }
+    }
+    if (negative) {
+        value = -value;
+    }
+    if (value > 2147483647LL) {
+        return 0;
+    }
+    *weight = (int)value;
+    return 1;
 }
 
 /*
-*FUNCTION: insertParcel
-* DESCRIPTION : Inserts a new parcel into a binary search tree(BST) based on weight.
-* PARAMETERS : Parcel * *root - Pointer to the root of the BST.
-* const char* destination - The destination of the parcel.
-* int weight - The weight of the parcel.
-* float valuation - The valuation of the parcel.
-* RETURNS : None.
-*/
-void insertParcel(Parcel** root, const char* destination, int weight, float valuation) {
-    if (*root == NULL) {
-        *root = createParcel(destination, weight, valuation);
-        return;
+ * FUNCTION: parseValuation
+ * DESCRIPTION: Parses a fixed-point decimal field ("123", "-4.50", ".5") without going through the C
+ *              locale. Surrounding blanks are allowed; exponents and other characters are not. Digits
+ *              beyond the 18th significant one are ignored.
+ * PARAMETERS: const char* p - The start of the field.
+ *             const char* end - One past the end of the field.
+ *             float* valuation - Pointer to store the parsed value.
+ * RETURNS: 1 if the field is a valid decimal, 0 otherwise.
+ */
+int parseValuation(const char* p, const char* end, float* valuation) {
+    static const double powersOfTen[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+        1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18
+    };
+
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        ++p;
     }
-    if (weight < (*root)->weight) {
-        insertParcel(&(*root)->left, destination, weight, valuation);
+    while (end > p && (end[-1] == ' ' || end[-1] == '\t')) {
+        --end;
     }
-    else {
-        insertParcel(&(*root)->right, destination, weight, valuation);
+
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p++ == '-';
+    }
+
+    unsigned long long mantissa = 0;
+    int significantDigits = 0;
+    int fractionDigits = 0;
+    int integerExponent = 0;
+    int digits = 0;
+    int seenPoint = 0;
+    for (; p < end; ++p) {
+        if (*p == '.' && !seenPoint) {
+            seenPoint = 1;
+            continue;
+        }
+        unsigned int digit = (unsigned int)(*p - '0');
+        if (digit > 9) {
+            return 0;
+        }
+        ++digits;
+        if (significantDigits < 18) {
+            mantissa = mantissa * 10 + digit;
+            if (mantissa != 0) {
+                ++significantDigits;
+            }
+            if (seenPoint) {
+                ++fractionDigits;
+            }
+        }
+        else if (!seenPoint) {
+            ++integerExponent;
+        }
     }
+    if (digits == 0) {
+        return 0;
+    }
+
+    double value = (double)mantissa;
+    while (integerExponent > 0) {
+        int step = integerExponent > 18 ? 18 : integerExponent;
+        value *= powersOfTen[step];
+        integerExponent -= step;
+    }
+    while (fractionDigits > 0) {
+        int step = fractionDigits > 18 ? 18 : fractionDigits;
+        value /= powersOfTen[step];
+        fractionDigits -= step;
+    }
+    *valuation = (float)(negative ? -value : value);
+    return 1;
 }
 
 /*
- * FUNCTION: searchParcel
- * DESCRIPTION: Searches for a parcel in the BST by weight.
- * PARAMETERS: Parcel* root - The root of the BST.
- *             int weight - The weight to search for.
- * RETURNS: A pointer to the Parcel if found, otherwise NULL.
+ * FUNCTION: parseParcelLine
+ * DESCRIPTION: Parses one "destination,weight,valuation" record starting at p. The destination is
+ *              returned as a slice of the buffer. CRLF line endings are accepted.
+ * PARAMETERS: const char* p - The start of the line.
+ *             const char* end - One past the last byte of the buffer.
+ *             ParsedLine* parsed - Pointer to store the fields.
+ *             int* result - Pointer to store PARSE_OK, PARSE_BLANK or PARSE_MALFORMED.
+ * RETURNS: A pointer to the start of the next line.
  */
+const char* parseParcelLine(const char* p, const char* end, ParsedLine* parsed, int* result) {
+    const char* line = p;
+    const char* destinationEnd = findFieldEnd(p, end);
+    const char* weightEnd = destinationEnd;
+    const char* lineEnd = destinationEnd;
 
-Parcel* searchParcel(Parcel* root, int weight) {
-    if (root == NULL || root->weight == weight) {
-        return root;
+    if (destinationEnd < end && *destinationEnd == ',') {
+        weightEnd = findFieldEnd(destinationEnd + 1, end);
+        lineEnd = weightEnd;
+        if (weightEnd < end && *weightEnd == ',') {
+            lineEnd = (const char*)memchr(weightEnd + 1, '\n', (size_t)(end - weightEnd - 1));
+            if (lineEnd == NULL) {
+                lineEnd = end;
+            }
+        }
+    }
+    const char* next = lineEnd < end ? lineEnd + 1 : end;
+
+    const char* recordEnd = lineEnd;
+    if (recordEnd > line && recordEnd[-1] == '\r') {
+        --recordEnd;  // Accept CRLF line endings
+    }
+
+    parsed->line = line;
+    if (recordEnd == line) {
+        *result = PARSE_BLANK;
     }
-    if (weight < root->weight) {
-        return searchParcel(root->left, weight);
+    else if (destinationEnd == line || destinationEnd >= recordEnd || *destinationEnd != ',' ||
+        weightEnd >= recordEnd || *weightEnd != ',' ||
+        !parseWeight(destinationEnd + 1, weightEnd, &parsed->weight) ||
+        !parseValuation(weightEnd + 1, recordEnd, &parsed->valuation)) {
+        *result = PARSE_MALFORMED;
     }
     else {
-        return searchParcel(root->right, weight);
+        parsed->destination = line;
+        parsed->destinationLength = (size_t)(destinationEnd - line);
+        *result = PARSE_OK;
     }
+    return next;
 }
 
 /*
- * FUNCTION: searchParcelByDestination
- * DESCRIPTION: Searches for a parcel in the BST by destination.
- * PARAMETERS: Parcel* root - The root of the BST.
- *             const char* destination - The destination to search for.
- * RETURNS: A pointer to the Parcel if found, otherwise NULL.
+ * FUNCTION: reportMalformedLine
+ * DESCRIPTION: Prints a malformed line with its byte offset, truncated to MALFORMED_LINE_PREVIEW bytes.
+ * PARAMETERS: const char* data - The start of the file contents.
+ *             const char* line - The start of the malformed line.
+ *             const char* end - One past the last byte of the file contents.
+ *             unsigned long long base - The file offset of data, when it holds only part of the file.
+ * RETURNS: None.
  */
-
-Parcel* searchParcelByDestination(Parcel* root, const char* destination) {
-    if (root == NULL) {
-        return NULL;
+void reportMalformedLine(const char* data, const char* line, const char* end, unsigned long long base) {
+    const char* lineEnd = (const char*)memchr(line, '\n', (size_t)(end - line));
+    if (lineEnd == NULL) {
+        lineEnd = end;
+    }
+    if (lineEnd > line && lineEnd[-1] == '\r') {
+        --lineEnd;
     }
+    size_t length = (size_t)(lineEnd - line);
+    printf("Malformed line at byte offset %llu: %.*s%s\n", base + (unsigned long long)(line - data),
+        (int)(length > MALFORMED_LINE_PREVIEW ? MALFORMED_LINE_PREVIEW : length), line,
+        length > MALFORMED_LINE_PREVIEW ? "..." : "");
+}
 
-    // Allocate memory for lowerDestination
-    char* lowerDestination = (char*)malloc(strlen(destination) + 1);
-    if (lowerDestination == NULL) {
-        printf("Memory allocation failed\n");
-        return NULL;
+/*
+ * FUNCTION: loadParcelData
+ * DESCRIPTION: Parses "destination,weight,valuation" records from a buffer and inserts them into the
+ *              hash table. The destination is passed to the index as a slice of the buffer and is only
+ *              copied the first time a country is seen. Blank lines are skipped; malformed lines are
+ *              reported with the byte offset they start at and skipped. Once every record is in, the
+ *              valuation index of every country is built.
+ * PARAMETERS: HashTable* hashTable - The hash table to insert into.
+ *             const char* data - The file contents.
+ *             size_t size - The number of bytes in data.
+ * RETURNS: The number of malformed lines, or -1 if the valuation index ran out of memory.
+ */
+long loadParcelData(HashTable* hashTable, const char* data, size_t size) {
+    const char* p = data;
+    const char* end = data + size;
+    long malformed = 0;
+
+    while (p < end) {
+        ParsedLine parsed;
+        int result;
+        p = parseParcelLine(p, end, &parsed, &result);
+        if (result == PARSE_MALFORMED) {
+            reportMalformedLine(data, parsed.line, end, 0);
+            ++malformed;
+        }
+        else if (result == PARSE_OK) {
+            Country* record = findOrAddCountry(hashTable, parsed.destination, parsed.destinationLength);
+            if (record != NULL) {
+                Parcel* root = record->root.load(std::memory_order_relaxed);
+                insertParcel(&hashTable->pool, &root, record->id, parsed.weight, parsed.valuation, WEIGHT_ORDER);
+                record->root.store(root, std::memory_order_relaxed);
+            }
+        }
     }
+    return indexValuations(hashTable) != 0 ? -1 : malformed;
+}
 
-    strcpy_s(lowerDestination, strlen(destination) + 1, destination);
+/*
+ * FUNCTION: addPartitionRecord
+ * DESCRIPTION: Appends a parsed record to the chunk-local partition of its destination, creating the
+ *              partition on first sight. Partitions are found through a small open-addressing table
+ *              that doubles when half full; destinations match ignoring case.
+ * PARAMETERS: IngestChunk* chunk - The chunk being parsed.
+ *             ParsedLine* parsed - The record to add.
+ * RETURNS: 1 on success, 0 on allocation failure.
+ */
+int addPartitionRecord(IngestChunk* chunk, ParsedLine* parsed) {
+    unsigned long hash = djb2_hash(parsed->destination, parsed->destinationLength);
 
-    // Convert lowerDestination to lowercase here
-    for (char* p = lowerDestination; *p; ++p) {
-        *p = tolower((unsigned char)*p);
+    if (chunk->partitionCount * 2 >= chunk->slotCount) {
+        size_t slotCount = chunk->slotCount ? chunk->slotCount * 2 : 64;
+        size_t* slots = (size_t*)calloc(slotCount, sizeof(size_t));
+        if (slots == NULL) {
+            return 0;
+        }
+        for (size_t i = 0; i < chunk->partitionCount; ++i) {
+            size_t slot = hashBucketIndex(chunk->partitions[i].hash, slotCount);
+            while (slots[slot] != 0) {
+                slot = (slot + 1) & (slotCount - 1);
+            }
+            slots[slot] = i + 1;
+        }
+        free(chunk->slots);
+        chunk->slots = slots;
+        chunk->slotCount = slotCount;
+    }
+
+    Partition* partition = NULL;
+    size_t slot = hashBucketIndex(hash, chunk->slotCount);
+    while (chunk->slots[slot] != 0) {
+        Partition* candidate = &chunk->partitions[chunk->slots[slot] - 1];
+        if (candidate->hash == hash && candidate->length == parsed->destinationLength) {
+            if (foldedNamesEqual(candidate->name, parsed->destination, candidate->length)) {
+                partition = candidate;
+                break;
+            }
+        }
+        slot = (slot + 1) & (chunk->slotCount - 1);
+    }
+
+    if (partition == NULL) {
+        if (chunk->partitionCount == chunk->partitionCapacity) {
+            size_t capacity = chunk->partitionCapacity ? chunk->partitionCapacity * 2 : 16;
+            Partition* partitions = (Partition*)realloc(chunk->partitions, capacity * sizeof(Partition));
+            if (partitions == NULL) {
+                return 0;
+            }
+            chunk->partitions = partitions;
+            chunk->partitionCapacity = capacity;
+        }
+        partition = &chunk->partitions[chunk->partitionCount++];
+        partition->name = parsed->destination;
+        partition->length = parsed->destinationLength;
+        partition->hash = hash;
+        partition->records = NULL;
+        partition->count = 0;
+        partition->capacity = 0;
+        partition->nextForCountry = NULL;
+        chunk->slots[slot] = chunk->partitionCount;
+    }
+
+    if (partition->count == partition->capacity) {
+        size_t capacity = partition->capacity ? partition->capacity * 2 : 16;
+        ParcelRecord* records = (ParcelRecord*)realloc(partition->records, capacity * sizeof(ParcelRecord));
+        if (records == NULL) {
+            return 0;
+        }
+        partition->records = records;
+        partition->capacity = capacity;
+    }
+    partition->records[partition->count].weight = parsed->weight;
+    partition->records[partition->count].valuation = parsed->valuation;
+    partition->count++;
+    return 1;
+}
+
+/*
+ * FUNCTION: parseIngestChunk
+ * DESCRIPTION: Worker body for the parallel loader. Parses one newline-aligned slice of the input into
+ *              chunk-local per-destination partitions and remembers the offsets of malformed lines, so
+ *              the merge can report them in file order.
+ * PARAMETERS: IngestChunk* chunk - The chunk to parse.
+ *             const char* data - The start of the file contents, for offsets.
+ * RETURNS: None.
+ */
+void parseIngestChunk(IngestChunk* chunk, const char* data) {
+    const char* p = chunk->begin;
+    while (p < chunk->end && !chunk->failed) {
+        ParsedLine parsed;
+        int result;
+        p = parseParcelLine(p, chunk->end, &parsed, &result);
+        if (result == PARSE_OK) {
+            chunk->failed = !addPartitionRecord(chunk, &parsed);
+        }
+        else if (result == PARSE_MALFORMED) {
+            if (chunk->malformedCount == chunk->malformedCapacity) {
+                size_t capacity = chunk->malformedCapacity ? chunk->malformedCapacity * 2 : 16;
+                size_t* offsets = (size_t*)realloc(chunk->malformedOffsets, capacity * sizeof(size_t));
+                if (offsets == NULL) {
+                    chunk->failed = 1;
+                    break;
+                }
+                chunk->malformedOffsets = offsets;
+                chunk->malformedCapacity = capacity;
+            }
+            chunk->malformedOffsets[chunk->malformedCount++] = (size_t)(parsed.line - data);
+        }
+    }
+}
+
+/*
+ * FUNCTION: insertCountryPartitions
+ * DESCRIPTION: Worker body for the insert phase of the parallel loader. Repeatedly claims the next
+ *              country id and inserts that country's partitions in chunk order, i.e. in file order, so
+ *              each tree receives exactly the insert sequence the serial loader would give it. The
+ *              country's valuation index is built right after its tree.
+ * PARAMETERS: HashTable* hashTable - The hash table being loaded.
+ *             Partition** countryPartitions - First partition of each country id, in chunk order.
+ *             std::atomic<unsigned long>* nextCountry - Shared counter of the next unclaimed country id.
+ *             ParcelPool* pool - The worker's own pool to allocate parcels from.
+ *             std::atomic<int>* failed - Set if a valuation index runs out of memory.
+ * RETURNS: None.
+ */
+void insertCountryPartitions(HashTable* hashTable, Partition** countryPartitions, std::atomic<unsigned long>* nextCountry, ParcelPool* pool, std::atomic<int>* failed) {
+    unsigned long id;
+    while ((id = nextCountry->fetch_add(1)) < hashTable->count) {
+        Country* record = countryById(hashTable, (int)id);
+        Parcel* root = record->root.load(std::memory_order_relaxed);
+        for (Partition* partition = countryPartitions[id]; partition != NULL; partition = partition->nextForCountry) {
+            for (size_t i = 0; i < partition->count; ++i) {
+                insertParcel(pool, &root, record->id, partition->records[i].weight, partition->records[i].valuation, WEIGHT_ORDER);
+            }
+        }
+        record->root.store(root, std::memory_order_relaxed);
+        if (indexCountryValuations(pool, record) != 0) {
+            failed->store(1);
+        }
+    }
+}
+
+/*
+ * FUNCTION: freeIngestChunk
+ * DESCRIPTION: Frees the partitions and bookkeeping of a parsed chunk.
+ * PARAMETERS: IngestChunk* chunk - The chunk to free.
+ * RETURNS: None.
+ */
+void freeIngestChunk(IngestChunk* chunk) {
+    for (size_t i = 0; i < chunk->partitionCount; ++i) {
+        free(chunk->partitions[i].records);
+    }
+    free(chunk->partitions);
+    free(chunk->slots);
+    free(chunk->malformedOffsets);
+}
+
+/*
+ * FUNCTION: loadParcelDataParallel
+ * DESCRIPTION: Loads a buffer of parcel records on several threads and builds the same index as
+ *              loadParcelData. The buffer is split into newline-aligned chunks that are parsed in
+ *              parallel into chunk-local partitions. A short serial merge then walks the chunks in file
+ *              order, reporting malformed lines and registering countries so they get the same ids as
+ *              in a serial load. Finally the workers insert whole countries in parallel, each from its
+ *              own pool, along with its valuation index, and the pools are handed over to the hash table.
+ * PARAMETERS: HashTable* hashTable - The hash table to insert into.
+ *             const char* data - The file contents.
+ *             size_t size - The number of bytes in data.
+ *             int threads - The number of worker threads.
+ * RETURNS: The number of malformed lines, or -1 if the load ran out of memory.
+ */
+long loadParcelDataParallel(HashTable* hashTable, const char* data, size_t size, int threads) {
+    size_t chunkCount = size / INGEST_MIN_CHUNK_SIZE;
+    if (chunkCount > (size_t)threads) {
+        chunkCount = (size_t)threads;
+    }
+    if (chunkCount < 2) {
+        return loadParcelData(hashTable, data, size);
+    }
+
+    IngestChunk* chunks = (IngestChunk*)calloc(chunkCount, sizeof(IngestChunk));
+    if (chunks == NULL) {
+        printf("Failed to allocate memory for parallel load\n");
+        return -1;
+    }
+    std::thread* workers = new std::thread[chunkCount];
+    const char* end = data + size;
+    const char* begin = data;
+    for (size_t i = 0; i < chunkCount; ++i) {
+        const char* chunkEnd = end;
+        if (i + 1 < chunkCount) {
+            chunkEnd = data + size / chunkCount * (i + 1);
+            if (chunkEnd < begin) {
+                chunkEnd = begin;
+            }
+            const char* newline = (const char*)memchr(chunkEnd, '\n', (size_t)(end - chunkEnd));
+            chunkEnd = newline ? newline + 1 : end;
+        }
+        chunks[i].begin = begin;
+        chunks[i].end = chunkEnd;
+        begin = chunkEnd;
+    }
+
+    for (size_t i = 0; i < chunkCount; ++i) {
+        workers[i] = std::thread(parseIngestChunk, &chunks[i], data);
+    }
+    for (size_t i = 0; i < chunkCount; ++i) {
+        workers[i].join();
+    }
+
+    long malformed = 0;
+    int failed = 0;
+    for (size_t i = 0; i < chunkCount; ++i) {
+        failed |= chunks[i].failed;
+    }
+
+    // Register countries in file order so ids match the serial loader
+    for (size_t i = 0; i < chunkCount && !failed; ++i) {
+        for (size_t j = 0; j < chunks[i].malformedCount; ++j) {
+            reportMalformedLine(data, data + chunks[i].malformedOffsets[j], end, 0);
+        }
+        malformed += (long)chunks[i].malformedCount;
+        for (size_t j = 0; j < chunks[i].partitionCount && !failed; ++j) {
+            Partition* partition = &chunks[i].partitions[j];
+            failed = findOrAddCountry(hashTable, partition->name, partition->length) == NULL;
+        }
+    }
+
+    Partition** countryPartitions = NULL;
+    Partition** countryTails = NULL;
+    ParcelPool* pools = NULL;
+    if (!failed) {
+        countryPartitions = (Partition**)calloc(hashTable->count + 1, sizeof(Partition*));
+        countryTails = (Partition**)calloc(hashTable->count + 1, sizeof(Partition*));
+        pools = (ParcelPool*)malloc(chunkCount * sizeof(ParcelPool));
+        failed = countryPartitions == NULL || countryTails == NULL || pools == NULL;
+    }
+
+    if (!failed) {
+        for (size_t i = 0; i < chunkCount; ++i) {
+            for (size_t j = 0; j < chunks[i].partitionCount; ++j) {
+                Partition* partition = &chunks[i].partitions[j];
+                int id = findCountry(hashTable, partition->name, partition->length)->id;
+                if (countryTails[id] == NULL) {
+                    countryPartitions[id] = partition;
+                }
+                else {
+                    countryTails[id]->nextForCountry = partition;
+                }
+                countryTails[id] = partition;
+            }
+        }
+
+        std::atomic<unsigned long> nextCountry(0);
+        std::atomic<int> indexFailed(0);
+        for (size_t i = 0; i < chunkCount; ++i) {
+            initParcelPool(&pools[i]);
+            workers[i] = std::thread(insertCountryPartitions, hashTable, countryPartitions, &nextCountry, &pools[i], &indexFailed);
+        }
+        for (size_t i = 0; i < chunkCount; ++i) {
+            workers[i].join();
+            mergeParcelPool(&hashTable->pool, &pools[i]);
+        }
+        if (indexFailed.load()) {
+            malformed = -1;
+        }
+    }
+
+    if (failed) {
+        printf("Failed to allocate memory for parallel load\n");
+    }
+    free(pools);
+    free(countryPartitions);
+    free(countryTails);
+    for (size_t i = 0; i < chunkCount; ++i) {
+        freeIngestChunk(&chunks[i]);
+    }
+    free(chunks);
+    delete[] workers;
+    return failed ? -1 : malformed;
+}
+
+/*
+ * FUNCTION: loadParcelFile
+ * DESCRIPTION: Memory-maps a parcel file and loads its records into the hash table.
+ * PARAMETERS: HashTable* hashTable - The hash table to insert into.
+ *             const char* path - The path of the parcel file.
+ *             int threads - The number of ingest threads; 1 selects the serial loader.
+ *             size_t* loadedSize - Pointer to store the number of bytes loaded, where following starts.
+ * RETURNS: 0 on success, 1 if the file cannot be opened or mapped or the load runs out of memory.
+ */
+int loadParcelFile(HashTable* hashTable, const char* path, int threads, size_t* loadedSize) {
+    MappedFile mapped;
+    if (mapFile(path, &mapped) != 0) {
+        printf("Error opening file\n");
+        return 1;
+    }
+    long malformed = threads > 1 ? loadParcelDataParallel(hashTable, mapped.data, mapped.size, threads)
+                                 : loadParcelData(hashTable, mapped.data, mapped.size);
+    *loadedSize = mapped.size;
+    unmapFile(&mapped);
+    return malformed < 0;
+}
+
+/*
+ * FUNCTION: getFileInfo
+ * DESCRIPTION: Reads the size and modification time of a file.
+ * PARAMETERS: const char* path - The path of the file.
+ *             FileInfo* info - Pointer to store the result; exists is 0 if the file cannot be found.
+ * RETURNS: None.
+ */
+void getFileInfo(const char* path, FileInfo* info) {
+#ifdef _WIN32
+    struct _stat64 status;
+    info->exists = _stat64(path, &status) == 0;
+#else
+    struct stat status;
+    info->exists = stat(path, &status) == 0;
+#endif
+    info->modified = info->exists ? (long long)status.st_mtime : 0;
+    info->size = info->exists ? (unsigned long long)status.st_size : 0;
+}
+
+/*
+ * FUNCTION: snapshotChecksum
+ * DESCRIPTION: Computes a 64-bit FNV-1a checksum over a buffer, taking eight bytes per step so that
+ *              verifying a snapshot costs little next to mapping it.
+ * PARAMETERS: const unsigned char* data - The bytes to checksum.
+ *             size_t size - The number of bytes.
+ * RETURNS: The checksum.
+ */
+unsigned long long snapshotChecksum(const unsigned char* data, size_t size) {
+    unsigned long long hash = 14695981039346656037ULL;
+    size_t i = 0;
+    for (; i + sizeof(unsigned long long) <= size; i += sizeof(unsigned long long)) {
+        unsigned long long word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 1099511628211ULL;
+    }
+    for (; i < size; ++i) {
+        hash = (hash ^ data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/*
+ * FUNCTION: saveSnapshot
+ * DESCRIPTION: Writes the loaded index to a binary snapshot: a header, the destination table, the names
+ *              and every country's columns with their totals and valuation extremes, in the layout of
+ *              SnapshotHeader. The file is built in memory, written next to the target and renamed over
+ *              it, so a reader never maps a half-written snapshot.
+ * PARAMETERS: HashTable* hashTable - The hash table to save.
+ *             const char* path - The path of the snapshot.
+ *             FileInfo* source - The text file the table was loaded from, as it was before loading.
+ * RETURNS: 0 on success, 1 if the snapshot cannot be built or written.
+ */
+int saveSnapshot(HashTable* hashTable, const char* path, FileInfo* source) {
+    size_t tableEnd = sizeof(SnapshotHeader) + hashTable->count * sizeof(SnapshotCountry);
+    size_t namesEnd = tableEnd;
+    size_t parcelCount = 0;
+    for (unsigned long id = 0; id < hashTable->count; ++id) {
+        Country* record = countryById(hashTable, (int)id);
+        ColumnSnapshot* frozen = record->columns;
+        Parcel* root = record->root;
+        namesEnd += strlen(record->name) + 1;
+        parcelCount += (size_t)(frozen ? frozen->count : root ? root->count : 0);
+    }
+    size_t columnsStart = (namesEnd + 7) & ~(size_t)7;
+    size_t size = columnsStart + parcelCount * (2 * sizeof(int) + sizeof(float));
+
+    unsigned char* image = (unsigned char*)calloc(1, size);
+    if (image == NULL) {
+        printf("Failed to allocate memory for snapshot '%s'\n", path);
+        return 1;
+    }
+
+    SnapshotCountry* entries = (SnapshotCountry*)(image + sizeof(SnapshotHeader));
+    size_t nameOffset = tableEnd;
+    size_t columnOffset = columnsStart;
+    for (unsigned long id = 0; id < hashTable->count; ++id) {
+        Country* record = countryById(hashTable, (int)id);
+        SnapshotCountry* entry = &entries[id];
+        size_t nameLength = strlen(record->name);
+        memcpy(image + nameOffset, record->name, nameLength + 1);
+        entry->nameOffset = nameOffset;
+        entry->nameLength = (unsigned int)nameLength;
+        nameOffset += nameLength + 1;
+
+        // Frozen countries are copied as they are; the rest are frozen straight into the image
+        ColumnSnapshot* frozen = record->columns;
+        Parcel* root = record->root;
+        ColumnSnapshot columns;
+        columns.count = frozen ? frozen->count : root ? root->count : 0;
+        columns.weights = (int*)(image + columnOffset);
+        columns.valuations = (float*)(columns.weights + columns.count);
+        columns.valuationOrder = (int*)(columns.valuations + columns.count);
+        columns.blocks = NULL;
+        columns.eytzinger = NULL;
+        columns.spill = NULL;
+        if (frozen != NULL && frozen->weights == NULL) {
+            unpackColumns(frozen, columns.weights, columns.valuations, columns.valuationOrder);
+        }
+        else if (frozen != NULL) {
+            memcpy(columns.weights, frozen->weights, (size_t)columns.count * sizeof(int));
+            memcpy(columns.valuations, frozen->valuations, (size_t)columns.count * sizeof(float));
+            memcpy(columns.valuationOrder, frozen->valuationOrder, (size_t)columns.count * sizeof(int));
+        }
+        if (frozen != NULL) {
+            columns.weightSum = frozen->weightSum;
+            columns.valuationSum = frozen->valuationSum;
+            columns.minValuationIndex = frozen->minValuationIndex;
+            columns.maxValuationIndex = frozen->maxValuationIndex;
+        }
+        else if (fillColumnSnapshot(record, &columns) != 0) {
+            free(image);
+            printf("Failed to allocate memory for snapshot '%s'\n", path);
+            return 1;
+        }
+        entry->columnOffset = columnOffset;
+        entry->count = columns.count;
+        entry->weightSum = columns.weightSum;
+        entry->valuationSum = columns.valuationSum;
+        entry->minValuationIndex = columns.minValuationIndex;
+        entry->maxValuationIndex = columns.maxValuationIndex;
+        columnOffset += (size_t)columns.count * (2 * sizeof(int) + sizeof(float));
+    }
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byteOrder = SNAPSHOT_BYTE_ORDER;
+    header.size = size;
+    header.sourceModified = source->modified;
+    header.sourceSize = source->size;
+    header.countryCount = (unsigned int)hashTable->count;
+    header.checksum = snapshotChecksum(image + sizeof(header), size - sizeof(header));
+    memcpy(image, &header, sizeof(header));
+
+    char temporary[FILENAME_MAX];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    FILE* file = NULL;
+    errno_t err = fopen_s(&file, temporary, "wb");
+    int written = err == 0 && file != NULL && fwrite(image, 1, size, file) == size;
+    if (file != NULL && fclose(file) != 0) {
+        written = 0;
+    }
+    free(image);
+#ifdef _WIN32
+    written = written && MoveFileExA(temporary, path, MOVEFILE_REPLACE_EXISTING);
+#else
+    written = written && rename(temporary, path) == 0;
+#endif
+    if (!written) {
+        remove(temporary);
+        printf("Error writing snapshot '%s'.\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * FUNCTION: loadSnapshot
+ * DESCRIPTION: Maps a binary snapshot written by saveSnapshot and builds a hash table whose countries
+ *              are frozen onto columns inside the mapping, so queries can start without parsing the
+ *              text file or allocating any parcel nodes. The snapshot is only used when it has the
+ *              current version and a valid checksum, and when it was built from the text file as it is
+ *              now; a snapshot without a text file next to it is used as it is.
+ * PARAMETERS: const char* path - The path of the snapshot.
+ *             FileInfo* source - The text file the snapshot must have been built from.
+ * RETURNS: The loaded hash table, or NULL if the snapshot is missing, out of date or invalid.
+ */
+HashTable* loadSnapshot(const char* path, FileInfo* source) {
+    MappedFile* mapped = (MappedFile*)malloc(sizeof(MappedFile));
+    if (mapped == NULL) {
+        return NULL;
+    }
+    if (mapFile(path, mapped) != 0) {
+        free(mapped);
+        return NULL;
+    }
+
+    const unsigned char* data = (const unsigned char*)mapped->data;
+    size_t size = mapped->size;
+    SnapshotHeader header;
+    int valid = size >= sizeof(header);
+    if (valid) {
+        memcpy(&header, data, sizeof(header));
+        valid = memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) == 0 && header.version == SNAPSHOT_VERSION
+             && header.byteOrder == SNAPSHOT_BYTE_ORDER && header.size == size
+             && header.countryCount <= (size - sizeof(header)) / sizeof(SnapshotCountry);
+    }
+    if (valid && source->exists && (header.sourceModified != source->modified || header.sourceSize != source->size)) {
+        unmapFile(mapped);  // Out of date: the text file has changed since the snapshot was written
+        free(mapped);
+        return NULL;
+    }
+    if (valid) {
+        valid = snapshotChecksum(data + sizeof(header), size - sizeof(header)) == header.checksum;
+    }
+
+    HashTable* hashTable = valid ? createHashTable() : NULL;
+    if (hashTable == NULL) {
+        if (!valid) {
+            printf("Ignoring invalid snapshot '%s'.\n", path);
+        }
+        unmapFile(mapped);
+        free(mapped);
+        return NULL;
+    }
+    hashTable->snapshot = mapped;
+
+    const SnapshotCountry* entries = (const SnapshotCountry*)(data + sizeof(header));
+    for (unsigned int i = 0; i < header.countryCount && valid; ++i) {
+        const SnapshotCountry* entry = &entries[i];
+        valid = entry->nameOffset < size && entry->nameLength < size - entry->nameOffset
+             && data[entry->nameOffset + entry->nameLength] == '\0'
+             && entry->count >= 0 && entry->columnOffset % sizeof(int) == 0 && entry->columnOffset <= size
+             && (size_t)entry->count <= (size - entry->columnOffset) / (2 * sizeof(int) + sizeof(float))
+             && entry->minValuationIndex >= -1 && entry->minValuationIndex < entry->count
+             && entry->maxValuationIndex >= -1 && entry->maxValuationIndex < entry->count;
+        if (!valid) {
+            break;
+        }
+
+        // Ids are handed out in table order, so a duplicated name shows up as an id mismatch
+        Country* record = findOrAddCountry(hashTable, (const char*)data + entry->nameOffset, entry->nameLength);
+        ColumnSnapshot* columns = record ? (ColumnSnapshot*)malloc(sizeof(ColumnSnapshot)) : NULL;
+        valid = columns != NULL && record->id == (int)i && record->columns == NULL;
+        if (!valid) {
+            free(columns);
+            break;
+        }
+        columns->count = entry->count;
+        columns->weights = (int*)(data + entry->columnOffset);
+        columns->valuations = (float*)(columns->weights + entry->count);
+        columns->valuationOrder = (int*)(columns->valuations + entry->count);
+        columns->blocks = NULL;
+        columns->eytzinger = NULL;
+        columns->spill = NULL;
+        columns->weightSum = entry->weightSum;
+        columns->valuationSum = entry->valuationSum;
+        columns->minValuationIndex = entry->minValuationIndex;
+        columns->maxValuationIndex = entry->maxValuationIndex;
+        record->columns = columns;
+    }
+    if (!valid) {
+        printf("Ignoring invalid snapshot '%s'.\n", path);
+        clean(hashTable);
+        return NULL;
+    }
+    return hashTable;
+}
+
+/*
+ * FUNCTION: seekFile
+ * DESCRIPTION: Moves a file's position to an offset that may lie beyond 2 GB.
+ * PARAMETERS: FILE* file - The file.
+ *             unsigned long long offset - The offset from the start of the file.
+ * RETURNS: 0 on success, nonzero on failure.
+ */
+int seekFile(FILE* file, unsigned long long offset) {
+#ifdef _WIN32
+    return _fseeki64(file, (long long)offset, SEEK_SET);
+#else
+    return fseeko(file, (off_t)offset, SEEK_SET);
+#endif
+}
+
+/*
+ * FUNCTION: spillFilePath
+ * DESCRIPTION: Builds the path of one of the files an out-of-core load keeps in its directory.
+ * PARAMETERS: const char* directory - The directory.
+ *             const char* name - The file's name, without extension.
+ *             int number - Appended to the name when not negative, e.g. a partition number.
+ * RETURNS: The path, which the caller frees, or NULL on allocation failure.
+ */
+char* spillFilePath(const char* directory, const char* name, int number) {
+    size_t size = strlen(directory) + strlen(name) + 32;
+    char* path = (char*)malloc(size);
+    if (path == NULL) {
+        printf("Failed to allocate memory for a spill file path\n");
+        return NULL;
+    }
+    if (number < 0) {
+        snprintf(path, size, "%s/%s.spill", directory, name);
+    }
+    else {
+        snprintf(path, size, "%s/%s-%d.spill", directory, name, number);
+    }
+    return path;
+}
+
+/*
+ * FUNCTION: openSpillFile
+ * DESCRIPTION: Creates a spill file for writing and reading back, replacing any file of that name.
+ * PARAMETERS: const char* path - The path of the file.
+ * RETURNS: The open file, or NULL if it cannot be created.
+ */
+FILE* openSpillFile(const char* path) {
+    FILE* file = NULL;
+    errno_t err = fopen_s(&file, path, "w+b");
+    if (err != 0 || file == NULL) {
+        printf("Error creating spill file '%s'.\n", path);
+        return NULL;
+    }
+    return file;
+}
+
+/*
+ * FUNCTION: createSpillStore
+ * DESCRIPTION: Creates the file the columns of an out-of-core load are written to, with an empty page
+ *              cache to read them back through.
+ * PARAMETERS: const char* directory - The directory to create the file in.
+ * RETURNS: The store, or NULL if the file or the cache cannot be created.
+ */
+SpillStore* createSpillStore(const char* directory) {
+    SpillStore* store = new SpillStore();
+    store->path = spillFilePath(directory, "parcels", -1);
+    store->file = store->path ? openSpillFile(store->path) : NULL;
+    store->cache = store->file ? (char*)malloc((size_t)SPILL_CACHE_PAGES * SPILL_PAGE_SIZE) : NULL;
+    if (store->cache == NULL) {
+        if (store->file != NULL) {
+            printf("Failed to allocate memory for the spill page cache\n");
+            fclose(store->file);
+            remove(store->path);
+        }
+        free(store->path);
+        delete store;
+        return NULL;
+    }
+    store->size = 0;
+    store->clock = 0;
+    store->failed = 0;
+    for (int i = 0; i < SPILL_CACHE_PAGES; ++i) {
+        store->pages[i].number = ULLONG_MAX;
+        store->pages[i].lastUse = 0;
+        store->pages[i].next = -1;
+        store->buckets[i] = -1;
+    }
+    return store;
+}
+
+/*
+ * FUNCTION: closeSpillStore
+ * DESCRIPTION: Closes and removes the file of an out-of-core load and frees its page cache.
+ * PARAMETERS: SpillStore* store - The store, may be NULL.
+ * RETURNS: None.
+ */
+void closeSpillStore(SpillStore* store) {
+    if (store == NULL) {
+        return;
+    }
+    fclose(store->file);
+    remove(store->path);
+    free(store->path);
+    free(store->cache);
+    delete store;
+}
+
+/*
+ * FUNCTION: fetchSpillPage
+ * DESCRIPTION: Finds a page of the spill file in the cache, or reads it in over the least recently used
+ *              page. Pages are found through buckets chained by page number. The store's lock must be
+ *              held.
+ * PARAMETERS: SpillStore* store - The store.
+ *             unsigned long long number - The page number, the file offset over SPILL_PAGE_SIZE.
+ * RETURNS: The page's bytes, or NULL if the page cannot be read.
+ */
+char* fetchSpillPage(SpillStore* store, unsigned long long number) {
+    int* bucket = &store->buckets[number % SPILL_CACHE_PAGES];
+    for (int i = *bucket; i >= 0; i = store->pages[i].next) {
+        if (store->pages[i].number == number) {
+            store->pages[i].lastUse = ++store->clock;
+            addStatCounter(STAT_SPILL_PAGE_HITS, 1);
+            return store->cache + (size_t)i * SPILL_PAGE_SIZE;
+        }
+    }
+
+    int victim = 0;
+    for (int i = 1; i < SPILL_CACHE_PAGES; ++i) {
+        if (store->pages[i].lastUse < store->pages[victim].lastUse) {
+            victim = i;
+        }
+    }
+    SpillPage* page = &store->pages[victim];
+    if (page->number != ULLONG_MAX) {
+        int* link = &store->buckets[page->number % SPILL_CACHE_PAGES];
+        while (*link != victim) {
+            link = &store->pages[*link].next;
+        }
+        *link = page->next;
+        page->number = ULLONG_MAX;
+        page->lastUse = 0;
+    }
+
+    char* data = store->cache + (size_t)victim * SPILL_PAGE_SIZE;
+    unsigned long long start = number * SPILL_PAGE_SIZE;
+    size_t length = store->size - start < SPILL_PAGE_SIZE ? (size_t)(store->size - start) : SPILL_PAGE_SIZE;
+    if (start >= store->size || seekFile(store->file, start) != 0 || fread(data, 1, length, store->file) != length) {
+        printf("Error reading spill file '%s'.\n", store->path);
+        return NULL;
+    }
+    addStatCounter(STAT_SPILL_PAGE_READS, 1);
+    page->number = number;
+    page->lastUse = ++store->clock;
+    page->next = *bucket;
+    *bucket = victim;
+    return data;
+}
+
+/*
+ * FUNCTION: readSpill
+ * DESCRIPTION: Copies bytes of the spill file out of the page cache, paging in whatever part of them is
+ *              not cached. Safe to call from several threads at once. A failed read marks the store
+ *              as failed (see spillFailed).
+ * PARAMETERS: SpillStore* store - The store.
+ *             unsigned long long offset - The file offset of the first byte.
+ *             void* data - Room for size bytes.
+ *             size_t size - The number of bytes.
+ * RETURNS: 1 on success, 0 if the file cannot be read (data is then zero-filled).
+ */
+int readSpill(SpillStore* store, unsigned long long offset, void* data, size_t size) {
+    char* out = (char*)data;
+    std::lock_guard<std::mutex> guard(store->lock);
+    while (size > 0) {
+        size_t within = (size_t)(offset % SPILL_PAGE_SIZE);
+        size_t length = SPILL_PAGE_SIZE - within < size ? SPILL_PAGE_SIZE - within : size;
+        char* page = fetchSpillPage(store, offset / SPILL_PAGE_SIZE);
+        if (page == NULL) {
+            memset(out, 0, size);
+            store->failed.store(1);
+            return 0;
+        }
+        memcpy(out, page + within, length);
+        out += length;
+        offset += length;
+        size -= length;
+    }
+    return 1;
+}
+
+/*
+ * FUNCTION: spillFailed
+ * DESCRIPTION: Tells whether a read of the table's spill file has failed. The columns of a spilled
+ *              country can then no longer be trusted, so queries report the error instead of answering.
+ * PARAMETERS: HashTable* hashTable - The hash table.
+ * RETURNS: 1 if the table was loaded out of core and a read of its spill file failed, 0 otherwise.
+ */
+int spillFailed(HashTable* hashTable) {
+    return hashTable->spill != NULL && hashTable->spill->failed.load();
+}
+
+/*
+ * FUNCTION: sortSpillRecords
+ * DESCRIPTION: Sorts spill records by country and then by key with a least significant digit radix
+ *              sort, three passes of 11 bits over each, like sortValuationOrder. The sort is stable, so
+ *              records with equal keys keep the order they were read in. Passes in which every record
+ *              has the same digit are skipped.
+ * PARAMETERS: SpillRecord* records - The records to sort.
+ *             size_t count - The number of records.
+ *             SpillRecord* scratch - Room for count records.
+ * RETURNS: None.
+ */
+void sortSpillRecords(SpillRecord* records, size_t count, SpillRecord* scratch) {
+    for (int pass = 0; pass < 6; ++pass) {
+        int shift = pass % 3 * 11;
+        int byCountry = pass >= 3;
+        size_t offsets[2048] = { 0 };
+        for (size_t i = 0; i < count; ++i) {
+            unsigned int value = byCountry ? (unsigned int)records[i].countryId : records[i].key;
+            offsets[(value >> shift) & 2047]++;
+        }
+        unsigned int first = count == 0 ? 0 : byCountry ? (unsigned int)records[0].countryId : records[0].key;
+        if (count == 0 || offsets[(first >> shift) & 2047] == count) {
+            continue;
+        }
+        size_t total = 0;
+        for (int digit = 0; digit < 2048; ++digit) {
+            size_t digitCount = offsets[digit];
+            offsets[digit] = total;
+            total += digitCount;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            unsigned int value = byCountry ? (unsigned int)records[i].countryId : records[i].key;
+            scratch[offsets[(value >> shift) & 2047]++] = records[i];
+        }
+        memcpy(records, scratch, count * sizeof(SpillRecord));
+    }
+}
+
+/*
+ * FUNCTION: spillRunBefore
+ * DESCRIPTION: Orders two runs of a merge by their next record; on a tie the earlier run comes first,
+ *              which keeps the merge stable.
+ * PARAMETERS: SpillMergeRun* runs - The runs.
+ *             size_t a - The first run.
+ *             size_t b - The second run.
+ * RETURNS: 1 if run a's next record goes first, 0 otherwise.
+ */
+int spillRunBefore(SpillMergeRun* runs, size_t a, size_t b) {
+    const SpillRecord* x = &runs[a].buffer[runs[a].used];
+    const SpillRecord* y = &runs[b].buffer[runs[b].used];
+    if (x->countryId != y->countryId) {
+        return x->countryId < y->countryId;
+    }
+    if (x->key != y->key) {
+        return x->key < y->key;
+    }
+    return a < b;
+}
+
+/*
+ * FUNCTION: siftSpillHeap
+ * DESCRIPTION: Moves a run down a binary min-heap of runs until neither of its children goes before it.
+ * PARAMETERS: SpillMergeRun* runs - The runs.
+ *             size_t* heap - The heap, of indices into runs.
+ *             size_t count - The number of runs in the heap.
+ *             size_t position - The position of the run to move down.
+ * RETURNS: None.
+ */
+void siftSpillHeap(SpillMergeRun* runs, size_t* heap, size_t count, size_t position) {
+    for (;;) {
+        size_t smallest = position;
+        size_t left = 2 * position + 1;
+        if (left < count && spillRunBefore(runs, heap[left], heap[smallest])) {
+            smallest = left;
+        }
+        if (left + 1 < count && spillRunBefore(runs, heap[left + 1], heap[smallest])) {
+            smallest = left + 1;
+        }
+        if (smallest == position) {
+            return;
+        }
+        size_t swap = heap[position];
+        heap[position] = heap[smallest];
+        heap[smallest] = swap;
+        position = smallest;
+    }
+}
+
+/*
+ * FUNCTION: fillSpillRun
+ * DESCRIPTION: Reads the next records of a sorted run into its buffer.
+ * PARAMETERS: FILE* runs - The file holding the runs.
+ *             SpillMergeRun* run - The run, with its buffer used up.
+ *             size_t capacity - The number of records the buffer holds.
+ * RETURNS: 1 on success, 0 if the file cannot be read.
+ */
+int fillSpillRun(FILE* runs, SpillMergeRun* run, size_t capacity) {
+    size_t count = run->end - run->next < capacity ? (size_t)(run->end - run->next) : capacity;
+    if (seekFile(runs, run->next * sizeof(SpillRecord)) != 0 || fread(run->buffer, sizeof(SpillRecord), count, runs) != count) {
+        return 0;
+    }
+    run->used = 0;
+    run->filled = count;
+    run->next += count;
+    return 1;
+}
+
+/*
+ * FUNCTION: sortSpillFile
+ * DESCRIPTION: Sorts a file of spill records by country and key (see sortSpillRecords) and hands them to
+ *              a sink in order. A file that fits in the sort memory is sorted there in one go; a larger
+ *              one is cut into sorted runs of that size, written to the run file, and the runs are
+ *              merged through a heap, each with an equal share of the memory as its read buffer.
+ * PARAMETERS: FILE* input - The records to sort.
+ *             unsigned long long count - The number of records in input.
+ *             FILE* runs - File for the sorted runs; anything in it is overwritten.
+ *             SpillRecord* memory - Room for 2 * budget records.
+ *             size_t budget - The number of records sorted in memory at a time.
+ *             SpillRecordSink sink - Called with the sorted records, a slice at a time.
+ *             void* context - Passed through to the sink.
+ * RETURNS: 1 on success, 0 if a file cannot be read or written or the sink fails.
+ */
+int sortSpillFile(FILE* input, unsigned long long count, FILE* runs, SpillRecord* memory, size_t budget, SpillRecordSink sink, void* context) {
+    if (seekFile(input, 0) != 0) {
+        return 0;
+    }
+    if (count <= budget) {
+        if (fread(memory, sizeof(SpillRecord), (size_t)count, input) != count) {
+            return 0;
+        }
+        sortSpillRecords(memory, (size_t)count, memory + budget);
+        return sink(memory, (size_t)count, context);
+    }
+
+    size_t runCount = (size_t)((count + budget - 1) / budget);
+    size_t share = 2 * budget / (runCount + 1);  // One more share collects the merged records
+    SpillMergeRun* merge = share > 0 ? (SpillMergeRun*)malloc(runCount * (sizeof(SpillMergeRun) + sizeof(size_t))) : NULL;
+    if (merge == NULL) {
+        printf("Failed to allocate memory to merge %lu sorted runs\n", (unsigned long)runCount);
+        return 0;
+    }
+    size_t* heap = (size_t*)(merge + runCount);
+    int ok = seekFile(runs, 0) == 0;
+    for (size_t run = 0; run < runCount && ok; ++run) {
+        size_t length = count - run * budget < budget ? (size_t)(count - run * budget) : budget;
+        ok = fread(memory, sizeof(SpillRecord), length, input) == length;
+        if (ok) {
+            sortSpillRecords(memory, length, memory + budget);
+            ok = fwrite(memory, sizeof(SpillRecord), length, runs) == length;
+        }
+    }
+    ok = ok && fflush(runs) == 0;
+
+    for (size_t run = 0; run < runCount && ok; ++run) {
+        merge[run].buffer = memory + run * share;
+        merge[run].next = run * (unsigned long long)budget;
+        merge[run].end = run + 1 < runCount ? merge[run].next + budget : count;
+        ok = fillSpillRun(runs, &merge[run], share);
+        heap[run] = run;
+    }
+    size_t heapCount = ok ? runCount : 0;
+    for (size_t i = heapCount / 2; i-- > 0;) {
+        siftSpillHeap(merge, heap, heapCount, i);
+    }
+    SpillRecord* out = memory + runCount * share;
+    size_t used = 0;
+    while (heapCount > 0 && ok) {
+        SpillMergeRun* run = &merge[heap[0]];
+        out[used++] = run->buffer[run->used++];
+        if (used == share) {
+            ok = sink(out, used, context);
+            used = 0;
+        }
+        if (run->used == run->filled && run->next == run->end) {
+            heap[0] = heap[--heapCount];
+        }
+        else if (run->used == run->filled) {
+            ok = fillSpillRun(runs, run, share);
+        }
+        siftSpillHeap(merge, heap, heapCount, 0);
+    }
+    ok = ok && sink(out, used, context);
+    free(merge);
+    return ok;
+}
+
+/*
+ * FUNCTION: addSpillRecord
+ * DESCRIPTION: Appends a parcel to the partition of its country, writing the partition's buffer out
+ *              when it fills up. A partition's file is created on its first record.
+ * PARAMETERS: SpillBuild* build - The load in progress.
+ *             int countryId - The id of the parcel's country.
+ *             int weight - The weight of the parcel.
+ *             float valuation - The valuation of the parcel.
+ * RETURNS: 1 on success, 0 if the partition cannot be created or written.
+ */
+int addSpillRecord(SpillBuild* build, int countryId, int weight, float valuation) {
+    int partition = countryId % SPILL_PARTITIONS;
+    SpillRecord* buffer = build->buffers + (size_t)partition * SPILL_BUFFER_RECORDS;
+    SpillRecord* record = &buffer[build->buffered[partition]++];
+    record->countryId = countryId;
+    record->key = (unsigned int)weight ^ 0x80000000u;
+    memcpy(&record->value, &valuation, sizeof(record->value));
+    if (build->buffered[partition] < SPILL_BUFFER_RECORDS) {
+        return 1;
+    }
+
+    if (build->partitions[partition] == NULL) {
+        char* path = spillFilePath(build->directory, "partition", partition);
+        build->partitions[partition] = path ? openSpillFile(path) : NULL;
+        free(path);
+        if (build->partitions[partition] == NULL) {
+            return 0;
+        }
+    }
+    size_t count = build->buffered[partition];
+    build->buffered[partition] = 0;
+    build->partitionCounts[partition] += count;
+    return fwrite(buffer, sizeof(SpillRecord), count, build->partitions[partition]) == count;
+}
+
+/*
+ * FUNCTION: partitionParcelData
+ * DESCRIPTION: Parses complete "destination,weight,valuation" lines of the input and adds each parcel
+ *              to the partition of its country (see addSpillRecord). Countries are interned as by the
+ *              in-memory loaders; malformed lines are reported with their file offset and skipped.
+ * PARAMETERS: SpillBuild* build - The load in progress.
+ *             const char* data - The lines read.
+ *             size_t size - The number of bytes in data.
+ *             unsigned long long base - The file offset of data.
+ * RETURNS: None. build->failed is set if a partition cannot be written.
+ */
+void partitionParcelData(SpillBuild* build, const char* data, size_t size, unsigned long long base) {
+    const char* p = data;
+    const char* end = data + size;
+    while (p < end && !build->failed) {
+        ParsedLine parsed;
+        int result;
+        p = parseParcelLine(p, end, &parsed, &result);
+        if (result == PARSE_MALFORMED) {
+            reportMalformedLine(data, parsed.line, end, base);
+        }
+        else if (result == PARSE_OK) {
+            Country* record = findOrAddCountry(build->hashTable, parsed.destination, parsed.destinationLength);
+            if (record != NULL && !addSpillRecord(build, record->id, parsed.weight, parsed.valuation)) {
+                build->failed = 1;
+            }
+        }
+    }
+}
+
+/*
+ * FUNCTION: partitionParcelStream
+ * DESCRIPTION: Reads the input file SPILL_READ_SIZE bytes at a time and partitions its lines (see
+ *              partitionParcelData), so only one read buffer of it is ever in memory. A line cut by the
+ *              end of the buffer is carried over to the next read; lines longer than the buffer are
+ *              reported and skipped. The last line needs no newline.
+ * PARAMETERS: SpillBuild* build - The load in progress.
+ *             FILE* input - The input file, at its start.
+ *             size_t* loadedSize - Pointer to store the number of bytes read.
+ * RETURNS: 1 on success, 0 if the input cannot be read, memory runs out or a partition cannot be
+ *          written.
+ */
+int partitionParcelStream(SpillBuild* build, FILE* input, size_t* loadedSize) {
+    char* buffer = (char*)malloc(SPILL_READ_SIZE);
+    if (buffer == NULL) {
+        printf("Failed to allocate memory to read the input\n");
+        return 0;
+    }
+    unsigned long long offset = 0;
+    size_t pending = 0;         // Bytes of an incomplete line at the start of buffer
+    int skipping = 0;           // Dropping the rest of an overlong line
+    for (;;) {
+        size_t got = fread(buffer + pending, 1, SPILL_READ_SIZE - pending, input);
+        size_t filled = pending + got;
+        size_t start = 0;
+        if (skipping) {
+            const char* newline = (const char*)memchr(buffer, '\n', filled);
+            start = newline ? (size_t)(newline - buffer) + 1 : filled;
+            skipping = newline == NULL;
+        }
+        size_t complete = filled;
+        while (got > 0 && complete > start && buffer[complete - 1] != '\n') {
+            --complete;
+        }
+        if (complete > start) {
+            partitionParcelData(build, buffer + start, complete - start, offset + start);
+        }
+        else if (start == 0 && filled == SPILL_READ_SIZE) {
+            reportMalformedLine(buffer, buffer, buffer + filled, offset);
+            skipping = 1;
+            complete = filled;
+        }
+        else {
+            complete = start;
+        }
+        offset += complete;
+        pending = filled - complete;
+        memmove(buffer, buffer + complete, pending);
+        if (got == 0 || build->failed) {
+            break;
+        }
+    }
+    free(buffer);
+    *loadedSize = (size_t)offset;
+    if (ferror(input)) {
+        printf("Error reading the input file\n");
+        return 0;
+    }
+    return !build->failed;
+}
+
+/*
+ * FUNCTION: writeSpilledParcels
+ * DESCRIPTION: Sink of the first sort of a partition. Appends the parcels, now in country and weight
+ *              order, to the spill file as each country's weight-ordered columns, and computes the
+ *              totals and valuation extremes a frozen country keeps. Each parcel's valuation and index
+ *              also go to the order file, to be sorted into the valuation order.
+ * PARAMETERS: const SpillRecord* records - The next sorted records.
+ *             size_t count - The number of records.
+ *             void* context - The SpillBuild.
+ * RETURNS: 1 on success, 0 if a file cannot be written or memory runs out.
+ */
+int writeSpilledParcels(const SpillRecord* records, size_t count, void* context) {
+    SpillBuild* build = (SpillBuild*)context;
+    ParcelRecord parcels[1024];
+    SpillRecord order[1024];
+    size_t used = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const SpillRecord* record = &records[i];
+        ColumnSnapshot* columns = build->columns;
+        if (columns == NULL || record->countryId != build->countryId) {
+            Country* country = countryById(build->hashTable, record->countryId);
+            columns = (ColumnSnapshot*)calloc(1, sizeof(ColumnSnapshot));
+            if (columns == NULL) {
+                printf("Failed to allocate memory for the columns of '%s'\n", country->name);
+                return 0;
+            }
+            columns->spill = build->store;
+            columns->spillParcels = build->store->size + used * sizeof(ParcelRecord);
+            columns->minValuationIndex = -1;
+            columns->maxValuationIndex = -1;
+            country->columns = columns;
+            build->columns = columns;
+            build->countryId = record->countryId;
+        }
+        if (columns->count == INT_MAX) {
+            printf("Too many parcels for '%s'\n", countryById(build->hashTable, record->countryId)->name);
+            return 0;
+        }
+
+        ParcelRecord* parcel = &parcels[used];
+        parcel->weight = (int)(record->key ^ 0x80000000u);
+        memcpy(&parcel->valuation, &record->value, sizeof(parcel->valuation));
+        int index = columns->count++;
+        columns->weightSum += parcel->weight;
+        columns->valuationSum += parcel->valuation;
+        if (index == 0 || parcel->valuation < build->cheapest) {
+            build->cheapest = parcel->valuation;
+            columns->minValuationIndex = index;
+        }
+        if (index == 0 || parcel->valuation > build->mostExpensive) {
+            build->mostExpensive = parcel->valuation;
+            columns->maxValuationIndex = index;
+        }
+        order[used].countryId = record->countryId;
+        order[used].key = valuationKey(parcel->valuation);
+        order[used].value = (unsigned int)index;
+
+        if (++used == 1024 || i + 1 == count) {
+            if (fwrite(parcels, sizeof(ParcelRecord), used, build->store->file) != used
+                || fwrite(order, sizeof(SpillRecord), used, build->order) != used) {
+                return 0;
+            }
+            build->store->size += used * sizeof(ParcelRecord);
+            build->orderCount += used;
+            used = 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * FUNCTION: writeSpilledOrder
+ * DESCRIPTION: Sink of the second sort of a partition. Appends the parcel indices, now in country and
+ *              valuation order, to the spill file as each country's valuation order. The first sort
+ *              wrote them in weight order and the sort is stable, so equal valuations stay in weight
+ *              order, as sortValuationOrder leaves them.
+ * PARAMETERS: const SpillRecord* records - The next sorted records.
+ *             size_t count - The number of records.
+ *             void* context - The SpillBuild.
+ * RETURNS: 1 on success, 0 if the spill file cannot be written.
+ */
+int writeSpilledOrder(const SpillRecord* records, size_t count, void* context) {
+    SpillBuild* build = (SpillBuild*)context;
+    int order[1024];
+    size_t used = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (i == 0 ? build->columns == NULL || records[i].countryId != build->countryId
+                   : records[i].countryId != records[i - 1].countryId) {
+            build->columns = countryById(build->hashTable, records[i].countryId)->columns;
+            build->countryId = records[i].countryId;
+            build->columns->spillOrder = build->store->size + used * sizeof(int);
+        }
+        order[used] = (int)records[i].value;
+        if (++used == 1024 || i + 1 == count) {
+            if (fwrite(order, sizeof(int), used, build->store->file) != used) {
+                return 0;
+            }
+            build->store->size += used * sizeof(int);
+            used = 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * FUNCTION: sortSpillPartitions
+ * DESCRIPTION: Sorts each partition twice with sortSpillFile: by country and weight, writing the
+ *              countries' parcels (see writeSpilledParcels), and then by country and valuation, writing
+ *              their valuation order (see writeSpilledOrder). Each partition's file is removed once it
+ *              has been sorted.
+ * PARAMETERS: SpillBuild* build - The load, with every parcel partitioned.
+ *             size_t budget - The number of records sorted in memory at a time.
+ * RETURNS: 1 on success, 0 if a file cannot be created, read or written or memory runs out.
+ */
+int sortSpillPartitions(SpillBuild* build, size_t budget) {
+    SpillRecord* memory = (SpillRecord*)malloc(2 * budget * sizeof(SpillRecord));
+    char* runsPath = spillFilePath(build->directory, "runs", -1);
+    char* orderPath = spillFilePath(build->directory, "order", -1);
+    build->runs = memory && runsPath ? openSpillFile(runsPath) : NULL;
+    build->order = build->runs && orderPath ? openSpillFile(orderPath) : NULL;
+    int ok = build->order != NULL;
+    if (memory == NULL) {
+        printf("Failed to allocate memory to sort the parcels\n");
+    }
+
+    for (int partition = 0; partition < SPILL_PARTITIONS && ok; ++partition) {
+        FILE* file = build->partitions[partition];
+        size_t buffered = build->buffered[partition];
+        if (file == NULL && buffered == 0) {
+            continue;
+        }
+        if (file == NULL) {
+            // Partitions that never filled their buffer are sorted straight from it
+            SpillRecord* records = build->buffers + (size_t)partition * SPILL_BUFFER_RECORDS;
+            sortSpillRecords(records, buffered, memory);
+            build->columns = NULL;
+            build->orderCount = 0;
+            ok = writeSpilledParcels(records, buffered, build) && fflush(build->order) == 0;
+        }
+        else {
+            ok = fwrite(build->buffers + (size_t)partition * SPILL_BUFFER_RECORDS, sizeof(SpillRecord), buffered, file) == buffered
+              && fflush(file) == 0;
+            build->partitionCounts[partition] += buffered;
+            build->columns = NULL;
+            build->orderCount = 0;
+            ok = ok && sortSpillFile(file, build->partitionCounts[partition], build->runs, memory, budget, writeSpilledParcels, build)
+              && fflush(build->order) == 0;
+        }
+        build->columns = NULL;
+        ok = ok && sortSpillFile(build->order, build->orderCount, build->runs, memory, budget, writeSpilledOrder, build);
+        ok = ok && seekFile(build->order, 0) == 0;
+        if (file != NULL) {
+            char* path = spillFilePath(build->directory, "partition", partition);
+            fclose(file);
+            build->partitions[partition] = NULL;
+            if (path != NULL) {
+                remove(path);
+            }
+            free(path);
+        }
+    }
+
+    if (build->runs != NULL) {
+        fclose(build->runs);
+        remove(runsPath);
+    }
+    if (build->order != NULL) {
+        fclose(build->order);
+        remove(orderPath);
+    }
+    build->runs = NULL;
+    build->order = NULL;
+    free(runsPath);
+    free(orderPath);
+    free(memory);
+    return ok && fflush(build->store->file) == 0;
+}
+
+/*
+ * FUNCTION: closeSpillBuild
+ * DESCRIPTION: Closes and removes the partition files a load leaves behind and frees its buffers.
+ * PARAMETERS: SpillBuild* build - The load.
+ * RETURNS: None.
+ */
+void closeSpillBuild(SpillBuild* build) {
+    for (int partition = 0; partition < SPILL_PARTITIONS; ++partition) {
+        if (build->partitions[partition] != NULL) {
+            char* path = spillFilePath(build->directory, "partition", partition);
+            fclose(build->partitions[partition]);
+            if (path != NULL) {
+                remove(path);
+            }
+            free(path);
+        }
+    }
+    free(build->buffers);
+}
+
+/*
+ * FUNCTION: spillParcelFile
+ * DESCRIPTION: Loads a parcel file too large for memory. The file is streamed once, each parcel going
+ *              to one of SPILL_PARTITIONS files by its country; each partition is then external-merge
+ *              sorted by weight and by valuation within a memory budget (see sortSpillPartitions) into
+ *              one spill file holding every country's columns, in the layout of a frozen country. The
+ *              countries are frozen onto that file: queries read the pages they need through a small
+ *              cache (see readSpill) and only the country records stay in memory. The file is removed
+ *              when the table is cleaned.
+ * PARAMETERS: HashTable* hashTable - The empty hash table to load into.
+ *             const char* path - The path of the parcel file.
+ *             const char* directory - The directory to keep the spill files in.
+ *             int memory - Megabytes the external sort may hold at a time.
+ *             size_t* loadedSize - Pointer to store the number of bytes loaded, where following starts.
+ * RETURNS: 0 on success, 1 if the file cannot be read, a spill file cannot be written or memory runs
+ *          out.
+ */
+int spillParcelFile(HashTable* hashTable, const char* path, const char* directory, int memory, size_t* loadedSize) {
+    FILE* input = NULL;
+    errno_t err = fopen_s(&input, path, "rb");
+    if (err != 0 || input == NULL) {
+        printf("Error opening file\n");
+        return 1;
+    }
+    SpillBuild build;
+    memset(&build, 0, sizeof(build));
+    build.hashTable = hashTable;
+    build.directory = directory;
+    build.store = createSpillStore(directory);
+    build.buffers = (SpillRecord*)malloc((size_t)SPILL_PARTITIONS * SPILL_BUFFER_RECORDS * sizeof(SpillRecord));
+    if (build.buffers == NULL) {
+        printf("Failed to allocate memory for the partition buffers\n");
+    }
+    hashTable->spill = build.store;
+
+    int partitioned = build.store != NULL && build.buffers != NULL && partitionParcelStream(&build, input, loadedSize);
+    fclose(input);
+    int ok = partitioned && sortSpillPartitions(&build, (size_t)memory * 1048576 / (2 * sizeof(SpillRecord)));
+    closeSpillBuild(&build);
+    if (build.failed || (partitioned && !ok)) {
+        printf("Error writing spill files in '%s'.\n", directory);
+    }
+    return !ok;
+}
+
+static thread_local ReaderSlot* readerSlot = NULL;  // This thread's slot in the live ingest, once it has one
+
+/*
+ * FUNCTION: beginRead
+ * DESCRIPTION: Enters a read section. While the input file is followed, every query must run inside
+ *              one: the section announces the epoch the reader started in, and nothing retired after
+ *              that is freed until the reader leaves. Readers never wait for the writer. Does nothing
+ *              when the file is not followed.
+ * PARAMETERS: HashTable* hashTable - The hash table about to be queried.
+ * RETURNS: None.
+ */
+void beginRead(HashTable* hashTable) {
+    LiveIngest* live = hashTable->live;
+    if (live == NULL) {
+        return;
+    }
+    if (readerSlot == NULL) {
+        // parseOptions keeps the reader threads within LIVE_MAX_READERS, so a slot is always free
+        int index = 0;
+        int expected = 0;
+        while (index < LIVE_MAX_READERS && !live->readers[index].taken.compare_exchange_strong(expected, 1)) {
+            ++index;
+            expected = 0;
+        }
+        if (index == LIVE_MAX_READERS) {
+            printf("Too many reader threads.\n");
+            abort();
+        }
+        int count = live->readerCount.load();
+        while (count <= index && !live->readerCount.compare_exchange_weak(count, index + 1)) {
+        }
+        readerSlot = &live->readers[index];
+    }
+    readerSlot->epoch.store(live->epoch.load());
+}
+
+/*
+ * FUNCTION: endRead
+ * DESCRIPTION: Leaves a read section entered with beginRead. Pointers read inside it must not be used
+ *              afterwards.
+ * PARAMETERS: HashTable* hashTable - The hash table that was queried.
+ * RETURNS: None.
+ */
+void endRead(HashTable* hashTable) {
+    if (hashTable->live != NULL) {
+        readerSlot->epoch.store(0);
+    }
+}
+
+/*
+ * FUNCTION: releaseReaderSlot
+ * DESCRIPTION: Gives the calling thread's reader slot back for another thread to take. Threads that
+ *              query a followed file call it before they exit, outside any read section.
+ * PARAMETERS: HashTable* hashTable - The hash table that was queried.
+ * RETURNS: None.
+ */
+void releaseReaderSlot(HashTable* hashTable) {
+    if (hashTable->live != NULL && readerSlot != NULL) {
+        readerSlot->epoch.store(0);
+        readerSlot->taken.store(0);
+        readerSlot = NULL;
+    }
+}
+
+/*
+ * FUNCTION: pinCountry
+ * DESCRIPTION: Copies a country record with its current tree root and columns into a private view, so
+ *              every part of a query sees the same parcels even if the writer publishes new ones in the
+ *              meantime. The columns are read first: the writer publishes a new root before it drops the
+ *              columns, so a view without columns always has the root they were dropped for. The version
+ *              is read before either, and bumped after both, so the view holds at least that version.
+ * PARAMETERS: Country* record - The country to pin, read inside a read section.
+ *             Country* view - The view to fill; valid until the read section ends.
+ * RETURNS: view.
+ */
+Country* pinCountry(Country* record, Country* view) {
+    view->name = record->name;
+    view->hash = record->hash;
+    view->id = record->id;
+    view->version.store(record->version.load(), std::memory_order_relaxed);
+    view->columns.store(record->columns.load(), std::memory_order_relaxed);
+    view->root.store(record->root.load(), std::memory_order_relaxed);
+    view->valuationRoot.store(record->valuationRoot.load(), std::memory_order_relaxed);
+    view->next = NULL;
+    return view;
+}
+
+/*
+ * FUNCTION: retirePointer
+ * DESCRIPTION: Queues memory the writer has just unlinked until no reader can still see it. It is
+ *              stamped with the next epoch: readers that started before the writer's next epoch bump
+ *              may still hold it. If the queue cannot grow the memory is leaked rather than freed early.
+ * PARAMETERS: LiveIngest* live - The live ingest.
+ *             void* pointer - The memory to free later.
+ *             int isParcel - 1 for a parcel node of the table's pool, 0 for a malloc'd block.
+ * RETURNS: None.
+ */
+void retirePointer(LiveIngest* live, void* pointer, int isParcel) {
+    if (live->retiredCount == live->retiredCapacity) {
+        if (live->retiredHead >= live->retiredCount / 2 && live->retiredHead > 0) {
+            live->retiredCount -= live->retiredHead;
+            memmove(live->retired, live->retired + live->retiredHead, live->retiredCount * sizeof(RetiredPointer));
+            live->retiredHead = 0;
+        }
+        else {
+            size_t capacity = live->retiredCapacity ? live->retiredCapacity * 2 : 1024;
+            RetiredPointer* retired = (RetiredPointer*)realloc(live->retired, capacity * sizeof(RetiredPointer));
+            if (retired == NULL) {
+                return;
+            }
+            live->retired = retired;
+            live->retiredCapacity = capacity;
+        }
+    }
+    RetiredPointer* entry = &live->retired[live->retiredCount++];
+    entry->pointer = pointer;
+    entry->epoch = live->epoch.load() + 1;
+    entry->isParcel = isParcel;
+}
+
+/*
+ * FUNCTION: reclaimRetired
+ * DESCRIPTION: Frees the retired memory no reader can still hold, i.e. everything stamped no later than
+ *              the epoch the oldest active reader started in. Parcel nodes go back to the table's pool.
+ *              Only the writer thread, or any thread once the writer has stopped, may call this.
+ * PARAMETERS: HashTable* hashTable - The hash table being followed.
+ *             int everything - 1 to free everything regardless of readers, once no query can run.
+ * RETURNS: None.
+ */
+void reclaimRetired(HashTable* hashTable, int everything) {
+    LiveIngest* live = hashTable->live;
+    unsigned long oldest = live->epoch.load();
+    int readers = live->readerCount.load();
+    for (int i = 0; i < readers && i < LIVE_MAX_READERS; ++i) {
+        unsigned long epoch = live->readers[i].epoch.load();
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+
+    while (live->retiredHead < live->retiredCount && (everything || live->retired[live->retiredHead].epoch <= oldest)) {
+        RetiredPointer* entry = &live->retired[live->retiredHead++];
+        if (entry->isParcel) {
+            releaseParcel(&hashTable->pool, (Parcel*)entry->pointer);
+        }
+        else {
+            free(entry->pointer);
+        }
+    }
+    if (live->retiredHead == live->retiredCount) {
+        live->retiredHead = live->retiredCount = 0;
+    }
+}
+
+/*
+ * FUNCTION: addLiveCountry
+ * DESCRIPTION: Adds a country while readers may be looking countries up. The bucket array and the intern
+ *              table are copied with the new record added and published in place of the old ones, which
+ *              are retired; no chain a reader may be walking is changed. The table does not grow while
+ *              the file is followed, so chains get longer if many new countries arrive.
+ * PARAMETERS: HashTable* hashTable - The hash table being followed.
+ *             const char* country - The country name, in any case, not necessarily NUL-terminated.
+ *             size_t length - The length of the name.
+ * RETURNS: A pointer to the new Country, or NULL on allocation failure.
+ */
+Country* addLiveCountry(HashTable* hashTable, const char* country, size_t length) {
+    unsigned long count = hashTable->count;
+    Country** oldTable = hashTable->table;
+    Country** oldCountries = hashTable->countries;
+    Country** table = (Country**)malloc(hashTable->size * sizeof(Country*));
+    Country** countries = (Country**)malloc((count + 1) * sizeof(Country*));
+    Country* newCountry = table && countries ? createCountry(&hashTable->pool, country, length) : NULL;
+    if (newCountry == NULL) {
+        printf("Failed to allocate memory for new country\n");
+        free(table);
+        free(countries);
+        return NULL;
+    }
+    newCountry->id = (int)count;
+
+    memcpy(table, oldTable, hashTable->size * sizeof(Country*));
+    if (count > 0) {
+        memcpy(countries, oldCountries, count * sizeof(Country*));
+    }
+    unsigned long hashIndex = hashBucketIndex(newCountry->hash, hashTable->size);
+    newCountry->next = table[hashIndex];
+    table[hashIndex] = newCountry;
+    countries[count] = newCountry;
+
+    // The intern table must hold the id before the count admits it
+    hashTable->countries.store(countries);
+    hashTable->table.store(table);
+    hashTable->count.store(count + 1);
+    hashTable->countryCapacity = count + 1;
+    retirePointer(hashTable->live, oldTable, 0);
+    retirePointer(hashTable->live, oldCountries, 0);
+    return newCountry;
+}
+
+/*
+ * FUNCTION: addLiveParcel
+ * DESCRIPTION: Adds a parcel while readers may be querying its country. The new tree is built beside the
+ *              published one with insertParcelCopy and published with a single store, so a reader sees
+ *              the country either before or after the insert. The valuation tree is updated the same way
+ *              and published first; a query only ever walks one of the two. A country without trees,
+ *              loaded from a binary snapshot or compacted, first gets both rebuilt from its columns;
+ *              the columns of a frozen country are dropped once the trees have the new parcel, and
+ *              queries fall back to them.
+ * PARAMETERS: HashTable* hashTable - The hash table being followed.
+ *             const char* destination - The destination name, not necessarily NUL-terminated.
+ *             size_t length - The length of the name.
+ *             int weight - The weight of the parcel.
+ *             float valuation - The valuation of the parcel.
+ * RETURNS: 1 on success, 0 on allocation failure.
+ */
+int addLiveParcel(HashTable* hashTable, const char* destination, size_t length, int weight, float valuation) {
+    LiveIngest* live = hashTable->live;
+    Country* record = findOrAddCountry(hashTable, destination, length);
+    if (record == NULL) {
+        return 0;
+    }
+
+    Parcel* root = record->root;
+    ColumnSnapshot* columns = record->columns;
+    Parcel* updated;
+    Parcel* updatedValuations;
+    ParcelCopy weightCopy;
+    ParcelCopy valuationCopy;
+    weightCopy.depth = valuationCopy.depth = 0;
+    if (root == NULL && columns != NULL) {
+        // Nobody can see the rebuilt trees yet, so they can be inserted into in place
+        if (!buildColumnTrees(&hashTable->pool, record, columns, &updated, &updatedValuations)) {
+            return 0;
+        }
+        insertParcel(&hashTable->pool, &updated, record->id, weight, valuation, WEIGHT_ORDER);
+        insertParcel(&hashTable->pool, &updatedValuations, record->id, weight, valuation, VALUATION_ORDER);
+        if (updated == NULL || updated->count != columns->count + 1
+            || updatedValuations == NULL || updatedValuations->count != columns->count + 1) {
+            return 0;
+        }
+    }
+    else {
+        updated = insertParcelCopy(&hashTable->pool, root, record->id, weight, valuation, WEIGHT_ORDER, &weightCopy);
+        if (updated == NULL) {
+            return 0;
+        }
+        updatedValuations = insertParcelCopy(&hashTable->pool, record->valuationRoot, record->id, weight, valuation, VALUATION_ORDER, &valuationCopy);
+        if (updatedValuations == NULL) {
+            // Nothing was published, so the first copy is simply dropped
+            releaseParcelCopy(&hashTable->pool, &weightCopy);
+            return 0;
+        }
+    }
+
+    // The replaced nodes stay reachable until both new roots are stored, and are only retired then
+    record->valuationRoot.store(updatedValuations);
+    record->root.store(updated);
+    retireParcelCopy(live, &valuationCopy);
+    retireParcelCopy(live, &weightCopy);
+    if (columns != NULL) {
+        record->columns.store(NULL);
+        retirePointer(live, columns, 0);
+    }
+    record->version.fetch_add(1);
+    live->epoch.fetch_add(1);
+    return 1;
+}
+
+/*
+ * FUNCTION: ingestLiveData
+ * DESCRIPTION: Parses complete "destination,weight,valuation" lines read from the followed file and
+ *              adds them with addLiveParcel. Malformed lines are reported with their file offset.
+ * PARAMETERS: HashTable* hashTable - The hash table being followed.
+ *             const char* data - The lines read.
+ *             size_t size - The number of bytes in data; the last one is a newline.
+ *             unsigned long long base - The file offset of data.
+ * RETURNS: None.
+ */
+void ingestLiveData(HashTable* hashTable, const char* data, size_t size, unsigned long long base) {
+    const char* p = data;
+    const char* end = data + size;
+    while (p < end) {
+        ParsedLine parsed;
+        int result;
+        p = parseParcelLine(p, end, &parsed, &result);
+        if (result == PARSE_MALFORMED) {
+            reportMalformedLine(data, parsed.line, end, base);
+        }
+        else if (result == PARSE_OK) {
+            addLiveParcel(hashTable, parsed.destination, parsed.destinationLength, parsed.weight, parsed.valuation);
+        }
+    }
+}
+
+/*
+ * FUNCTION: followParcelFile
+ * DESCRIPTION: Body of the live ingest thread. Reads the input file from where the load stopped and adds
+ *              every complete line appended to it, polling every LIVE_POLL_INTERVAL_MS at the end of the
+ *              file; a trailing line without its newline is kept until the rest of it arrives. Lines
+ *              longer than LIVE_READ_SIZE are reported and skipped. Retired memory is reclaimed between
+ *              reads. The file is expected to only ever grow.
+ * PARAMETERS: HashTable* hashTable - The hash table to add to.
+ * RETURNS: None.
+ */
+void followParcelFile(HashTable* hashTable) {
+    LiveIngest* live = hashTable->live;
+    char* buffer = (char*)malloc(LIVE_READ_SIZE);
+    if (buffer == NULL) {
+        printf("Failed to allocate memory for live ingest\n");
+        return;
+    }
+    FILE* file = NULL;
+    size_t pending = 0;         // Bytes of an incomplete line at the start of buffer
+    int skipping = 0;           // Dropping the rest of an overlong line
+
+    while (!live->stop.load()) {
+        if (file == NULL) {
+            errno_t err = fopen_s(&file, live->path, "rb");
+            if (err != 0 || file == NULL) {
+                file = NULL;
+            }
+            else if (seekFile(file, live->offset) != 0) {
+                fclose(file);
+                file = NULL;
+            }
+        }
+        size_t got = file ? fread(buffer + pending, 1, LIVE_READ_SIZE - pending, file) : 0;
+        if (got == 0) {
+            if (file != NULL) {
+                clearerr(file);  // Forget the end of file so the next read sees appended data
+            }
+            reclaimRetired(hashTable, 0);
+            std::this_thread::sleep_for(std::chrono::milliseconds(LIVE_POLL_INTERVAL_MS));
+            continue;
+        }
+
+        size_t filled = pending + got;
+        size_t start = 0;
+        if (skipping) {
+            const char* newline = (const char*)memchr(buffer, '\n', filled);
+            start = newline ? (size_t)(newline - buffer) + 1 : filled;
+            skipping = newline == NULL;
+        }
+        size_t complete = filled;
+        while (complete > start && buffer[complete - 1] != '\n') {
+            --complete;
+        }
+        if (complete > start) {
+            ingestLiveData(hashTable, buffer + start, complete - start, live->offset + start);
+        }
+        else if (start == 0 && filled == LIVE_READ_SIZE) {
+            reportMalformedLine(buffer, buffer, buffer + filled, live->offset);
+            skipping = 1;
+            complete = filled;
+        }
+        else {
+            complete = start;
+        }
+        live->offset += complete;
+        pending = filled - complete;
+        memmove(buffer, buffer + complete, pending);
+        reclaimRetired(hashTable, 0);
+    }
+
+    if (file != NULL) {
+        fclose(file);
+    }
+    free(buffer);
+}
+
+/*
+ * FUNCTION: startLiveIngest
+ * DESCRIPTION: Starts following the input file on a thread of its own, adding lines appended after the
+ *              initial load while queries are being answered. Any growth of the table is finished
+ *              first, since migrating buckets would move countries under readers' feet.
+ * PARAMETERS: HashTable* hashTable - The loaded hash table.
+ *             const char* path - The path of the input file.
+ *             unsigned long long offset - The number of bytes of the file already loaded.
+ * RETURNS: None.
+ */
+void startLiveIngest(HashTable* hashTable, const char* path, unsigned long long offset) {
+    rehashStep(hashTable, hashTable->oldSize);
+    LiveIngest* live = new LiveIngest();
+    live->epoch.store(1);
+    live->path = path;
+    live->offset = offset;
+    live->retired = NULL;
+    live->retiredHead = live->retiredCount = live->retiredCapacity = 0;
+    hashTable->live = live;
+    live->thread = std::thread(followParcelFile, hashTable);
+}
+
+/*
+ * FUNCTION: stopLiveIngest
+ * DESCRIPTION: Stops following the input file, waits for the ingest thread and frees everything it
+ *              retired. No query may be running. Does nothing when the file is not followed.
+ * PARAMETERS: HashTable* hashTable - The hash table being followed.
+ * RETURNS: None.
+ */
+void stopLiveIngest(HashTable* hashTable) {
+    LiveIngest* live = hashTable->live;
+    if (live == NULL) {
+        return;
+    }
+    live->stop.store(1);
+    live->thread.join();
+    reclaimRetired(hashTable, 1);
+    free(live->retired);
+    delete live;
+    hashTable->live = NULL;
+}
+
+/*
+ * FUNCTION: foldCase
+ * DESCRIPTION: Lowercases the ASCII letters of a name, as tolower does in the C locale; other bytes are
+ *              copied unchanged. With SSE2 16 bytes are folded at a time: the bytes between 'A' and 'Z'
+ *              get the 0x20 bit set. Bytes above 0x7f compare as negative, so they are never folded.
+ * PARAMETERS: char* folded - Room for length bytes; may be text itself.
+ *             const char* text - The name, not necessarily NUL-terminated.
+ *             size_t length - The number of bytes to fold.
+ * RETURNS: None.
+ */
+void foldCase(char* folded, const char* text, size_t length) {
+    size_t i = 0;
+#ifdef HAVE_SSE2
+    const __m128i beforeA = _mm_set1_epi8('A' - 1);
+    const __m128i afterZ = _mm_set1_epi8('Z' + 1);
+    const __m128i lowerBit = _mm_set1_epi8(0x20);
+    for (; i + 16 <= length; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(text + i));
+        __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(chunk, beforeA), _mm_cmplt_epi8(chunk, afterZ));
+        _mm_storeu_si128((__m128i*)(folded + i), _mm_or_si128(chunk, _mm_and_si128(upper, lowerBit)));
+    }
+#endif
+    for (; i < length; ++i) {
+        unsigned char c = (unsigned char)text[i];
+        folded[i] = (char)(c >= 'A' && c <= 'Z' ? c | 0x20 : c);
+    }
+}
+
+/*
+ * FUNCTION: foldedNamesEqual
+ * DESCRIPTION: Compares two names of the same length ignoring the case of ASCII letters (see foldCase),
+ *              16 bytes at a time with SSE2.
+ * PARAMETERS: const char* a - The first name.
+ *             const char* b - The second name.
+ *             size_t length - The length of both.
+ * RETURNS: 1 if the names are equal ignoring case, 0 otherwise.
+ */
+int foldedNamesEqual(const char* a, const char* b, size_t length) {
+    char foldedA[CASE_FOLD_CHUNK];
+    char foldedB[CASE_FOLD_CHUNK];
+    while (length > 0) {
+        size_t chunk = length < CASE_FOLD_CHUNK ? length : CASE_FOLD_CHUNK;
+        foldCase(foldedA, a, chunk);
+        foldCase(foldedB, b, chunk);
+        if (memcmp(foldedA, foldedB, chunk) != 0) {
+            return 0;
+        }
+        a += chunk;
+        b += chunk;
+        length -= chunk;
+    }
+    return 1;
+}
+
+/*
+ * FUNCTION: djb2_hash
+ * DESCRIPTION: Computes a hash value for a given string using the djb2 hash function. The full
+ *              value is returned so it can be stored and reused when the table grows. The string is
+ *              folded to lowercase a chunk at a time (see foldCase), for consistent hashing.
+ * PARAMETERS: const char* str - The string to hash.
+ *             size_t length - The number of characters to hash.
+ * RETURNS: The computed hash value as an unsigned long integer.
+ */
+unsigned long djb2_hash(const char* str, size_t length) {
+    unsigned long hash = 5381;
+    char folded[CASE_FOLD_CHUNK];
+    while (length > 0) {
+        size_t chunk = length < CASE_FOLD_CHUNK ? length : CASE_FOLD_CHUNK;
+        foldCase(folded, str, chunk);
+        for (size_t i = 0; i < chunk; ++i) {
+            hash = ((hash << 5) + hash) + (unsigned char)folded[i];
+        }
+        str += chunk;
+        length -= chunk;
+    }
+    return hash;
+}
+
+/*
+ * FUNCTION: hashBucketIndex
+ * DESCRIPTION: Maps a full hash value onto a bucket of a power-of-two sized table. The value is mixed
+ *              first because djb2 leaves similar names (e.g. numbered region codes) in neighbouring
+ *              low bits, which a plain mask would cluster into the same buckets.
+ * PARAMETERS: unsigned long hash - The full hash value.
+ *             unsigned long size - The number of buckets, a power of two.
+ * RETURNS: The bucket index.
+ */
+unsigned long hashBucketIndex(unsigned long hash, unsigned long size) {
+    hash &= 0xffffffffUL;
+    hash = ((hash >> 16) ^ hash) * 0x45d9f3bUL;
+    hash = ((hash >> 16) ^ hash) & 0xffffffffUL;
+    return (hash ^ (hash >> 16)) & (size - 1);
+}
+
+/*
+ * FUNCTION: initParcelPool
+ * DESCRIPTION: Initializes an empty parcel pool. Slabs and arena blocks are allocated on demand.
+ * PARAMETERS: ParcelPool* pool - The pool to initialize.
+ * RETURNS: None.
+ */
+void initParcelPool(ParcelPool* pool) {
+    pool->slabs = NULL;
+    pool->arena = NULL;
+    pool->freeParcels = NULL;
+    pool->slabCount = 0;
+    pool->arenaBlockCount = 0;
+}
+
+/*
+ * FUNCTION: allocParcel
+ * DESCRIPTION: Hands out an uninitialized parcel node: a node given back with releaseParcel if there is
+ *              one, otherwise the next node of the current slab, starting a new slab when the current one
+ *              is full. Slabs themselves are only freed with the pool.
+ * PARAMETERS: ParcelPool* pool - The pool to allocate from.
+ * RETURNS: A pointer to the parcel node, or NULL on allocation failure.
+ */
+Parcel* allocParcel(ParcelPool* pool) {
+    if (pool->freeParcels != NULL) {
+        Parcel* node = pool->freeParcels;
+        pool->freeParcels = node->left;
+        addStatCounter(STAT_PARCELS_RECYCLED, 1);
+        return node;
+    }
+    if (pool->slabs == NULL || pool->slabs->used == PARCEL_SLAB_SIZE) {
+        ParcelSlab* slab = (ParcelSlab*)malloc(sizeof(ParcelSlab));
+        if (slab == NULL) {
+            return NULL;
+        }
+        slab->next = pool->slabs;
+        slab->used = 0;
+        pool->slabs = slab;
+        pool->slabCount++;
+        addStatCounter(STAT_SLAB_ALLOCATIONS, 1);
+    }
+    addStatCounter(STAT_PARCEL_ALLOCATIONS, 1);
+    return &pool->slabs->parcels[pool->slabs->used++];
+}
+
+/*
+ * FUNCTION: releaseParcel
+ * DESCRIPTION: Gives a parcel node back to its pool, to be handed out again by allocParcel. The caller
+ *              must make sure nothing can still reach the node.
+ * PARAMETERS: ParcelPool* pool - The pool the node was allocated from.
+ *             Parcel* node - The node to release.
+ * RETURNS: None.
+ */
+void releaseParcel(ParcelPool* pool, Parcel* node) {
+    node->left = pool->freeParcels;
+    pool->freeParcels = node;
+    addStatCounter(STAT_PARCELS_RELEASED, 1);
+}
+
+/*
+ * FUNCTION: arenaAlloc
+ * DESCRIPTION: Bump-allocates bytes from the pool's arena, starting a new block when the current one
+ *              cannot hold the request. Requests larger than a block get a block of their own.
+ * PARAMETERS: ParcelPool* pool - The pool to allocate from.
+ *             size_t size - The number of bytes to allocate.
+ * RETURNS: A pointer to ARENA_ALIGNMENT-aligned memory, or NULL on allocation failure.
+ */
+void* arenaAlloc(ParcelPool* pool, size_t size) {
+    size_t header = (sizeof(ArenaBlock) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+    ArenaBlock* block = pool->arena;
+    if (block == NULL || block->capacity - block->used < size) {
+        size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = (ArenaBlock*)malloc(header + capacity);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->used = 0;
+        block->capacity = capacity;
+        block->next = pool->arena;
+        pool->arena = block;
+        pool->arenaBlockCount++;
+        addStatCounter(STAT_ARENA_ALLOCATIONS, 1);
+    }
+
+    void* memory = (char*)block + header + block->used;
+    block->used += size;
+    return memory;
+}
+
+/*
+ * FUNCTION: freeParcelSlabs
+ * DESCRIPTION: Releases every slab of the pool, and with them every parcel, once no tree is left, e.g.
+ *              after every country has been compacted. The arena, and the country records and names in
+ *              it, are kept, and later parcels start a new slab.
+ * PARAMETERS: ParcelPool* pool - The pool whose slabs to free.
+ * RETURNS: None.
+ */
+void freeParcelSlabs(ParcelPool* pool) {
+    while (pool->slabs != NULL) {
+        ParcelSlab* next = pool->slabs->next;
+        free(pool->slabs);
+        pool->slabs = next;
+    }
+    pool->freeParcels = NULL;
+    pool->slabCount = 0;
+}
+
+/*
+ * FUNCTION: freeParcelPool
+ * DESCRIPTION: Releases every slab and arena block of the pool, and with them every parcel, country
+ *              record and name allocated from it. The cost depends on the number of blocks, not parcels.
+ * PARAMETERS: ParcelPool* pool - The pool to free.
+ * RETURNS: None.
+ */
+void freeParcelPool(ParcelPool* pool) {
+    freeParcelSlabs(pool);
+    while (pool->arena != NULL) {
+        ArenaBlock* next = pool->arena->next;
+        free(pool->arena);
+        pool->arena = next;
+    }
+    pool->arenaBlockCount = 0;
+}
+
+/*
+ * FUNCTION: mergeParcelPool
+ * DESCRIPTION: Moves every slab and arena block of one pool into another, e.g. when a loader thread
+ *              hands its parcels over to the hash table. The blocks are appended behind the target's
+ *              current blocks so allocation continues where it left off. The source is left empty.
+ * PARAMETERS: ParcelPool* into - The pool that takes ownership.
+ *             ParcelPool* from - The pool to empty.
+ * RETURNS: None.
+ */
+void mergeParcelPool(ParcelPool* into, ParcelPool* from) {
+    ParcelSlab** slabTail = &into->slabs;
+    while (*slabTail != NULL) {
+        slabTail = &(*slabTail)->next;
+    }
+    *slabTail = from->slabs;
+
+    ArenaBlock** arenaTail = &into->arena;
+    while (*arenaTail != NULL) {
+        arenaTail = &(*arenaTail)->next;
+    }
+    *arenaTail = from->arena;
+
+    Parcel** freeTail = &into->freeParcels;
+    while (*freeTail != NULL) {
+        freeTail = &(*freeTail)->left;
+    }
+    *freeTail = from->freeParcels;
+
+    into->slabCount += from->slabCount;
+    into->arenaBlockCount += from->arenaBlockCount;
+    initParcelPool(from);
+}
+
+/*
+ * FUNCTION: createParcel
+ * DESCRIPTION: Creates a new parcel with the specified destination, weight, and valuation. The node is
+ *              taken from the pool and the destination is stored as its interned country id.
+ * PARAMETERS: ParcelPool* pool - The pool to allocate the parcel from.
+ *             int countryId - The interned id of the parcel's destination.
+ *             int weight - The weight of the parcel.
+ *             float valuation - The valuation of the parcel.
+ * RETURNS: A pointer to the newly created Parcel.
+ */
+Parcel* createParcel(ParcelPool* pool, int countryId, int weight, float valuation) {
+    Parcel* newParcel = allocParcel(pool);
+    if (newParcel == NULL) {
+        printf("Failed to allocate memory for new parcel\n");
+        return NULL;
+    }
+    newParcel->countryId = countryId;
+    newParcel->weight = weight;
+    newParcel->valuation = valuation;
+    newParcel->left = newParcel->right = NULL;
+    updateParcel(newParcel);
+    return newParcel;
+}
+
+/*
+ * FUNCTION: parcelHeight
+ * DESCRIPTION: Returns the height of an AVL subtree.
+ * PARAMETERS: Parcel* node - The root of the subtree, may be NULL.
+ * RETURNS: The height of the subtree, 0 for an empty subtree.
+ */
+int parcelHeight(Parcel* node) {
+    return node ? node->height : 0;
+}
+
+/*
+ * FUNCTION: updateParcel
+ * DESCRIPTION: Recomputes a node's height and subtree aggregates from its own fields and its children.
+ * PARAMETERS: Parcel* node - The node to update.
+ * RETURNS: None.
+ */
+void updateParcel(Parcel* node) {
+    Parcel* left = node->left;
+    Parcel* right = node->right;
+    int leftHeight = parcelHeight(left);
+    int rightHeight = parcelHeight(right);
+    node->height = (leftHeight > rightHeight ? leftHeight : rightHeight) + 1;
+
+    node->count = 1;
+    node->weightSum = node->weight;
+    node->valuationSum = node->valuation;
+    node->minValuation = node->maxValuation = node->valuation;
+    if (left != NULL) {
+        node->count += left->count;
+        node->weightSum += left->weightSum;
+        node->valuationSum += left->valuationSum;
+        if (left->minValuation < node->minValuation) {
+            node->minValuation = left->minValuation;
+        }
+        if (left->maxValuation > node->maxValuation) {
+            node->maxValuation = left->maxValuation;
+        }
+    }
+    if (right != NULL) {
+        node->count += right->count;
+        node->weightSum += right->weightSum;
+        node->valuationSum += right->valuationSum;
+        if (right->minValuation < node->minValuation) {
+            node->minValuation = right->minValuation;
+        }
+        if (right->maxValuation > node->maxValuation) {
+            node->maxValuation = right->maxValuation;
+        }
+    }
+}
+
+/*
+ * FUNCTION: rotateParcelLeft
+ * DESCRIPTION: Rotates a subtree to the left, lifting the right child into the root position.
+ * PARAMETERS: Parcel* node - The root of the subtree to rotate.
+ * RETURNS: The new root of the subtree.
+ */
+Parcel* rotateParcelLeft(Parcel* node) {
+    Parcel* pivot = node->right;
+    node->right = pivot->left;
+    pivot->left = node;
+    updateParcel(node);
+    updateParcel(pivot);
+    return pivot;
+}
+
+/*
+ * FUNCTION: rotateParcelRight
+ * DESCRIPTION: Rotates a subtree to the right, lifting the left child into the root position.
+ * PARAMETERS: Parcel* node - The root of the subtree to rotate.
+ * RETURNS: The new root of the subtree.
+ */
+Parcel* rotateParcelRight(Parcel* node) {
+    Parcel* pivot = node->left;
+    node->left = pivot->right;
+    pivot->right = node;
+    updateParcel(node);
+    updateParcel(pivot);
+    return pivot;
+}
+
+/*
+ * FUNCTION: rebalanceParcel
+ * DESCRIPTION: Restores the AVL balance of a node whose children differ in height by at most two, and
+ *              refreshes the aggregates of every node it moves.
+ * PARAMETERS: Parcel* node - The root of the subtree to rebalance.
+ * RETURNS: The new root of the subtree.
+ */
+Parcel* rebalanceParcel(Parcel* node) {
+    updateParcel(node);
+    int balance = parcelHeight(node->left) - parcelHeight(node->right);
+    if (balance > 1) {
+        if (parcelHeight(node->left->left) < parcelHeight(node->left->right)) {
+            node->left = rotateParcelLeft(node->left);
+        }
+        return rotateParcelRight(node);
+    }
+    if (balance < -1) {
+        if (parcelHeight(node->right->right) < parcelHeight(node->right->left)) {
+            node->right = rotateParcelRight(node->right);
+        }
+        return rotateParcelLeft(node);
+    }
+    return node;
+}
+
+/*
+ * FUNCTION: parcelGoesLeft
+ * DESCRIPTION: Compares a parcel with a node of a tree in the given order.
+ * PARAMETERS: Parcel* node - The node to compare with.
+ *             int weight - The weight of the parcel.
+ *             float valuation - The valuation of the parcel.
+ *             int order - The order of the tree (a ParcelOrder value).
+ * RETURNS: 1 if the parcel belongs left of the node, 0 if it belongs right of it, as ties do.
+ */
+int parcelGoesLeft(Parcel* node, int weight, float valuation, int order) {
+    if (order == VALUATION_ORDER && valuation != node->valuation) {
+        return valuation < node->valuation;
+    }
+    return weight < node->weight;
+}
+
+/*
+ * FUNCTION: insertParcel
+ * DESCRIPTION: Inserts a new parcel into an AVL tree ordered by weight, or by valuation for a valuation
+ *              index. Parcels with equal keys are kept in insertion order. The descent is iterative and the links visited are kept on a
+ *              fixed stack so the tree can be rebalanced on the way back up, which keeps the depth
+ *              logarithmic even when the input is already sorted by weight. Every node on the path has
+ *              its subtree aggregates refreshed.
+ * PARAMETERS: ParcelPool* pool - The pool to allocate the parcel from.
+ *             Parcel** root - Pointer to the root of the tree.
+ *             int countryId - The interned id of the parcel's destination.
+ *             int weight - The weight of the parcel.
+ *             float valuation - The valuation of the parcel.
+ *             int order - The order of the tree (a ParcelOrder value).
+ * RETURNS: None.
+ */
+void insertParcel(ParcelPool* pool, Parcel** root, int countryId, int weight, float valuation, int order) {
+    Parcel** path[AVL_MAX_HEIGHT];
+    int depth = 0;
+    Parcel** link = root;
+
+    while (*link != NULL) {
+        path[depth++] = link;
+        link = parcelGoesLeft(*link, weight, valuation, order) ? &(*link)->left : &(*link)->right;
+    }
+
+    *link = createParcel(pool, countryId, weight, valuation);
+    if (*link == NULL) {
+        return;
+    }
+
+    // Walk back up to the root; every ancestor's aggregates include the new parcel
+    while (depth > 0) {
+        link = path[--depth];
+        *link = rebalanceParcel(*link);
+    }
+}
+
+/*
+ * FUNCTION: insertParcelCopy
+ * DESCRIPTION: Inserts a new parcel like insertParcel, but without changing any node a reader may be
+ *              walking: every node on the path from the root to the new leaf is copied, and the copies
+ *              are linked to the untouched subtrees of the originals and rebalanced. An insert rotates
+ *              at most once, and only nodes on the path, so the rotations only ever touch copies. The
+ *              old root keeps describing the tree as it was. Once the new root is published the
+ *              originals are retired with retireParcelCopy; if it never is, releaseParcelCopy frees it.
+ * PARAMETERS: ParcelPool* pool - The pool to allocate the new nodes from.
+ *             Parcel* root - The root of the tree to insert into, may be NULL.
+ *             int countryId - The interned id of the parcel's destination.
+ *             int weight - The weight of the parcel.
+ *             float valuation - The valuation of the parcel.
+ *             int order - The order of the tree (a ParcelOrder value).
+ *             ParcelCopy* copy - Filled with the replaced and the new nodes.
+ * RETURNS: The root of the new tree, or NULL on allocation failure (the old tree is then unchanged).
+ */
+Parcel* insertParcelCopy(ParcelPool* pool, Parcel* root, int countryId, int weight, float valuation, int order, ParcelCopy* copy) {
+    Parcel** copies = copy->created + 1;
+    int depth = 0;
+    copy->depth = 0;
+    for (Parcel* node = root; node != NULL; node = parcelGoesLeft(node, weight, valuation, order) ? node->left : node->right) {
+        copy->originals[depth++] = node;
+    }
+
+    Parcel* leaf = createParcel(pool, countryId, weight, valuation);
+    for (int i = 0; i < depth && leaf != NULL; ++i) {
+        copies[i] = allocParcel(pool);
+        if (copies[i] == NULL) {
+            printf("Failed to allocate memory for new parcel\n");
+            while (i-- > 0) {
+                releaseParcel(pool, copies[i]);
+            }
+            releaseParcel(pool, leaf);
+            return NULL;
+        }
+        *copies[i] = *copy->originals[i];
+    }
+    if (leaf == NULL) {
+        return NULL;
+    }
+    copy->created[0] = leaf;
+    copy->depth = depth;
+
+    // Rebuild the path bottom-up; each copy takes the (possibly rotated) subtree below it
+    Parcel* subtree = leaf;
+    while (depth > 0) {
+        Parcel* node = copies[--depth];
+        if (parcelGoesLeft(node, weight, valuation, order)) {
+            node->left = subtree;
+        }
+        else {
+            node->right = subtree;
+        }
+        subtree = rebalanceParcel(node);
+    }
+    return subtree;
+}
+
+/*
+ * FUNCTION: releaseParcelCopy
+ * DESCRIPTION: Gives the new nodes of a tree built by insertParcelCopy back to the pool, when it is
+ *              abandoned before being published. The originals it shares subtrees with are untouched.
+ * PARAMETERS: ParcelPool* pool - The pool the nodes were allocated from.
+ *             ParcelCopy* copy - The copy to release.
+ * RETURNS: None.
+ */
+void releaseParcelCopy(ParcelPool* pool, ParcelCopy* copy) {
+    for (int i = 0; i <= copy->depth; ++i) {
+        releaseParcel(pool, copy->created[i]);
+    }
+}
+
+/*
+ * FUNCTION: retireParcelCopy
+ * DESCRIPTION: Retires the nodes a published tree built by insertParcelCopy replaced.
+ * PARAMETERS: LiveIngest* live - The live ingest the replaced nodes are retired to.
+ *             ParcelCopy* copy - The copy that was published.
+ * RETURNS: None.
+ */
+void retireParcelCopy(LiveIngest* live, ParcelCopy* copy) {
+    for (int i = 0; i < copy->depth; ++i) {
+        retirePointer(live, copy->originals[i], 1);
+    }
+}
+
+/*
+ * FUNCTION: findParcelPath
+ * DESCRIPTION: Finds a parcel with the given weight and valuation in a tree and records the links from
+ *              the root down to it, so it can be changed or unlinked in place and its ancestors
+ *              rebalanced. Rotations can leave parcels with equal keys on either side of each other, so
+ *              the first parcel not before the key is found by rank and the run of equal keys is walked
+ *              in order from there; in VALUATION_ORDER the first of the run already matches.
+ * PARAMETERS: Parcel** root - Pointer to the root of the tree.
+ *             int weight - The weight of the parcel.
+ *             float valuation - The valuation of the parcel.
+ *             int order - The order of the tree (a ParcelOrder value).
+ *             Parcel*** path - Room for AVL_MAX_HEIGHT links; the last one stored points at the parcel.
+ * RETURNS: The number of links stored, or 0 if the tree holds no such parcel.
+ */
+int findParcelPath(Parcel** root, int weight, float valuation, int order, Parcel*** path) {
+    long long rank = 0;
+    long long visited = 0;
+    for (Parcel* node = *root; node != NULL; ++visited) {
+        int before = order == VALUATION_ORDER && node->valuation != valuation ? node->valuation < valuation : node->weight < weight;
+        if (before) {
+            rank += (node->left ? node->left->count : 0) + 1;
+            node = node->right;
+        }
+        else {
+            node = node->left;
+        }
+    }
+    addStatCounter(STAT_NODES_VISITED, visited);
+
+    ParcelIterator iterator;
+    initParcelIteratorAtRank(&iterator, *root, rank, -1, 0);
+    for (Parcel* parcel = nextParcel(&iterator); parcel == NULL || parcel->weight != weight || parcel->valuation != valuation;
+         parcel = nextParcel(&iterator)) {
+        if (parcel == NULL || parcel->weight != weight || order == VALUATION_ORDER) {
+            addStatCounter(STAT_NODES_VISITED, iterator.visited);
+            return 0;
+        }
+        ++rank;
+    }
+    addStatCounter(STAT_NODES_VISITED, iterator.visited);
+
+    // Descend to the parcel of that rank, as selectParcel does
+    int depth = 0;
+    Parcel** link = root;
+    while (1) {
+        path[depth++] = link;
+        long long leftCount = (*link)->left ? (*link)->left->count : 0;
+        if (rank == leftCount) {
+            break;
+        }
+        if (rank < leftCount) {
+            link = &(*link)->left;
+        }
+        else {
+            rank -= leftCount + 1;
+            link = &(*link)->right;
+        }
+    }
+    return depth;
+}
+
+/*
+ * FUNCTION: unlinkParcel
+ * DESCRIPTION: Removes the parcel at the end of a path found by findParcelPath from its tree and gives
+ *              its node back to the pool. A parcel with two children takes over the fields of its
+ *              successor, whose node is unlinked instead, so none of the links on the path change. Every
+ *              node above the unlinked one is then rebalanced and has its aggregates refreshed.
+ * PARAMETERS: ParcelPool* pool - The pool the tree's nodes belong to.
+ *             Parcel*** path - The links from the root down to the parcel; it is modified.
+ *             int depth - The number of links in path.
+ * RETURNS: None.
+ */
+void unlinkParcel(ParcelPool* pool, Parcel*** path, int depth) {
+    Parcel** link = path[--depth];
+    Parcel* node = *link;
+    if (node->left != NULL && node->right != NULL) {
+        path[depth++] = link;
+        Parcel** successor = &node->right;
+        while ((*successor)->left != NULL) {
+            path[depth++] = successor;
+            successor = &(*successor)->left;
+        }
+        node->weight = (*successor)->weight;
+        node->valuation = (*successor)->valuation;
+        link = successor;
+        node = *successor;
+    }
+    *link = node->left != NULL ? node->left : node->right;
+    releaseParcel(pool, node);
+
+    while (depth > 0) {
+        link = path[--depth];
+        *link = rebalanceParcel(*link);
+    }
+}
+
+/*
+ * FUNCTION: removeParcel
+ * DESCRIPTION: Removes one parcel with the given weight and valuation from a tree in place (see
+ *              findParcelPath and unlinkParcel). Nobody else may be walking the tree.
+ * PARAMETERS: ParcelPool* pool - The pool the tree's nodes belong to.
+ *             Parcel** root - Pointer to the root of the tree.
+ *             int weight - The weight of the parcel.
+ *             float valuation - The valuation of the parcel.
+ *             int order - The order of the tree (a ParcelOrder value).
+ * RETURNS: 1 if a parcel was removed, 0 if the tree holds no such parcel.
+ */
+int removeParcel(ParcelPool* pool, Parcel** root, int weight, float valuation, int order) {
+    Parcel** path[AVL_MAX_HEIGHT];
+    int depth = findParcelPath(root, weight, valuation, order, path);
+    if (depth == 0) {
+        return 0;
+    }
+    unlinkParcel(pool, path, depth);
+    return 1;
+}
+
+/*
+ * FUNCTION: replaceParcel
+ * DESCRIPTION: Changes the weight and valuation of one parcel of a tree in place. When the parcel's key
+ *              in the tree's order stays the same (the weight in WEIGHT_ORDER, both fields in
+ *              VALUATION_ORDER) the node keeps its place and only the aggregates on its path are
+ *              refreshed; otherwise it is unlinked and inserted again, reusing the node just released,
+ *              so the insert cannot run out of memory. Nobody else may be walking the tree.
+ * PARAMETERS: ParcelPool* pool - The pool the tree's nodes belong to.
+ *             Parcel** root - Pointer to the root of the tree.
+ *             int countryId - The interned id of the parcel's destination.
+ *             int weight - The weight of the parcel.
+ *             float valuation - The valuation of the parcel.
+ *             int newWeight - The weight to give it.
+ *             float newValuation - The valuation to give it.
+ *             int order - The order of the tree (a ParcelOrder value).
+ * RETURNS: 1 if a parcel was changed, 0 if the tree holds no such parcel.
+ */
+int replaceParcel(ParcelPool* pool, Parcel** root, int countryId, int weight, float valuation, int newWeight, float newValuation, int order) {
+    Parcel** path[AVL_MAX_HEIGHT];
+    int depth = findParcelPath(root, weight, valuation, order, path);
+    if (depth == 0) {
+        return 0;
+    }
+    if (newWeight == weight && (order == WEIGHT_ORDER || newValuation == valuation)) {
+        (*path[depth - 1])->valuation = newValuation;
+        while (depth > 0) {
+            updateParcel(*path[--depth]);
+        }
+        return 1;
+    }
+    unlinkParcel(pool, path, depth);
+    insertParcel(pool, root, countryId, newWeight, newValuation, order);
+    return 1;
+}
+
+/*
+ * FUNCTION: buildParcelTree
+ * DESCRIPTION: Builds a balanced AVL tree from parcels already in the tree's order, e.g. to turn the
+ *              columns of a country loaded from a binary snapshot back into trees. The middle parcel
+ *              becomes the root, so the order of equal keys is kept.
+ * PARAMETERS: ParcelPool* pool - The pool to allocate the nodes from.
+ *             int countryId - The interned id of the parcels' destination.
+ *             const int* weights - The weights.
+ *             const float* valuations - valuations[i] belongs to weights[i].
+ *             const int* order - The indices of the parcels in the tree's order, or NULL if the arrays
+ *                                are already in it.
+ *             int count - The number of parcels.
+ * RETURNS: The root of the tree, or NULL if count is 0 or on allocation failure.
+ */
+Parcel* buildParcelTree(ParcelPool* pool, int countryId, const int* weights, const float* valuations, const int* order, int count) {
+    if (count <= 0) {
+        return NULL;
+    }
+    int middle = count / 2;
+    int index = order ? order[middle] : middle;
+    Parcel* node = createParcel(pool, countryId, weights[index], valuations[index]);
+    if (node == NULL) {
+        return NULL;
+    }
+    node->left = buildParcelTree(pool, countryId, weights, valuations, order, middle);
+    node->right = order ? buildParcelTree(pool, countryId, weights, valuations, order + middle + 1, count - middle - 1)
+                        : buildParcelTree(pool, countryId, weights + middle + 1, valuations + middle + 1, NULL, count - middle - 1);
+    if ((middle > 0 && node->left == NULL) || (count - middle - 1 > 0 && node->right == NULL)) {
+        return NULL;
+    }
+    updateParcel(node);
+    return node;
+}
+
+/*
+ * FUNCTION: valuationKey
+ * DESCRIPTION: Maps a valuation onto an unsigned key that sorts in the same order, so valuations can be
+ *              radix sorted: the sign bit is flipped for positive values and every bit for negative
+ *              ones. Both zeros map to the same key.
+ * PARAMETERS: float valuation - The valuation.
+ * RETURNS: The key.
+ */
+unsigned int valuationKey(float valuation) {
+    unsigned int bits = 0;
+    if (valuation != 0.0f) {
+        memcpy(&bits, &valuation, sizeof(bits));
+    }
+    return bits & 0x80000000u ? ~bits : bits | 0x80000000u;
+}
+
+/*
+ * FUNCTION: sortValuationOrder
+ * DESCRIPTION: Lists the indices of a country's columns in VALUATION_ORDER with a least significant
+ *              digit radix sort of the valuation keys, three passes of 11 bits. The sort is stable and
+ *              the columns are sorted by weight, so equal valuations stay in weight order. Passes in
+ *              which every key has the same digit are skipped.
+ * PARAMETERS: const float* valuations - The valuation column; the weights must be sorted.
+ *             int count - The number of parcels.
+ *             int* order - Pointer to store the count indices.
+ *             unsigned int* scratch - Room for 3 * count values.
+ * RETURNS: None.
+ */
+void sortValuationOrder(const float* valuations, int count, int* order, unsigned int* scratch) {
+    unsigned int* keys = scratch;
+    unsigned int* sortedKeys = scratch + count;
+    int* sortedOrder = (int*)(scratch + 2 * (size_t)count);
+    for (int i = 0; i < count; ++i) {
+        keys[i] = valuationKey(valuations[i]);
+        order[i] = i;
+    }
+
+    for (int shift = 0; shift < 32; shift += 11) {
+        int offsets[2048] = { 0 };
+        for (int i = 0; i < count; ++i) {
+            offsets[(keys[i] >> shift) & 2047]++;
+        }
+        if (count == 0 || offsets[(keys[0] >> shift) & 2047] == count) {
+            continue;
+        }
+        int total = 0;
+        for (int digit = 0; digit < 2048; ++digit) {
+            int digitCount = offsets[digit];
+            offsets[digit] = total;
+            total += digitCount;
+        }
+        for (int i = 0; i < count; ++i) {
+            int position = offsets[(keys[i] >> shift) & 2047]++;
+            sortedKeys[position] = keys[i];
+            sortedOrder[position] = order[i];
+        }
+        memcpy(keys, sortedKeys, (size_t)count * sizeof(unsigned int));
+        memcpy(order, sortedOrder, (size_t)count * sizeof(int));
+    }
+}
+
+/*
+ * FUNCTION: indexCountryValuations
+ * DESCRIPTION: Builds a country's valuation tree from its weight tree in one pass: the parcels are
+ *              listed in weight order, radix sorted into VALUATION_ORDER and built into a balanced tree,
+ *              which is quicker than inserting them one by one. Ties end up in the order inserts would
+ *              have given them.
+ * PARAMETERS: ParcelPool* pool - The pool to allocate the nodes from.
+ *             Country* record - The country to index.
+ * RETURNS: 0 on success, 1 on allocation failure.
+ */
+int indexCountryValuations(ParcelPool* pool, Country* record) {
+    Parcel* root = record->root;
+    int count = root ? root->count : 0;
+    if (count == 0) {
+        return 0;
+    }
+    int* weights = (int*)malloc((size_t)count * (5 * sizeof(int) + sizeof(float)));
+    if (weights == NULL) {
+        printf("Failed to allocate memory for the valuation index of '%s'\n", record->name);
+        return 1;
+    }
+    float* valuations = (float*)(weights + count);
+    int* order = (int*)(valuations + count);
+    unsigned int* scratch = (unsigned int*)(order + count);
+
+    ParcelIterator iterator;
+    initParcelIterator(&iterator, root, INT_MIN, INT_MAX, 0, -1);
+    int i = 0;
+    for (Parcel* parcel = nextParcel(&iterator); parcel != NULL; parcel = nextParcel(&iterator)) {
+        weights[i] = parcel->weight;
+        valuations[i] = parcel->valuation;
+        ++i;
+    }
+    sortValuationOrder(valuations, count, order, scratch);
+    Parcel* valuationRoot = buildParcelTree(pool, record->id, weights, valuations, order, count);
+    free(weights);
+    if (valuationRoot == NULL) {
+        return 1;
+    }
+    record->valuationRoot = valuationRoot;
+    return 0;
+}
+
+/*
+ * FUNCTION: indexValuations
+ * DESCRIPTION: Builds the valuation tree of every country (see indexCountryValuations).
+ * PARAMETERS: HashTable* hashTable - The hash table to index.
+ * RETURNS: 0 on success, 1 if any country ran out of memory.
+ */
+int indexValuations(HashTable* hashTable) {
+    for (unsigned long id = 0; id < hashTable->count; ++id) {
+        if (indexCountryValuations(&hashTable->pool, countryById(hashTable, (int)id)) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * FUNCTION: selectParcel
+ * DESCRIPTION: Finds the parcel of a given rank in a tree's order using the subtree counts, in
+ *              O(log n) steps.
+ * PARAMETERS: Parcel* root - The root of the tree.
+ *             long long rank - The rank, from 0 for the first parcel.
+ * RETURNS: The Parcel, or NULL if the tree has no parcel of that rank.
+ */
+Parcel* selectParcel(Parcel* root, long long rank) {
+    long long visited = 0;
+    for (; root != NULL; ++visited) {
+        long long leftCount = root->left ? root->left->count : 0;
+        if (rank < leftCount) {
+            root = root->left;
+        }
+        else if (rank == leftCount) {
+            break;
+        }
+        else {
+            rank -= leftCount + 1;
+            root = root->right;
+        }
+    }
+    addStatCounter(STAT_NODES_VISITED, visited);
+    return root;
+}
+
+/*
+ * FUNCTION: searchParcel
+ * DESCRIPTION: Searches for a parcel in the AVL tree by weight.
+ * PARAMETERS: Parcel* root - The root of the tree.
+ *             int weight - The weight to search for.
+ * RETURNS: A pointer to the Parcel if found, otherwise NULL.
+ */
+
+Parcel* searchParcel(Parcel* root, int weight) {
+    long long visited = 0;
+    while (root != NULL && root->weight != weight) {
+        root = weight < root->weight ? root->left : root->right;
+        ++visited;
+    }
+    addStatCounter(STAT_NODES_VISITED, visited);
+    return root;
+}
+
+/*
+ * FUNCTION: weightRangeBounds
+ * DESCRIPTION: Converts a weight interval with open or closed ends into the equivalent closed interval.
+ * PARAMETERS: int low - The lower end of the interval.
+ *             int lowInclusive - 1 if low itself is included, 0 if the end is open.
+ *             int high - The upper end of the interval.
+ *             int highInclusive - 1 if high itself is included, 0 if the end is open.
+ *             int* minWeight - Pointer to store the smallest included weight.
+ *             int* maxWeight - Pointer to store the largest included weight.
+ * RETURNS: 1 if the interval contains at least one weight, 0 if it is empty.
+ */
+int weightRangeBounds(int low, int lowInclusive, int high, int highInclusive, int* minWeight, int* maxWeight) {
+    if ((!lowInclusive && low == INT_MAX) || (!highInclusive && high == INT_MIN)) {
+        return 0;
+    }
+    *minWeight = lowInclusive ? low : low + 1;
+    *maxWeight = highInclusive ? high : high - 1;
+    return *minWeight <= *maxWeight;
+}
+
+/*
+ * FUNCTION: countParcelsBelow
+ * DESCRIPTION: Counts the parcels lighter than a weight using the subtree counts, in O(log n) steps.
+ * PARAMETERS: Parcel* root - The root of the country's BST.
+ *             int weight - The weight to compare against.
+ * RETURNS: The number of parcels with a weight strictly below the given one.
+ */
+long long countParcelsBelow(Parcel* root, int weight) {
+    long long below = 0;
+    long long visited = 0;
+    for (; root != NULL; ++visited) {
+        if (root->weight < weight) {
+            below += (root->left ? root->left->count : 0) + 1;
+            root = root->right;
+        }
+        else {
+            root = root->left;
+        }
+    }
+    addStatCounter(STAT_NODES_VISITED, visited);
+    return below;
+}
+
+/*
+ * FUNCTION: initParcelIteratorAtRank
+ * DESCRIPTION: Positions an iterator on the parcel of a given rank, from where it returns the rest of
+ *              the tree in order, or in reverse order with the rank counted from the end.
+ * PARAMETERS: ParcelIterator* iterator - The iterator to initialize.
+ *             Parcel* root - The root of the tree.
+ *             long long rank - The number of parcels to skip.
+ *             long long limit - The maximum number of parcels to return, -1 for no limit.
+ *             int descending - 1 to walk from the end of the tree down, 0 to walk up.
+ * RETURNS: None.
+ */
+void initParcelIteratorAtRank(ParcelIterator* iterator, Parcel* root, long long rank, long long limit, int descending) {
+    iterator->depth = 0;
+    iterator->maxWeight = INT_MAX;
+    iterator->remaining = limit;
+    iterator->descending = descending;
+    iterator->visited = 0;
+
+    // Descend to the parcel of the given rank, keeping the ancestors it lies before
+    long long visited = 0;
+    for (; root != NULL; ++visited) {
+        Parcel* before = descending ? root->right : root->left;
+        long long beforeCount = before ? before->count : 0;
+        if (rank <= beforeCount) {
+            iterator->stack[iterator->depth++] = root;
+            if (rank == beforeCount) {
+                break;
+            }
+            root = before;
+        }
+        else {
+            rank -= beforeCount + 1;
+            root = descending ? root->left : root->right;
+        }
+    }
+    addStatCounter(STAT_NODES_VISITED, visited);
+}
+
+/*
+ * FUNCTION: initParcelIterator
+ * DESCRIPTION: Positions an iterator on the parcels of a closed weight range, in weight order. The
+ *              first offset parcels of the range are skipped by rank using the subtree counts, so a
+ *              page deep into the range costs O(log n) to reach rather than a scan of earlier pages.
+ * PARAMETERS: ParcelIterator* iterator - The iterator to initialize.
+ *             Parcel* root - The root of the country's BST.
+ *             int minWeight - The smallest weight to return.
+ *             int maxWeight - The largest weight to return.
+ *             long long offset - The number of matching parcels to skip.
+ *             long long limit - The maximum number of parcels to return, -1 for no limit.
+ * RETURNS: None.
+ */
+void initParcelIterator(ParcelIterator* iterator, Parcel* root, int minWeight, int maxWeight, long long offset, long long limit) {
+    long long rank = countParcelsBelow(root, minWeight) + (offset > 0 ? offset : 0);
+    initParcelIteratorAtRank(iterator, root, rank, limit, 0);
+    iterator->maxWeight = maxWeight;
+}
+
+/*
+ * FUNCTION: nextParcel
+ * DESCRIPTION: Returns the next parcel of an iterator's range.
+ * PARAMETERS: ParcelIterator* iterator - The iterator to advance.
+ * RETURNS: The next Parcel, or NULL once the range or the limit is exhausted.
+ */
+Parcel* nextParcel(ParcelIterator* iterator) {
+    if (iterator->depth == 0 || iterator->remaining == 0) {
+        return NULL;
+    }
+    Parcel* parcel = iterator->stack[--iterator->depth];
+    if (parcel->weight > iterator->maxWeight) {
+        iterator->depth = 0;
+        return NULL;
+    }
+    if (iterator->descending) {
+        for (Parcel* node = parcel->left; node != NULL; node = node->right) {
+            iterator->stack[iterator->depth++] = node;
+            iterator->visited++;
+        }
+    }
+    else {
+        for (Parcel* node = parcel->right; node != NULL; node = node->left) {
+            iterator->stack[iterator->depth++] = node;
+            iterator->visited++;
+        }
+    }
+    if (iterator->remaining > 0) {
+        iterator->remaining--;
+    }
+    return parcel;
+}
+
+/*
+ * FUNCTION: forEachParcelInRange
+ * DESCRIPTION: Calls a visitor for each parcel of a closed weight range, in weight order, with
+ *              LIMIT/OFFSET-style paging. Subtrees outside the range are never entered.
+ * PARAMETERS: Parcel* root - The root of the country's BST.
+ *             int minWeight - The smallest weight to visit.
+ *             int maxWeight - The largest weight to visit.
+ *             long long offset - The number of matching parcels to skip.
+ *             long long limit - The maximum number of parcels to visit, -1 for no limit.
+ *             ParcelVisitor visit - The function called for each parcel; returning 0 stops the walk.
+ *             void* context - Passed through to the visitor.
+ * RETURNS: The number of parcels visited.
+ */
+long long forEachParcelInRange(Parcel* root, int minWeight, int maxWeight, long long offset, long long limit, ParcelVisitor visit, void* context) {
+    ParcelIterator iterator;
+    long long visited = 0;
+    if (minWeight > maxWeight) {
+        return 0;
+    }
+    initParcelIterator(&iterator, root, minWeight, maxWeight, offset, limit);
+    for (Parcel* parcel = nextParcel(&iterator); parcel != NULL; parcel = nextParcel(&iterator)) {
+        ++visited;
+        if (!visit(parcel, context)) {
+            break;
+        }
+    }
+    return visited;
+}
+
+/*
+ * FUNCTION: printParcel
+ * DESCRIPTION: Prints the details of a single parcel.
+ * PARAMETERS: HashTable* hashTable - The hash table whose intern table resolves the destination.
+ *             Parcel* parcel - The parcel to print.
+ * RETURNS: None.
+ */
+
+void printParcel(HashTable* hashTable, Parcel* parcel) {
+    if (parcel) {
+        printParcelFields(hashTable, parcel->countryId, parcel->weight, parcel->valuation);
+    }
+    else {
+        printf("Parcel not found.\n\n");
+    }
+}
+
+/*
+ * FUNCTION: printParcelFields
+ * DESCRIPTION: Prints a parcel given by its fields, e.g. a row of a country's columns.
+ * PARAMETERS: HashTable* hashTable - The hash table whose intern table resolves the destination.
+ *             int countryId - The interned id of the parcel's destination.
+ *             int weight - The weight of the parcel.
+ *             float valuation - The valuation of the parcel.
+ * RETURNS: None.
+ */
+void printParcelFields(HashTable* hashTable, int countryId, int weight, float valuation) {
+    printf("Destination: %s, Weight: %d, Valuation: %.2f\n", countryById(hashTable, countryId)->name, weight, valuation);
+}
+
+/*
+ * FUNCTION: printAllParcels
+ * DESCRIPTION: Prints details of all parcels of a country in order of weight.
+ * PARAMETERS: HashTable* hashTable - The hash table the country belongs to.
+ *             Country* record - The country to print.
+ * RETURNS: None.
+ */
+
+void printAllParcels(HashTable* hashTable, Country* record) {
+    printCountryParcels(hashTable, record, INT_MIN, INT_MAX, 0, -1);
+}
+
+/*
+ * FUNCTION: printParcelVisitor
+ * DESCRIPTION: ParcelRecordVisitor that prints each parcel it is given.
+ * PARAMETERS: Country* record - The country the parcel belongs to.
+ *             int weight - The weight of the parcel.
+ *             float valuation - The valuation of the parcel.
+ *             void* context - The HashTable the country belongs to.
+ * RETURNS: 1, to continue the walk.
+ */
+int printParcelVisitor(Country* record, int weight, float valuation, void* context) {
+    printParcelFields((HashTable*)context, record->id, weight, valuation);
+    return 1;
+}
+
+/*
+ * FUNCTION: printParcelsWithCondition
+ * DESCRIPTION: Prints parcels of a country that meet the specified weight condition, in order of
+ *              weight. Only the part of the tree or columns inside the matching range is visited.
+ * PARAMETERS: HashTable* hashTable - The hash table the country belongs to.
+ *             Country* record - The country to print.
+ *             int weight - The weight to compare against.
+ *             int condition - The condition (1 for higher, 0 for lower).
+ * RETURNS: None.
+ */
+
+void printParcelsWithCondition(HashTable* hashTable, Country* record, int weight, int condition) {
+    int minWeight;
+    int maxWeight;
+    int nonEmpty = condition == 1 ? weightRangeBounds(weight, 0, INT_MAX, 1, &minWeight, &maxWeight)
+                                  : weightRangeBounds(INT_MIN, 1, weight, 0, &minWeight, &maxWeight);
+    if (nonEmpty) {
+        printCountryParcels(hashTable, record, minWeight, maxWeight, 0, -1);
+    }
+}
+
+/*
+ * FUNCTION: createHashTable
+ * DESCRIPTION: Creates a new hash table with initialized entries.
+ * PARAMETERS: None.
+ * RETURNS: A pointer to the newly created HashTable.
+ */
+HashTable* createHashTable() {
+    HashTable* hashTable = (HashTable*)malloc(sizeof(HashTable));
+    if (hashTable == NULL) {
+        printf("Failed to allocate memory for hash table\n");
+        return NULL;
+    }
+    hashTable->table = (Country**)calloc(HASH_TABLE_INITIAL_SIZE, sizeof(Country*));
+    if (hashTable->table == NULL) {
+        printf("Failed to allocate memory for hash table\n");
+        free(hashTable);
+        return NULL;
+    }
+    initParcelPool(&hashTable->pool);
+    hashTable->size = HASH_TABLE_INITIAL_SIZE;
+    hashTable->oldTable = NULL;
+    hashTable->oldSize = 0;
+    hashTable->rehashIndex = 0;
+    hashTable->count = 0;
+    hashTable->countries = NULL;
+    hashTable->countryCapacity = 0;
+    hashTable->snapshot = NULL;
+    hashTable->spill = NULL;
+    hashTable->live = NULL;
+    hashTable->dumper = NULL;
+    hashTable->cache = NULL;
+    hashTable->perfect = NULL;
+    hashTable->serving = 0;
+    return hashTable;
+}
+
+/*
+ * FUNCTION: rehashStep
+ * DESCRIPTION: Migrates up to the given number of buckets from the old table into the current one.
+ *              The old table is released once its last bucket has been moved.
+ * PARAMETERS: HashTable* hashTable - The hash table being grown.
+ *             unsigned long buckets - The maximum number of old buckets to migrate.
+ * RETURNS: None.
+ */
+void rehashStep(HashTable* hashTable, unsigned long buckets) {
+    if (hashTable->oldTable == NULL) {
+        return;
+    }
+    while (buckets-- > 0 && hashTable->rehashIndex < hashTable->oldSize) {
+        Country* record = hashTable->oldTable[hashTable->rehashIndex];
+        while (record != NULL) {
+            Country* next = record->next;
+            unsigned long hashIndex = hashBucketIndex(record->hash, hashTable->size);
+            Country** table = hashTable->table;
+            record->next = table[hashIndex];
+            table[hashIndex] = record;
+            record = next;
+        }
+        hashTable->oldTable[hashTable->rehashIndex++] = NULL;
+    }
+    if (hashTable->rehashIndex == hashTable->oldSize) {
+        free(hashTable->oldTable);
+        hashTable->oldTable = NULL;
+        hashTable->oldSize = 0;
+        hashTable->rehashIndex = 0;
+    }
+}
+
+/*
+ * FUNCTION: growHashTable
+ * DESCRIPTION: Doubles the number of buckets. Existing countries stay in the old table and are
+ *              migrated a few buckets at a time by later inserts, so no single insert pays for a full
+ *              rehash. If the new table cannot be allocated the current one is kept.
+ * PARAMETERS: HashTable* hashTable - The hash table to grow.
+ * RETURNS: None.
+ */
+void growHashTable(HashTable* hashTable) {
+    if (hashTable->oldTable != NULL) {
+        rehashStep(hashTable, hashTable->oldSize);  // Finish the previous growth first
+    }
+    Country** newTable = (Country**)calloc(hashTable->size * 2, sizeof(Country*));
+    if (newTable == NULL) {
+        return;
+    }
+    hashTable->oldTable = hashTable->table;
+    hashTable->oldSize = hashTable->size;
+    hashTable->rehashIndex = 0;
+    hashTable->table = newTable;
+    hashTable->size *= 2;
+}
+
+/*
+ * FUNCTION: getHashTableStats
+ * DESCRIPTION: Collects occupancy and probe-length statistics for the hash table. The probe length of
+ *              a country is its position in its bucket chain, i.e. the number of records compared by a
+ *              successful lookup.
+ * PARAMETERS: HashTable* hashTable - The hash table to inspect.
+ *             HashTableStats* stats - Pointer to store the statistics.
+ * RETURNS: None.
+ */
+void getHashTableStats(HashTable* hashTable, HashTableStats* stats) {
+    unsigned long totalProbes = 0;
+
+    stats->buckets = hashTable->size + hashTable->oldSize - hashTable->rehashIndex;
+    stats->occupiedBuckets = 0;
+    stats->countries = hashTable->count;
+    stats->maxProbeLength = 0;
+    stats->rehashing = hashTable->oldTable != NULL;
+
+    for (int pass = 0; pass < 2; ++pass) {
+        Country** buckets = pass == 0 ? hashTable->table.load() : hashTable->oldTable;
+        unsigned long first = pass == 0 ? 0 : hashTable->rehashIndex;
+        unsigned long last = pass == 0 ? hashTable->size : hashTable->oldSize;
+        for (unsigned long i = first; buckets != NULL && i < last; ++i) {
+            unsigned long probes = 0;
+            for (Country* record = buckets[i]; record != NULL; record = record->next) {
+                totalProbes += ++probes;
+            }
+            if (probes > 0) {
+                stats->occupiedBuckets++;
+            }
+            if (probes > stats->maxProbeLength) {
+                stats->maxProbeLength = probes;
+            }
+        }
+    }
+
+    stats->loadFactor = (double)hashTable->count / (double)hashTable->size;
+    stats->averageProbeLength = hashTable->count ? (double)totalProbes / (double)hashTable->count : 0.0;
+}
+
+static Statistics statistics;                            // Process-wide; zero until something is recorded
+static thread_local ThreadCounters* threadCounters = NULL;  // This thread's block in statistics, once claimed
+
+/*
+ * FUNCTION: addStatCounter
+ * DESCRIPTION: Adds to one of the structural counters. Each thread counts into a block of its own, so
+ *              the hot paths pay for a plain load and store instead of a locked add. Threads beyond
+ *              STATS_MAX_THREADS share the last block and may lose a few counts.
+ * PARAMETERS: int counter - The counter (a StatCounter value).
+ *             long long amount - The amount to add.
+ * RETURNS: None.
+ */
+void addStatCounter(int counter, long long amount) {
+    if (threadCounters == NULL) {
+        int index = statistics.threadCount.fetch_add(1);
+        threadCounters = &statistics.threads[index < STATS_MAX_THREADS ? index : STATS_MAX_THREADS - 1];
+    }
+    std::atomic<long long>* value = &threadCounters->values[counter];
+    value->store(value->load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+/*
+ * FUNCTION: readStatCounter
+ * DESCRIPTION: Sums a structural counter over every thread.
+ * PARAMETERS: int counter - The counter (a StatCounter value).
+ * RETURNS: The total so far.
+ */
+long long readStatCounter(int counter) {
+    int threads = statistics.threadCount.load();
+    long long total = 0;
+    for (int i = 0; i < threads && i < STATS_MAX_THREADS; ++i) {
+        total += statistics.threads[i].values[counter].load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+/*
+ * FUNCTION: latencyBucket
+ * DESCRIPTION: Maps a latency onto its histogram bucket. Buckets are log-linear: each power of two is
+ *              split into four, so a bucket is at most 25% wide and the histogram stays small.
+ * PARAMETERS: long long nanoseconds - The latency.
+ * RETURNS: The bucket index, below STATS_HISTOGRAM_BUCKETS.
+ */
+int latencyBucket(long long nanoseconds) {
+    if (nanoseconds < 4) {
+        return nanoseconds < 0 ? 0 : (int)nanoseconds;
+    }
+    int highest = 2;
+    while (highest < 62 && (nanoseconds >> (highest + 1)) != 0) {
+        ++highest;
+    }
+    int bucket = (highest - 1) * 4 + (int)((nanoseconds >> (highest - 2)) & 3);
+    return bucket < STATS_HISTOGRAM_BUCKETS ? bucket : STATS_HISTOGRAM_BUCKETS - 1;
+}
+
+/*
+ * FUNCTION: latencyBucketLimit
+ * DESCRIPTION: Returns the first latency past a histogram bucket.
+ * PARAMETERS: int bucket - The bucket index.
+ * RETURNS: The exclusive upper bound of the bucket in nanoseconds.
+ */
+long long latencyBucketLimit(int bucket) {
+    if (bucket < 4) {
+        return bucket + 1;
+    }
+    int highest = bucket / 4 + 1;
+    return (long long)(4 + bucket % 4 + 1) << (highest - 2);
+}
+
+/*
+ * FUNCTION: recordLatency
+ * DESCRIPTION: Records how long an operation took, from a start time up to now.
+ * PARAMETERS: int operation - The operation (a StatOperation value).
+ *             std::chrono::steady_clock::time_point start - When the operation started.
+ * RETURNS: None.
+ */
+void recordLatency(int operation, std::chrono::steady_clock::time_point start) {
+    long long nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    LatencyHistogram* histogram = &statistics.latencies[operation];
+    histogram->buckets[latencyBucket(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+    histogram->count.fetch_add(1, std::memory_order_relaxed);
+    histogram->totalNanoseconds.fetch_add(nanoseconds, std::memory_order_relaxed);
+    long long longest = histogram->maxNanoseconds.load(std::memory_order_relaxed);
+    while (nanoseconds > longest && !histogram->maxNanoseconds.compare_exchange_weak(longest, nanoseconds)) {
+    }
+}
+
+/*
+ * FUNCTION: latencyPercentile
+ * DESCRIPTION: Estimates a percentile of an operation's latencies as the upper bound of the histogram
+ *              bucket it falls in.
+ * PARAMETERS: LatencyHistogram* histogram - The operation's histogram.
+ *             long long count - The number of latencies in it.
+ *             double fraction - The percentile, e.g. 0.99.
+ * RETURNS: The estimate in nanoseconds, 0 if the histogram is empty.
+ */
+long long latencyPercentile(LatencyHistogram* histogram, long long count, double fraction) {
+    long long rank = (long long)ceil(fraction * (double)count);
+    long long seen = 0;
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; ++i) {
+        seen += histogram->buckets[i].load(std::memory_order_relaxed);
+        if (seen >= rank && seen > 0) {
+            return latencyBucketLimit(i);
+        }
+    }
+    return 0;
+}
+
+/*
+ * FUNCTION: writeStatistics
+ * DESCRIPTION: Writes everything the instrumentation knows: the hash table's occupancy, the distribution
+ *              of bucket chain lengths and tree heights, the tallest tree compared with a perfectly
+ *              balanced one, the latency of every operation and the structural counters. Must be called
+ *              inside a read section.
+ * PARAMETERS: HashTable* hashTable - The hash table to describe.
+ *             OutputBuffer* out - The writer to append to.
+ * RETURNS: None.
+ */
+void writeStatistics(HashTable* hashTable, OutputBuffer* out) {
+    static const char* operationNames[STAT_OP_COUNT] = {
+        "load", "list", "filter", "totals", "valuation extremes", "weight extremes", "range totals", "page",
+        "top valuations", "valuation rank", "summary", "report", "remove", "update"
+    };
+    static const char* counterNames[STAT_COUNTER_COUNT] = {
+        "country lookups", "chain probes", "name comparisons", "tree nodes visited", "column values scanned",
+        "parcels output", "parcel allocations", "parcels recycled", "parcels released", "slab allocations",
+        "arena blocks", "spill page hits", "spill pages read", "query cache hits", "query cache misses"
+    };
+
+    HashTableStats stats;
+    getHashTableStats(hashTable, &stats);
+    writeOutputFormat(out, "Buckets: %lu, Occupied: %lu, Countries: %lu, Load Factor: %.2f\n",
+        stats.buckets, stats.occupiedBuckets, stats.countries, stats.loadFactor);
+    writeOutputFormat(out, "Average Probe Length: %.2f, Max Probe Length: %lu%s\n",
+        stats.averageProbeLength, stats.maxProbeLength, stats.rehashing ? " (rehashing)" : "");
+    if (hashTable->perfect != NULL) {
+        writeOutputFormat(out, "Perfect Hash: %lu countries, %lu seeds\n", hashTable->perfect->count, hashTable->perfect->buckets);
+    }
+
+    long long chains[STATS_CHAIN_LENGTHS] = { 0 };
+    for (int pass = 0; pass < 2; ++pass) {
+        Country** buckets = pass == 0 ? hashTable->table.load() : hashTable->oldTable;
+        unsigned long first = pass == 0 ? 0 : hashTable->rehashIndex;
+        unsigned long last = pass == 0 ? hashTable->size : hashTable->oldSize;
+        for (unsigned long i = first; buckets != NULL && i < last; ++i) {
+            int length = 0;
+            for (Country* record = buckets[i]; record != NULL; record = record->next) {
+                ++length;
+            }
+            chains[length < STATS_CHAIN_LENGTHS ? length : STATS_CHAIN_LENGTHS - 1]++;
+        }
+    }
+    writeOutput(out, "Bucket chain lengths:", 21);
+    for (int i = 0; i < STATS_CHAIN_LENGTHS; ++i) {
+        if (chains[i] > 0) {
+            writeOutputFormat(out, " %d%s:%lld", i, i == STATS_CHAIN_LENGTHS - 1 ? "+" : "", chains[i]);
+        }
+    }
+    writeOutput(out, "\n", 1);
+
+    long long heights[AVL_MAX_HEIGHT + 1] = { 0 };
+    Country* tallest = NULL;
+    int tallestHeight = 0;
+    int tallestCount = 0;
+    int tallestExcess = -1;
+    for (unsigned long id = 0; id < hashTable->count; ++id) {
+        Country* record = countryById(hashTable, (int)id);
+        Parcel* root = record->root;
+        int height = parcelHeight(root);
+        int count = root ? root->count : 0;
+        heights[height]++;
+        int balanced = 0;
+        while (((long long)1 << balanced) - 1 < count) {
+            ++balanced;
+        }
+        if (root != NULL && height - balanced > tallestExcess) {
+            tallest = record;
+            tallestHeight = height;
+            tallestCount = count;
+            tallestExcess = height - balanced;
+        }
+    }
+    writeOutput(out, "Tree heights:", 13);
+    for (int i = 0; i <= AVL_MAX_HEIGHT; ++i) {
+        if (heights[i] > 0) {
+            writeOutputFormat(out, " %d:%lld", i, heights[i]);
+        }
+    }
+    writeOutput(out, "\n", 1);
+    if (tallest != NULL) {
+        writeOutputFormat(out, "Least balanced tree: %s, height %d for %d parcels (balanced: %d)\n",
+            tallest->name, tallestHeight, tallestCount, tallestHeight - tallestExcess);
+    }
+
+    writeOutput(out, "Latency:\n", 9);
+    for (int i = 0; i < STAT_OP_COUNT; ++i) {
+        LatencyHistogram* histogram = &statistics.latencies[i];
+        long long count = histogram->count.load(std::memory_order_relaxed);
+        if (count == 0) {
+            continue;
+        }
+        writeOutputFormat(out, "  %s: %lld calls, mean %.1f us, p50 < %.1f us, p99 < %.1f us, max %.1f us\n",
+            operationNames[i], count, (double)histogram->totalNanoseconds.load(std::memory_order_relaxed) / 1000.0 / (double)count,
+            (double)latencyPercentile(histogram, count, 0.50) / 1000.0, (double)latencyPercentile(histogram, count, 0.99) / 1000.0,
+            (double)histogram->maxNanoseconds.load(std::memory_order_relaxed) / 1000.0);
+    }
+
+    writeOutput(out, "Counters:\n", 10);
+    for (int i = 0; i < STAT_COUNTER_COUNT; ++i) {
+        writeOutputFormat(out, "  %s: %lld\n", counterNames[i], readStatCounter(i));
+    }
+}
+
+/*
+ * FUNCTION: printStatistics
+ * DESCRIPTION: Prints the statistics described in writeStatistics to stdout.
+ * PARAMETERS: HashTable* hashTable - The hash table to describe.
+ * RETURNS: None.
+ */
+void printStatistics(HashTable* hashTable) {
+    OutputBuffer out;
+    if (initOutputBuffer(&out, stdout) != 0) {
+        return;
+    }
+    beginRead(hashTable);
+    writeStatistics(hashTable, &out);
+    endRead(hashTable);
+    freeOutputBuffer(&out);
+}
+
+/*
+ * FUNCTION: dumpStatistics
+ * DESCRIPTION: Appends the statistics, headed by the current time, to the dump file.
+ * PARAMETERS: HashTable* hashTable - The hash table to describe.
+ *             const char* path - The dump file.
+ * RETURNS: None.
+ */
+void dumpStatistics(HashTable* hashTable, const char* path) {
+    FILE* file = NULL;
+    errno_t err = fopen_s(&file, path, "a");
+    if (err != 0 || file == NULL) {
+        return;
+    }
+    OutputBuffer out;
+    if (initOutputBuffer(&out, file) == 0) {
+        writeOutputFormat(&out, "=== Statistics at %lld (seconds since the epoch) ===\n", (long long)time(NULL));
+        beginRead(hashTable);
+        writeStatistics(hashTable, &out);
+        endRead(hashTable);
+        freeOutputBuffer(&out);
+    }
+    fclose(file);
+}
+
+/*
+ * FUNCTION: dumpStatisticsPeriodically
+ * DESCRIPTION: Body of the statistics dump thread: appends the statistics to the dump file every
+ *              interval, and once more when stopped.
+ * PARAMETERS: HashTable* hashTable - The hash table to describe.
+ * RETURNS: None.
+ */
+void dumpStatisticsPeriodically(HashTable* hashTable) {
+    StatsDumper* dumper = hashTable->dumper;
+    std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now() + std::chrono::seconds(dumper->interval);
+    while (!dumper->stop.load()) {
+        if (std::chrono::steady_clock::now() >= next) {
+            dumpStatistics(hashTable, dumper->path);
+            next += std::chrono::seconds(dumper->interval);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(STATS_POLL_INTERVAL_MS));
+    }
+    dumpStatistics(hashTable, dumper->path);
+    releaseReaderSlot(hashTable);
+}
+
+/*
+ * FUNCTION: startStatisticsDump
+ * DESCRIPTION: Starts appending the statistics to a file at a fixed interval on a thread of its own.
+ * PARAMETERS: HashTable* hashTable - The hash table to describe.
+ *             const char* path - The dump file.
+ *             int interval - Seconds between dumps.
+ * RETURNS: None.
+ */
+void startStatisticsDump(HashTable* hashTable, const char* path, int interval) {
+    StatsDumper* dumper = new StatsDumper();
+    dumper->path = path;
+    dumper->interval = interval;
+    hashTable->dumper = dumper;
+    dumper->thread = std::thread(dumpStatisticsPeriodically, hashTable);
+}
+
+/*
+ * FUNCTION: stopStatisticsDump
+ * DESCRIPTION: Stops the statistics dump thread after a final dump. Does nothing if none is running.
+ * PARAMETERS: HashTable* hashTable - The hash table being described.
+ * RETURNS: None.
+ */
+void stopStatisticsDump(HashTable* hashTable) {
+    StatsDumper* dumper = hashTable->dumper;
+    if (dumper == NULL) {
+        return;
+    }
+    dumper->stop.store(1);
+    dumper->thread.join();
+    delete dumper;
+    hashTable->dumper = NULL;
+}
+
+/*
+ * FUNCTION: createCountry
+ * DESCRIPTION: Creates a new country record with an empty parcel tree. The record and its name are
+ *              allocated from the pool's arena, and the name is stored in lowercase.
+ * PARAMETERS: ParcelPool* pool - The pool to allocate the record from.
+ *             const char* name - The name of the country, not necessarily NUL-terminated.
+ *             size_t length - The length of the name.
+ * RETURNS: A pointer to the newly created Country, or NULL on allocation failure.
+ */
+Country* createCountry(ParcelPool* pool, const char* name, size_t length) {
+    Country* newCountry = (Country*)arenaAlloc(pool, sizeof(Country));
+    if (newCountry == NULL) {
+        printf("Failed to allocate memory for new country\n");
+        return NULL;
+    }
+    char* lowerName = (char*)arenaAlloc(pool, length + 1);
+    if (lowerName == NULL) {
+        printf("Failed to allocate memory for country name\n");
+        return NULL;
+    }
+    foldCase(lowerName, name, length);
+    lowerName[length] = '\0';
+
+    newCountry->name = lowerName;
+    newCountry->hash = djb2_hash(lowerName, length);
+    newCountry->root = NULL;
+    newCountry->valuationRoot = NULL;
+    newCountry->columns = NULL;
+    newCountry->version = 0;
+    newCountry->next = NULL;
+    return newCountry;
+}
+
+/*
+ * FUNCTION: countryNameMatches
+ * DESCRIPTION: Compares a stored lowercase country name against a name in any case.
+ * PARAMETERS: const char* name - The stored lowercase name.
+ *             const char* country - The name to compare, not necessarily NUL-terminated.
+ *             size_t length - The length of country.
+ * RETURNS: 1 if the names are equal ignoring case, 0 otherwise.
+ */
+int countryNameMatches(const char* name, const char* country, size_t length) {
+    char folded[CASE_FOLD_CHUNK];
+    while (length > 0) {
+        size_t chunk = length < CASE_FOLD_CHUNK ? length : CASE_FOLD_CHUNK;
+        foldCase(folded, country, chunk);
+        if (strncmp(name, folded, chunk) != 0) {
+            return 0;  // Also stops at the end of a shorter name
+        }
+        name += chunk;
+        country += chunk;
+        length -= chunk;
+    }
+    return *name == '\0';
+}
+
+/*
+ * FUNCTION: findCountry
+ * DESCRIPTION: Looks up the country record for a country name. Only the records chained in the
+ *              country's hash bucket are compared; no parcel nodes are visited. While the table is
+ *              growing, buckets that have not been migrated yet are looked up in the old table. With a
+ *              perfect hash (see buildPerfectHash) the one record in the name's slot is compared
+ *              instead, and the chains are only walked for countries added since it was built.
+ * PARAMETERS: HashTable* hashTable - The hash table to search.
+ *             const char* country - The country name to look up, in any case.
+ *             size_t length - The length of the name.
+ * RETURNS: A pointer to the Country if found, otherwise NULL.
+ */
+Country* findCountry(HashTable* hashTable, const char* country, size_t length) {
+    unsigned long hash = djb2_hash(country, length);
+    Country* found = NULL;
+    long long probes = 0;
+    long long comparisons = 0;
+
+    PerfectHash* perfect = hashTable->perfect;
+    if (perfect != NULL) {
+        unsigned int seed = perfect->seeds[perfectHashMix(hash, 0) % perfect->buckets];
+        Country* record = countryById(hashTable, perfect->slots[perfectHashMix(hash, seed) % perfect->count]);
+        probes = 1;
+        if (record->hash == hash) {
+            comparisons = 1;
+            found = countryNameMatches(record->name, country, length) ? record : NULL;
+        }
+        if (found != NULL || hashTable->count == perfect->count) {
+            addStatCounter(STAT_COUNTRY_LOOKUPS, 1);
+            addStatCounter(STAT_CHAIN_PROBES, probes);
+            addStatCounter(STAT_NAME_COMPARISONS, comparisons);
+            return found;
+        }
+    }
+
+    if (hashTable->oldTable != NULL) {
+        unsigned long oldIndex = hashBucketIndex(hash, hashTable->oldSize);
+        if (oldIndex >= hashTable->rehashIndex) {
+            for (Country* record = hashTable->oldTable[oldIndex]; record != NULL && found == NULL; record = record->next) {
+                ++probes;
+                if (record->hash == hash) {
+                    ++comparisons;
+                    found = countryNameMatches(record->name, country, length) ? record : NULL;
+                }
+            }
+        }
+    }
+    Country** table = hashTable->table;
+    for (Country* record = table[hashBucketIndex(hash, hashTable->size)]; record != NULL && found == NULL; record = record->next) {
+        ++probes;
+        if (record->hash == hash) {
+            ++comparisons;
+            found = countryNameMatches(record->name, country, length) ? record : NULL;
+        }
+    }
+    addStatCounter(STAT_COUNTRY_LOOKUPS, 1);
+    addStatCounter(STAT_CHAIN_PROBES, probes);
+    addStatCounter(STAT_NAME_COMPARISONS, comparisons);
+    return found;
+}
+
+/*
+ * FUNCTION: findOrAddCountry
+ * DESCRIPTION: Looks up the country record for a destination, creating and chaining a new record
+ *              into its hash bucket and interning it under the next country id if the country has not
+ *              been seen before. Each insert migrates a few buckets of an ongoing growth, and the
+ *              table doubles once the load factor is reached. While the input file is followed, new
+ *              countries are added by addLiveCountry instead.
+ * PARAMETERS: HashTable* hashTable - The hash table to search.
+ *             const char* country - The country name, in any case, not necessarily NUL-terminated.
+ *             size_t length - The length of the name.
+ * RETURNS: A pointer to the Country, or NULL on allocation failure.
+ */
+Country* findOrAddCountry(HashTable* hashTable, const char* country, size_t length) {
+    Country* record = findCountry(hashTable, country, length);
+    if (record != NULL) {
+        return record;
+    }
+    if (hashTable->live != NULL) {
+        return addLiveCountry(hashTable, country, length);
+    }
+
+    if (hashTable->count == hashTable->countryCapacity) {
+        unsigned long capacity = hashTable->countryCapacity ? hashTable->countryCapacity * 2 : COUNTRY_ID_INITIAL_CAPACITY;
+        Country** countries = (Country**)realloc(hashTable->countries, capacity * sizeof(Country*));
+        if (countries == NULL) {
+            printf("Failed to allocate memory for country intern table\n");
+            return NULL;
+        }
+        hashTable->countries = countries;
+        hashTable->countryCapacity = capacity;
+    }
+
+    Country* newCountry = createCountry(&hashTable->pool, country, length);
+    if (newCountry == NULL) {
+        return NULL;
+    }
+    newCountry->id = (int)hashTable->count;
+
+    rehashStep(hashTable, HASH_TABLE_REHASH_STEP);
+    if ((double)(hashTable->count + 1) > (double)hashTable->size * HASH_TABLE_MAX_LOAD) {
+        growHashTable(hashTable);
+    }
+
+    unsigned long hashIndex = hashBucketIndex(newCountry->hash, hashTable->size);
+    Country** table = hashTable->table;
+    newCountry->next = table[hashIndex];
+    table[hashIndex] = newCountry;
+    hashTable->countries.load()[hashTable->count] = newCountry;
+    hashTable->count++;
+    return newCountry;
+}
+
+/*
+ * FUNCTION: countryById
+ * DESCRIPTION: Resolves an interned country id back to its country record.
+ * PARAMETERS: HashTable* hashTable - The hash table that assigned the id.
+ *             int id - The country id.
+ * RETURNS: A pointer to the Country.
+ */
+Country* countryById(HashTable* hashTable, int id) {
+    return hashTable->countries.load()[id];
+}
+
+/*
+ * FUNCTION: perfectHashMix
+ * DESCRIPTION: Derives an independent well-mixed value from a country's hash for each seed (the
+ *              finalizer of MurmurHash3), which picks the country's bucket (seed 0) and its slot.
+ * PARAMETERS: unsigned long long hash - The country's djb2 hash.
+ *             unsigned long long seed - The seed.
+ * RETURNS: The mixed value.
+ */
+unsigned long long perfectHashMix(unsigned long long hash, unsigned long long seed) {
+    hash ^= seed * 0x9E3779B97F4A7C15ULL;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    return hash ^ (hash >> 33);
+}
+
+/*
+ * FUNCTION: buildPerfectHash
+ * DESCRIPTION: Builds a minimal perfect hash of the countries loaded, so findCountry finds a country
+ *              with one probe and one name comparison instead of walking a chain. The countries are
+ *              spread over buckets of about PERFECT_HASH_BUCKET_SIZE, and the buckets, largest first,
+ *              each get the first seed that sends all their countries to distinct free slots among
+ *              exactly one slot per country (hash and displace, as in CHD). Countries added later, by
+ *              a followed file, are still found through the chains, which are kept.
+ * PARAMETERS: HashTable* hashTable - The loaded hash table.
+ * RETURNS: 1 on success, 0 if it cannot be built (two names with the same djb2 hash, or allocation
+ *          failure); lookups then keep using the chains.
+ */
+int buildPerfectHash(HashTable* hashTable) {
+    unsigned long count = hashTable->count;
+    if (count == 0) {
+        return 1;
+    }
+    unsigned long buckets = count / PERFECT_HASH_BUCKET_SIZE + 1;
+    PerfectHash* perfect = (PerfectHash*)malloc(sizeof(PerfectHash));
+    unsigned long* starts = (unsigned long*)calloc(buckets + 1, sizeof(unsigned long));
+    int* members = (int*)malloc(count * sizeof(int));
+    char* taken = (char*)calloc(count, 1);
+    if (perfect != NULL) {
+        perfect->count = count;
+        perfect->buckets = buckets;
+        perfect->seeds = (unsigned int*)calloc(buckets, sizeof(unsigned int));
+        perfect->slots = (int*)malloc(count * sizeof(int));
+    }
+    int built = perfect != NULL && perfect->seeds != NULL && perfect->slots != NULL && starts != NULL && members != NULL
+                && taken != NULL;
+    if (!built) {
+        printf("Failed to allocate memory for the perfect hash\n");
+    }
+
+    // Group the countries by bucket with a counting sort: starts[bucket] is the bucket's first member
+    unsigned long largest = 0;
+    for (unsigned long id = 0; built && id < count; ++id) {
+        ++starts[perfectHashMix(countryById(hashTable, (int)id)->hash, 0) % buckets + 1];
+    }
+    for (unsigned long bucket = 0; built && bucket < buckets; ++bucket) {
+        largest = starts[bucket + 1] > largest ? starts[bucket + 1] : largest;
+        starts[bucket + 1] += starts[bucket];
+    }
+    for (unsigned long id = 0; built && id < count; ++id) {
+        members[starts[perfectHashMix(countryById(hashTable, (int)id)->hash, 0) % buckets]++] = (int)id;
+    }
+    for (unsigned long bucket = buckets; built && bucket > 0; --bucket) {
+        starts[bucket] = starts[bucket - 1];
+    }
+    if (built) {
+        starts[0] = 0;
+    }
+
+    // Place the largest buckets first, while most slots are free
+    unsigned long long slots[PERFECT_HASH_BUCKET_SIZE * 16];
+    for (unsigned long size = largest; built && size > 0; --size) {
+        for (unsigned long bucket = 0; built && bucket < buckets; ++bucket) {
+            unsigned long first = starts[bucket];
+            if (starts[bucket + 1] - first != size) {
+                continue;
+            }
+            unsigned int seed = 1;
+            unsigned long placed = 0;
+            while (placed < size && seed < PERFECT_HASH_MAX_SEED && size <= PERFECT_HASH_BUCKET_SIZE * 16) {
+                unsigned long long hash = countryById(hashTable, members[first + placed])->hash;
+                unsigned long long slot = perfectHashMix(hash, seed) % count;
+                int available = !taken[slot];
+                for (unsigned long i = 0; available && i < placed; ++i) {
+                    available = slots[i] != slot;
+                }
+                if (available) {
+                    slots[placed++] = slot;
+                }
+                else {
+                    placed = 0;
+                    ++seed;
+                }
+            }
+            if (placed < size) {
+                printf("Could not build a perfect hash of the countries; lookups keep using the hash chains.\n");
+                built = 0;
+                break;
+            }
+            perfect->seeds[bucket] = seed;
+            for (unsigned long i = 0; i < size; ++i) {
+                taken[slots[i]] = 1;
+                perfect->slots[slots[i]] = members[first + i];
+            }
+        }
+    }
+
+    free(starts);
+    free(members);
+    free(taken);
+    if (!built) {
+        freePerfectHash(perfect);
+        return 0;
+    }
+    hashTable->perfect = perfect;
+    return 1;
+}
+
+/*
+ * FUNCTION: freePerfectHash
+ * DESCRIPTION: Frees a perfect hash built by buildPerfectHash.
+ * PARAMETERS: PerfectHash* perfect - The perfect hash, may be NULL.
+ * RETURNS: None.
+ */
+void freePerfectHash(PerfectHash* perfect) {
+    if (perfect == NULL) {
+        return;
+    }
+    free(perfect->seeds);
+    free(perfect->slots);
+    free(perfect);
+}
+
+/*
+ * FUNCTION: clean
+ * DESCRIPTION: Frees all memory associated with the hash table. Country records and parcels live in the
+ *              table's pool, so they are released a whole slab or arena block at a time; only the
+ *              columnar snapshots are freed per country, and a binary snapshot the columns point into is
+ *              unmapped last, or the spill file they are paged in from removed. A running statistics dump and live ingest are stopped first.
+ * PARAMETERS: HashTable* hashTable - The hash table to clean.
+ * RETURNS: None.
+ */
+void clean(HashTable* hashTable) {
+    stopStatisticsDump(hashTable);
+    stopLiveIngest(hashTable);
+    for (unsigned long id = 0; id < hashTable->count; ++id) {
+        free(countryById(hashTable, (int)id)->columns);
+    }
+    freeParcelPool(&hashTable->pool);
+    free(hashTable->oldTable);
+    free(hashTable->table);
+    free(hashTable->countries);
+    if (hashTable->snapshot != NULL) {
+        unmapFile(hashTable->snapshot);
+        free(hashTable->snapshot);
+    }
+    closeSpillStore(hashTable->spill);
+    freeQueryCache(hashTable->cache);
+    freePerfectHash(hashTable->perfect);
+    free(hashTable);
+}
+
+/*
+ * FUNCTION: findExtremeParcel
+ * DESCRIPTION: Finds the cheapest, most expensive, lightest or heaviest parcel of a country's BST. The
+ *              lightest and heaviest are the leftmost and rightmost nodes; the cheapest and most
+ *              expensive are found by following the subtree whose aggregate holds the extreme, the left
+ *              one first, so ties go to the lightest parcel as in scanColumns. Either way only one
+ *              path is walked, so it takes O(log n) steps. The extreme is a template
+ *              parameter, so each instantiation is a plain loop with no test on it.
+ * PARAMETERS: Extreme - Which parcel to find (a ParcelExtreme value).
+ *             Parcel* root - The root of the BST, may be NULL.
+ * RETURNS: A pointer to the Parcel found, or NULL if the tree is empty.
+ */
+template <int Extreme>
+Parcel* findExtremeParcel(Parcel* root) {
+    long long visited = 0;
+    while (root != NULL) {
+        Parcel* next;
+        if (Extreme == LIGHTEST_PARCEL || Extreme == HEAVIEST_PARCEL) {
+            next = Extreme == LIGHTEST_PARCEL ? root->left : root->right;
+            if (next == NULL) {
+                break;
+            }
+        }
+        else {
+            float target = Extreme == CHEAPEST_PARCEL ? root->minValuation : root->maxValuation;
+            Parcel* left = root->left;
+            if (left != NULL && (Extreme == CHEAPEST_PARCEL ? left->minValuation : left->maxValuation) == target) {
+                next = left;
+            }
+            else if (root->valuation == target) {
+                break;
+            }
+            else {
+                next = root->right;
+            }
+        }
+        root = next;
+        ++visited;
+    }
+    addStatCounter(STAT_NODES_VISITED, visited);
+    return root;
+}
+
+/*
+ * FUNCTION: setSummaryParcel
+ * DESCRIPTION: Stores one of the extreme parcels of a summary.
+ * PARAMETERS: ParcelSummary* summary - The summary to update.
+ *             int extreme - Which parcel to store (a ParcelExtreme value).
+ *             int weight - The parcel's weight.
+ *             float valuation - The parcel's valuation.
+ * RETURNS: None.
+ */
+void setSummaryParcel(ParcelSummary* summary, int extreme, int weight, float valuation) {
+    summary->extremes[extreme].weight = weight;
+    summary->extremes[extreme].valuation = valuation;
+}
+
+/*
+ * FUNCTION: addExtremeToSummary
+ * DESCRIPTION: Offers a node, or a node's whole subtree, as the cheapest or most expensive parcel of a
+ *              summary (see addParcelToSummary). Equal valuations go to the lighter parcel, as in
+ *              scanColumns; to compare weights a subtree holding a tie is resolved to its parcel first.
+ * PARAMETERS: Extreme - CHEAPEST_PARCEL or MOST_EXPENSIVE_PARCEL.
+ *             ParcelSummary* summary - The summary to update.
+ *             Parcel* node - The node offered.
+ *             int wholeSubtree - 1 to offer the node's subtree, 0 to offer only the node.
+ *             int first - 1 if the summary holds no parcel yet.
+ *             Parcel** extremeSubtrees - As for addParcelToSummary.
+ * RETURNS: None.
+ */
+template <int Extreme>
+void addExtremeToSummary(ParcelSummary* summary, Parcel* node, int wholeSubtree, int first, Parcel** extremeSubtrees) {
+    float valuation = !wholeSubtree ? node->valuation : Extreme == CHEAPEST_PARCEL ? node->minValuation : node->maxValuation;
+    float current = summary->extremes[Extreme].valuation;
+    if (first || (Extreme == CHEAPEST_PARCEL ? valuation < current : valuation > current)) {
+        setSummaryParcel(summary, Extreme, node->weight, valuation);
+        extremeSubtrees[Extreme] = wholeSubtree ? node : NULL;
+    }
+    else if (valuation == current) {
+        if (extremeSubtrees[Extreme] != NULL) {
+            Parcel* held = findExtremeParcel<Extreme>(extremeSubtrees[Extreme]);
+            setSummaryParcel(summary, Extreme, held->weight, held->valuation);
+            extremeSubtrees[Extreme] = NULL;
+        }
+        Parcel* offered = wholeSubtree ? findExtremeParcel<Extreme>(node) : node;
+        if (offered->weight < summary->extremes[Extreme].weight) {
+            setSummaryParcel(summary, Extreme, offered->weight, offered->valuation);
+        }
+    }
+}
+
+/*
+ * FUNCTION: addParcelToSummary
+ * DESCRIPTION: Adds a single node, or a node's whole subtree, to a summary, updating only the requested
+ *              fields. When a subtree holds a new cheapest or most expensive valuation, only the value
+ *              is known; the subtree is remembered so that its parcel can be found once at the end.
+ * PARAMETERS: Fields - The requested ParcelSummaryField values.
+ *             ParcelSummary* summary - The summary to add to.
+ *             Parcel* node - The node to add, may be NULL.
+ *             int wholeSubtree - 1 to add the node's subtree aggregates, 0 to add only the node.
+ *             Parcel** extremeSubtrees - The subtrees holding the cheapest and most expensive parcel so
+ *                                        far, indexed by ParcelExtreme, NULL when the summary holds it.
+ * RETURNS: None.
+ */
+template <unsigned Fields>
+void addParcelToSummary(ParcelSummary* summary, Parcel* node, int wholeSubtree, Parcel** extremeSubtrees) {
+    if (node == NULL) {
+        return;
+    }
+    int first = summary->count == 0;
+    summary->count += wholeSubtree ? node->count : 1;
+    if (Fields & SUMMARY_WEIGHT_SUM) {
+        summary->weightSum += wholeSubtree ? node->weightSum : node->weight;
+    }
+    if (Fields & SUMMARY_VALUATION_SUM) {
+        summary->valuationSum += wholeSubtree ? node->valuationSum : node->valuation;
+    }
+    if (Fields & SUMMARY_CHEAPEST) {
+        addExtremeToSummary<CHEAPEST_PARCEL>(summary, node, wholeSubtree, first, extremeSubtrees);
+    }
+    if (Fields & SUMMARY_MOST_EXPENSIVE) {
+        addExtremeToSummary<MOST_EXPENSIVE_PARCEL>(summary, node, wholeSubtree, first, extremeSubtrees);
+    }
+}
+
+/*
+ * FUNCTION: summarizeWeightRange
+ * DESCRIPTION: Computes the requested fields of a summary of the parcels whose weight lies in
+ *              [minWeight, maxWeight] in one descent. The search goes down to the node where the bounds
+ *              split, then follows each bound down one side, adding whole subtrees that lie inside the
+ *              range from their aggregates; the last node taken on each side is the lightest or
+ *              heaviest parcel in range. Only O(log n) nodes are visited, plus one more path per
+ *              valuation extreme that lies inside a whole subtree. The whole weight range is answered
+ *              from the root's aggregates. The summary must be zeroed and minWeight <= maxWeight.
+ * PARAMETERS: Fields - The requested ParcelSummaryField values; SUMMARY_MEANS is ignored here.
+ *             Parcel* root - The root of the country's BST.
+ *             int minWeight - The smallest weight included.
+ *             int maxWeight - The largest weight included.
+ *             ParcelSummary* summary - The summary to fill.
+ * RETURNS: None.
+ */
+template <unsigned Fields>
+void summarizeWeightRange(Parcel* root, int minWeight, int maxWeight, ParcelSummary* summary) {
+    Parcel* found[4] = { NULL, NULL, NULL, NULL };
+    if (minWeight == INT_MIN && maxWeight == INT_MAX) {
+        if (root == NULL) {
+            return;
+        }
+        summary->count = root->count;
+        summary->weightSum = Fields & SUMMARY_WEIGHT_SUM ? root->weightSum : 0;
+        summary->valuationSum = Fields & SUMMARY_VALUATION_SUM ? root->valuationSum : 0.0;
+        found[CHEAPEST_PARCEL] = Fields & SUMMARY_CHEAPEST ? findExtremeParcel<CHEAPEST_PARCEL>(root) : NULL;
+        found[MOST_EXPENSIVE_PARCEL] = Fields & SUMMARY_MOST_EXPENSIVE ? findExtremeParcel<MOST_EXPENSIVE_PARCEL>(root) : NULL;
+        found[LIGHTEST_PARCEL] = Fields & SUMMARY_LIGHTEST ? findExtremeParcel<LIGHTEST_PARCEL>(root) : NULL;
+        found[HEAVIEST_PARCEL] = Fields & SUMMARY_HEAVIEST ? findExtremeParcel<HEAVIEST_PARCEL>(root) : NULL;
+    }
+    else {
+        Parcel* split = root;
+        long long visited = 0;
+        while (split != NULL && (split->weight < minWeight || split->weight > maxWeight)) {
+            split = split->weight < minWeight ? split->right : split->left;
+            ++visited;
+        }
+        if (split == NULL) {
+            addStatCounter(STAT_NODES_VISITED, visited);
+            return;
+        }
+        addParcelToSummary<Fields>(summary, split, 0, found);
+        found[LIGHTEST_PARCEL] = found[HEAVIEST_PARCEL] = split;
+
+        // Everything right of a node on the lower bound's path is >= that node, and so in range
+        for (Parcel* node = split->left; node != NULL; ++visited) {
+            if (node->weight >= minWeight) {
+                addParcelToSummary<Fields>(summary, node, 0, found);
+                addParcelToSummary<Fields>(summary, node->right, 1, found);
+                found[LIGHTEST_PARCEL] = node;
+                node = node->left;
+            }
+            else {
+                node = node->right;
+            }
+        }
+        for (Parcel* node = split->right; node != NULL; ++visited) {
+            if (node->weight <= maxWeight) {
+                addParcelToSummary<Fields>(summary, node, 0, found);
+                addParcelToSummary<Fields>(summary, node->left, 1, found);
+                found[HEAVIEST_PARCEL] = node;
+                node = node->right;
+            }
+            else {
+                node = node->left;
+            }
+        }
+        addStatCounter(STAT_NODES_VISITED, visited + 1);
+        if (found[CHEAPEST_PARCEL] != NULL) {
+            found[CHEAPEST_PARCEL] = findExtremeParcel<CHEAPEST_PARCEL>(found[CHEAPEST_PARCEL]);
+        }
+        if (found[MOST_EXPENSIVE_PARCEL] != NULL) {
+            found[MOST_EXPENSIVE_PARCEL] = findExtremeParcel<MOST_EXPENSIVE_PARCEL>(found[MOST_EXPENSIVE_PARCEL]);
+        }
+    }
+
+    for (int extreme = CHEAPEST_PARCEL; extreme <= HEAVIEST_PARCEL; ++extreme) {
+        if ((Fields & (SUMMARY_CHEAPEST << extreme)) && found[extreme] != NULL) {
+            setSummaryParcel(summary, extreme, found[extreme]->weight, found[extreme]->valuation);
+        }
+    }
+}
+
+/*
+ * FUNCTION: scanColumns
+ * DESCRIPTION: Reduces a non-empty slice of a country's columns to the requested sums and the indices
+ *              of its cheapest and most expensive parcel, reading each value once. Uses AVX2 when the
+ *              build enables it, SSE2 otherwise, and a scalar loop for the tail and for builds without
+ *              either. The fields are a template parameter, so every combination compiles to its own
+ *              loop without the accumulators it does not need. Rather than carry indices through the
+ *              vector loop, the scan remembers the first COLUMN_SCAN_BLOCK block that lowered the
+ *              minimum or raised the maximum, and looks for the first matching index inside that block
+ *              once at the end, so ties go to the first index.
+ * PARAMETERS: Fields - The requested ParcelSummaryField values; only the sums, SUMMARY_CHEAPEST and
+ *                      SUMMARY_MOST_EXPENSIVE change the scan.
+ *             const int* weights - The weight column slice.
+ *             const float* valuations - The valuation column slice.
+ *             int count - The number of entries, at least 1.
+ *             long long* weightSum - Pointer to store the sum of the weights.
+ *             double* valuationSum - Pointer to store the sum of the valuations, in double precision.
+ *             int* cheapest - Pointer to store the index of the first smallest valuation.
+ *             int* mostExpensive - Pointer to store the index of the first largest valuation.
+ * RETURNS: None. Outputs of fields that were not requested are left unchanged.
+ */
+template <unsigned Fields>
+void scanColumns(const int* weights, const float* valuations, int count, long long* weightSum, double* valuationSum, int* cheapest, int* mostExpensive) {
+    const int sumWeights = (Fields & SUMMARY_WEIGHT_SUM) != 0;
+    const int sumValuations = (Fields & SUMMARY_VALUATION_SUM) != 0;
+    const int findLow = (Fields & SUMMARY_CHEAPEST) != 0;
+    const int findHigh = (Fields & SUMMARY_MOST_EXPENSIVE) != 0;
+    long long weightTotal = 0;
+    double valuationTotal = 0.0;
+    float low = valuations[0];
+    float high = valuations[0];
+    int lowBlock = 0;           // Start of the first block holding the smallest valuation seen
+    int highBlock = 0;
+    int i = 0;
+#if defined(__AVX2__)
+    if (count >= 8) {
+        __m256i weightAcc = _mm256_setzero_si256();
+        __m256d valuationAcc0 = _mm256_setzero_pd();
+        __m256d valuationAcc1 = _mm256_setzero_pd();
+        while (i + 8 <= count) {
+            int blockStart = i;
+            int blockEnd = count - i > COLUMN_SCAN_BLOCK ? i + COLUMN_SCAN_BLOCK : count;
+            __m256 lows = _mm256_loadu_ps(valuations + i);
+            __m256 highs = lows;
+            for (; i + 8 <= blockEnd; i += 8) {
+                if (sumWeights) {
+                    __m256i chunk = _mm256_loadu_si256((const __m256i*)(weights + i));
+                    weightAcc = _mm256_add_epi64(weightAcc, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(chunk)));
+                    weightAcc = _mm256_add_epi64(weightAcc, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(chunk, 1)));
+                }
+                __m256 chunk = _mm256_loadu_ps(valuations + i);
+                if (sumValuations) {
+                    valuationAcc0 = _mm256_add_pd(valuationAcc0, _mm256_cvtps_pd(_mm256_castps256_ps128(chunk)));
+                    valuationAcc1 = _mm256_add_pd(valuationAcc1, _mm256_cvtps_pd(_mm256_extractf128_ps(chunk, 1)));
+                }
+                lows = _mm256_min_ps(lows, chunk);
+                highs = _mm256_max_ps(highs, chunk);
+            }
+            if (findLow || findHigh) {
+                float lowLanes[8];
+                float highLanes[8];
+                _mm256_storeu_ps(lowLanes, lows);
+                _mm256_storeu_ps(highLanes, highs);
+                for (int lane = 0; lane < 8; ++lane) {
+                    if (lowLanes[lane] < low) {
+                        low = lowLanes[lane];
+                        lowBlock = blockStart;
+                    }
+                    if (highLanes[lane] > high) {
+                        high = highLanes[lane];
+                        highBlock = blockStart;
+                    }
+                }
+            }
+        }
+        long long weightLanes[4];
+        double valuationLanes[4];
+        _mm256_storeu_si256((__m256i*)weightLanes, weightAcc);
+        _mm256_storeu_pd(valuationLanes, _mm256_add_pd(valuationAcc0, valuationAcc1));
+        weightTotal = weightLanes[0] + weightLanes[1] + weightLanes[2] + weightLanes[3];
+        valuationTotal = valuationLanes[0] + valuationLanes[1] + valuationLanes[2] + valuationLanes[3];
+    }
+#elif defined(HAVE_SSE2)
+    if (count >= 4) {
+        __m128i weightAcc = _mm_setzero_si128();
+        __m128d valuationAcc0 = _mm_setzero_pd();
+        __m128d valuationAcc1 = _mm_setzero_pd();
+        while (i + 4 <= count) {
+            int blockStart = i;
+            int blockEnd = count - i > COLUMN_SCAN_BLOCK ? i + COLUMN_SCAN_BLOCK : count;
+            __m128 lows = _mm_loadu_ps(valuations + i);
+            __m128 highs = lows;
+            for (; i + 4 <= blockEnd; i += 4) {
+                if (sumWeights) {
+                    __m128i chunk = _mm_loadu_si128((const __m128i*)(weights + i));
+                    __m128i sign = _mm_srai_epi32(chunk, 31);  // Sign-extend to 64 bits by interleaving
+                    weightAcc = _mm_add_epi64(weightAcc, _mm_unpacklo_epi32(chunk, sign));
+                    weightAcc = _mm_add_epi64(weightAcc, _mm_unpackhi_epi32(chunk, sign));
+                }
+                __m128 chunk = _mm_loadu_ps(valuations + i);
+                if (sumValuations) {
+                    valuationAcc0 = _mm_add_pd(valuationAcc0, _mm_cvtps_pd(chunk));
+                    valuationAcc1 = _mm_add_pd(valuationAcc1, _mm_cvtps_pd(_mm_movehl_ps(chunk, chunk)));
+                }
+                lows = _mm_min_ps(lows, chunk);
+                highs = _mm_max_ps(highs, chunk);
+            }
+            if (findLow || findHigh) {
+                float lowLanes[4];
+                float highLanes[4];
+                _mm_storeu_ps(lowLanes, lows);
+                _mm_storeu_ps(highLanes, highs);
+                for (int lane = 0; lane < 4; ++lane) {
+                    if (lowLanes[lane] < low) {
+                        low = lowLanes[lane];
+                        lowBlock = blockStart;
+                    }
+                    if (highLanes[lane] > high) {
+                        high = highLanes[lane];
+                        highBlock = blockStart;
+                    }
+                }
+            }
+        }
+        long long weightLanes[2];
+        double valuationLanes[2];
+        _mm_storeu_si128((__m128i*)weightLanes, weightAcc);
+        _mm_storeu_pd(valuationLanes, _mm_add_pd(valuationAcc0, valuationAcc1));
+        weightTotal = weightLanes[0] + weightLanes[1];
+        valuationTotal = valuationLanes[0] + valuationLanes[1];
+    }
+#endif
+    for (; i < count; ++i) {
+        if (sumWeights) {
+            weightTotal += weights[i];
+        }
+        if (sumValuations) {
+            valuationTotal += valuations[i];
+        }
+        if (findLow && valuations[i] < low) {
+            low = valuations[i];
+            lowBlock = i;
+        }
+        if (findHigh && valuations[i] > high) {
+            high = valuations[i];
+            highBlock = i;
+        }
+    }
+    if (sumWeights) {
+        *weightSum = weightTotal;
+    }
+    if (sumValuations) {
+        *valuationSum = valuationTotal;
+    }
+    if (findLow) {
+        while (lowBlock < count - 1 && valuations[lowBlock] != low) {
+            ++lowBlock;
+        }
+        *cheapest = lowBlock;
+    }
+    if (findHigh) {
+        while (highBlock < count - 1 && valuations[highBlock] != high) {
+            ++highBlock;
+        }
+        *mostExpensive = highBlock;
+    }
+}
+
+/*
+ * FUNCTION: lowerBoundWeight
+ * DESCRIPTION: Finds the first entry of a sorted weight column that is not lighter than a weight. The
+ *              search halves the range with a conditional move instead of a branch, so its cost does
+ *              not depend on mispredictions.
+ * PARAMETERS: const int* weights - The sorted weight column.
+ *             int count - The number of entries.
+ *             int weight - The weight to search for.
+ * RETURNS: The index of the first weight >= the given one, or count if there is none.
+ */
+int lowerBoundWeight(const int* weights, int count, int weight) {
+    if (count == 0) {
+        return 0;
+    }
+    const int* base = weights;
+    int length = count;
+    while (length > 1) {
+        int half = length / 2;
+        base = base[half] < weight ? base + half : base;
+        length -= half;
+    }
+    return (int)(base - weights) + (*base < weight);
+}
+
+/*
+ * FUNCTION: fillColumnSnapshot
+ * DESCRIPTION: Copies a country's weights and valuations out of the tree in weight order into the
+ *              columns' two arrays, sorts their valuation order, and computes the totals and valuation
+ *              extremes in one scanColumns pass.
+ * PARAMETERS: Country* record - The country to copy.
+ *             ColumnSnapshot* columns - The columns to fill; count, weights, valuations and
+ *                                       valuationOrder must already describe arrays with room for every
+ *                                       parcel of the country.
+ * RETURNS: 0 on success, 1 if there is no memory to sort the valuations in.
+ */
+int fillColumnSnapshot(Country* record, ColumnSnapshot* columns) {
+    int count = columns->count;
+    unsigned int* scratch = (unsigned int*)malloc(3 * (size_t)count * sizeof(unsigned int) + 1);
+    if (scratch == NULL) {
+        return 1;
+    }
+
+    ParcelIterator iterator;
+    initParcelIterator(&iterator, record->root, INT_MIN, INT_MAX, 0, -1);
+    int i = 0;
+    for (Parcel* parcel = nextParcel(&iterator); parcel != NULL; parcel = nextParcel(&iterator)) {
+        columns->weights[i] = parcel->weight;
+        columns->valuations[i] = parcel->valuation;
+        ++i;
+    }
+    sortValuationOrder(columns->valuations, count, columns->valuationOrder, scratch);
+    free(scratch);
+
+    columns->weightSum = 0;
+    columns->valuationSum = 0.0;
+    columns->minValuationIndex = columns->maxValuationIndex = -1;
+    if (count > 0) {
+        scanColumns<SUMMARY_WEIGHT_SUM | SUMMARY_VALUATION_SUM | SUMMARY_CHEAPEST | SUMMARY_MOST_EXPENSIVE>(columns->weights,
+            columns->valuations, count, &columns->weightSum, &columns->valuationSum, &columns->minValuationIndex, &columns->maxValuationIndex);
+    }
+    return 0;
+}
+
+/*
+ * FUNCTION: freezeCountry
+ * DESCRIPTION: Builds the columnar snapshot of a country (see fillColumnSnapshot). Any previous snapshot
+ *              is replaced, except for countries loaded from a binary snapshot or out of core, which have
+ *              no tree to rebuild from and are already frozen.
+ * PARAMETERS: Country* record - The country to freeze.
+ * RETURNS: 1 on success, 0 on allocation failure (the country is then left unfrozen).
+ */
+int freezeCountry(Country* record) {
+    Parcel* root = record->root;
+    if (root == NULL && record->columns != NULL) {
+        return 1;
+    }
+    int count = root ? root->count : 0;
+    ColumnSnapshot* columns = (ColumnSnapshot*)malloc(sizeof(ColumnSnapshot) + (size_t)count * (2 * sizeof(int) + sizeof(float)));
+    free(record->columns);
+    record->columns = NULL;
+    if (columns == NULL) {
+        printf("Failed to allocate memory for the columns of '%s'\n", record->name);
+        return 0;
+    }
+
+    columns->count = count;
+    columns->weights = (int*)(columns + 1);
+    columns->valuations = (float*)(columns->weights + count);
+    columns->valuationOrder = (int*)(columns->valuations + count);
+    columns->blocks = NULL;
+    columns->eytzinger = NULL;
+    columns->spill = NULL;
+    if (fillColumnSnapshot(record, columns) != 0) {
+        free(columns);
+        printf("Failed to allocate memory for the columns of '%s'\n", record->name);
+        return 0;
+    }
+    record->columns = columns;
+    return 1;
+}
+
+/*
+ * FUNCTION: freezeHashTable
+ * DESCRIPTION: Freezes every country of the hash table into its columnar snapshot. Queries on a frozen
+ *              country read the columns instead of walking the tree. Compacting every country also
+ *              drops every tree, so the parcel slabs are freed at once.
+ * PARAMETERS: HashTable* hashTable - The hash table to freeze.
+ *             int mode - FREEZE_COLUMNS to keep the trees beside the columns, FREEZE_COMPACT to keep
+ *                        only compressed columns (see compactCountry), FREEZE_EYTZINGER to also lay
+ *                        the weights out for searching (see indexColumnWeights).
+ * RETURNS: 1 if every country was frozen, 0 if any ran out of memory.
+ */
+int freezeHashTable(HashTable* hashTable, int mode) {
+    int frozen = 1;
+    for (unsigned long id = 0; id < hashTable->count; ++id) {
+        Country* record = countryById(hashTable, (int)id);
+        frozen &= mode == FREEZE_COMPACT ? compactCountry(record) : freezeCountry(record);
+        if (mode == FREEZE_EYTZINGER && record->columns != NULL) {
+            frozen &= indexColumnWeights(record);
+        }
+    }
+    if (mode == FREEZE_COMPACT && frozen) {
+        freeParcelSlabs(&hashTable->pool);
+    }
+    return frozen;
+}
+
+/*
+ * FUNCTION: layOutEytzinger
+ * DESCRIPTION: Copies a sorted weight column into Eytzinger order by walking the implicit tree in
+ *              order: the children of entry k are entries 2k and 2k + 1, so the tree needs no pointers
+ *              and its top levels share a few cache lines.
+ * PARAMETERS: const int* weights - The sorted weight column.
+ *             int* tree - Room for count + 1 entries; entry 0 is unused.
+ *             int* index - Room for count + 1 entries, to store each tree entry's index in weights.
+ *             int next - The index of the next weight to place.
+ *             unsigned long long k - The tree entry to fill the subtree of.
+ *             int count - The number of weights.
+ * RETURNS: The index of the next weight to place after the subtree.
+ */
+int layOutEytzinger(const int* weights, int* tree, int* index, int next, unsigned long long k, int count) {
+    if (k > (unsigned long long)count) {
+        return next;
+    }
+    next = layOutEytzinger(weights, tree, index, next, 2 * k, count);
+    tree[k] = weights[next];
+    index[k] = next++;
+    return layOutEytzinger(weights, tree, index, next, 2 * k + 1, count);
+}
+
+/*
+ * FUNCTION: indexColumnWeights
+ * DESCRIPTION: Adds an Eytzinger-ordered copy of a frozen country's weight column, which
+ *              columnLowerBound then searches instead of the sorted column (see eytzingerLowerBound).
+ *              The columns are copied into one new allocation with the copy, except arrays inside a
+ *              binary snapshot, which stay where they are. Compressed and spilled columns have no
+ *              weight array and are left alone.
+ * PARAMETERS: Country* record - The frozen country.
+ * RETURNS: 1 on success, 0 on allocation failure (the country then keeps its columns as they were).
+ */
+int indexColumnWeights(Country* record) {
+    ColumnSnapshot* columns = record->columns;
+    if (columns->weights == NULL || columns->eytzinger != NULL) {
+        return 1;
+    }
+    int count = columns->count;
+    int owned = columns->weights == (int*)(columns + 1);
+    size_t arrays = owned ? (size_t)count * (2 * sizeof(int) + sizeof(float)) : 0;
+    ColumnSnapshot* indexed = (ColumnSnapshot*)malloc(sizeof(ColumnSnapshot) + arrays + 2 * ((size_t)count + 1) * sizeof(int));
+    if (indexed == NULL) {
+        printf("Failed to allocate memory for the weight index of '%s'\n", record->name);
+        return 0;
+    }
+    *indexed = *columns;
+    if (owned) {
+        memcpy(indexed + 1, columns + 1, arrays);
+        indexed->weights = (int*)(indexed + 1);
+        indexed->valuations = (float*)(indexed->weights + count);
+        indexed->valuationOrder = (int*)(indexed->valuations + count);
+    }
+    indexed->eytzinger = (int*)((char*)(indexed + 1) + arrays);
+    indexed->eytzingerIndex = indexed->eytzinger + count + 1;
+    indexed->eytzinger[0] = INT_MIN;
+    indexed->eytzingerIndex[0] = count;
+    layOutEytzinger(indexed->weights, indexed->eytzinger, indexed->eytzingerIndex, 0, 1, count);
+    record->columns = indexed;
+    free(columns);
+    return 1;
+}
+
+/*
+ * FUNCTION: eytzingerLowerBound
+ * DESCRIPTION: Finds the first weight at or above a given one in the Eytzinger copy of a weight column.
+ *              Each step moves to child 2k or 2k + 1 by the comparison alone, with no branch to
+ *              mispredict, and prefetches the cache line holding the 16 descendants four levels down,
+ *              so the loads of several levels overlap. The search ends below a leaf; dropping the
+ *              trailing right turns and the last left turn leads back to the answer.
+ * PARAMETERS: ColumnSnapshot* columns - The columns, with eytzinger built.
+ *             int weight - The weight to search for.
+ * RETURNS: The index into weights of the first weight >= the given one, or count if there is none.
+ */
+int eytzingerLowerBound(ColumnSnapshot* columns, int weight) {
+    const int* tree = columns->eytzinger;
+    unsigned long long count = (unsigned long long)columns->count;
+    unsigned long long k = 1;
+    while (k <= count) {
+#ifdef HAVE_SSE2
+        _mm_prefetch((const char*)tree + 16 * k * sizeof(int), _MM_HINT_T0);
+#endif
+        k = 2 * k + (tree[k] < weight);
+    }
+#ifdef _MSC_VER
+    unsigned long ones;
+    _BitScanForward64(&ones, ~k);
+    k >>= ones + 1;
+#else
+    k >>= __builtin_ctzll(~k) + 1;
+#endif
+    return columns->eytzingerIndex[k];
+}
+
+/*
+ * FUNCTION: bitWidth
+ * DESCRIPTION: Counts the bits needed to store an unsigned value.
+ * PARAMETERS: unsigned int value - The value.
+ * RETURNS: The number of bits, 0 for 0.
+ */
+int bitWidth(unsigned int value) {
+    int width = 0;
+    while (value != 0) {
+        ++width;
+        value >>= 1;
+    }
+    return width;
+}
+
+/*
+ * FUNCTION: readBits
+ * DESCRIPTION: Reads a bit field that may straddle two words of a packed array.
+ * PARAMETERS: const unsigned long long* bits - The packed array; it needs a spare word at the end.
+ *             size_t position - The bit the field starts at.
+ *             int width - The width of the field, at most 32.
+ * RETURNS: The field.
+ */
+unsigned int readBits(const unsigned long long* bits, size_t position, int width) {
+    int shift = (int)(position & 63);
+    unsigned long long value = bits[position >> 6] >> shift;
+    if (shift + width > 64) {
+        value |= bits[(position >> 6) + 1] << (64 - shift);
+    }
+    return (unsigned int)(value & ((1ULL << width) - 1));
+}
+
+/*
+ * FUNCTION: writeBits
+ * DESCRIPTION: Stores a bit field that may straddle two words of a zeroed packed array.
+ * PARAMETERS: unsigned long long* bits - The packed array.
+ *             size_t position - The bit the field starts at.
+ *             int width - The width of the field, at most 32.
+ *             unsigned int value - The field, which must fit the width.
+ * RETURNS: None.
+ */
+void writeBits(unsigned long long* bits, size_t position, int width, unsigned int value) {
+    int shift = (int)(position & 63);
+    bits[position >> 6] |= (unsigned long long)value << shift;
+    if (shift + width > 64) {
+        bits[(position >> 6) + 1] |= (unsigned long long)value >> (64 - shift);
+    }
+}
+
+/*
+ * FUNCTION: valuationCents
+ * DESCRIPTION: Converts a valuation to whole cents when nothing is lost: the cents must fit an int and
+ *              turn back into the very same float (see centsValuation), as every valuation read with
+ *              at most two decimals does.
+ * PARAMETERS: float valuation - The valuation.
+ *             int* cents - Pointer to store the cents.
+ * RETURNS: 1 if the valuation is a whole number of cents, 0 otherwise.
+ */
+int valuationCents(float valuation, int* cents) {
+    double scaled = (double)valuation * 100.0;
+    if (!(scaled > -2147483647.0 && scaled < 2147483647.0)) {
+        return 0;
+    }
+    int rounded = (int)(scaled < 0.0 ? scaled - 0.5 : scaled + 0.5);
+    float restored = centsValuation(rounded);
+    if (memcmp(&restored, &valuation, sizeof(float)) != 0) {
+        return 0;
+    }
+    *cents = rounded;
+    return 1;
+}
+
+/*
+ * FUNCTION: centsValuation
+ * DESCRIPTION: Converts whole cents back to a valuation, rounding the way parseValuation does.
+ * PARAMETERS: int cents - The cents.
+ * RETURNS: The valuation.
+ */
+float centsValuation(int cents) {
+    return (float)(cents / 100.0);
+}
+
+/*
+ * FUNCTION: measurePackedBlock
+ * DESCRIPTION: Works out the first weight, the smallest valuation in cents and the field widths of one
+ *              block of compressed columns.
+ * PARAMETERS: ColumnSnapshot* columns - The uncompressed columns.
+ *             int first - The index of the block's first parcel.
+ *             int last - One past the index of its last parcel.
+ *             PackedBlock* block - The block header to fill, except for its start.
+ * RETURNS: 1 on success, 0 if a valuation is not a whole number of cents.
+ */
+int measurePackedBlock(ColumnSnapshot* columns, int first, int last, PackedBlock* block) {
+    unsigned int gaps = 0;
+    int minCents = INT_MAX;
+    int maxCents = INT_MIN;
+    for (int i = first; i < last; ++i) {
+        int cents;
+        if (!valuationCents(columns->valuations[i], &cents)) {
+            return 0;
+        }
+        minCents = cents < minCents ? cents : minCents;
+        maxCents = cents > maxCents ? cents : maxCents;
+        if (i > first) {
+            gaps |= (unsigned int)columns->weights[i] - (unsigned int)columns->weights[i - 1];  // As wide as the widest gap
+        }
+    }
+    block->firstWeight = columns->weights[first];
+    block->minCents = minCents;
+    block->weightBits = (unsigned char)bitWidth(gaps);
+    block->centsBits = (unsigned char)bitWidth((unsigned int)maxCents - (unsigned int)minCents);
+    return 1;
+}
+
+/*
+ * FUNCTION: packColumns
+ * DESCRIPTION: Compresses a country's columns. The parcels are cut into blocks of PACKED_BLOCK_SIZE in
+ *              weight order. A block keeps its first weight and the gap to each later one, bit-packed
+ *              as wide as the widest gap, and the valuations as whole cents above the block's smallest,
+ *              bit-packed likewise; the valuation order is bit-packed as wide as the largest index. A
+ *              country of a million parcels takes about 6 bytes a parcel instead of 12. The valuation
+ *              total is summed in cents, so it carries no float rounding.
+ * PARAMETERS: ColumnSnapshot* columns - The uncompressed columns.
+ * RETURNS: The compressed columns, in one allocation, or NULL if a valuation is not a whole number of
+ *          cents or on allocation failure.
+ */
+ColumnSnapshot* packColumns(ColumnSnapshot* columns) {
+    int count = columns->count;
+    int blockCount = (count + PACKED_BLOCK_SIZE - 1) / PACKED_BLOCK_SIZE;
+    int orderBits = bitWidth(count > 0 ? (unsigned int)count - 1 : 0);
+    size_t bitCount = (size_t)count * (size_t)orderBits;
+    for (int block = 0; block < blockCount; ++block) {
+        PackedBlock header;
+        int first = block * PACKED_BLOCK_SIZE;
+        int last = first + PACKED_BLOCK_SIZE < count ? first + PACKED_BLOCK_SIZE : count;
+        if (!measurePackedBlock(columns, first, last, &header)) {
+            return NULL;
+        }
+        bitCount += (size_t)(last - first - 1) * header.weightBits + (size_t)(last - first) * header.centsBits;
+    }
+
+    size_t wordCount = (bitCount + 63) / 64 + 1;  // The spare word lets readBits always read two
+    ColumnSnapshot* packed = (ColumnSnapshot*)calloc(1, sizeof(ColumnSnapshot) + (size_t)blockCount * sizeof(PackedBlock)
+                                                        + wordCount * sizeof(unsigned long long));
+    if (packed == NULL) {
+        printf("Failed to allocate memory for the compressed columns\n");
+        return NULL;
+    }
+    *packed = *columns;
+    packed->weights = NULL;
+    packed->valuations = NULL;
+    packed->valuationOrder = NULL;
+    packed->eytzinger = NULL;
+    packed->blocks = (PackedBlock*)(packed + 1);
+    packed->bits = (unsigned long long*)(packed->blocks + blockCount);
+    packed->orderBits = orderBits;
+
+    long long totalCents = 0;
+    size_t position = 0;
+    for (int block = 0; block < blockCount; ++block) {
+        PackedBlock* header = &packed->blocks[block];
+        int first = block * PACKED_BLOCK_SIZE;
+        int last = first + PACKED_BLOCK_SIZE < count ? first + PACKED_BLOCK_SIZE : count;
+        measurePackedBlock(columns, first, last, header);
+        header->start = position;
+        for (int i = first + 1; i < last; ++i, position += header->weightBits) {
+            writeBits(packed->bits, position, header->weightBits, (unsigned int)columns->weights[i] - (unsigned int)columns->weights[i - 1]);
+        }
+        for (int i = first; i < last; ++i, position += header->centsBits) {
+            int cents;
+            valuationCents(columns->valuations[i], &cents);
+            writeBits(packed->bits, position, header->centsBits, (unsigned int)cents - (unsigned int)header->minCents);
+            totalCents += cents;
+        }
+    }
+    packed->orderStart = position;
+    for (int i = 0; i < count; ++i, position += (size_t)orderBits) {
+        writeBits(packed->bits, position, orderBits, (unsigned int)columns->valuationOrder[i]);
+    }
+    packed->valuationSum = (double)totalCents / 100.0;
+    return packed;
+}
+
+/*
+ * FUNCTION: decodePackedBlock
+ * DESCRIPTION: Decodes the weights and valuations, in cents, of one block of compressed columns.
+ * PARAMETERS: ColumnSnapshot* columns - The compressed columns.
+ *             int block - The block to decode.
+ *             int* weights - Room for PACKED_BLOCK_SIZE weights, or NULL to skip them.
+ *             int* cents - Room for PACKED_BLOCK_SIZE valuations in cents, or NULL to skip them.
+ * RETURNS: The number of parcels in the block.
+ */
+int decodePackedBlock(ColumnSnapshot* columns, int block, int* weights, int* cents) {
+    PackedBlock* header = &columns->blocks[block];
+    int count = columns->count - block * PACKED_BLOCK_SIZE;
+    if (count > PACKED_BLOCK_SIZE) {
+        count = PACKED_BLOCK_SIZE;
+    }
+    size_t position = header->start;
+    if (weights != NULL) {
+        weights[0] = header->firstWeight;
+        for (int i = 1; i < count; ++i, position += header->weightBits) {
+            weights[i] = (int)((unsigned int)weights[i - 1] + readBits(columns->bits, position, header->weightBits));
+        }
+    }
+    else {
+        position += (size_t)(count - 1) * header->weightBits;
+    }
+    if (cents != NULL) {
+        for (int i = 0; i < count; ++i, position += header->centsBits) {
+            cents[i] = (int)((unsigned int)header->minCents + readBits(columns->bits, position, header->centsBits));
+        }
+    }
+    return count;
+}
+
+/*
+ * FUNCTION: readSpilledParcels
+ * DESCRIPTION: Reads consecutive parcels of a country's spilled columns through the page cache.
+ * PARAMETERS: ColumnSnapshot* columns - The spilled columns.
+ *             int first - The index of the first parcel, in weight order.
+ *             int count - The number of parcels.
+ *             ParcelRecord* parcels - Room for count parcels.
+ * RETURNS: 1 on success, 0 if the spill file cannot be read (see readSpill).
+ */
+int readSpilledParcels(ColumnSnapshot* columns, int first, int count, ParcelRecord* parcels) {
+    return readSpill(columns->spill, columns->spillParcels + (unsigned long long)first * sizeof(ParcelRecord), parcels, (size_t)count * sizeof(ParcelRecord));
+}
+
+/*
+ * FUNCTION: columnParcel
+ * DESCRIPTION: Reads the parcel at an index of a frozen country's columns, compressed, spilled or
+ *              not. In compressed columns the weight is the sum of the gaps before it in its block.
+ * PARAMETERS: ColumnSnapshot* columns - The columns.
+ *             int index - The index, in weight order.
+ *             int* weight - Pointer to store the weight.
+ *             float* valuation - Pointer to store the valuation.
+ * RETURNS: None.
+ */
+void columnParcel(ColumnSnapshot* columns, int index, int* weight, float* valuation) {
+    if (columns->spill != NULL) {
+        ParcelRecord parcel;
+        readSpilledParcels(columns, index, 1, &parcel);
+        *weight = parcel.weight;
+        *valuation = parcel.valuation;
+        return;
+    }
+    if (columns->blocks == NULL) {
+        *weight = columns->weights[index];
+        *valuation = columns->valuations[index];
+        return;
+    }
+    int block = index / PACKED_BLOCK_SIZE;
+    int offset = index % PACKED_BLOCK_SIZE;
+    int count = columns->count - block * PACKED_BLOCK_SIZE;
+    PackedBlock* header = &columns->blocks[block];
+    unsigned int sum = (unsigned int)header->firstWeight;
+    for (int i = 0; i < offset; ++i) {
+        sum += readBits(columns->bits, header->start + (size_t)i * header->weightBits, header->weightBits);
+    }
+    size_t position = header->start + (size_t)((count < PACKED_BLOCK_SIZE ? count : PACKED_BLOCK_SIZE) - 1) * header->weightBits
+                      + (size_t)offset * header->centsBits;
+    *weight = (int)sum;
+    *valuation = centsValuation((int)((unsigned int)header->minCents + readBits(columns->bits, position, header->centsBits)));
+}
+
+/*
+ * FUNCTION: columnOrderIndex
+ * DESCRIPTION: Reads an entry of a frozen country's valuation order, compressed, spilled or not.
+ * PARAMETERS: ColumnSnapshot* columns - The columns.
+ *             long long rank - The rank, from 0 for the cheapest parcel.
+ * RETURNS: The index of the parcel of that rank, in weight order.
+ */
+int columnOrderIndex(ColumnSnapshot* columns, long long rank) {
+    if (columns->spill != NULL) {
+        int index;
+        readSpill(columns->spill, columns->spillOrder + (unsigned long long)rank * sizeof(int), &index, sizeof(index));
+        return index;
+    }
+    if (columns->blocks == NULL) {
+        return columns->valuationOrder[rank];
+    }
+    return (int)readBits(columns->bits, columns->orderStart + (size_t)rank * (size_t)columns->orderBits, columns->orderBits);
+}
+
+/*
+ * FUNCTION: columnLowerBound
+ * DESCRIPTION: Finds the first parcel of a frozen country's columns at or above a weight, through the
+ *              Eytzinger copy of the weights when there is one. Compressed columns are searched by the
+ *              first weight of each block, and then within the one block the answer can lie in. Spilled columns are searched through the page cache, where the
+ *              first probes of every search stay cached.
+ * PARAMETERS: ColumnSnapshot* columns - The columns.
+ *             int weight - The weight to search for.
+ * RETURNS: The index of the first weight >= the given one, or count if there is none.
+ */
+int columnLowerBound(ColumnSnapshot* columns, int weight) {
+    if (columns->eytzinger != NULL) {
+        return eytzingerLowerBound(columns, weight);
+    }
+    if (columns->spill != NULL) {
+        int low = 0;
+        int high = columns->count;
+        while (low < high) {
+            int middle = low + (high - low) / 2;
+            ParcelRecord parcel;
+            readSpilledParcels(columns, middle, 1, &parcel);
+            if (parcel.weight < weight) {
+                low = middle + 1;
+            }
+            else {
+                high = middle;
+            }
+        }
+        return low;
+    }
+    if (columns->blocks == NULL) {
+        return lowerBoundWeight(columns->weights, columns->count, weight);
+    }
+    int low = 0;
+    int high = (columns->count + PACKED_BLOCK_SIZE - 1) / PACKED_BLOCK_SIZE;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (columns->blocks[middle].firstWeight < weight) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    if (low == 0) {
+        return 0;
+    }
+    int weights[PACKED_BLOCK_SIZE];
+    int count = decodePackedBlock(columns, low - 1, weights, NULL);
+    return (low - 1) * PACKED_BLOCK_SIZE + lowerBoundWeight(weights, count, weight);
+}
+
+/*
+ * FUNCTION: unpackColumns
+ * DESCRIPTION: Decodes compressed columns, or reads spilled ones, into plain arrays.
+ * PARAMETERS: ColumnSnapshot* columns - The compressed or spilled columns.
+ *             int* weights - Room for count weights.
+ *             float* valuations - Room for count valuations.
+ *             int* order - Room for count indices of the valuation order.
+ * RETURNS: 1 on success, 0 if spilled columns cannot be read.
+ */
+int unpackColumns(ColumnSnapshot* columns, int* weights, float* valuations, int* order) {
+    if (columns->spill != NULL) {
+        ParcelRecord parcels[PACKED_BLOCK_SIZE];
+        for (int first = 0; first < columns->count; first += PACKED_BLOCK_SIZE) {
+            int count = columns->count - first < PACKED_BLOCK_SIZE ? columns->count - first : PACKED_BLOCK_SIZE;
+            if (!readSpilledParcels(columns, first, count, parcels)) {
+                return 0;
+            }
+            for (int i = 0; i < count; ++i) {
+                weights[first + i] = parcels[i].weight;
+                valuations[first + i] = parcels[i].valuation;
+            }
+        }
+        return readSpill(columns->spill, columns->spillOrder, order, (size_t)columns->count * sizeof(int));
+    }
+    int cents[PACKED_BLOCK_SIZE];
+    for (int first = 0; first < columns->count; first += PACKED_BLOCK_SIZE) {
+        int count = decodePackedBlock(columns, first / PACKED_BLOCK_SIZE, weights + first, cents);
+        for (int i = 0; i < count; ++i) {
+            valuations[first + i] = centsValuation(cents[i]);
+        }
+    }
+    for (int i = 0; i < columns->count; ++i) {
+        order[i] = columnOrderIndex(columns, i);
+    }
+    return 1;
+}
+
+/*
+ * FUNCTION: buildColumnTrees
+ * DESCRIPTION: Builds both trees of a country from its columns, decoding compressed or spilled columns
+ *              first, e.g. for a country loaded from a binary snapshot that is about to be changed.
+ * PARAMETERS: ParcelPool* pool - The pool to allocate the nodes from.
+ *             Country* record - The country.
+ *             ColumnSnapshot* columns - Its columns.
+ *             Parcel** root - Pointer to store the root of the weight tree.
+ *             Parcel** valuationRoot - Pointer to store the root of the valuation tree.
+ * RETURNS: 1 on success, 0 on allocation failure or if spilled columns cannot be read (no trees are
+ *          then built).
+ */
+int buildColumnTrees(ParcelPool* pool, Country* record, ColumnSnapshot* columns, Parcel** root, Parcel** valuationRoot) {
+    int count = columns->count;
+    int* weights = columns->weights;
+    float* valuations = columns->valuations;
+    int* order = columns->valuationOrder;
+    if (weights == NULL) {
+        weights = (int*)malloc((size_t)count * (2 * sizeof(int) + sizeof(float)) + 1);
+        if (weights == NULL) {
+            return 0;
+        }
+        valuations = (float*)(weights + count);
+        order = (int*)(valuations + count);
+        if (!unpackColumns(columns, weights, valuations, order)) {
+            free(weights);
+            return 0;
+        }
+    }
+    *root = buildParcelTree(pool, record->id, weights, valuations, NULL, count);
+    *valuationRoot = buildParcelTree(pool, record->id, weights, valuations, order, count);
+    if (weights != columns->weights) {
+        free(weights);
+    }
+    return (*root != NULL && *valuationRoot != NULL) || count == 0;
+}
+
+/*
+ * FUNCTION: compactCountry
+ * DESCRIPTION: Freezes a country (see freezeCountry), compresses its columns (see packColumns) and
+ *              drops its trees, so its parcels are kept in the compressed columns alone and queries
+ *              decode the blocks they need as they go. A country whose valuations are not all whole
+ *              cents keeps uncompressed columns, and spilled columns stay as they are. The trees' nodes stay
+ *              in the pool until it frees its slabs.
+ * PARAMETERS: Country* record - The country to compact.
+ * RETURNS: 1 on success, 0 on allocation failure (the country then keeps its trees).
+ */
+int compactCountry(Country* record) {
+    if (!freezeCountry(record)) {
+        return 0;
+    }
+    ColumnSnapshot* columns = record->columns;
+    if (columns->weights != NULL) {
+        ColumnSnapshot* packed = packColumns(columns);
+        if (packed != NULL) {
+            record->columns = packed;
+            free(columns);
+        }
+    }
+    record->root = NULL;
+    record->valuationRoot = NULL;
+    return 1;
+}
+
+/*
+ * FUNCTION: findColumnParcel
+ * DESCRIPTION: Finds a parcel with the given weight and valuation in a frozen country's columns.
+ * PARAMETERS: ColumnSnapshot* columns - The country's columns.
+ *             int weight - The weight of the parcel.
+ *             float valuation - The valuation of the parcel.
+ * RETURNS: The index of the first such parcel, or -1 if there is none.
+ */
+int findColumnParcel(ColumnSnapshot* columns, int weight, float valuation) {
+    for (int i = columnLowerBound(columns, weight); i < columns->count; ++i) {
+        int found;
+        float foundValuation;
+        columnParcel(columns, i, &found, &foundValuation);
+        if (found != weight) {
+            break;
+        }
+        if (foundValuation == valuation) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * FUNCTION: thawCountry
+ * DESCRIPTION: Makes a country's trees the only copy of its parcels so they can be changed in place. A
+ *              country without trees, loaded from a binary snapshot or compacted, first gets both
+ *              rebuilt from its columns; the columns are then dropped, and queries use the trees until
+ *              the country is frozen again.
+ * PARAMETERS: ParcelPool* pool - The pool to allocate the nodes from.
+ *             Country* record - The country to thaw.
+ * RETURNS: 1 on success, 0 on allocation failure (the country is then unchanged).
+ */
+int thawCountry(ParcelPool* pool, Country* record) {
+    ColumnSnapshot* columns = record->columns;
+    if (columns == NULL) {
+        return 1;
+    }
+    if (record->root == NULL) {
+        Parcel* root;
+        Parcel* valuationRoot;
+        if (!buildColumnTrees(pool, record, columns, &root, &valuationRoot)) {
+            printf("Failed to rebuild the parcels of '%s'\n", record->name);
+            return 0;
+        }
+        record->root = root;
+        record->valuationRoot = valuationRoot;
+    }
+    record->columns = NULL;
+    free(columns);
+    return 1;
+}
+
+/*
+ * FUNCTION: parcelsChangeable
+ * DESCRIPTION: Tells whether parcels can be removed or changed. Both happen in place, so they are
+ *              refused while another thread may be walking the trees: when the input file is followed,
+ *              queries are served or the statistics are dumped periodically.
+ * PARAMETERS: HashTable* hashTable - The hash table to change.
+ * RETURNS: 1 if parcels can be changed, 0 otherwise.
+ */
+int parcelsChangeable(HashTable* hashTable) {
+    return hashTable->live == NULL && hashTable->dumper == NULL && !hashTable->serving;
+}
+
+/*
+ * FUNCTION: removeCountryParcel
+ * DESCRIPTION: Removes one parcel with the given weight and valuation from a country, from both of its
+ *              trees. The nodes go back to the pool's free list, so a long-running process that removes
+ *              as many parcels as it adds keeps a flat footprint. A frozen country is thawed first, but
+ *              only if it holds the parcel. See parcelsChangeable for when this may be called.
+ * PARAMETERS: ParcelPool* pool - The pool the country's nodes belong to.
+ *             Country* record - The country.
+ *             int weight - The weight of the parcel.
+ *             float valuation - The valuation of the parcel.
+ * RETURNS: 1 if the parcel was removed, 0 if the country holds no such parcel, -1 on allocation failure.
+ */
+int removeCountryParcel(ParcelPool* pool, Country* record, int weight, float valuation) {
+    if (record->columns != NULL && findColumnParcel(record->columns, weight, valuation) < 0) {
+        return 0;
+    }
+    if (!thawCountry(pool, record)) {
+        return -1;
+    }
+    Parcel* root = record->root;
+    if (!removeParcel(pool, &root, weight, valuation, WEIGHT_ORDER)) {
+        return 0;
+    }
+    record->root = root;
+    Parcel* valuationRoot = record->valuationRoot;
+    removeParcel(pool, &valuationRoot, weight, valuation, VALUATION_ORDER);
+    record->valuationRoot = valuationRoot;
+    record->version.fetch_add(1);
+    return 1;
+}
+
+/*
+ * FUNCTION: replaceCountryParcel
+ * DESCRIPTION: Changes the weight and valuation of one parcel of a country in both of its trees (see
+ *              replaceParcel). A frozen country is thawed first, but only if it holds the parcel. See
+ *              parcelsChangeable for when this may be called.
+ * PARAMETERS: ParcelPool* pool - The pool the country's nodes belong to.
+ *             Country* record - The country.
+ *             int weight - The weight of the parcel.
+ *             float valuation - The valuation of the parcel.
+ *             int newWeight - The weight to give it.
+ *             float newValuation - The valuation to give it.
+ * RETURNS: 1 if the parcel was changed, 0 if the country holds no such parcel, -1 on allocation failure.
+ */
+int replaceCountryParcel(ParcelPool* pool, Country* record, int weight, float valuation, int newWeight, float newValuation) {
+    if (record->columns != NULL && findColumnParcel(record->columns, weight, valuation) < 0) {
+        return 0;
+    }
+    if (!thawCountry(pool, record)) {
+        return -1;
+    }
+    Parcel* root = record->root;
+    if (!replaceParcel(pool, &root, record->id, weight, valuation, newWeight, newValuation, WEIGHT_ORDER)) {
+        return 0;
+    }
+    record->root = root;
+    Parcel* valuationRoot = record->valuationRoot;
+    replaceParcel(pool, &valuationRoot, record->id, weight, valuation, newWeight, newValuation, VALUATION_ORDER);
+    record->valuationRoot = valuationRoot;
+    record->version.fetch_add(1);
+    return 1;
+}
+
+/*
+ * FUNCTION: columnRangeBounds
+ * DESCRIPTION: Maps a closed weight range onto the index range of a frozen country's weight column.
+ * PARAMETERS: ColumnSnapshot* columns - The country's columns.
+ *             int minWeight - The smallest weight included.
+ *             int maxWeight - The largest weight included.
+ *             int* first - Pointer to store the first index in range.
+ *             int* last - Pointer to store one past the last index in range.
+ * RETURNS: None.
+ */
+void columnRangeBounds(ColumnSnapshot* columns, int minWeight, int maxWeight, int* first, int* last) {
+    *first = minWeight == INT_MIN ? 0 : columnLowerBound(columns, minWeight);
+    *last = maxWeight == INT_MAX ? columns->count : columnLowerBound(columns, maxWeight + 1);
+    if (*last < *first) {
+        *last = *first;
+    }
+}
+
+/*
+ * FUNCTION: visitCountryParcels
+ * DESCRIPTION: Calls a visitor for each parcel of a country in a closed weight range, in weight order,
+ *              with LIMIT/OFFSET-style paging. Frozen countries are read straight from their columns,
+ *              others through a tree iterator; spilled columns are paged in only where the page lies,
+ *              and the walk stops at a block of them that cannot be read.
+ * PARAMETERS: Country* record - The country to visit.
+ *             int minWeight - The smallest weight to visit.
+ *             int maxWeight - The largest weight to visit.
+ *             long long offset - The number of matching parcels to skip.
+ *             long long limit - The maximum number of parcels to visit, -1 for no limit.
+ *             ParcelRecordVisitor visit - The function called for each parcel; returning 0 stops the walk.
+ *             void* context - Passed through to the visitor.
+ * RETURNS: The number of parcels visited.
+ */
+long long visitCountryParcels(Country* record, int minWeight, int maxWeight, long long offset, long long limit, ParcelRecordVisitor visit, void* context) {
+    ColumnSnapshot* columns = record->columns;
+    long long visited = 0;
+    if (minWeight > maxWeight) {
+        return 0;
+    }
+
+    if (columns == NULL) {
+        ParcelIterator iterator;
+        initParcelIterator(&iterator, record->root, minWeight, maxWeight, offset, limit);
+        for (Parcel* parcel = nextParcel(&iterator); parcel != NULL; parcel = nextParcel(&iterator)) {
+            ++visited;
+            if (!visit(record, parcel->weight, parcel->valuation, context)) {
+                break;
+            }
+        }
+        addStatCounter(STAT_NODES_VISITED, iterator.visited);
+        addStatCounter(STAT_ROWS_OUTPUT, visited);
+        return visited;
+    }
+
+    int first;
+    int last;
+    columnRangeBounds(columns, minWeight, maxWeight, &first, &last);
+    long long start = first + (offset > 0 ? offset : 0);
+    long long end = limit >= 0 && start + limit < last ? start + limit : last;
+    int weights[PACKED_BLOCK_SIZE];
+    int cents[PACKED_BLOCK_SIZE];
+    ParcelRecord parcels[PACKED_BLOCK_SIZE];
+    for (long long i = start; i < end; ++i) {
+        int weight;
+        float valuation;
+        if (columns->spill != NULL) {
+            // Spilled columns are read PACKED_BLOCK_SIZE parcels at a time through the page cache
+            if ((i - start) % PACKED_BLOCK_SIZE == 0
+                && !readSpilledParcels(columns, (int)i, end - i < PACKED_BLOCK_SIZE ? (int)(end - i) : PACKED_BLOCK_SIZE, parcels)) {
+                break;
+            }
+            weight = parcels[(i - start) % PACKED_BLOCK_SIZE].weight;
+            valuation = parcels[(i - start) % PACKED_BLOCK_SIZE].valuation;
+        }
+        else if (columns->blocks == NULL) {
+            weight = columns->weights[i];
+            valuation = columns->valuations[i];
+        }
+        else {
+            // Compressed columns are decoded a block at a time as the walk reaches it
+            if (i == start || i % PACKED_BLOCK_SIZE == 0) {
+                decodePackedBlock(columns, (int)(i / PACKED_BLOCK_SIZE), weights, cents);
+            }
+            weight = weights[i % PACKED_BLOCK_SIZE];
+            valuation = centsValuation(cents[i % PACKED_BLOCK_SIZE]);
+        }
+        ++visited;
+        if (!visit(record, weight, valuation, context)) {
+            break;
+        }
+    }
+    addStatCounter(STAT_COLUMN_VALUES, visited);
+    addStatCounter(STAT_ROWS_OUTPUT, visited);
+    return visited;
+}
+
+/*
+ * FUNCTION: printCountryParcels
+ * DESCRIPTION: Prints a page of a country's parcels in a closed weight range, in weight order.
+ * PARAMETERS: HashTable* hashTable - The hash table the country belongs to.
+ *             Country* record - The country to print.
+ *             int minWeight - The smallest weight to print.
+ *             int maxWeight - The largest weight to print.
+ *             long long offset - The number of matching parcels to skip.
+ *             long long limit - The maximum number of parcels to print, -1 for no limit.
+ * RETURNS: The number of parcels printed.
+ */
+long long printCountryParcels(HashTable* hashTable, Country* record, int minWeight, int maxWeight, long long offset, long long limit) {
+    return visitCountryParcels(record, minWeight, maxWeight, offset, limit, printParcelVisitor, hashTable);
+}
+
+/*
+ * FUNCTION: scanPackedColumns
+ * DESCRIPTION: Computes the totals and the positions of the cheapest and most expensive parcel of a
+ *              slice of compressed columns, like scanColumns, decoding one block at a time. The
+ *              valuations are summed in whole cents, so the total is exact.
+ * PARAMETERS: Fields - The requested ParcelSummaryField values; the others are not computed.
+ *             ColumnSnapshot* columns - The compressed columns.
+ *             int first - The first index of the slice.
+ *             int last - One past the last index of the slice.
+ *             long long* weightSum - Pointer to store the total weight.
+ *             double* valuationSum - Pointer to store the total valuation.
+ *             int* cheapest - Pointer to store the index of the first cheapest parcel.
+ *             int* mostExpensive - Pointer to store the index of the first most expensive parcel.
+ * RETURNS: None.
+ */
+template <unsigned Fields>
+void scanPackedColumns(ColumnSnapshot* columns, int first, int last, long long* weightSum, double* valuationSum, int* cheapest, int* mostExpensive) {
+    const int needsCents = (Fields & (SUMMARY_VALUATION_SUM | SUMMARY_CHEAPEST | SUMMARY_MOST_EXPENSIVE)) != 0;
+    int weights[PACKED_BLOCK_SIZE];
+    int cents[PACKED_BLOCK_SIZE];
+    long long weightTotal = 0;
+    long long centsTotal = 0;
+    int minCents = INT_MAX;
+    int maxCents = INT_MIN;
+    for (int block = first / PACKED_BLOCK_SIZE; block * PACKED_BLOCK_SIZE < last; ++block) {
+        int blockStart = block * PACKED_BLOCK_SIZE;
+        decodePackedBlock(columns, block, Fields & SUMMARY_WEIGHT_SUM ? weights : NULL, needsCents ? cents : NULL);
+        int from = first > blockStart ? first - blockStart : 0;
+        int to = last < blockStart + PACKED_BLOCK_SIZE ? last - blockStart : PACKED_BLOCK_SIZE;
+        for (int i = from; i < to; ++i) {
+            if (Fields & SUMMARY_WEIGHT_SUM) {
+                weightTotal += weights[i];
+            }
+            if (Fields & SUMMARY_VALUATION_SUM) {
+                centsTotal += cents[i];
+            }
+            if ((Fields & SUMMARY_CHEAPEST) && cents[i] < minCents) {
+                minCents = cents[i];
+                *cheapest = blockStart + i;
+            }
+            if ((Fields & SUMMARY_MOST_EXPENSIVE) && cents[i] > maxCents) {
+                maxCents = cents[i];
+                *mostExpensive = blockStart + i;
+            }
+        }
+    }
+    *weightSum = weightTotal;
+    *valuationSum = (double)centsTotal / 100.0;
+}
+
+/*
+ * FUNCTION: scanSpilledColumns
+ * DESCRIPTION: Computes the totals and the positions of the cheapest and most expensive parcel of a
+ *              slice of spilled columns, like scanColumns, reading them through the page cache a piece at
+ *              a time and running scanColumns on each piece. The scan stops at a piece that cannot be
+ *              read, which leaves the spill store failed (see spillFailed).
+ * PARAMETERS: Fields - The requested ParcelSummaryField values; the others are not computed.
+ *             ColumnSnapshot* columns - The spilled columns.
+ *             int first - The first index of the slice.
+ *             int last - One past the last index of the slice.
+ *             long long* weightSum - Pointer to store the total weight.
+ *             double* valuationSum - Pointer to store the total valuation.
+ *             int* cheapest - Pointer to store the index of the first cheapest parcel.
+ *             int* mostExpensive - Pointer to store the index of the first most expensive parcel.
+ * RETURNS: None.
+ */
+template <unsigned Fields>
+void scanSpilledColumns(ColumnSnapshot* columns, int first, int last, long long* weightSum, double* valuationSum, int* cheapest, int* mostExpensive) {
+    const int pieceSize = SPILL_PAGE_SIZE / 8 / (int)sizeof(ParcelRecord);
+    ParcelRecord parcels[pieceSize];
+    int weights[pieceSize];
+    float valuations[pieceSize];
+    long long weightTotal = 0;
+    double valuationTotal = 0.0;
+    float low = 0.0f;
+    float high = 0.0f;
+    for (int start = first; start < last; start += pieceSize) {
+        int count = last - start < pieceSize ? last - start : pieceSize;
+        if (!readSpilledParcels(columns, start, count, parcels)) {
+            break;
+        }
+        for (int i = 0; i < count; ++i) {
+            weights[i] = parcels[i].weight;
+            valuations[i] = parcels[i].valuation;
+        }
+        long long pieceWeight = 0;
+        double pieceValuation = 0.0;
+        int pieceLow = 0;
+        int pieceHigh = 0;
+        scanColumns<Fields>(weights, valuations, count, &pieceWeight, &pieceValuation, &pieceLow, &pieceHigh);
+        weightTotal += pieceWeight;
+        valuationTotal += pieceValuation;
+        if ((Fields & SUMMARY_CHEAPEST) && (start == first || valuations[pieceLow] < low)) {
+            low = valuations[pieceLow];
+            *cheapest = start + pieceLow;
+        }
+        if ((Fields & SUMMARY_MOST_EXPENSIVE) && (start == first || valuations[pieceHigh] > high)) {
+            high = valuations[pieceHigh];
+            *mostExpensive = start + pieceHigh;
+        }
+    }
+    *weightSum = weightTotal;
+    *valuationSum = valuationTotal;
+}
+
+/*
+ * FUNCTION: summarizeColumns
+ * DESCRIPTION: Computes the requested fields of a summary of a slice of a frozen country's columns. The
+ *              whole column is answered from the totals and extremes computed when it was frozen, any
+ *              other slice with a single scanColumns pass, or scanPackedColumns for compressed columns and
+ *              scanSpilledColumns for spilled ones.
+ * PARAMETERS: Fields - The requested ParcelSummaryField values; SUMMARY_MEANS is ignored here.
+ *             ColumnSnapshot* columns - The country's columns.
+ *             int first - The first index of the slice.
+ *             int last - One past the last index of the slice.
+ *             ParcelSummary* summary - The zeroed summary to fill.
+ * RETURNS: None.
+ */
+template <unsigned Fields>
+void summarizeColumns(ColumnSnapshot* columns, int first, int last, ParcelSummary* summary) {
+    summary->count = last - first;
+    if (last <= first) {
+        return;
+    }
+    long long weightSum = columns->weightSum;
+    double valuationSum = columns->valuationSum;
+    int cheapest = columns->minValuationIndex;
+    int mostExpensive = columns->maxValuationIndex;
+    if ((first != 0 || last != columns->count) && columns->spill != NULL) {
+        addStatCounter(STAT_COLUMN_VALUES, last - first);
+        scanSpilledColumns<Fields>(columns, first, last, &weightSum, &valuationSum, &cheapest, &mostExpensive);
+    }
+    else if ((first != 0 || last != columns->count) && columns->blocks != NULL) {
+        addStatCounter(STAT_COLUMN_VALUES, last - first);
+        scanPackedColumns<Fields>(columns, first, last, &weightSum, &valuationSum, &cheapest, &mostExpensive);
+    }
+    else if (first != 0 || last != columns->count) {
+        addStatCounter(STAT_COLUMN_VALUES, last - first);
+        scanColumns<Fields>(columns->weights + first, columns->valuations + first, last - first, &weightSum, &valuationSum, &cheapest, &mostExpensive);
+        cheapest += first;
+        mostExpensive += first;
+    }
+    if (Fields & SUMMARY_WEIGHT_SUM) {
+        summary->weightSum = weightSum;
+    }
+    if (Fields & SUMMARY_VALUATION_SUM) {
+        summary->valuationSum = valuationSum;
+    }
+    int found[4] = { cheapest, mostExpensive, first, last - 1 };
+    for (int extreme = CHEAPEST_PARCEL; extreme <= HEAVIEST_PARCEL; ++extreme) {
+        if (Fields & (SUMMARY_CHEAPEST << extreme)) {
+            int weight;
+            float valuation;
+            columnParcel(columns, found[extreme], &weight, &valuation);
+            setSummaryParcel(summary, extreme, weight, valuation);
+        }
+    }
+}
+
+/*
+ * FUNCTION: summarizeCountry
+ * DESCRIPTION: Computes any combination of parcel count, total load and valuation, their means, and the
+ *              cheapest, most expensive, lightest and heaviest parcel of a country in a closed weight
+ *              range, all in one pass: a single descent of the tree (see summarizeWeightRange) or a
+ *              single scan of a frozen country's column slice (see summarizeColumns). The fields are a
+ *              template parameter, so each combination gets its own code with no test of which fields
+ *              were asked for. Must be called inside a read section, on a pinned country.
+ * PARAMETERS: Fields - The requested ParcelSummaryField values.
+ *             Country* record - The country to summarize.
+ *             int minWeight - The smallest weight included.
+ *             int maxWeight - The largest weight included.
+ *             ParcelSummary* summary - Pointer to store the result.
+ * RETURNS: None.
+ */
+template <unsigned Fields>
+void summarizeCountry(Country* record, int minWeight, int maxWeight, ParcelSummary* summary) {
+    const unsigned computed = Fields & SUMMARY_MEANS ? Fields | SUMMARY_WEIGHT_SUM | SUMMARY_VALUATION_SUM : Fields;
+    memset(summary, 0, sizeof(ParcelSummary));
+    if (minWeight > maxWeight) {
+        return;
+    }
+
+    ColumnSnapshot* columns = record->columns;
+    if (columns == NULL) {
+        summarizeWeightRange<computed>(record->root, minWeight, maxWeight, summary);
+    }
+    else {
+        int first;
+        int last;
+        columnRangeBounds(columns, minWeight, maxWeight, &first, &last);
+        summarizeColumns<computed>(columns, first, last, summary);
+    }
+    if ((Fields & SUMMARY_MEANS) && summary->count > 0) {
+        summary->meanWeight = (double)summary->weightSum / (double)summary->count;
+        summary->meanValuation = summary->valuationSum / (double)summary->count;
+    }
+}
+
+/*
+ * FUNCTION: createQueryCache
+ * DESCRIPTION: Creates an empty query result cache (see summarizeCountryCached). The entries are split
+ *              evenly between QUERY_CACHE_SHARDS shards, each with its own lock and clock. Keys are
+ *              spread over the shards by their hash, so concurrent queries rarely wait for each other
+ *              and one busy country can still fill the whole cache.
+ * PARAMETERS: int capacity - The number of summaries it keeps.
+ * RETURNS: The cache, or NULL on allocation failure (queries are then answered without one).
+ */
+QueryCache* createQueryCache(int capacity) {
+    QueryCache* cache = new QueryCache();
+    int shardCapacity = (capacity + QUERY_CACHE_SHARDS - 1) / QUERY_CACHE_SHARDS;
+    int failed = 0;
+    for (int s = 0; s < QUERY_CACHE_SHARDS; ++s) {
+        QueryCacheShard* shard = &cache->shards[s];
+        shard->entries = (QueryCacheEntry*)malloc((size_t)shardCapacity * sizeof(QueryCacheEntry));
+        shard->buckets = (int*)malloc((size_t)shardCapacity * sizeof(int));
+        shard->capacity = shardCapacity;
+        shard->hand = 0;
+        if (shard->entries == NULL || shard->buckets == NULL) {
+            failed = 1;
+            continue;
+        }
+        for (int i = 0; i < shardCapacity; ++i) {
+            shard->entries[i].countryId = -1;
+            shard->entries[i].referenced = 0;
+            shard->entries[i].next = -1;
+            shard->buckets[i] = -1;
+        }
+    }
+    if (failed) {
+        printf("Failed to allocate memory for the query cache\n");
+        freeQueryCache(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+/*
+ * FUNCTION: freeQueryCache
+ * DESCRIPTION: Frees a query result cache.
+ * PARAMETERS: QueryCache* cache - The cache, may be NULL.
+ * RETURNS: None.
+ */
+void freeQueryCache(QueryCache* cache) {
+    if (cache == NULL) {
+        return;
+    }
+    for (int s = 0; s < QUERY_CACHE_SHARDS; ++s) {
+        free(cache->shards[s].entries);
+        free(cache->shards[s].buckets);
+    }
+    delete cache;
+}
+
+/*
+ * FUNCTION: queryCacheHash
+ * DESCRIPTION: Hashes the key of a cached summary. The key's shard is the hash modulo
+ *              QUERY_CACHE_SHARDS; its bucket in the shard comes from the rest (see queryCacheBucket).
+ * PARAMETERS: int countryId - The country's id.
+ *             unsigned fields - The SummaryField flags.
+ *             int minWeight - The smallest weight included.
+ *             int maxWeight - The largest weight included.
+ * RETURNS: The hash.
+ */
+unsigned long long queryCacheHash(int countryId, unsigned fields, int minWeight, int maxWeight) {
+    unsigned long long key = ((unsigned long long)(unsigned)countryId << 32 | fields) * 0x9E3779B97F4A7C15ULL;
+    key ^= (unsigned long long)(unsigned)minWeight << 32 | (unsigned)maxWeight;
+    key *= 0x9E3779B97F4A7C15ULL;
+    return key >> 32;
+}
+
+/*
+ * FUNCTION: queryCacheBucket
+ * DESCRIPTION: Finds the bucket of a cached summary in its shard.
+ * PARAMETERS: QueryCacheShard* shard - The key's shard.
+ *             unsigned long long hash - The key's hash (see queryCacheHash).
+ * RETURNS: The bucket index.
+ */
+int queryCacheBucket(QueryCacheShard* shard, unsigned long long hash) {
+    return (int)(hash / QUERY_CACHE_SHARDS % (unsigned long long)shard->capacity);
+}
+
+/*
+ * FUNCTION: lookupQueryCache
+ * DESCRIPTION: Looks for the summary of a query in the cache. An entry computed for an older version of
+ *              the country no longer matches, so a change to a country's parcels invalidates exactly
+ *              its own entries; they are overwritten when the query is next stored, or replaced by the
+ *              clock. Safe to call from several threads at once; only the key's shard is locked.
+ * PARAMETERS: QueryCache* cache - The cache.
+ *             Country* record - The country, as pinned for the query.
+ *             unsigned fields - The SummaryField flags requested.
+ *             int minWeight - The smallest weight included.
+ *             int maxWeight - The largest weight included.
+ *             ParcelSummary* summary - Pointer to store the cached summary.
+ * RETURNS: 1 if the summary was found, 0 otherwise.
+ */
+int lookupQueryCache(QueryCache* cache, Country* record, unsigned fields, int minWeight, int maxWeight, ParcelSummary* summary) {
+    unsigned long version = record->version.load();
+    unsigned long long hash = queryCacheHash(record->id, fields, minWeight, maxWeight);
+    QueryCacheShard* shard = &cache->shards[hash % QUERY_CACHE_SHARDS];
+    std::lock_guard<std::mutex> guard(shard->lock);
+    for (int i = shard->buckets[queryCacheBucket(shard, hash)]; i >= 0; i = shard->entries[i].next) {
+        QueryCacheEntry* entry = &shard->entries[i];
+        if (entry->countryId == record->id && entry->fields == fields && entry->minWeight == minWeight
+            && entry->maxWeight == maxWeight && entry->version == version) {
+            entry->referenced = 1;
+            *summary = entry->summary;
+            addStatCounter(STAT_QUERY_CACHE_HITS, 1);
+            return 1;
+        }
+    }
+    addStatCounter(STAT_QUERY_CACHE_MISSES, 1);
+    return 0;
+}
+
+/*
+ * FUNCTION: storeQueryCache
+ * DESCRIPTION: Adds the summary of a query to the cache. An entry with the same key, computed for an
+ *              older version of the country, is overwritten; otherwise the clock hand sweeps past the
+ *              entries hit since it last passed, clearing their mark, and replaces the first unmarked
+ *              one. Safe to call from several threads at once; only the key's shard is locked.
+ * PARAMETERS: QueryCache* cache - The cache.
+ *             Country* record - The country, as pinned for the query.
+ *             unsigned long version - The country's version read before the summary was computed.
+ *             unsigned fields - The SummaryField flags computed.
+ *             int minWeight - The smallest weight included.
+ *             int maxWeight - The largest weight included.
+ *             ParcelSummary* summary - The summary.
+ * RETURNS: None.
+ */
+void storeQueryCache(QueryCache* cache, Country* record, unsigned long version, unsigned fields, int minWeight, int maxWeight, ParcelSummary* summary) {
+    unsigned long long hash = queryCacheHash(record->id, fields, minWeight, maxWeight);
+    QueryCacheShard* shard = &cache->shards[hash % QUERY_CACHE_SHARDS];
+    int* bucket = &shard->buckets[queryCacheBucket(shard, hash)];
+    std::lock_guard<std::mutex> guard(shard->lock);
+    QueryCacheEntry* entry = NULL;
+    for (int i = *bucket; i >= 0; i = shard->entries[i].next) {
+        QueryCacheEntry* candidate = &shard->entries[i];
+        if (candidate->countryId == record->id && candidate->fields == fields && candidate->minWeight == minWeight
+            && candidate->maxWeight == maxWeight) {
+            entry = candidate;
+            break;
+        }
+    }
+
+    if (entry == NULL) {
+        while (shard->entries[shard->hand].referenced) {
+            shard->entries[shard->hand].referenced = 0;
+            shard->hand = (shard->hand + 1) % shard->capacity;
+        }
+        int victim = shard->hand;
+        shard->hand = (shard->hand + 1) % shard->capacity;
+        entry = &shard->entries[victim];
+        if (entry->countryId >= 0) {
+            int* link = &shard->buckets[queryCacheBucket(shard, queryCacheHash(entry->countryId, entry->fields, entry->minWeight, entry->maxWeight))];
+            while (*link != victim) {
+                link = &shard->entries[*link].next;
+            }
+            *link = entry->next;
+        }
+        entry->countryId = record->id;
+        entry->fields = fields;
+        entry->minWeight = minWeight;
+        entry->maxWeight = maxWeight;
+        entry->next = *bucket;
+        *bucket = victim;
+    }
+    else if (entry->version > version) {
+        return;  // A concurrent query already stored a newer summary
+    }
+    entry->version = version;
+    entry->referenced = 0;
+    entry->summary = *summary;
+}
+
+/*
+ * FUNCTION: summarizeCountryCached
+ * DESCRIPTION: Answers summarizeCountry through the table's query cache, if it has one, so a repeated
+ *              totals, extremes or weight threshold query costs a lookup until the country changes.
+ *              The version is read from the pinned view, which holds at least that version's parcels,
+ *              so a summary is never filed under a version newer than the parcels it was computed from.
+ *              A frozen country's whole range is summarized from its precomputed totals faster than
+ *              the cache could be looked up, so that query bypasses the cache.
+ * PARAMETERS: Fields - The SummaryField flags to compute.
+ *             HashTable* hashTable - The hash table the country belongs to.
+ *             Country* record - The country, as pinned for the query.
+ *             int minWeight - The smallest weight included.
+ *             int maxWeight - The largest weight included.
+ *             ParcelSummary* summary - Pointer to store the result.
+ * RETURNS: None.
+ */
+template <unsigned Fields>
+void summarizeCountryCached(HashTable* hashTable, Country* record, int minWeight, int maxWeight, ParcelSummary* summary) {
+    QueryCache* cache = hashTable->cache;
+    if (cache == NULL || (record->columns != NULL && minWeight == INT_MIN && maxWeight == INT_MAX)) {
+        summarizeCountry<Fields>(record, minWeight, maxWeight, summary);
+        return;
+    }
+    if (!lookupQueryCache(cache, record, Fields, minWeight, maxWeight, summary)) {
+        summarizeCountry<Fields>(record, minWeight, maxWeight, summary);
+        if (spillFailed(hashTable)) {
+            return;
+        }
+        storeQueryCache(cache, record, record->version.load(), Fields, minWeight, maxWeight, summary);
+    }
+}
+
+/*
+ * FUNCTION: summarizeWeightCondition
+ * DESCRIPTION: Computes the count, total load, total valuation and valuation range of a country's parcels
+ *              that are heavier or lighter than a weight, matching the condition used by
+ *              printParcelsWithCondition.
+ * PARAMETERS: HashTable* hashTable - The hash table the country belongs to, for its query cache.
+ *             Country* record - The country to summarize.
+ *             int weight - The weight to compare against.
+ *             int condition - The condition (1 for higher, 0 for lower).
+ *             ParcelSummary* summary - Pointer to store the result.
+ * RETURNS: None.
+ */
+void summarizeWeightCondition(HashTable* hashTable, Country* record, int weight, int condition, ParcelSummary* summary) {
+    int minWeight;
+    int maxWeight;
+    int nonEmpty = condition == 1 ? weightRangeBounds(weight, 0, INT_MAX, 1, &minWeight, &maxWeight)
+                                  : weightRangeBounds(INT_MIN, 1, weight, 0, &minWeight, &maxWeight);
+    if (!nonEmpty) {
+        minWeight = 1;
+        maxWeight = 0;
+    }
+    summarizeCountryCached<SUMMARY_WEIGHT_SUM | SUMMARY_VALUATION_SUM | SUMMARY_CHEAPEST | SUMMARY_MOST_EXPENSIVE>(hashTable, record, minWeight, maxWeight, summary);
+}
+
+/*
+ * FUNCTION: printCountryParcel
+ * DESCRIPTION: Prints the cheapest, most expensive, lightest or heaviest parcel of a country from its
+ *              summary.
+ * PARAMETERS: HashTable* hashTable - The hash table the country belongs to.
+ *             Country* record - The country summarized.
+ *             ParcelSummary* summary - The country's summary, with the extreme requested.
+ *             int extreme - Which parcel to print (a ParcelExtreme value).
+ * RETURNS: None.
+ */
+void printCountryParcel(HashTable* hashTable, Country* record, ParcelSummary* summary, int extreme) {
+    if (summary->count > 0) {
+        printParcelFields(hashTable, record->id, summary->extremes[extreme].weight, summary->extremes[extreme].valuation);
+    }
+    else {
+        printParcel(hashTable, NULL);
+    }
+}
+
+/*
+ * FUNCTION: printCountrySummary
+ * DESCRIPTION: Prints a full summary of a country: parcel count, totals, means and the four extreme
+ *              parcels.
+ * PARAMETERS: HashTable* hashTable - The hash table the country belongs to.
+ *             Country* record - The country summarized.
+ *             ParcelSummary* summary - The country's summary, with every field requested.
+ * RETURNS: None.
+ */
+void printCountrySummary(HashTable* hashTable, Country* record, ParcelSummary* summary) {
+    static const char* headings[4] = { "Cheapest Parcel:", "Most Expensive Parcel:", "Lightest Parcel:", "Heaviest Parcel:" };
+    printf("Parcels: %lld, Total Load: %lld, Total Valuation: %.2f\n", summary->count, summary->weightSum, summary->valuationSum);
+    printf("Mean Weight: %.2f, Mean Valuation: %.2f\n", summary->meanWeight, summary->meanValuation);
+    for (int extreme = CHEAPEST_PARCEL; extreme <= HEAVIEST_PARCEL; ++extreme) {
+        printf("%s\n", headings[extreme]);
+        printCountryParcel(hashTable, record, summary, extreme);
+    }
+}
+
+/*
+ * FUNCTION: countCountryParcels
+ * DESCRIPTION: Returns the number of parcels of a country.
+ * PARAMETERS: Country* record - The country to count.
+ * RETURNS: The number of parcels.
+ */
+long long countCountryParcels(Country* record) {
+    ColumnSnapshot* columns = record->columns;
+    Parcel* root = record->root;
+    return columns ? columns->count : root ? root->count : 0;
+}
+
+/*
+ * FUNCTION: percentileRank
+ * DESCRIPTION: Converts a percentile into the rank of the parcel at it, by the nearest-rank method: the
+ *              p-th percentile is the cheapest parcel that at least p percent of the parcels are no more
+ *              expensive than.
+ * PARAMETERS: long long count - The number of parcels.
+ *             double percentile - The percentile, from 0 to 100.
+ * RETURNS: The rank, from 0 for the cheapest parcel.
+ */
+long long percentileRank(long long count, double percentile) {
+    long long rank = (long long)ceil(percentile / 100.0 * (double)count) - 1;
+    return rank < 0 ? 0 : rank < count ? rank : count - 1;
+}
+
+/*
+ * FUNCTION: findValuationRank
+ * DESCRIPTION: Finds a country's parcel of a given rank by valuation, from the valuation order of a
+ *              frozen country or by selecting it in the valuation tree, in O(log n) steps.
+ * PARAMETERS: Country* record - The country to search.
+ *             long long rank - The rank, from 0 for the cheapest parcel.
+ *             ParcelRecord* found - Pointer to store the parcel's weight and valuation.
+ * RETURNS: 1 if the country has a parcel of that rank, 0 otherwise.
+ */
+int findValuationRank(Country* record, long long rank, ParcelRecord* found) {
+    if (rank < 0 || rank >= countCountryParcels(record)) {
+        return 0;
+    }
+    ColumnSnapshot* columns = record->columns;
+    if (columns != NULL) {
+        columnParcel(columns, columnOrderIndex(columns, rank), &found->weight, &found->valuation);
+        return 1;
+    }
+    Parcel* parcel = selectParcel(record->valuationRoot, rank);
+    if (parcel == NULL) {
+        return 0;
+    }
+    found->weight = parcel->weight;
+    found->valuation = parcel->valuation;
+    return 1;
+}
+
+/*
+ * FUNCTION: visitByValuation
+ * DESCRIPTION: Calls a visitor for a country's parcels in order of valuation, cheapest first or most
+ *              expensive first, with LIMIT/OFFSET-style paging. Reaching the first parcel takes
+ *              O(log n) steps, so the top K parcels cost O(log n + K).
+ * PARAMETERS: Country* record - The country to visit.
+ *             long long offset - The number of parcels to skip.
+ *             long long limit - The maximum number of parcels to visit, -1 for no limit.
+ *             int descending - 1 to start from the most expensive parcel, 0 from the cheapest.
+ *             ParcelRecordVisitor visit - The function called for each parcel; returning 0 stops.
+ *             void* context - Passed through to the visitor.
+ * RETURNS: The number of parcels visited.
+ */
+long long visitByValuation(Country* record, long long offset, long long limit, int descending, ParcelRecordVisitor visit, void* context) {
+    ColumnSnapshot* columns = record->columns;
+    long long visited = 0;
+    if (offset < 0) {
+        offset = 0;
+    }
+
+    if (columns == NULL) {
+        ParcelIterator iterator;
+        initParcelIteratorAtRank(&iterator, record->valuationRoot, offset, limit, descending);
+        for (Parcel* parcel = nextParcel(&iterator); parcel != NULL; parcel = nextParcel(&iterator)) {
+            ++visited;
+            if (!visit(record, parcel->weight, parcel->valuation, context)) {
+                break;
+            }
+        }
+        addStatCounter(STAT_NODES_VISITED, iterator.visited);
+        addStatCounter(STAT_ROWS_OUTPUT, visited);
+        return visited;
+    }
+
+    long long end = limit >= 0 && offset + limit < columns->count ? offset + limit : columns->count;
+    for (long long i = offset; i < end; ++i) {
+        int weight;
+        float valuation;
+        columnParcel(columns, columnOrderIndex(columns, descending ? columns->count - 1 - i : i), &weight, &valuation);
+        ++visited;
+        if (!visit(record, weight, valuation, context)) {
+            break;
+        }
+    }
+    addStatCounter(STAT_COLUMN_VALUES, visited);
+    addStatCounter(STAT_ROWS_OUTPUT, visited);
+    return visited;
+}
+
+/*
+ * FUNCTION: printValuationRank
+ * DESCRIPTION: Finds and prints a country's parcel of a given rank by valuation.
+ * PARAMETERS: HashTable* hashTable - The hash table the country belongs to.
+ *             Country* record - The country to search.
+ *             long long rank - The rank, from 0 for the cheapest parcel.
+ * RETURNS: None.
+ */
+void printValuationRank(HashTable* hashTable, Country* record, long long rank) {
+    ParcelRecord found;
+    printf("Parcel %lld of %lld by valuation:\n", rank + 1, countCountryParcels(record));
+    if (findValuationRank(record, rank, &found)) {
+        printParcelFields(hashTable, record->id, found.weight, found.valuation);
+    }
+    else {
+        printParcel(hashTable, NULL);
+    }
+}
+
+/*
+ * FUNCTION: initOutputBuffer
+ * DESCRIPTION: Prepares a buffered writer that collects output in one large block and hands it to the
+ *              file with a single fwrite each time the block fills up.
+ * PARAMETERS: OutputBuffer* out - The writer to initialize.
+ *             FILE* file - The file the output goes to, or NULL to send it to the writer's server
+ *                          connection, which the caller sets.
+ * RETURNS: 0 on success, 1 if the buffer cannot be allocated.
+ */
+int initOutputBuffer(OutputBuffer* out, FILE* file) {
+    out->file = file;
+    out->connection = NULL;
+    out->used = 0;
+    out->capacity = OUTPUT_BUFFER_SIZE;
+    out->failed = 0;
+    out->data = (char*)malloc(out->capacity);
+    if (out->data == NULL) {
+        printf("Memory allocation failed for output buffer.\n");
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * FUNCTION: flushOutputBuffer
+ * DESCRIPTION: Writes everything collected so far to the writer's file or server connection.
+ * PARAMETERS: OutputBuffer* out - The writer to flush.
+ * RETURNS: None.
+ */
+void flushOutputBuffer(OutputBuffer* out) {
+    if (out->used > 0) {
+        writeOutputDirect(out, out->data, out->used);
+    }
+    out->used = 0;
+}
+
+/*
+ * FUNCTION: writeOutputDirect
+ * DESCRIPTION: Writes bytes straight to the writer's file or server connection (see queueResponse),
+ *              bypassing the buffer.
+ * PARAMETERS: OutputBuffer* out - The writer.
+ *             const char* text - The bytes to write.
+ *             size_t length - The number of bytes.
+ * RETURNS: None.
+ */
+void writeOutputDirect(OutputBuffer* out, const char* text, size_t length) {
+    int written = out->file != NULL ? fwrite(text, 1, length, out->file) == length
+                                    : queueResponse(out->connection, text, length) == 0;
+    if (!written) {
+        out->failed = 1;
+    }
+}
+
+/*
+ * FUNCTION: freeOutputBuffer
+ * DESCRIPTION: Flushes a writer and frees its buffer. The file itself is left open.
+ * PARAMETERS: OutputBuffer* out - The writer to free.
+ * RETURNS: None.
+ */
+void freeOutputBuffer(OutputBuffer* out) {
+    flushOutputBuffer(out);
+    if (out->file != NULL && fflush(out->file) != 0) {
+        out->failed = 1;
+    }
+    free(out->data);
+    out->data = NULL;
+}
+
+/*
+ * FUNCTION: writeOutput
+ * DESCRIPTION: Appends bytes to a writer, flushing first if they do not fit. Text larger than the
+ *              whole buffer is written straight through.
+ * PARAMETERS: OutputBuffer* out - The writer to append to.
+ *             const char* text - The bytes to append.
+ *             size_t length - The number of bytes.
+ * RETURNS: None.
+ */
+void writeOutput(OutputBuffer* out, const char* text, size_t length) {
+    if (length > out->capacity - out->used) {
+        flushOutputBuffer(out);
+        if (length > out->capacity) {
+            writeOutputDirect(out, text, length);
+            return;
+        }
+    }
+    memcpy(out->data + out->used, text, length);
+    out->used += length;
+}
+
+/*
+ * FUNCTION: writeOutputFormat
+ * DESCRIPTION: Appends printf-style formatted text to a writer. Meant for headers and messages; the
+ *              per-parcel lines use the hand-written formatters below.
+ * PARAMETERS: OutputBuffer* out - The writer to append to.
+ *             const char* format - The printf format string.
+ *             ... - The values to format.
+ * RETURNS: None.
+ */
+void writeOutputFormat(OutputBuffer* out, const char* format, ...) {
+    va_list args;
+    size_t room = out->capacity - out->used;
+    va_start(args, format);
+    int length = vsnprintf(out->data + out->used, room, format, args);
+    va_end(args);
+    if (length < 0) {
+        out->failed = 1;
+        return;
+    }
+    if ((size_t)length >= room) {
+        // Did not fit: flush and format again into the empty buffer, or straight to the file
+        flushOutputBuffer(out);
+        va_start(args, format);
+        if ((size_t)length < out->capacity) {
+            vsnprintf(out->data, out->capacity, format, args);
+        }
+        else {
+            if (out->file == NULL || vfprintf(out->file, format, args) < 0) {
+                out->failed = 1;
+            }
+            length = 0;
+        }
+        va_end(args);
+    }
+    out->used += (size_t)length;
+}
+
+/*
+ * FUNCTION: writeOutputInt
+ * DESCRIPTION: Appends an integer in decimal, as printf's %lld would.
+ * PARAMETERS: OutputBuffer* out - The writer to append to.
+ *             long long value - The value to write.
+ * RETURNS: None.
+ */
+void writeOutputInt(OutputBuffer* out, long long value) {
+    char digits[24];
+    char* p = digits + sizeof(digits);
+    unsigned long long magnitude = value < 0 ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+    do {
+        *--p = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
+    if (value < 0) {
+        *--p = '-';
+    }
+    writeOutput(out, p, (size_t)(digits + sizeof(digits) - p));
+}
+
+/*
+ * FUNCTION: writeOutputValuation
+ * DESCRIPTION: Appends a valuation with two decimals, as printf's %.2f would. printf rounds the exact
+ *              binary value, so values whose scaled product lands too close to half a cent for the
+ *              shortcut to be trusted, and very large values, are still handed to printf.
+ * PARAMETERS: OutputBuffer* out - The writer to append to.
+ *             double value - The value to write.
+ * RETURNS: None.
+ */
+void writeOutputValuation(OutputBuffer* out, double value) {
+    double scaled = fabs(value) * 100.0;
+    if (!(scaled < 1e12) || fabs(scaled - floor(scaled) - 0.5) < 1e-3) {
+        writeOutputFormat(out, "%.2f", value);
+        return;
+    }
+
+    char digits[24];
+    char* p = digits + sizeof(digits);
+    unsigned long long cents = (unsigned long long)(scaled + 0.5);
+    *--p = (char)('0' + cents % 10);
+    cents /= 10;
+    *--p = (char)('0' + cents % 10);
+    cents /= 10;
+    *--p = '.';
+    do {
+        *--p = (char)('0' + cents % 10);
+        cents /= 10;
+    } while (cents != 0);
+    if (signbit(value)) {
+        *--p = '-';  // printf keeps the sign of values that round to zero too
+    }
+    writeOutput(out, p, (size_t)(digits + sizeof(digits) - p));
+}
+
+/*
+ * FUNCTION: writeParcelLine
+ * DESCRIPTION: Appends a parcel in the same format printParcelFields prints.
+ * PARAMETERS: OutputBuffer* out - The writer to append to.
+ *             const char* name - The parcel's destination.
+ *             int weight - The weight of the parcel.
+ *             float valuation - The valuation of the parcel.
+ * RETURNS: None.
+ */
+void writeParcelLine(OutputBuffer* out, const char* name, int weight, float valuation) {
+    writeOutput(out, "Destination: ", 13);
+    writeOutput(out, name, strlen(name));
+    writeOutput(out, ", Weight: ", 10);
+    writeOutputInt(out, weight);
+    writeOutput(out, ", Valuation: ", 13);
+    writeOutputValuation(out, valuation);
+    writeOutput(out, "\n", 1);
+}
+
+/*
+ * FUNCTION: writeCountryParcel
+ * DESCRIPTION: Appends the cheapest, most expensive, lightest or heaviest parcel of a country to a
+ *              writer from its summary, in the same words as printCountryParcel.
+ * PARAMETERS: OutputBuffer* out - The writer to append to.
+ *             Country* record - The country summarized.
+ *             ParcelSummary* summary - The country's summary, with the extreme requested.
+ *             int extreme - Which parcel to write (a ParcelExtreme value).
+ * RETURNS: None.
+ */
+void writeCountryParcel(OutputBuffer* out, Country* record, ParcelSummary* summary, int extreme) {
+    if (summary->count > 0) {
+        writeParcelLine(out, record->name, summary->extremes[extreme].weight, summary->extremes[extreme].valuation);
+    }
+    else {
+        writeOutput(out, "Parcel not found.\n\n", 19);
+    }
+}
+
+/*
+ * FUNCTION: writeCountrySummary
+ * DESCRIPTION: Appends a full summary of a country to a writer, in the same words as
+ *              printCountrySummary.
+ * PARAMETERS: OutputBuffer* out - The writer to append to.
+ *             Country* record - The country summarized.
+ *             ParcelSummary* summary - The country's summary, with every field requested.
+ * RETURNS: None.
+ */
+void writeCountrySummary(OutputBuffer* out, Country* record, ParcelSummary* summary) {
+    static const char* headings[4] = { "Cheapest Parcel:\n", "Most Expensive Parcel:\n", "Lightest Parcel:\n", "Heaviest Parcel:\n" };
+    writeOutput(out, "Parcels: ", 9);
+    writeOutputInt(out, summary->count);
+    writeOutput(out, ", Total Load: ", 14);
+    writeOutputInt(out, summary->weightSum);
+    writeOutput(out, ", Total Valuation: ", 19);
+    writeOutputValuation(out, summary->valuationSum);
+    writeOutput(out, "\nMean Weight: ", 14);
+    writeOutputValuation(out, summary->meanWeight);
+    writeOutput(out, ", Mean Valuation: ", 18);
+    writeOutputValuation(out, summary->meanValuation);
+    writeOutput(out, "\n", 1);
+    for (int extreme = CHEAPEST_PARCEL; extreme <= HEAVIEST_PARCEL; ++extreme) {
+        writeOutput(out, headings[extreme], strlen(headings[extreme]));
+        writeCountryParcel(out, record, summary, extreme);
+    }
+}
+
+/*
+ * FUNCTION: writeValuationRank
+ * DESCRIPTION: Appends a country's parcel of a given rank by valuation to a writer, in the same words
+ *              as printValuationRank.
+ * PARAMETERS: OutputBuffer* out - The writer to append to.
+ *             Country* record - The country to search.
+ *             long long rank - The rank, from 0 for the cheapest parcel.
+ * RETURNS: None.
+ */
+void writeValuationRank(OutputBuffer* out, Country* record, long long rank) {
+    ParcelRecord found;
+    writeOutputFormat(out, "Parcel %lld of %lld by valuation:\n", rank + 1, countCountryParcels(record));
+    if (findValuationRank(record, rank, &found)) {
+        writeParcelLine(out, record->name, found.weight, found.valuation);
+    }
+    else {
+        writeOutput(out, "Parcel not found.\n\n", 19);
+    }
+}
+
+/*
+ * FUNCTION: writeParcelVisitor
+ * DESCRIPTION: ParcelRecordVisitor that appends each parcel it is given to a writer.
+ * PARAMETERS: Country* record - The country the parcel belongs to.
+ *             int weight - The weight of the parcel.
+ *             float valuation - The valuation of the parcel.
+ *             void* context - The OutputBuffer to append to.
+ * RETURNS: 1, to continue the walk.
+ */
+int writeParcelVisitor(Country* record, int weight, float valuation, void* context) {
+    writeParcelLine((OutputBuffer*)context, record->name, weight, valuation);
+    return 1;
+}
+
+/*
+ * FUNCTION: trimSpaces
+ * DESCRIPTION: Strips leading and trailing whitespace from a string in place.
+ * PARAMETERS: char* text - The string to trim.
+ * RETURNS: A pointer to the first non-space character of text.
+ */
+char* trimSpaces(char* text) {
+    while (isspace((unsigned char)*text)) {
+        ++text;
+    }
+    char* end = text + strlen(text);
+    while (end > text && isspace((unsigned char)end[-1])) {
+        --end;
+    }
+    *end = '\0';
+    return text;
+}
+
+/*
+ * FUNCTION: splitLastWord
+ * DESCRIPTION: Splits the last whitespace-separated word off a trimmed string in place.
+ * PARAMETERS: char* text - The string to split; it keeps everything before the last word, untrimmed.
+ * RETURNS: A pointer to the last word, or NULL if the string has fewer than two words.
+ */
+char* splitLastWord(char* text) {
+    char* last = NULL;
+    for (char* p = text; *p != '\0'; ++p) {
+        if (isspace((unsigned char)*p)) {
+            last = p;
+        }
+    }
+    if (last == NULL) {
+        return NULL;
+    }
+    *last = '\0';
+    return last + 1;
+}
+
+/*
+ * FUNCTION: splitParcelFields
+ * DESCRIPTION: Splits a weight and a valuation, the last two words, off a trimmed string in place. They
+ *              are parsed like the fields of the input file, so a valuation matches the stored one.
+ * PARAMETERS: char* text - The string to split; it keeps everything before the weight, untrimmed.
+ *             int* weight - Pointer to store the weight.
+ *             float* valuation - Pointer to store the valuation.
+ * RETURNS: 1 on success, 0 if either word is missing or invalid.
+ */
+int splitParcelFields(char* text, int* weight, float* valuation) {
+    char* valuationWord = splitLastWord(text);
+    if (valuationWord == NULL || !parseValuation(valuationWord, valuationWord + strlen(valuationWord), valuation)) {
+        return 0;
+    }
+    text = trimSpaces(text);
+    char* weightWord = splitLastWord(text);
+    return weightWord != NULL && parseWeight(weightWord, weightWord + strlen(weightWord), weight);
+}
+
+/*
+ * FUNCTION: runBatchQuery
+ * DESCRIPTION: Answers one batch query and appends the query, prefixed with "> ", and its result to
+ *              a writer. The results use the menu's wording. Supported queries:
+ *              list <country>             All parcels of the country in order of weight.
+ *              filter <country> <op> <w>  Parcels compared against a weight, op one of > >= < <=.
+ *              totals <country>           Total load and valuation.
+ *              minmax <country>           Cheapest and most expensive parcel.
+ *              weights <country>          Lightest and heaviest parcel.
+ *              summary <country>          Count, totals, means and all four of the above parcels.
+ *              top <country> <k>          The k most expensive parcels, most expensive first.
+ *              rank <country> <k>         The k-th cheapest parcel, from 1.
+ *              percentile <country> <p>   The parcel at the p-th valuation percentile, 0 <= p <= 100.
+ *              remove <country> <w> <v>   Removes a parcel of that weight and valuation.
+ *              update <country> <w> <v> <new w> <new v>
+ *                                         Gives a parcel of that weight and valuation new ones.
+ *              stats                      The statistics described in writeStatistics.
+ *              Blank lines and lines starting with '#' are skipped. The latency of each answered query
+ *              is recorded. Once a read of the spill file has failed (see spillFailed), only stats is
+ *              answered.
+ *              Must be called inside a read section.
+ * PARAMETERS: HashTable* hashTable - The hash table to query.
+ *             char* query - The query line, without its newline. It is modified.
+ *             OutputBuffer* out - The writer to append to.
+ * RETURNS: None.
+ */
+void runBatchQuery(HashTable* hashTable, char* query, OutputBuffer* out) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    query = trimSpaces(query);
+    if (*query == '\0' || *query == '#') {
+        return;
+    }
+    writeOutput(out, "> ", 2);
+    writeOutput(out, query, strlen(query));
+    writeOutput(out, "\n", 1);
+
+    char* command = query;
+    char* argument = query;
+    while (*argument != '\0' && !isspace((unsigned char)*argument)) {
+        ++argument;
+    }
+    if (*argument != '\0') {
+        *argument++ = '\0';
+    }
+    argument = trimSpaces(argument);
+    if (strcmp(command, "stats") == 0 && *argument == '\0') {
+        writeStatistics(hashTable, out);
+        return;
+    }
+    if (spillFailed(hashTable)) {
+        writeOutput(out, "Error reading spill file; the parcels can no longer be queried.\n", 64);
+        return;
+    }
+
+    char* op = NULL;
+    int minWeight = INT_MIN;
+    int maxWeight = INT_MAX;
+    long long rank = 0;
+    double percentile = 0.0;
+    int weight = 0;
+    float valuation = 0.0f;
+    int newWeight = 0;
+    float newValuation = 0.0f;
+    if (strcmp(command, "top") == 0 || strcmp(command, "rank") == 0 || strcmp(command, "percentile") == 0) {
+        char* number = splitLastWord(argument);
+        if (number == NULL) {
+            writeOutput(out, "Invalid query.\n", 15);  // The country or the number is missing
+            return;
+        }
+        char* end = number;
+        errno = 0;
+        if (command[0] == 'p') {
+            percentile = strtod(number, &end);
+        }
+        else {
+            rank = strtoll(number, &end, 10);
+        }
+        if (end == number || *end != '\0' || errno == ERANGE || rank < 0 || (command[0] == 'r' && rank == 0)
+            || !(percentile >= 0.0 && percentile <= 100.0)) {
+            writeOutput(out, "Invalid number.\n", 16);
+            return;
+        }
+        argument = trimSpaces(argument);
+    }
+    else if (strcmp(command, "filter") == 0) {
+        // The operator is the last '<' or '>'; a destination may contain either before it
+        for (char* c = argument; *c != '\0'; ++c) {
+            if (*c == '<' || *c == '>') {
+                op = c;
+            }
+        }
+        if (op == NULL) {
+            writeOutput(out, "Invalid query.\n", 15);
+            return;
+        }
+        char comparison = *op;
+        int inclusive = op[1] == '=';
+        char* number = op + 1 + inclusive;
+        *op = '\0';
+        argument = trimSpaces(argument);
+
+        char* end;
+        errno = 0;
+        long threshold = strtol(number, &end, 10);
+        if (end == number || *trimSpaces(end) != '\0' || errno == ERANGE || threshold < INT_MIN || threshold > INT_MAX) {
+            writeOutput(out, "Invalid weight.\n", 16);
+            return;
+        }
+        int nonEmpty = comparison == '>' ? weightRangeBounds((int)threshold, inclusive, INT_MAX, 1, &minWeight, &maxWeight)
+                                         : weightRangeBounds(INT_MIN, 1, (int)threshold, inclusive, &minWeight, &maxWeight);
+        if (!nonEmpty) {
+            minWeight = 1;  // Nothing can match; an empty range keeps the country check below
+            maxWeight = 0;
+        }
+    }
+    else if (strcmp(command, "remove") == 0 || strcmp(command, "update") == 0) {
+        if ((command[0] == 'u' && !splitParcelFields(argument, &newWeight, &newValuation))
+            || !splitParcelFields(trimSpaces(argument), &weight, &valuation)) {
+            writeOutput(out, "Invalid parcel.\n", 16);
+            return;
+        }
+        if (!parcelsChangeable(hashTable)) {
+            writeOutput(out, "Parcels cannot be changed while other threads read them.\n", 57);
+            return;
+        }
+        argument = trimSpaces(argument);
+    }
+    else if (strcmp(command, "list") != 0 && strcmp(command, "totals") != 0 && strcmp(command, "minmax") != 0
+             && strcmp(command, "weights") != 0 && strcmp(command, "summary") != 0) {
+        writeOutput(out, "Invalid query.\n", 15);
+        return;
+    }
+
+    if (*argument == '\0') {
+        writeOutput(out, "Invalid query.\n", 15);
+        return;
+    }
+    Country view;
+    Country* record = findCountry(hashTable, argument, strlen(argument));
+    if (record == NULL) {
+        writeOutputFormat(out, "Country '%s' not found in the list.\n", argument);
+        return;
+    }
+    if (strcmp(command, "remove") == 0 || strcmp(command, "update") == 0) {
+        int changed = command[0] == 'r' ? removeCountryParcel(&hashTable->pool, record, weight, valuation)
+                                        : replaceCountryParcel(&hashTable->pool, record, weight, valuation, newWeight, newValuation);
+        if (changed > 0) {
+            writeOutputFormat(out, "Parcel %s.\n", command[0] == 'r' ? "removed" : "updated");
+        }
+        else {
+            writeOutput(out, changed == 0 ? "Parcel not found.\n" : "Parcel not changed.\n", changed == 0 ? 18 : 20);
+        }
+        recordLatency(command[0] == 'r' ? STAT_OP_REMOVE : STAT_OP_UPDATE, start);
+        return;
+    }
+    record = pinCountry(record, &view);
+
+    int operation;
+    ParcelSummary summary;
+    if (strcmp(command, "totals") == 0) {
+        operation = STAT_OP_TOTALS;
+        summarizeCountryCached<SUMMARY_WEIGHT_SUM | SUMMARY_VALUATION_SUM>(hashTable, record, INT_MIN, INT_MAX, &summary);
+        writeOutput(out, "Total Load: ", 12);
+        writeOutputInt(out, summary.weightSum);
+        writeOutput(out, ", Total Valuation: ", 19);
+        writeOutputValuation(out, summary.valuationSum);
+        writeOutput(out, "\n", 1);
+    }
+    else if (strcmp(command, "minmax") == 0) {
+        operation = STAT_OP_VALUATION_EXTREMES;
+        summarizeCountryCached<SUMMARY_CHEAPEST | SUMMARY_MOST_EXPENSIVE>(hashTable, record, INT_MIN, INT_MAX, &summary);
+        writeOutput(out, "Cheapest Parcel:\n", 17);
+        writeCountryParcel(out, record, &summary, CHEAPEST_PARCEL);
+        writeOutput(out, "Most Expensive Parcel:\n", 23);
+        writeCountryParcel(out, record, &summary, MOST_EXPENSIVE_PARCEL);
+    }
+    else if (strcmp(command, "weights") == 0) {
+        operation = STAT_OP_WEIGHT_EXTREMES;
+        summarizeCountryCached<SUMMARY_LIGHTEST | SUMMARY_HEAVIEST>(hashTable, record, INT_MIN, INT_MAX, &summary);
+        writeOutput(out, "Lightest Parcel:\n", 17);
+        writeCountryParcel(out, record, &summary, LIGHTEST_PARCEL);
+        writeOutput(out, "Heaviest Parcel:\n", 17);
+        writeCountryParcel(out, record, &summary, HEAVIEST_PARCEL);
+    }
+    else if (strcmp(command, "summary") == 0) {
+        operation = STAT_OP_SUMMARY;
+        summarizeCountryCached<SUMMARY_ALL>(hashTable, record, INT_MIN, INT_MAX, &summary);
+        writeCountrySummary(out, record, &summary);
+    }
+    else if (strcmp(command, "top") == 0) {
+        operation = STAT_OP_TOP_VALUATIONS;
+        writeOutput(out, "Most Expensive Parcels:\n", 24);
+        visitByValuation(record, 0, rank, 1, writeParcelVisitor, out);
+    }
+    else if (strcmp(command, "rank") == 0) {
+        operation = STAT_OP_VALUATION_RANK;
+        writeValuationRank(out, record, rank - 1);
+    }
+    else if (strcmp(command, "percentile") == 0) {
+        operation = STAT_OP_VALUATION_RANK;
+        writeValuationRank(out, record, percentileRank(countCountryParcels(record), percentile));
+    }
+    else {
+        operation = op != NULL ? STAT_OP_FILTER : STAT_OP_LIST;
+        visitCountryParcels(record, minWeight, maxWeight, 0, -1, writeParcelVisitor, out);
+    }
+    if (spillFailed(hashTable)) {
+        writeOutput(out, "Error reading spill file; the result above is incomplete.\n", 58);
+    }
+    recordLatency(operation, start);
+}
+
+/*
+ * FUNCTION: runBatchQueries
+ * DESCRIPTION: Answers every query in a file, one per line (see runBatchQuery), and writes the results
+ *              to stdout through one large output buffer instead of a printf per parcel.
+ * PARAMETERS: HashTable* hashTable - The hash table to query.
+ *             const char* path - The query file, or "-" to read queries from stdin.
+ * RETURNS: 0 on success, 1 if the query file cannot be opened or the results cannot be written.
+ */
+int runBatchQueries(HashTable* hashTable, const char* path) {
+    FILE* input = stdin;
+    if (strcmp(path, "-") != 0) {
+        errno_t err = fopen_s(&input, path, "r");
+        if (err != 0 || input == NULL) {
+            printf("Error opening query file '%s'.\n", path);
+            return 1;
+        }
+    }
+
+    OutputBuffer out;
+    if (initOutputBuffer(&out, stdout) != 0) {
+        if (input != stdin) {
+            fclose(input);
+        }
+        return 1;
+    }
+
+    char query[BATCH_QUERY_MAX_LENGTH];
+    while (fgets(query, sizeof(query), input) != NULL) {
+        size_t length = strlen(query);
+        if (length == sizeof(query) - 1 && query[length - 1] != '\n' && !feof(input)) {
+            // Skip the rest of an overlong line rather than reading it as further queries
+            int c;
+            while ((c = getc(input)) != '\n' && c != EOF) {
+            }
+            writeOutput(&out, "Query too long.\n", 16);
+            continue;
+        }
+        query[strcspn(query, "\r\n")] = '\0';
+        beginRead(hashTable);
+        runBatchQuery(hashTable, query, &out);
+        endRead(hashTable);
+    }
+
+    int failed = ferror(input) != 0;
+    if (failed) {
+        fprintf(stderr, "Error reading query file '%s'.\n", path);
+    }
+    if (input != stdin) {
+        fclose(input);
+    }
+    freeOutputBuffer(&out);
+    if (out.failed) {
+        fprintf(stderr, "Error writing query results.\n");
+    }
+    return failed || out.failed;
+}
+
+/*
+ * FUNCTION: reportWorker
+ * DESCRIPTION: Worker body for writeCountryReport. Repeatedly claims the next block of
+ *              REPORT_BLOCK_SIZE country ids and summarizes each of those countries, then marks the
+ *              block ready for the writer. Claiming small blocks from a shared counter lets a worker
+ *              that drew cheap countries take over the rest of the work, so skewed countries do not
+ *              leave threads idle. Runs inside the writer's read section.
+ * PARAMETERS: CountryReport* report - The report being built.
+ * RETURNS: None.
+ */
+void reportWorker(CountryReport* report) {
+    unsigned long blockCount = (report->countries + REPORT_BLOCK_SIZE - 1) / REPORT_BLOCK_SIZE;
+    unsigned long block;
+    while ((block = report->nextBlock.fetch_add(1)) < blockCount) {
+        unsigned long end = (block + 1) * REPORT_BLOCK_SIZE < report->countries ? (block + 1) * REPORT_BLOCK_SIZE : report->countries;
+        for (unsigned long id = block * REPORT_BLOCK_SIZE; id < end; ++id) {
+            Country view;
+            Country* record = pinCountry(countryById(report->hashTable, (int)id), &view);
+            summarizeCountry<SUMMARY_WEIGHT_SUM | SUMMARY_VALUATION_SUM | SUMMARY_CHEAPEST | SUMMARY_MOST_EXPENSIVE
+                             | SUMMARY_LIGHTEST | SUMMARY_HEAVIEST>(record, INT_MIN, INT_MAX, &report->summaries[id]);
+        }
+        report->blockReady[block].store(1, std::memory_order_release);
+    }
+}
+
+/*
+ * FUNCTION: writeCsvField
+ * DESCRIPTION: Appends a text field to a CSV writer, quoting it if it holds a comma, a quote or a line
+ *              break, with quotes doubled inside.
+ * PARAMETERS: OutputBuffer* out - The writer to append to.
+ *             const char* text - The field.
+ * RETURNS: None.
+ */
+void writeCsvField(OutputBuffer* out, const char* text) {
+    size_t length = strlen(text);
+    if (strpbrk(text, ",\"\r\n") == NULL) {
+        writeOutput(out, text, length);
+        return;
+    }
+    writeOutput(out, "\"", 1);
+    for (const char* quote = strchr(text, '"'); quote != NULL; quote = strchr(text, '"')) {
+        writeOutput(out, text, (size_t)(quote - text + 1));
+        writeOutput(out, "\"", 1);
+        text = quote + 1;
+    }
+    writeOutput(out, text, strlen(text));
+    writeOutput(out, "\"", 1);
+}
+
+/*
+ * FUNCTION: writeReportRow
+ * DESCRIPTION: Appends a country's row of the report to a CSV writer. The weight and valuation ranges
+ *              are left empty for a country without parcels.
+ * PARAMETERS: OutputBuffer* out - The writer to append to.
+ *             Country* record - The country.
+ *             ParcelSummary* summary - The country's summary, with both sums and all four extremes.
+ * RETURNS: None.
+ */
+void writeReportRow(OutputBuffer* out, Country* record, ParcelSummary* summary) {
+    writeCsvField(out, record->name);
+    writeOutput(out, ",", 1);
+    writeOutputInt(out, summary->count);
+    writeOutput(out, ",", 1);
+    writeOutputInt(out, summary->weightSum);
+    writeOutput(out, ",", 1);
+    writeOutputValuation(out, summary->valuationSum);
+    if (summary->count == 0) {
+        writeOutput(out, ",,,,\n", 5);
+        return;
+    }
+    writeOutput(out, ",", 1);
+    writeOutputInt(out, summary->extremes[LIGHTEST_PARCEL].weight);
+    writeOutput(out, ",", 1);
+    writeOutputInt(out, summary->extremes[HEAVIEST_PARCEL].weight);
+    writeOutput(out, ",", 1);
+    writeOutputValuation(out, summary->extremes[CHEAPEST_PARCEL].valuation);
+    writeOutput(out, ",", 1);
+    writeOutputValuation(out, summary->extremes[MOST_EXPENSIVE_PARCEL].valuation);
+    writeOutput(out, "\n", 1);
+}
+
+/*
+ * FUNCTION: writeCountryReport
+ * DESCRIPTION: Writes one CSV row per country, in order of country id (the order the countries first
+ *              appeared in the input), with its parcel count, total load, total valuation, and weight
+ *              and valuation range. Worker threads summarize blocks of countries (see reportWorker)
+ *              while this thread streams the finished blocks to the file in order, so the file is
+ *              written while the rest is still being computed. Countries added by live ingest after
+ *              the report starts are left out.
+ * PARAMETERS: HashTable* hashTable - The hash table to report on.
+ *             const char* path - The CSV file to write, or "-" for stdout.
+ *             int workers - The number of worker threads.
+ * RETURNS: 0 on success, 1 if the file cannot be opened or written, memory runs out or the spill file
+ *          cannot be read.
+ */
+int writeCountryReport(HashTable* hashTable, const char* path, int workers) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    FILE* file = stdout;
+    if (strcmp(path, "-") != 0) {
+        errno_t err = fopen_s(&file, path, "w");
+        if (err != 0 || file == NULL) {
+            printf("Error opening report file '%s'.\n", path);
+            return 1;
+        }
+    }
+    OutputBuffer out;
+    if (initOutputBuffer(&out, file) != 0) {
+        if (file != stdout) {
+            fclose(file);
+        }
+        return 1;
+    }
+
+    beginRead(hashTable);
+    CountryReport report;
+    report.hashTable = hashTable;
+    report.countries = hashTable->count.load();
+    unsigned long blockCount = (report.countries + REPORT_BLOCK_SIZE - 1) / REPORT_BLOCK_SIZE;
+    report.summaries = (ParcelSummary*)malloc((report.countries + 1) * sizeof(ParcelSummary));
+    report.blockReady = new std::atomic<int>[blockCount + 1];
+    report.nextBlock.store(0);
+    std::thread* threads = NULL;
+    int started = 0;
+    int failed = report.summaries == NULL;
+    if (!failed) {
+        for (unsigned long block = 0; block < blockCount; ++block) {
+            report.blockReady[block].store(0, std::memory_order_relaxed);
+        }
+        workers = workers < 1 ? 1 : (unsigned long)workers < blockCount ? workers : (int)blockCount;
+        threads = new std::thread[workers];
+        for (; started < workers; ++started) {
+            threads[started] = std::thread(reportWorker, &report);
+        }
+
+        writeOutput(&out, "destination,parcels,total_load,total_valuation,min_weight,max_weight,min_valuation,max_valuation\n", 97);
+        for (unsigned long block = 0; block < blockCount; ++block) {
+            while (!report.blockReady[block].load(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+            unsigned long end = (block + 1) * REPORT_BLOCK_SIZE < report.countries ? (block + 1) * REPORT_BLOCK_SIZE : report.countries;
+            for (unsigned long id = block * REPORT_BLOCK_SIZE; id < end; ++id) {
+                writeReportRow(&out, countryById(hashTable, (int)id), &report.summaries[id]);
+            }
+        }
+        addStatCounter(STAT_ROWS_OUTPUT, (long long)report.countries);
+    }
+    for (int i = 0; i < started; ++i) {
+        threads[i].join();
+    }
+    endRead(hashTable);
+    delete[] threads;
+    delete[] report.blockReady;
+    free(report.summaries);
+
+    if (failed) {
+        printf("Memory allocation failed for the report.\n");
+    }
+    else if (spillFailed(hashTable)) {
+        printf("Error reading spill file; the report is incomplete.\n");
+        failed = 1;
+    }
+    freeOutputBuffer(&out);
+    if (file != stdout && fclose(file) != 0) {
+        out.failed = 1;
+    }
+    if (out.failed) {
+        fprintf(stderr, "Error writing report file '%s'.\n", path);
+    }
+    recordLatency(STAT_OP_REPORT, start);
+    return failed || out.failed;
+}
+
+/*
+ * FUNCTION: closeSocket
+ * DESCRIPTION: Closes a socket.
+ * PARAMETERS: SocketHandle socket - The socket to close.
+ * RETURNS: None.
+ */
+void closeSocket(SocketHandle socket) {
+#ifdef _WIN32
+    closesocket(socket);
+#else
+    close(socket);
+#endif
+}
+
+/*
+ * FUNCTION: setSocketBlocking
+ * DESCRIPTION: Switches a socket between blocking and non-blocking mode.
+ * PARAMETERS: SocketHandle socket - The socket to change.
+ *             int blocking - 1 for blocking, 0 for non-blocking.
+ * RETURNS: 0 on success, 1 on failure.
+ */
+int setSocketBlocking(SocketHandle socket, int blocking) {
+#ifdef _WIN32
+    u_long nonBlocking = blocking ? 0 : 1;
+    return ioctlsocket(socket, FIONBIO, &nonBlocking) != 0;
+#else
+    int flags = fcntl(socket, F_GETFL, 0);
+    if (flags < 0) {
+        return 1;
+    }
+    flags = blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK;
+    return fcntl(socket, F_SETFL, flags) != 0;
+#endif
+}
+
+/*
+ * FUNCTION: pollSockets
+ * DESCRIPTION: Waits until one of the sockets is ready or the timeout expires (poll, or WSAPoll on
+ *              Windows).
+ * PARAMETERS: struct pollfd* sockets - The sockets and the events to wait for.
+ *             size_t count - The number of sockets.
+ *             int timeout - The longest wait in milliseconds.
+ * RETURNS: The number of ready sockets, 0 on timeout, or a negative value on error.
+ */
+int pollSockets(struct pollfd* sockets, size_t count, int timeout) {
+#ifdef _WIN32
+    return WSAPoll(sockets, (ULONG)count, timeout);
+#else
+    return poll(sockets, (nfds_t)count, timeout);
+#endif
+}
+
+/*
+ * FUNCTION: sendAll
+ * DESCRIPTION: Sends a whole buffer over a blocking socket.
+ * PARAMETERS: SocketHandle socket - The socket to send on.
+ *             const char* data - The bytes to send.
+ *             size_t length - The number of bytes.
+ * RETURNS: 0 on success, 1 if the peer has gone away or the send fails.
+ */
+int sendAll(SocketHandle socket, const char* data, size_t length) {
+    while (length > 0) {
+        size_t chunk = length > INT_MAX ? INT_MAX : length;
+        int sent = (int)send(socket, data, (SocketLength)chunk, SOCKET_SEND_FLAGS);
+        if (sent <= 0) {
+            return 1;
+        }
+        data += sent;
+        length -= (size_t)sent;
+    }
+    return 0;
+}
+
+/*
+ * FUNCTION: socketWouldBlock
+ * DESCRIPTION: Tells whether the last socket call failed only because a non-blocking socket was not
+ *              ready.
+ * PARAMETERS: None.
+ * RETURNS: 1 if the call would have blocked, 0 for a real error.
+ */
+int socketWouldBlock() {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+/*
+ * FUNCTION: sendAvailable
+ * DESCRIPTION: Sends as much of a buffer as a non-blocking socket takes without waiting.
+ * PARAMETERS: SocketHandle socket - The socket to send on.
+ *             const char* data - The bytes to send.
+ *             size_t length - The number of bytes.
+ *             size_t* sent - Pointer to store the number of bytes sent.
+ * RETURNS: 0 on success, even if not everything was sent, 1 if the peer has gone away or the send fails.
+ */
+int sendAvailable(SocketHandle socket, const char* data, size_t length, size_t* sent) {
+    *sent = 0;
+    while (*sent < length) {
+        size_t left = length - *sent;
+        size_t chunk = left > INT_MAX ? INT_MAX : left;
+        int result = (int)send(socket, data + *sent, (SocketLength)chunk, SOCKET_SEND_FLAGS);
+        if (result < 0 && socketWouldBlock()) {
+            return 0;
+        }
+        if (result <= 0) {
+            return 1;
+        }
+        *sent += (size_t)result;
+    }
+    return 0;
+}
+
+/*
+ * FUNCTION: queueResponse
+ * DESCRIPTION: Sends response bytes to a server connection without blocking. If bytes are already
+ *              queued, or the socket does not take everything at once, the rest is appended to the
+ *              connection's output queue, which serverWorker drains when the socket is writable.
+ * PARAMETERS: ServerConnection* connection - The connection.
+ *             const char* data - The bytes to send.
+ *             size_t length - The number of bytes.
+ * RETURNS: 0 on success, 1 if the peer has gone away, the send fails or the queue cannot grow.
+ */
+int queueResponse(ServerConnection* connection, const char* data, size_t length) {
+    if (connection->queueStart == connection->queueEnd) {
+        size_t sent;
+        if (sendAvailable(connection->socket, data, length, &sent) != 0) {
+            return 1;
+        }
+        data += sent;
+        length -= sent;
+        connection->queueStart = connection->queueEnd = 0;
+    }
+    if (length == 0) {
+        return 0;
+    }
+
+    if (length > connection->queueCapacity - connection->queueEnd) {
+        size_t queued = connection->queueEnd - connection->queueStart;
+        memmove(connection->queue, connection->queue + connection->queueStart, queued);
+        connection->queueStart = 0;
+        connection->queueEnd = queued;
+        if (length > connection->queueCapacity - queued) {
+            size_t capacity = connection->queueCapacity ? connection->queueCapacity : OUTPUT_BUFFER_SIZE;
+            while (capacity - queued < length) {
+                capacity *= 2;
+            }
+            char* queue = (char*)realloc(connection->queue, capacity);
+            if (queue == NULL) {
+                printf("Failed to allocate memory for a server response\n");
+                return 1;
+            }
+            connection->queue = queue;
+            connection->queueCapacity = capacity;
+        }
+    }
+    memcpy(connection->queue + connection->queueEnd, data, length);
+    connection->queueEnd += length;
+    return 0;
+}
+
+/*
+ * FUNCTION: sendQueuedResponse
+ * DESCRIPTION: Sends what the socket of a writable server connection takes of its output queue. A
+ *              queue that has grown past SERVER_MAX_QUEUED is freed once it empties.
+ * PARAMETERS: ServerConnection* connection - The connection.
+ * RETURNS: 0 on success, 1 if the peer has gone away or the send fails.
+ */
+int sendQueuedResponse(ServerConnection* connection) {
+    size_t sent;
+    if (sendAvailable(connection->socket, connection->queue + connection->queueStart,
+                      connection->queueEnd - connection->queueStart, &sent) != 0) {
+        return 1;
+    }
+    connection->queueStart += sent;
+    if (connection->queueStart == connection->queueEnd) {
+        connection->queueStart = connection->queueEnd = 0;
+        if (connection->queueCapacity > SERVER_MAX_QUEUED) {
+            free(connection->queue);
+            connection->queue = NULL;
+            connection->queueCapacity = 0;
+        }
+    }
+    return 0;
+}
+
+/*
+ * FUNCTION: startSockets
+ * DESCRIPTION: Prepares the socket library; only Windows needs this.
+ * PARAMETERS: None.
+ * RETURNS: 0 on success, 1 on failure.
+ */
+int startSockets() {
+#ifdef _WIN32
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        printf("Error starting Winsock.\n");
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+/*
+ * FUNCTION: stopSockets
+ * DESCRIPTION: Releases the socket library prepared by startSockets.
+ * PARAMETERS: None.
+ * RETURNS: None.
+ */
+void stopSockets() {
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+/*
+ * FUNCTION: unixSocketAddress
+ * DESCRIPTION: Fills in the address of a Unix domain socket.
+ * PARAMETERS: const char* path - The path of the socket file.
+ *             struct sockaddr_un* address - Pointer to store the address.
+ * RETURNS: 0 on success, 1 if the path is too long for a socket address.
+ */
+int unixSocketAddress(const char* path, struct sockaddr_un* address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        printf("Socket path '%s' is too long.\n", path);
+        return 1;
+    }
+    memcpy(address->sun_path, path, strlen(path) + 1);
+    return 0;
+}
+
+/*
+ * FUNCTION: openServerSocket
+ * DESCRIPTION: Creates a non-blocking Unix domain socket listening on a path. A socket file left behind
+ *              by an earlier server is not removed, so the path cannot silently replace another file.
+ * PARAMETERS: const char* path - The path of the socket file to create.
+ * RETURNS: The listening socket, or INVALID_SOCKET_HANDLE on failure.
+ */
+SocketHandle openServerSocket(const char* path) {
+    struct sockaddr_un address;
+    if (unixSocketAddress(path, &address) != 0) {
+        return INVALID_SOCKET_HANDLE;
+    }
+    SocketHandle listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener == INVALID_SOCKET_HANDLE) {
+        printf("Error creating socket.\n");
+        return INVALID_SOCKET_HANDLE;
+    }
+    if (bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        printf("Error binding '%s'; remove it first if an earlier server left it behind.\n", path);
+        closeSocket(listener);
+        return INVALID_SOCKET_HANDLE;
+    }
+    if (listen(listener, SOMAXCONN) != 0 || setSocketBlocking(listener, 0) != 0) {
+        printf("Error listening on '%s'.\n", path);
+        closeSocket(listener);
+        remove(path);
+        return INVALID_SOCKET_HANDLE;
+    }
+    return listener;
+}
+
+/*
+ * FUNCTION: connectServerSocket
+ * DESCRIPTION: Connects a blocking socket to a query server.
+ * PARAMETERS: const char* path - The path of the server's socket file.
+ * RETURNS: The connected socket, or INVALID_SOCKET_HANDLE on failure.
+ */
+SocketHandle connectServerSocket(const char* path) {
+    struct sockaddr_un address;
+    if (unixSocketAddress(path, &address) != 0) {
+        return INVALID_SOCKET_HANDLE;
+    }
+    SocketHandle client = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (client == INVALID_SOCKET_HANDLE) {
+        return INVALID_SOCKET_HANDLE;
+    }
+    if (connect(client, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        closeSocket(client);
+        return INVALID_SOCKET_HANDLE;
+    }
+    return client;
+}
+
+/*
+ * FUNCTION: serveConnection
+ * DESCRIPTION: Reads what a client has sent and answers the complete request lines in it. A request is
+ *              a batch query (see runBatchQuery); its response is what batch mode would print for it,
+ *              followed by a line holding a single '.', which no result line ever is. A request longer
+ *              than BATCH_QUERY_MAX_LENGTH is answered with "Query too long." and its rest is dropped.
+ *              Answering stops while more than SERVER_MAX_QUEUED response bytes wait to be sent; the
+ *              remaining requests stay buffered until the queue drains.
+ * PARAMETERS: QueryServer* server - The server.
+ *             ServerConnection* connection - The connection.
+ *             OutputBuffer* out - The worker's writer, sent to the connection (see queueResponse).
+ *             int readable - 1 to read from the socket first, 0 to answer buffered requests only.
+ * RETURNS: 1 to keep the connection, 0 if the client has gone away.
+ */
+int serveConnection(QueryServer* server, ServerConnection* connection, OutputBuffer* out, int readable) {
+    size_t room = sizeof(connection->request) - 1 - connection->used;
+    if (readable && room > 0) {
+        int received = (int)recv(connection->socket, connection->request + connection->used, (SocketLength)room, 0);
+        if (received <= 0 && !(received < 0 && socketWouldBlock())) {
+            return 0;
+        }
+        connection->used += received > 0 ? (size_t)received : 0;
+    }
+    out->connection = connection;
+
+    char* line = connection->request;
+    char* end = connection->request + connection->used;
+    char* newline;
+    while (connection->queueEnd - connection->queueStart <= SERVER_MAX_QUEUED
+           && (newline = (char*)memchr(line, '\n', (size_t)(end - line))) != NULL) {
+        *newline = '\0';
+        if (connection->skipping) {
+            connection->skipping = 0;  // The tail of an overlong request, already answered
+        }
+        else {
+            line[strcspn(line, "\r")] = '\0';
+            beginRead(server->hashTable);
+            runBatchQuery(server->hashTable, line, out);
+            endRead(server->hashTable);
+            writeOutput(out, SERVER_END_OF_RESPONSE, strlen(SERVER_END_OF_RESPONSE));
+        }
+        line = newline + 1;
+        flushOutputBuffer(out);
+    }
+
+    size_t rest = (size_t)(end - line);
+    if (rest == sizeof(connection->request) - 1 && memchr(line, '\n', rest) == NULL) {
+        if (!connection->skipping) {
+            writeOutput(out, "Query too long.\n", 16);
+            writeOutput(out, SERVER_END_OF_RESPONSE, strlen(SERVER_END_OF_RESPONSE));
+        }
+        connection->skipping = 1;
+        rest = 0;
+    }
+    memmove(connection->request, line, rest);
+    connection->used = rest;
+
+    flushOutputBuffer(out);
+    int failed = out->failed;
+    out->failed = 0;
+    return !failed;
+}
+
+/*
+ * FUNCTION: serverWorker
+ * DESCRIPTION: Body of a query server worker: a poll loop over the shared listening socket and up to
+ *              SERVER_MAX_CONNECTIONS connections of its own. Whichever idle worker wins the accept
+ *              takes a new connection, so clients spread over the pool, and the workers answer queries
+ *              in parallel against the shared index. A response the client does not take at once waits
+ *              in the connection's output queue, sent as the socket becomes writable, and no further
+ *              requests are read from the connection while more than SERVER_MAX_QUEUED bytes wait, so
+ *              a client that stops reading holds up only itself.
+ * PARAMETERS: QueryServer* server - The server.
+ * RETURNS: None.
+ */
+void serverWorker(QueryServer* server) {
+    struct pollfd sockets[SERVER_MAX_CONNECTIONS + 1];
+    ServerConnection* connections = (ServerConnection*)malloc(SERVER_MAX_CONNECTIONS * sizeof(ServerConnection));
+    OutputBuffer out;
+    if (connections == NULL || initOutputBuffer(&out, NULL) != 0) {
+        printf("Failed to allocate memory for server worker\n");
+        free(connections);
+        return;
+    }
+    int count = 0;
+
+    while (!server->stop.load()) {
+        for (int i = 0; i < count; ++i) {
+            size_t queued = connections[i].queueEnd - connections[i].queueStart;
+            sockets[i].fd = connections[i].socket;
+            sockets[i].events = (short)((queued <= SERVER_MAX_QUEUED ? POLLIN : 0) | (queued > 0 ? POLLOUT : 0));
+            sockets[i].revents = 0;
+        }
+        int listening = count < SERVER_MAX_CONNECTIONS;
+        int watched = count;
+        if (listening) {
+            sockets[watched].fd = server->listener;
+            sockets[watched].events = POLLIN;
+            sockets[watched].revents = 0;
+        }
+        if (pollSockets(sockets, (size_t)(watched + listening), SERVER_POLL_INTERVAL_MS) <= 0) {
+            continue;
+        }
+
+        // Backwards, so a closed connection can be replaced by the last one, which was already served
+        for (int i = watched - 1; i >= 0; --i) {
+            short revents = sockets[i].revents;
+            int keep = 1;
+            if (revents & POLLOUT) {
+                keep = sendQueuedResponse(&connections[i]) == 0;
+            }
+            if (keep && (revents & POLLIN)) {
+                keep = serveConnection(server, &connections[i], &out, 1);
+            }
+            else if (keep && (revents & (POLLERR | POLLHUP | POLLNVAL))) {
+                keep = 0;
+            }
+            else if (keep && (revents & POLLOUT) && connections[i].used > 0) {
+                keep = serveConnection(server, &connections[i], &out, 0);  // Requests held back while the queue was full
+            }
+            if (!keep) {
+                closeSocket(connections[i].socket);
+                free(connections[i].queue);
+                connections[i] = connections[--count];
+            }
+        }
+        if (listening && (sockets[watched].revents & POLLIN)) {
+            SocketHandle client = accept(server->listener, NULL, NULL);
+            if (client != INVALID_SOCKET_HANDLE && setSocketBlocking(client, 0) != 0) {
+                closeSocket(client);
+            }
+            else if (client != INVALID_SOCKET_HANDLE) {
+                connections[count].socket = client;
+                connections[count].used = 0;
+                connections[count].skipping = 0;
+                connections[count].queue = NULL;
+                connections[count].queueStart = connections[count].queueEnd = 0;
+                connections[count].queueCapacity = 0;
+                ++count;
+            }
+        }
+    }
+
+    for (int i = 0; i < count; ++i) {
+        closeSocket(connections[i].socket);
+        free(connections[i].queue);
+    }
+    free(connections);
+    freeOutputBuffer(&out);
+    releaseReaderSlot(server->hashTable);
+}
+
+/*
+ * FUNCTION: runQueryServer
+ * DESCRIPTION: Answers queries from local clients over a Unix domain socket until Enter is pressed, so
+ *              several tools can share one loaded index. The socket file is removed on the way out. If
+ *              stdin is closed the server runs until the process is killed.
+ * PARAMETERS: HashTable* hashTable - The hash table to serve.
+ *             const char* path - The path of the socket file to create.
+ *             int workers - The number of worker threads.
+ * RETURNS: 0 on success, 1 if the socket cannot be set up.
+ */
+int runQueryServer(HashTable* hashTable, const char* path, int workers) {
+    if (startSockets() != 0) {
+        return 1;
+    }
+    QueryServer server;
+    server.hashTable = hashTable;
+    server.listener = openServerSocket(path);
+    server.stop.store(0);
+    if (server.listener == INVALID_SOCKET_HANDLE) {
+        stopSockets();
+        return 1;
     }
 
-    Parcel* foundParcel = NULL;
-    if (strcmp(root->destination, lowerDestination) == 0) {
-        foundParcel = root;
+    hashTable->serving = 1;
+    std::thread* threads = new std::thread[workers];
+    for (int i = 0; i < workers; ++i) {
+        threads[i] = std::thread(serverWorker, &server);
     }
-    else {
-        foundParcel = searchParcelByDestination(root->left, destination);
-        if (foundParcel == NULL) {
-            foundParcel = searchParcelByDestination(root->right, destination);
-        }
+    printf("Serving queries on '%s' with %d workers. Press Enter to stop.\n", path, workers);
+    fflush(stdout);
+    int c;
+    while ((c = getchar()) != '\n' && c != EOF) {
     }
+    if (c != EOF) {
+        server.stop.store(1);
+    }
+    for (int i = 0; i < workers; ++i) {
+        threads[i].join();
+    }
+    delete[] threads;
+    hashTable->serving = 0;
 
-    // Free the allocated memory
-    free(lowerDestination);
-
-    return foundParcel;
+    closeSocket(server.listener);
+    remove(path);
+    stopSockets();
+    return 0;
 }
 
 /*
- * FUNCTION: printParcel
- * DESCRIPTION: Prints the details of a single parcel.
- * PARAMETERS: Parcel* parcel - The parcel to print.
- * RETURNS: None.
+ * FUNCTION: readServerResponse
+ * DESCRIPTION: Reads one response from a query server, up to and including its terminating '.' line.
+ * PARAMETERS: SocketHandle socket - The connection to the server.
+ *             char* buffer - Scratch space for the received bytes.
+ *             size_t size - The size of buffer.
+ * RETURNS: 0 on success, 1 if the connection fails or closes first.
  */
-
-void printParcel(Parcel* parcel) {
-    if (parcel) {
-        printf("Destination: %s, Weight: %d, Valuation: %.2f\n", parcel->destination, parcel->weight, parcel->valuation);
-    }
-    else {
-        printf("Parcel not found.\n\n");
+int readServerResponse(SocketHandle socket, char* buffer, size_t size) {
+    int lineStart = 1;
+    int lineIsDot = 0;
+    while (1) {
+        int received = (int)recv(socket, buffer, (SocketLength)size, 0);
+        if (received <= 0) {
+            return 1;
+        }
+        for (int i = 0; i < received; ++i) {
+            if (lineIsDot && buffer[i] == '\n') {
+                return 0;
+            }
+            lineIsDot = lineStart && buffer[i] == '.';
+            lineStart = buffer[i] == '\n';
+        }
     }
 }
 
 /*
- * FUNCTION: printAllParcels
- * DESCRIPTION: Prints details of all parcels in the BST that match the given country.
- * PARAMETERS: Parcel* root - The root of the BST.
- *             const char* country - The country to match.
+ * FUNCTION: loadTestClient
+ * DESCRIPTION: Body of a load test client thread: sends its share of requests one at a time over its own
+ *              connection and records the latency of each, from sending the request to reading the end
+ *              of its response.
+ * PARAMETERS: LoadTestClient* client - The client's settings and results.
  * RETURNS: None.
  */
-
-void printAllParcels(Parcel* root, const char* country) {
-    if (root == NULL) {
+void loadTestClient(LoadTestClient* client) {
+    char buffer[65536];
+    SocketHandle socket = connectServerSocket(client->path);
+    if (socket == INVALID_SOCKET_HANDLE) {
+        client->errors = client->requests;
         return;
     }
-    printAllParcels(root->left, country);
-
-    // Convert country to lowercase and compare
-    char lowerCountry[21];
-    strcpy_s(lowerCountry, sizeof(lowerCountry), country);
-    for (char* p = lowerCountry; *p; ++p) {
-        *p = tolower((unsigned char)*p);
-    }
-
-    if (strcmp(root->destination, lowerCountry) == 0) {
-        printParcel(root);
+    for (int i = 0; i < client->requests; ++i) {
+        const char* query = client->queries[(size_t)(client->first + i) % client->queryCount];
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (sendAll(socket, query, strlen(query)) != 0 || sendAll(socket, "\n", 1) != 0
+            || readServerResponse(socket, buffer, sizeof(buffer)) != 0) {
+            client->errors = client->requests - i;
+            break;
+        }
+        client->latencies[client->completed++] = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
     }
-
-    printAllParcels(root->right, country);
+    closeSocket(socket);
 }
 
 /*
- * FUNCTION: printParcelsWithCondition
- * DESCRIPTION: Prints parcels that meet the specified weight condition and match the given country.
- * PARAMETERS: Parcel* root - The root of the BST.
- *             int weight - The weight to compare against.
- *             int condition - The condition (1 for higher, 0 for lower).
- *             const char* country - The country to match.
- * RETURNS: None.
+ * FUNCTION: compareLatencies
+ * DESCRIPTION: qsort comparator ordering latencies ascending.
+ * PARAMETERS: const void* a - The first latency.
+ *             const void* b - The second latency.
+ * RETURNS: A negative, zero or positive value as a is less than, equal to or greater than b.
  */
+int compareLatencies(const void* a, const void* b) {
+    long long x = *(const long long*)a;
+    long long y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
 
-void printParcelsWithCondition(Parcel* root, int weight, int condition, const char* country) {
-    if (root == NULL) {
-        return;
+/*
+ * FUNCTION: runLoadTest
+ * DESCRIPTION: Drives a running query server with concurrent clients and reports the throughput and the
+ *              median, 99th percentile and worst latency. Each client sends the queries of a file round
+ *              robin, starting at a different query, and waits for each response before the next request.
+ * PARAMETERS: const char* path - The path of the server's socket file.
+ *             const char* queryPath - The query file, or "-" for stdin; blank and '#' lines are skipped.
+ *             int clients - The number of concurrent clients.
+ *             int requests - The number of requests each client sends.
+ * RETURNS: 0 if every request was answered, 1 otherwise.
+ */
+int runLoadTest(const char* path, const char* queryPath, int clients, int requests) {
+    FILE* input = stdin;
+    if (strcmp(queryPath, "-") != 0) {
+        errno_t err = fopen_s(&input, queryPath, "r");
+        if (err != 0 || input == NULL) {
+            printf("Error opening query file '%s'.\n", queryPath);
+            return 1;
+        }
     }
-
-    // Convert country to lowercase and compare
-    char lowerCountry[21];
-    strcpy_s(lowerCountry, sizeof(lowerCountry), country);
-    for (char* p = lowerCountry; *p; ++p) {
-        *p = tolower((unsigned char)*p);
+    char** queries = NULL;
+    size_t queryCount = 0;
+    size_t queryCapacity = 0;
+    char query[BATCH_QUERY_MAX_LENGTH];
+    int failed = 0;
+    while (!failed && fgets(query, sizeof(query), input) != NULL) {
+        query[strcspn(query, "\r\n")] = '\0';
+        char* text = trimSpaces(query);
+        if (*text == '\0' || *text == '#') {
+            continue;
+        }
+        if (queryCount == queryCapacity) {
+            queryCapacity = queryCapacity ? queryCapacity * 2 : 64;
+            char** grown = (char**)realloc(queries, queryCapacity * sizeof(char*));
+            failed = grown == NULL;
+            queries = grown ? grown : queries;
+        }
+        if (!failed) {
+            queries[queryCount] = _strdup(text);
+            failed = queries[queryCount++] == NULL;
+        }
+    }
+    if (input != stdin) {
+        fclose(input);
     }
 
-    // Print parcels based on the weight condition and matching the country
-    if (strcmp(root->destination, lowerCountry) == 0 &&
-        ((condition == 1 && root->weight > weight) ||
-            (condition == 0 && root->weight < weight))) {
-        printParcel(root);
+    LoadTestClient* states = NULL;
+    if (!failed && queryCount == 0) {
+        printf("No queries in '%s'.\n", queryPath);
+        failed = 1;
+    }
+    else if (!failed) {
+        states = (LoadTestClient*)calloc((size_t)clients, sizeof(LoadTestClient));
+        failed = states == NULL;
+        for (int i = 0; i < clients && !failed; ++i) {
+            states[i].path = path;
+            states[i].queries = queries;
+            states[i].queryCount = queryCount;
+            states[i].first = i;
+            states[i].requests = requests;
+            states[i].latencies = (long long*)malloc((size_t)requests * sizeof(long long));
+            failed = states[i].latencies == NULL;
+        }
+    }
+    long long* latencies = failed ? NULL : (long long*)malloc((size_t)clients * (size_t)requests * sizeof(long long));
+    if (!failed && latencies == NULL) {
+        failed = 1;
+    }
+    if (failed && queryCount > 0) {
+        printf("Failed to allocate memory for load test\n");
     }
 
-    // Recursively check left and right subtrees
-    printParcelsWithCondition(root->left, weight, condition, country);
-    printParcelsWithCondition(root->right, weight, condition, country);
-}
+    if (!failed && startSockets() == 0) {
+        std::thread* threads = new std::thread[clients];
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int i = 0; i < clients; ++i) {
+            threads[i] = std::thread(loadTestClient, &states[i]);
+        }
+        for (int i = 0; i < clients; ++i) {
+            threads[i].join();
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        delete[] threads;
+        stopSockets();
 
-/*
- * FUNCTION: createHashTable
- * DESCRIPTION: Creates a new hash table with initialized entries.
- * PARAMETERS: None.
- * RETURNS: A pointer to the newly created HashTable.
- */
-HashTable* createHashTable() {
-    HashTable* hashTable = (HashTable*)malloc(sizeof(HashTable));
-    if (hashTable == NULL) {
-        printf("Failed to allocate memory for hash table\n");
-        return NULL;
+        long long completed = 0;
+        long long errors = 0;
+        for (int i = 0; i < clients; ++i) {
+            memcpy(latencies + completed, states[i].latencies, (size_t)states[i].completed * sizeof(long long));
+            completed += states[i].completed;
+            errors += states[i].errors;
+        }
+        qsort(latencies, (size_t)completed, sizeof(long long), compareLatencies);
+        printf("Requests: %lld, Errors: %lld, Clients: %d, Elapsed: %.3f s\n", completed, errors, clients, seconds);
+        if (completed > 0) {
+            printf("Throughput: %.0f requests/s, p50: %.1f us, p99: %.1f us, Max: %.1f us\n",
+                (double)completed / seconds, (double)latencies[(completed - 1) / 2] / 1000.0,
+                (double)latencies[(completed - 1) * 99 / 100] / 1000.0, (double)latencies[completed - 1] / 1000.0);
+        }
+        failed = errors > 0;
     }
-    for (int i = 0; i < HASH_TABLE_SIZE; ++i) {
-        hashTable->table[i] = NULL;
+    else {
+        failed = 1;
     }
-    return hashTable;
+
+    free(latencies);
+    for (int i = 0; states != NULL && i < clients; ++i) {
+        free(states[i].latencies);
+    }
+    free(states);
+    for (size_t i = 0; i < queryCount; ++i) {
+        free(queries[i]);
+    }
+    free(queries);
+    return failed;
 }
 
 /*
- * FUNCTION: clean
- * DESCRIPTION: Frees all memory associated with the hash table and its parcels.
- * PARAMETERS: HashTable* hashTable - The hash table to clean.
- * RETURNS: None.
+ * FUNCTION: nextRandom
+ * DESCRIPTION: Returns the next value of a splitmix64 generator. Cheap, and the same on every platform,
+ *              so a seed always reproduces the same dataset.
+ * PARAMETERS: unsigned long long* state - The generator state, advanced in place.
+ * RETURNS: A uniformly distributed 64-bit value.
  */
-void clean(HashTable* hashTable) {
-    // Free the parcels using a helper function
-    for (int i = 0; i < HASH_TABLE_SIZE; ++i) {
-        Parcel* parcel = hashTable->table[i];
-        // Traverse the BST to free all parcels
-        while (parcel) {
-            Parcel* next = parcel->right;
-            free(parcel->destination);
-            free(parcel);
-            parcel = next;
-        }
-    }
-    free(hashTable);
+unsigned long long nextRandom(unsigned long long* state) {
+    unsigned long long z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
 }
 
 /*
- * FUNCTION: totalLoadAndValuation
- * DESCRIPTION: Calculates the total load and valuation of all parcels in the BST for a specific country.
- * PARAMETERS: Parcel* root - The root of the BST.
- *             const char* country - The country to match.
- *             int* totalLoad - Pointer to store the total load.
- *             float* totalValuation - Pointer to store the total valuation.
+ * FUNCTION: makeDestinationName
+ * DESCRIPTION: Builds the name of a generated destination from its rank: at least three syllables that
+ *              spell the rank in base 16, so every rank gets a different name, padded with further
+ *              syllables after a space up to the requested length.
+ * PARAMETERS: int rank - The destination's rank, 0 for the most frequent.
+ *             int minLength - The shortest name wanted, at most GENERATOR_MAX_NAME_LENGTH.
+ *             char* name - Buffer of at least GENERATOR_MAX_NAME_LENGTH + 1 bytes.
  * RETURNS: None.
  */
-void totalLoadAndValuation(Parcel* root, const char* country, int* totalLoad, float* totalValuation) {
-    if (root == NULL) {
-        return;
-    }
-
-    // Convert country to lowercase and compare
-    char lowerCountry[21];
-    strcpy_s(lowerCountry, sizeof(lowerCountry), country);
-    for (char* p = lowerCountry; *p; ++p) {
-        *p = tolower((unsigned char)*p);
+void makeDestinationName(int rank, int minLength, char* name) {
+    static const char* syllables[16] = {
+        "ba", "ce", "di", "fo", "gu", "ha", "ke", "li", "mo", "nu", "pa", "re", "si", "to", "vu", "ya"
+    };
+    int length = 0;
+    unsigned int value = (unsigned int)rank;
+    do {
+        memcpy(name + length, syllables[value & 15], 2);
+        length += 2;
+        value >>= 4;
+    } while (value > 0 || length < 6);
+    if (length < minLength) {
+        name[length++] = ' ';
     }
-
-    if (strcmp(root->destination, lowerCountry) == 0) {
-        *totalLoad += root->weight;
-        *totalValuation += root->valuation;
+    for (int i = 0; length < minLength; ++i) {
+        name[length++] = syllables[(rank + i) & 15][i & 1];
     }
-    totalLoadAndValuation(root->left, country, totalLoad, totalValuation);
-    totalLoadAndValuation(root->right, country, totalLoad, totalValuation);
+    name[length] = '\0';
+    name[0] = (char)toupper((unsigned char)name[0]);
 }
 
 /*
- * FUNCTION: findMinValuation
- * DESCRIPTION: Finds the parcel with the minimum valuation for the given country in the BST.
- * PARAMETERS: Parcel* root - The root of the BST.
- *             const char* country - The country to match.
- * RETURNS: A pointer to the Parcel with the minimum valuation.
+ * FUNCTION: generateParcelFile
+ * DESCRIPTION: Writes a synthetic parcel file in the format of couries.txt. Destinations are drawn from a
+ *              Zipf distribution over their rank (skew 0 is uniform, larger skews concentrate the
+ *              parcels on the first destinations). Weights are uniform in 1..GENERATOR_MAX_WEIGHT, or
+ *              rise steadily through the file when sorted, which is the worst case for an unbalanced
+ *              tree; valuations are uniform in 1.00..2000.00.
+ * PARAMETERS: const char* path - The file to write.
+ *             DatasetSpec* spec - The size and shape of the dataset.
+ * RETURNS: 0 on success, 1 if the file cannot be written or memory runs out.
  */
-Parcel* findMinValuation(Parcel* root, const char* country) {
-    if (root == NULL) {
-        return NULL;
+int generateParcelFile(const char* path, DatasetSpec* spec) {
+    size_t nameSize = GENERATOR_MAX_NAME_LENGTH + 1;
+    char* names = (char*)malloc((size_t)spec->countries * nameSize);
+    double* cumulative = (double*)malloc((size_t)spec->countries * sizeof(double));
+    if (names == NULL || cumulative == NULL) {
+        printf("Failed to allocate memory for the generator\n");
+        free(names);
+        free(cumulative);
+        return 1;
     }
-
-    char lowerCountry[21];
-    strcpy_s(lowerCountry, sizeof(lowerCountry), country);
-    for (char* p = lowerCountry; *p; ++p) {
-        *p = tolower((unsigned char)*p);
+    double total = 0.0;
+    for (int i = 0; i < spec->countries; ++i) {
+        makeDestinationName(i, spec->nameLength, names + (size_t)i * nameSize);
+        total += pow((double)(i + 1), -spec->skew);
+        cumulative[i] = total;
     }
 
-    Parcel* minParcel = NULL;
-    if (strcmp(root->destination, lowerCountry) == 0) {
-        minParcel = root;
+    FILE* file = NULL;
+    errno_t err = fopen_s(&file, path, "wb");
+    if (err != 0 || file == NULL) {
+        printf("Error opening file '%s' for writing.\n", path);
+        free(names);
+        free(cumulative);
+        return 1;
     }
+    setvbuf(file, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
 
-    Parcel* leftMin = findMinValuation(root->left, country);
-    Parcel* rightMin = findMinValuation(root->right, country);
-
-    if (leftMin != NULL && (minParcel == NULL || leftMin->valuation < minParcel->valuation)) {
-        minParcel = leftMin;
+    unsigned long long state = spec->seed;
+    int written = 1;
+    for (long long row = 0; row < spec->rows && written; ++row) {
+        double target = (double)(nextRandom(&state) >> 11) * (1.0 / 9007199254740992.0) * total;
+        int low = 0;
+        int high = spec->countries - 1;
+        while (low < high) {
+            int middle = low + (high - low) / 2;
+            if (cumulative[middle] < target) {
+                low = middle + 1;
+            }
+            else {
+                high = middle;
+            }
+        }
+        int weight = spec->sorted ? 1 + (int)(row * GENERATOR_MAX_WEIGHT / spec->rows)
+                                  : 1 + (int)(nextRandom(&state) % GENERATOR_MAX_WEIGHT);
+        int cents = 100 + (int)(nextRandom(&state) % (GENERATOR_MAX_VALUATION_CENTS - 99));
+        written = fprintf(file, "%s, %d, %d.%02d\n", names + (size_t)low * nameSize, weight, cents / 100, cents % 100) > 0;
     }
-    if (rightMin != NULL && (minParcel == NULL || rightMin->valuation < minParcel->valuation)) {
-        minParcel = rightMin;
+    if (fclose(file) != 0) {
+        written = 0;
     }
-
-    return minParcel;
+    free(names);
+    free(cumulative);
+    if (!written) {
+        printf("Error writing file '%s'.\n", path);
+        return 1;
+    }
+    printf("Wrote %lld parcels for %d destinations to '%s'.\n", spec->rows, spec->countries, path);
+    return 0;
 }
 
 /*
- * FUNCTION: findMaxValuation
- * DESCRIPTION: Finds the parcel with the maximum valuation for the given country in the BST.
- * PARAMETERS: Parcel* root - The root of the BST.
- *             const char* country - The country to match.
- * RETURNS: A pointer to the Parcel with the maximum valuation.
+ * FUNCTION: writeJsonString
+ * DESCRIPTION: Writes a string as a JSON string literal, escaping quotes, backslashes and control
+ *              characters.
+ * PARAMETERS: FILE* file - The file to write to.
+ *             const char* text - The string to write.
+ * RETURNS: None.
  */
-Parcel* findMaxValuation(Parcel* root, const char* country) {
-    if (root == NULL) {
-        return NULL;
-    }
-
-    char lowerCountry[21];
-    strcpy_s(lowerCountry, sizeof(lowerCountry), country);
-    for (char* p = lowerCountry; *p; ++p) {
-        *p = tolower((unsigned char)*p);
-    }
-
-    Parcel* maxParcel = NULL;
-    if (strcmp(root->destination, lowerCountry) == 0) {
-        maxParcel = root;
+void writeJsonString(FILE* file, const char* text) {
+    fputc('"', file);
+    for (const unsigned char* p = (const unsigned char*)text; *p != '\0'; ++p) {
+        if (*p == '"' || *p == '\\') {
+            fputc('\\', file);
+            fputc(*p, file);
+        }
+        else if (*p < 0x20) {
+            fprintf(file, "\\u%04x", *p);
+        }
+        else {
+            fputc(*p, file);
+        }
     }
+    fputc('"', file);
+}
 
-    Parcel* leftMax = findMaxValuation(root->left, country);
-    Parcel* rightMax = findMaxValuation(root->right, country);
-
-    if (leftMax != NULL && (maxParcel == NULL || leftMax->valuation > maxParcel->valuation)) {
-        maxParcel = leftMax;
-    }
-    if (rightMax != NULL && (maxParcel == NULL || rightMax->valuation > maxParcel->valuation)) {
-        maxParcel = rightMax;
-    }
+/*
+ * FUNCTION: writeBenchmarkResult
+ * DESCRIPTION: Appends one benchmark measurement to the results file as a single-line JSON object, so
+ *              results of different builds and datasets can be collected in one file and compared.
+ * PARAMETERS: BenchmarkRun* run - The benchmark the measurement belongs to.
+ *             const char* operation - The name of the function measured.
+ *             long long calls - The number of calls timed.
+ *             double seconds - The time they took together.
+ *             long long checksum - A value derived from the results, which also keeps the calls from
+ *                                  being optimized away; it only changes when the answers do.
+ * RETURNS: None.
+ */
+void writeBenchmarkResult(BenchmarkRun* run, const char* operation, long long calls, double seconds, long long checksum) {
+    fprintf(run->results, "{\"build\":\"%s %s\",\"dataset\":", __DATE__, __TIME__);
+    writeJsonString(run->results, run->dataset);
+    fprintf(run->results, ",\"parcels\":%lld,\"countries\":%lu,\"threads\":%d,\"frozen\":%d,\"operation\":\"%s\","
+        "\"calls\":%lld,\"seconds\":%.6f,\"nsPerCall\":%.1f,\"checksum\":%lld}\n",
+        run->parcels, run->countries, run->threads, run->frozen, operation, calls, seconds,
+        calls > 0 ? seconds * 1e9 / (double)calls : 0.0, checksum);
+}
 
-    return maxParcel;
+/*
+ * FUNCTION: secondsSince
+ * DESCRIPTION: Returns the time elapsed since a starting point.
+ * PARAMETERS: std::chrono::steady_clock::time_point start - The starting point.
+ * RETURNS: The elapsed time in seconds.
+ */
+double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 }
 
 /*
- * FUNCTION: findMinWeight
- * DESCRIPTION: Finds the parcel with the minimum weight for the given country in the BST.
- * PARAMETERS: Parcel* root - The root of the BST.
- *             const char* country - The country to match.
- * RETURNS: A pointer to the Parcel with the minimum weight.
+ * FUNCTION: runBenchmark
+ * DESCRIPTION: Times every query path on a dataset and appends the results to a JSON lines file (see
+ *              writeBenchmarkResult): the load itself, the optional freeze, random weight searches
+ *              (searchParcel on the trees, or columnLowerBound once frozen), printAllParcels and
+ *              printParcelsWithCondition for every country, and summarizeCountry and findExtremeParcel
+ *              over BENCHMARK_ROUNDS passes. The print functions write to stdout as usual; redirect it
+ *              to measure them without a terminal.
+ * PARAMETERS: const char* dataset - The parcel file to load.
+ *             const char* resultsPath - The file the results are appended to.
+ *             int threads - The number of ingest threads.
+ *             int freeze - A FreezeMode value: how to freeze the table after loading, so the columnar
+ *                          paths are timed.
+ * RETURNS: 0 on success, 1 if the dataset cannot be loaded or the results cannot be written.
  */
-Parcel* findMinWeight(Parcel* root, const char* country) {
-    if (root == NULL) {
-        return NULL;
+int runBenchmark(const char* dataset, const char* resultsPath, int threads, int freeze) {
+    BenchmarkRun run;
+    run.dataset = dataset;
+    run.threads = threads;
+    run.frozen = freeze;
+    run.results = NULL;
+    errno_t err = fopen_s(&run.results, resultsPath, "a");
+    if (err != 0 || run.results == NULL) {
+        printf("Error opening results file '%s'.\n", resultsPath);
+        return 1;
     }
 
-    char lowerCountry[21];
-    strcpy_s(lowerCountry, sizeof(lowerCountry), country);
-    for (char* p = lowerCountry; *p; ++p) {
-        *p = tolower((unsigned char)*p);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    HashTable* hashTable = createHashTable();
+    size_t loadedSize = 0;
+    if (hashTable == NULL || loadParcelFile(hashTable, dataset, threads, &loadedSize) != 0) {
+        if (hashTable != NULL) {
+            clean(hashTable);
+        }
+        fclose(run.results);
+        return 1;
     }
-
-    Parcel* minParcel = NULL;
-    if (strcmp(root->destination, lowerCountry) == 0) {
-        minParcel = root;
+    double seconds = secondsSince(start);
+    run.countries = hashTable->count;
+    run.parcels = 0;
+    for (unsigned long id = 0; id < run.countries; ++id) {
+        Parcel* root = countryById(hashTable, (int)id)->root;
+        run.parcels += root ? root->count : 0;
     }
+    writeBenchmarkResult(&run, "loadParcelFile", 1, seconds, run.parcels);
 
-    Parcel* leftMin = findMinWeight(root->left, country);
-    Parcel* rightMin = findMinWeight(root->right, country);
-
-    if (leftMin != NULL && (minParcel == NULL || leftMin->weight < minParcel->weight)) {
-        minParcel = leftMin;
-    }
-    if (rightMin != NULL && (minParcel == NULL || rightMin->weight < minParcel->weight)) {
-        minParcel = rightMin;
+    if (freeze != FREEZE_NONE) {
+        start = std::chrono::steady_clock::now();
+        freezeHashTable(hashTable, freeze);
+        writeBenchmarkResult(&run, "freezeHashTable", 1, secondsSince(start), (long long)run.countries);
     }
 
-    return minParcel;
-}
+    // A frozen table answers searches from its columns, so only the path queries actually take is timed
+    unsigned long long state = 1;
+    long long checksum = 0;
+    if (freeze == FREEZE_NONE) {
+        start = std::chrono::steady_clock::now();
+        for (unsigned long id = 0; id < run.countries; ++id) {
+            Parcel* root = countryById(hashTable, (int)id)->root;
+            for (int i = 0; i < BENCHMARK_SEARCHES; ++i) {
+                checksum += searchParcel(root, 1 + (int)(nextRandom(&state) % GENERATOR_MAX_WEIGHT)) != NULL;
+            }
+        }
+        writeBenchmarkResult(&run, "searchParcel", (long long)run.countries * BENCHMARK_SEARCHES, secondsSince(start), checksum);
+    } else {
+        start = std::chrono::steady_clock::now();
+        for (unsigned long id = 0; id < run.countries; ++id) {
+            ColumnSnapshot* columns = countryById(hashTable, (int)id)->columns;
+            for (int i = 0; columns != NULL && i < BENCHMARK_SEARCHES; ++i) {
+                checksum += columnLowerBound(columns, 1 + (int)(nextRandom(&state) % GENERATOR_MAX_WEIGHT));
+            }
+        }
+        writeBenchmarkResult(&run, "columnLowerBound", (long long)run.countries * BENCHMARK_SEARCHES, secondsSince(start), checksum);
+    }
 
-/*
- * FUNCTION: findMaxWeight
- * DESCRIPTION: Finds the parcel with the maximum weight for the given country in the BST.
- * PARAMETERS: Parcel* root - The root of the BST.
- *             const char* country - The country to match.
- * RETURNS: A pointer to the Parcel with the maximum weight.
- */
-Parcel* findMaxWeight(Parcel* root, const char* country) {
-    if (root == NULL) {
-        return NULL;
+    start = std::chrono::steady_clock::now();
+    for (unsigned long id = 0; id < run.countries; ++id) {
+        printAllParcels(hashTable, countryById(hashTable, (int)id));
     }
+    writeBenchmarkResult(&run, "printAllParcels", (long long)run.countries, secondsSince(start), run.parcels);
 
-    char lowerCountry[21];
-    strcpy_s(lowerCountry, sizeof(lowerCountry), country);
-    for (char* p = lowerCountry; *p; ++p) {
-        *p = tolower((unsigned char)*p);
+    // Split each country at the middle of its weight range
+    int* middleWeights = (int*)malloc((run.countries + 1) * sizeof(int));
+    if (middleWeights == NULL) {
+        printf("Memory allocation failed.\n");
+        clean(hashTable);
+        fclose(run.results);
+        return 1;
     }
+    checksum = 0;
+    start = std::chrono::steady_clock::now();
+    for (unsigned long id = 0; id < run.countries; ++id) {
+        Country* record = countryById(hashTable, (int)id);
+        ParcelSummary summary;
+        summarizeCountry<SUMMARY_LIGHTEST | SUMMARY_HEAVIEST>(record, INT_MIN, INT_MAX, &summary);
+        middleWeights[id] = INT_MAX;
+        if (summary.count > 0) {
+            int lightest = summary.extremes[LIGHTEST_PARCEL].weight;
+            middleWeights[id] = lightest + (summary.extremes[HEAVIEST_PARCEL].weight - lightest) / 2;
+            printParcelsWithCondition(hashTable, record, middleWeights[id], 1);
+            checksum += middleWeights[id];
+        }
+    }
+    writeBenchmarkResult(&run, "printParcelsWithCondition", (long long)run.countries, secondsSince(start), checksum);
 
-    Parcel* maxParcel = NULL;
-    if (strcmp(root->destination, lowerCountry) == 0) {
-        maxParcel = root;
+    checksum = 0;
+    start = std::chrono::steady_clock::now();
+    for (int round = 0; round < BENCHMARK_ROUNDS; ++round) {
+        for (unsigned long id = 0; id < run.countries; ++id) {
+            ParcelSummary summary;
+            summarizeCountry<SUMMARY_WEIGHT_SUM | SUMMARY_VALUATION_SUM>(countryById(hashTable, (int)id), INT_MIN, INT_MAX, &summary);
+            checksum += summary.weightSum;
+        }
     }
+    writeBenchmarkResult(&run, "summarizeCountry totals", (long long)run.countries * BENCHMARK_ROUNDS, secondsSince(start), checksum);
 
-    Parcel* leftMax = findMaxWeight(root->left, country);
-    Parcel* rightMax = findMaxWeight(root->right, country);
+    static const char* finderNames[4] = { "findExtremeParcel cheapest", "findExtremeParcel most expensive",
+                                          "findExtremeParcel lightest", "findExtremeParcel heaviest" };
+    Parcel* (*finders[4])(Parcel*) = { findExtremeParcel<CHEAPEST_PARCEL>, findExtremeParcel<MOST_EXPENSIVE_PARCEL>,
+                                       findExtremeParcel<LIGHTEST_PARCEL>, findExtremeParcel<HEAVIEST_PARCEL> };
+    for (int f = 0; f < 4; ++f) {
+        checksum = 0;
+        start = std::chrono::steady_clock::now();
+        for (int round = 0; round < BENCHMARK_ROUNDS; ++round) {
+            for (unsigned long id = 0; id < run.countries; ++id) {
+                Parcel* parcel = finders[f](countryById(hashTable, (int)id)->root);
+                checksum += parcel ? parcel->weight : 0;
+            }
+        }
+        writeBenchmarkResult(&run, finderNames[f], (long long)run.countries * BENCHMARK_ROUNDS, secondsSince(start), checksum);
+    }
 
-    if (leftMax != NULL && (maxParcel == NULL || leftMax->weight > maxParcel->weight)) {
-        maxParcel = leftMax;
+    // Everything the menu's options 3 to 5 show, for the whole country and for its heavier half
+    for (int half = 0; half < 2; ++half) {
+        checksum = 0;
+        start = std::chrono::steady_clock::now();
+        for (int round = 0; round < BENCHMARK_ROUNDS; ++round) {
+            for (unsigned long id = 0; id < run.countries; ++id) {
+                ParcelSummary summary;
+                summarizeCountry<SUMMARY_ALL>(countryById(hashTable, (int)id), half ? middleWeights[id] : INT_MIN, INT_MAX, &summary);
+                checksum += summary.count > 0 ? summary.weightSum + summary.extremes[CHEAPEST_PARCEL].weight : 0;
+            }
+        }
+        writeBenchmarkResult(&run, half ? "summarizeCountry heavier half" : "summarizeCountry all", (long long)run.countries * BENCHMARK_ROUNDS, secondsSince(start), checksum);
     }
-    if (rightMax != NULL && (maxParcel == NULL || rightMax->weight > maxParcel->weight)) {
-        maxParcel = rightMax;
+    free(middleWeights);
+
+    // Pick the median parcel of each country by valuation
+    checksum = 0;
+    start = std::chrono::steady_clock::now();
+    for (int round = 0; round < BENCHMARK_ROUNDS; ++round) {
+        for (unsigned long id = 0; id < run.countries; ++id) {
+            Country* record = countryById(hashTable, (int)id);
+            ParcelRecord found;
+            if (findValuationRank(record, countCountryParcels(record) / 2, &found)) {
+                checksum += found.weight;
+            }
+        }
     }
+    writeBenchmarkResult(&run, "findValuationRank", (long long)run.countries * BENCHMARK_ROUNDS, secondsSince(start), checksum);
 
-    return maxParcel;
+    clean(hashTable);
+    int failed = ferror(run.results) != 0;
+    if (fclose(run.results) != 0 || failed) {
+        fprintf(stderr, "Error writing results file '%s'.\n", resultsPath);
+        return 1;
+    }
+    fflush(stdout);
+    fprintf(stderr, "Benchmark results for '%s' appended to '%s'.\n", dataset, resultsPath);
+    return 0;
 }
 
 /*
  * FUNCTION: handleCountryName
- * DESCRIPTION: Prompts the user to enter a country name and computes its hash index.
+ * DESCRIPTION: Prompts the user to enter a country name and looks up its country record.
  * PARAMETERS: char* country - Buffer to store the country name.
- *             unsigned long* hashIndex - Pointer to store the computed hash index.
+ *             Country** record - Pointer to store the country record, or NULL if not found.
  *             HashTable* hashTable - The hash table to check for the country.
  * RETURNS: 1 if the country exists in the hash table, 0 otherwise.
  */
-int handleCountryName(char* country, unsigned long* hashIndex, HashTable* hashTable) {
+int handleCountryName(char* country, Country** record, HashTable* hashTable) {
+    *record = NULL;
     printf("Enter country name: ");
     if (fgets(country, 21, stdin) == NULL) {  // Use the correct buffer size
         printf("Error reading country name.\n\n");
@@ -544,25 +8855,12 @@ int handleCountryName(char* country, unsigned long* hashIndex, HashTable* hashTa
     country[strcspn(country, "\n")] = '\0';  // Remove newline character
 
     // Convert country to lowercase here
-    for (char* p = country; *p; ++p) {
-        *p = tolower((unsigned char)*p);
-    }
-
-    *hashIndex = djb2_hash(country);
+    foldCase(country, country, strlen(country));
 
-    // Check if the country exists in the hash table at the given index
-    return isCountryInHashTable(hashTable->table[*hashIndex], country);
-}
-
-/*
- * FUNCTION: isCountryInHashTable
- * DESCRIPTION: Checks if a country is present in the hash table.
- * PARAMETERS: Parcel* root - The root of the BST in the hash table bucket.
- *             const char* country - The country to check.
- * RETURNS: 1 if the country is found, 0 otherwise.
- */
-int isCountryInHashTable(Parcel* root, const char* country) {
-    return searchParcelByDestination(root, country) != NULL;
+    beginRead(hashTable);
+    *record = findCountry(hashTable, country, strlen(country));
+    endRead(hashTable);
+    return *record != NULL;
 }
 
 /*
@@ -573,17 +8871,59 @@ int isCountryInHashTable(Parcel* root, const char* country) {
  * RETURNS: None.
  */
 void handleWeightInput(int* weight, int* success) {
-    printf("Enter weight: ");
-    if (scanf_s("%d", weight) == 1) {
-        *success = 1;  // Valid input received
+    handleIntInput("Enter weight: ", weight, success);
+}
+
+/*
+ * FUNCTION: handleIntInput
+ * DESCRIPTION: Prompts the user with the given text to enter an integer and validates the input.
+ * PARAMETERS: const char* prompt - The prompt to display.
+ *             int* value - Pointer to store the entered value.
+ *             int* success - Pointer to indicate whether the input was successful.
+ * RETURNS: None.
+ */
+void handleIntInput(const char* prompt, int* value, int* success) {
+    printf("%s", prompt);
+    if (scanf_s("%d", value) == 1) {
+        *success = 1;
     }
     else {
-        printf("Invalid input for weight. Please enter a number.\n\n");
-        *success = 0;  // Invalid input
+        printf("Invalid input. Please enter a number.\n\n");
+        *success = 0;
     }
     while (getchar() != '\n');  // Clear any leftover characters in the input buffer
 }
 
+/*
+ * FUNCTION: handleValuationInput
+ * DESCRIPTION: Prompts the user with the given text to enter a valuation and validates the input. It is
+ *              parsed like the valuations of the input file, so it matches a stored one exactly.
+ * PARAMETERS: const char* prompt - The prompt to display.
+ *             float* valuation - Pointer to store the entered valuation.
+ *             int* success - Pointer to indicate whether the input was successful.
+ * RETURNS: None.
+ */
+void handleValuationInput(const char* prompt, float* valuation, int* success) {
+    char buffer[64];
+    printf("%s", prompt);
+    *success = 0;
+    if (fgets(buffer, sizeof(buffer), stdin) == NULL) {
+        printf("Error reading valuation.\n\n");
+        return;
+    }
+    size_t length = strcspn(buffer, "\r\n");
+    if (buffer[length] == '\0' && length == sizeof(buffer) - 1) {
+        int c;
+        while ((c = getchar()) != '\n' && c != EOF) {
+        }
+    }
+    else if (parseValuation(buffer, buffer + length, valuation)) {
+        *success = 1;
+        return;
+    }
+    printf("Invalid input for valuation. Please enter a number.\n\n");
+}
+
 /*
  * FUNCTION: handleConditionInput
  * DESCRIPTION: Prompts the user to enter a condition (1 for higher, 0 for lower) and validates the input.
@@ -609,17 +8949,20 @@ void handleUserMenu(HashTable* hashTable) {
     int choice;
     char inputBuffer[10];
     char country[21];
+    char fileName[FILENAME_MAX];
     int weight;
     int condition;
-    unsigned long hashIndex;
-    Parcel* foundParcel;
-    int totalLoad;
-    float totalValuation;
-    Parcel* minParcel;
-    Parcel* maxParcel;
-    Parcel* lightestParcel;
-    Parcel* heaviestParcel;
+    Country* record;
+    Country view;               // The record as pinned for the query being answered
+    ParcelSummary summary;
+    int maxWeight;
+    int pageSize;
+    int page;
     int weightInputSuccess;
+    float valuation;
+    int newWeight;
+    float newValuation;
+    std::chrono::steady_clock::time_point start;  // When the query being answered started
 
     while (1) {
         printf("\nUser Menu:\n");
@@ -629,6 +8972,16 @@ void handleUserMenu(HashTable* hashTable) {
         printf("4. Enter the country name and display cheapest and most expensive parcel's details\n");
         printf("5. Enter the country name and display lightest and heaviest parcel for the country\n");
         printf("6. Exit the application\n");
+        printf("7. Display statistics\n");
+        printf("8. Enter country and weight pair and display the total load and valuation range\n");
+        printf("9. Enter country and weight range and display the parcels in it page by page\n");
+        printf("10. Enter the country name and display its most expensive parcels\n");
+        printf("11. Enter the country name and a rank and display the parcel that is that cheapest\n");
+        printf("12. Enter the country name and a percentile and display the parcel at that valuation percentile\n");
+        printf("13. Enter the country name and display its totals, means and extreme parcels at once\n");
+        printf("14. Write the totals and ranges of every country to a CSV file\n");
+        printf("15. Enter country, weight and valuation and remove that parcel\n");
+        printf("16. Enter country, weight and valuation and change that parcel's weight and valuation\n");
         printf("Enter your choice: ");
 
         if (fgets(inputBuffer, sizeof(inputBuffer), stdin) == NULL || inputBuffer[0] == '\n') {
@@ -638,15 +8991,21 @@ void handleUserMenu(HashTable* hashTable) {
 
         choice = atoi(inputBuffer);
 
+        // Spilled columns that could not be read hold zeros, so only exit and statistics are left
+        int spillError = spillFailed(hashTable);
+        if (spillError && choice != 6 && choice != 7) {
+            printf("Error reading spill file; the parcels can no longer be queried.\n");
+            continue;
+        }
+
         switch (choice) {
         case 1:
-            if (handleCountryName(country, &hashIndex, hashTable)) {
-                if (hashTable->table[hashIndex] != NULL) {
-                    printAllParcels(hashTable->table[hashIndex], country);
-                }
-                else {
-                    printf("Country '%s' not found in the list.\n", country);
-                }
+            if (handleCountryName(country, &record, hashTable)) {
+                start = std::chrono::steady_clock::now();
+                beginRead(hashTable);
+                printAllParcels(hashTable, pinCountry(record, &view));
+                endRead(hashTable);
+                recordLatency(STAT_OP_LIST, start);
             }
             else {
                 printf("Country '%s' not found in the list.\n", country);
@@ -654,16 +9013,15 @@ void handleUserMenu(HashTable* hashTable) {
             break;
 
         case 2:
-            if (handleCountryName(country, &hashIndex, hashTable)) {
-                if (hashTable->table[hashIndex] != NULL) {
-                    handleWeightInput(&weight, &weightInputSuccess);
-                    if (weightInputSuccess) {
-                        handleConditionInput(&condition);
-                        printParcelsWithCondition(hashTable->table[hashIndex], weight, condition, country);
-                    }
-                }
-                else {
-                    printf("Country '%s' not found in the list.\n", country);
+            if (handleCountryName(country, &record, hashTable)) {
+                handleWeightInput(&weight, &weightInputSuccess);
+                if (weightInputSuccess) {
+                    handleConditionInput(&condition);
+                    start = std::chrono::steady_clock::now();
+                    beginRead(hashTable);
+                    printParcelsWithCondition(hashTable, pinCountry(record, &view), weight, condition);
+                    endRead(hashTable);
+                    recordLatency(STAT_OP_FILTER, start);
                 }
             }
             else {
@@ -672,16 +9030,13 @@ void handleUserMenu(HashTable* hashTable) {
             break;
 
         case 3:
-            if (handleCountryName(country, &hashIndex, hashTable)) {
-                if (hashTable->table[hashIndex] != NULL) {
-                    totalLoad = 0;
-                    totalValuation = 0.0f;
-                    totalLoadAndValuation(hashTable->table[hashIndex], country, &totalLoad, &totalValuation);
-                    printf("Total Load: %d, Total Valuation: %.2f\n", totalLoad, totalValuation);
-                }
-                else {
-                    printf("Country '%s' not found in the list.\n", country);
-                }
+            if (handleCountryName(country, &record, hashTable)) {
+                start = std::chrono::steady_clock::now();
+                beginRead(hashTable);
+                summarizeCountryCached<SUMMARY_WEIGHT_SUM | SUMMARY_VALUATION_SUM>(hashTable, pinCountry(record, &view), INT_MIN, INT_MAX, &summary);
+                endRead(hashTable);
+                printf("Total Load: %lld, Total Valuation: %.2f\n", summary.weightSum, summary.valuationSum);
+                recordLatency(STAT_OP_TOTALS, start);
             }
             else {
                 printf("Country '%s' not found in the list.\n", country);
@@ -689,20 +9044,17 @@ void handleUserMenu(HashTable* hashTable) {
             break;
 
         case 4:
-            if (handleCountryName(country, &hashIndex, hashTable)) {
-                Parcel* root = hashTable->table[hashIndex];
-                if (root != NULL) {
-                    minParcel = findMinValuation(root, country);
-                    maxParcel = findMaxValuation(root, country);
-
-                    printf("Cheapest Parcel:\n");
-                    printParcel(minParcel);
-                    printf("Most Expensive Parcel:\n");
-                    printParcel(maxParcel);
-                }
-                else {
-                    printf("Country '%s' not found in the list.\n", country);
-                }
+            if (handleCountryName(country, &record, hashTable)) {
+                start = std::chrono::steady_clock::now();
+                beginRead(hashTable);
+                record = pinCountry(record, &view);
+                summarizeCountryCached<SUMMARY_CHEAPEST | SUMMARY_MOST_EXPENSIVE>(hashTable, record, INT_MIN, INT_MAX, &summary);
+                printf("Cheapest Parcel:\n");
+                printCountryParcel(hashTable, record, &summary, CHEAPEST_PARCEL);
+                printf("Most Expensive Parcel:\n");
+                printCountryParcel(hashTable, record, &summary, MOST_EXPENSIVE_PARCEL);
+                endRead(hashTable);
+                recordLatency(STAT_OP_VALUATION_EXTREMES, start);
             }
             else {
                 printf("Country '%s' not found in the list.\n", country);
@@ -710,20 +9062,17 @@ void handleUserMenu(HashTable* hashTable) {
             break;
 
         case 5:
-            if (handleCountryName(country, &hashIndex, hashTable)) {
-                Parcel* root = hashTable->table[hashIndex];
-                if (root != NULL) {
-                    lightestParcel = findMinWeight(root, country);
-                    heaviestParcel = findMaxWeight(root, country);
-
-                    printf("Lightest Parcel:\n");
-                    printParcel(lightestParcel);
-                    printf("Heaviest Parcel:\n");
-                    printParcel(heaviestParcel);
-                }
-                else {
-                    printf("Country '%s' not found in the list.\n", country);
-                }
+            if (handleCountryName(country, &record, hashTable)) {
+                start = std::chrono::steady_clock::now();
+                beginRead(hashTable);
+                record = pinCountry(record, &view);
+                summarizeCountryCached<SUMMARY_LIGHTEST | SUMMARY_HEAVIEST>(hashTable, record, INT_MIN, INT_MAX, &summary);
+                printf("Lightest Parcel:\n");
+                printCountryParcel(hashTable, record, &summary, LIGHTEST_PARCEL);
+                printf("Heaviest Parcel:\n");
+                printCountryParcel(hashTable, record, &summary, HEAVIEST_PARCEL);
+                endRead(hashTable);
+                recordLatency(STAT_OP_WEIGHT_EXTREMES, start);
             }
             else {
                 printf("Country '%s' not found in the list.\n", country);
@@ -735,8 +9084,181 @@ void handleUserMenu(HashTable* hashTable) {
             printf("Now the code is ended.\n");
             printf("Good bye.. see you soon..\n\n");
             return;
+
+        case 7:
+            printStatistics(hashTable);
+            break;
+
+        case 8:
+            if (handleCountryName(country, &record, hashTable)) {
+                handleWeightInput(&weight, &weightInputSuccess);
+                if (weightInputSuccess) {
+                    handleConditionInput(&condition);
+                    start = std::chrono::steady_clock::now();
+                    beginRead(hashTable);
+                    summarizeWeightCondition(hashTable, pinCountry(record, &view), weight, condition, &summary);
+                    endRead(hashTable);
+                    recordLatency(STAT_OP_RANGE_TOTALS, start);
+                    if (summary.count > 0) {
+                        printf("Parcels: %lld, Total Load: %lld, Total Valuation: %.2f\n",
+                            summary.count, summary.weightSum, summary.valuationSum);
+                        printf("Cheapest Valuation: %.2f, Most Expensive Valuation: %.2f\n",
+                            summary.extremes[CHEAPEST_PARCEL].valuation, summary.extremes[MOST_EXPENSIVE_PARCEL].valuation);
+                    }
+                    else {
+                        printf("No parcels match.\n");
+                    }
+                }
+            }
+            else {
+                printf("Country '%s' not found in the list.\n", country);
+            }
+            break;
+
+        case 9:
+            if (handleCountryName(country, &record, hashTable)) {
+                handleIntInput("Enter minimum weight: ", &weight, &weightInputSuccess);
+                if (weightInputSuccess) {
+                    handleIntInput("Enter maximum weight: ", &maxWeight, &weightInputSuccess);
+                }
+                if (weightInputSuccess) {
+                    handleIntInput("Enter page size: ", &pageSize, &weightInputSuccess);
+                }
+                if (weightInputSuccess) {
+                    handleIntInput("Enter page number (from 1): ", &page, &weightInputSuccess);
+                }
+                if (weightInputSuccess && pageSize > 0 && page > 0) {
+                    long long offset = (long long)(page - 1) * pageSize;
+                    start = std::chrono::steady_clock::now();
+                    beginRead(hashTable);
+                    record = pinCountry(record, &view);
+                    long long shown = printCountryParcels(hashTable, record, weight, maxWeight, offset, pageSize);
+                    summarizeCountryCached<0>(hashTable, record, weight, maxWeight, &summary);
+                    endRead(hashTable);
+                    recordLatency(STAT_OP_PAGE, start);
+                    if (shown > 0) {
+                        printf("Showing parcels %lld-%lld of %lld\n", offset + 1, offset + shown, summary.count);
+                    }
+                    else {
+                        printf("No parcels on this page (%lld in range).\n", summary.count);
+                    }
+                }
+                else if (weightInputSuccess) {
+                    printf("Page size and page number must be positive.\n");
+                }
+            }
+            else {
+                printf("Country '%s' not found in the list.\n", country);
+            }
+            break;
+
+        case 10:
+            if (handleCountryName(country, &record, hashTable)) {
+                handleIntInput("Enter number of parcels: ", &pageSize, &weightInputSuccess);
+                if (weightInputSuccess && pageSize > 0) {
+                    start = std::chrono::steady_clock::now();
+                    beginRead(hashTable);
+                    printf("Most Expensive Parcels:\n");
+                    visitByValuation(pinCountry(record, &view), 0, pageSize, 1, printParcelVisitor, hashTable);
+                    endRead(hashTable);
+                    recordLatency(STAT_OP_TOP_VALUATIONS, start);
+                }
+                else if (weightInputSuccess) {
+                    printf("The number of parcels must be positive.\n");
+                }
+            }
+            else {
+                printf("Country '%s' not found in the list.\n", country);
+            }
+            break;
+
+        case 11:
+        case 12:
+            if (handleCountryName(country, &record, hashTable)) {
+                handleIntInput(choice == 11 ? "Enter rank (1 = cheapest): " : "Enter percentile (0-100): ", &page, &weightInputSuccess);
+                if (weightInputSuccess && (choice == 11 ? page > 0 : page >= 0 && page <= 100)) {
+                    start = std::chrono::steady_clock::now();
+                    beginRead(hashTable);
+                    record = pinCountry(record, &view);
+                    printValuationRank(hashTable, record, choice == 11 ? page - 1 : percentileRank(countCountryParcels(record), page));
+                    endRead(hashTable);
+                    recordLatency(STAT_OP_VALUATION_RANK, start);
+                }
+                else if (weightInputSuccess) {
+                    printf(choice == 11 ? "The rank must be positive.\n" : "The percentile must be between 0 and 100.\n");
+                }
+            }
+            else {
+                printf("Country '%s' not found in the list.\n", country);
+            }
+            break;
+
+        case 13:
+            if (handleCountryName(country, &record, hashTable)) {
+                start = std::chrono::steady_clock::now();
+                beginRead(hashTable);
+                record = pinCountry(record, &view);
+                summarizeCountryCached<SUMMARY_ALL>(hashTable, record, INT_MIN, INT_MAX, &summary);
+                printCountrySummary(hashTable, record, &summary);
+                endRead(hashTable);
+                recordLatency(STAT_OP_SUMMARY, start);
+            }
+            else {
+                printf("Country '%s' not found in the list.\n", country);
+            }
+            break;
+
+        case 14:
+            printf("Enter report file name: ");
+            if (fgets(fileName, sizeof(fileName), stdin) != NULL) {
+                fileName[strcspn(fileName, "\r\n")] = '\0';
+                if (fileName[0] == '\0') {
+                    printf("Invalid file name.\n");
+                }
+                else if (writeCountryReport(hashTable, fileName, (int)std::thread::hardware_concurrency()) == 0) {
+                    printf("Report written to '%s'.\n", fileName);
+                }
+            }
+            break;
+
+        case 15:
+        case 16:
+            if (!parcelsChangeable(hashTable)) {
+                printf("Parcels cannot be changed while other threads read them.\n");
+            }
+            else if (handleCountryName(country, &record, hashTable)) {
+                handleWeightInput(&weight, &weightInputSuccess);
+                if (weightInputSuccess) {
+                    handleValuationInput("Enter valuation: ", &valuation, &weightInputSuccess);
+                }
+                if (weightInputSuccess && choice == 16) {
+                    handleIntInput("Enter new weight: ", &newWeight, &weightInputSuccess);
+                    if (weightInputSuccess) {
+                        handleValuationInput("Enter new valuation: ", &newValuation, &weightInputSuccess);
+                    }
+                }
+                if (weightInputSuccess) {
+                    start = std::chrono::steady_clock::now();
+                    int changed = choice == 15 ? removeCountryParcel(&hashTable->pool, record, weight, valuation)
+                                               : replaceCountryParcel(&hashTable->pool, record, weight, valuation, newWeight, newValuation);
+                    recordLatency(choice == 15 ? STAT_OP_REMOVE : STAT_OP_UPDATE, start);
+                    if (changed > 0) {
+                        printf(choice == 15 ? "Parcel removed.\n" : "Parcel updated.\n");
+                    }
+                    else if (changed == 0) {
+                        printf("Parcel not found.\n");
+                    }
+                }
+            }
+            else {
+                printf("Country '%s' not found in the list.\n", country);
+            }
+            break;
         default:
             printf("Invalid choice. Please select a valid menu option.\n");
         }
+        if (!spillError && spillFailed(hashTable)) {
+            printf("Error reading spill file; the result above is incomplete.\n");
+        }
     }
 }
\ No newline at end of file